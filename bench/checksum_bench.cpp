@@ -0,0 +1,75 @@
+
+// checksum_bench.cpp
+// Single-core throughput of every checksum kernel the CPU supports, over
+// 64 KiB buffers (the RPC chunk size) and a few smaller sizes. Usage:
+// checksum_bench [seconds_per_run]
+
+#include "../checksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BUFFER_SIZE 65536
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns GB/s of checksumming size-byte buffers for about seconds.
+static double run(int kind, const char *buf, size_t size, double seconds) {
+    volatile uint64_t sink = 0;
+    long iterations = 0;
+    double start = now();
+    double elapsed = 0;
+    while (elapsed < seconds) {
+        for (int i = 0; i < 256; i++) {
+            sink += checksum_compute(kind, buf, size);
+        }
+        iterations += 256;
+        elapsed = now() - start;
+    }
+    (void)sink;
+    return (double)iterations * size / elapsed / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    char *buf = (char *)malloc(BENCH_BUFFER_SIZE);
+    srand(1);
+    for (int i = 0; i < BENCH_BUFFER_SIZE; i++) {
+        buf[i] = (char)rand();
+    }
+
+    const size_t sizes[] = {512, 4096, BENCH_BUFFER_SIZE};
+    const struct {
+        int kind;
+        const char *name;
+    } kinds[] = {{CHECKSUM_CRC32C, "crc32c"}, {CHECKSUM_XXH3, "xxh3"}};
+    const int impls[] = {CHECKSUM_IMPL_SCALAR, CHECKSUM_IMPL_SSE42,
+                         CHECKSUM_IMPL_AVX2, CHECKSUM_IMPL_AVX512};
+
+    printf("%-8s %-8s", "kernel", "impl");
+    for (size_t size : sizes) {
+        printf(" %9zuB", size);
+    }
+    printf("   (GB/s, one core)\n");
+    for (auto &k : kinds) {
+        for (int impl : impls) {
+            if (checksum_set_impl(k.kind, impl) < 0) {
+                continue;
+            }
+            printf("%-8s %-8s", k.name, checksum_impl_name(k.kind));
+            for (size_t size : sizes) {
+                printf(" %10.2f", run(k.kind, buf, size, seconds));
+            }
+            printf("\n");
+        }
+    }
+
+    free(buf);
+    return 0;
+}
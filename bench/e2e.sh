@@ -0,0 +1,153 @@
+#!/bin/sh
+# e2e.sh
+# End-to-end benchmarks: starts watdfs_server on a temporary directory, and
+# for every workload mounts a fresh watdfs_client on localhost (so each run
+# starts with a cold cache), runs bench/e2e_bench against the mount, and
+# unmounts it. The results go to one JSON file, every workload with the RPC
+# counts its client made. A workload that fails is recorded as failed, the
+# others still run, and the script exits 1 at the end. Run from the
+# repository root, after `make bench` built everything; `make bench` runs it.
+#
+# Settings, from the environment:
+#   BENCH_OUT          the JSON file (bench/results/e2e-<commit>.json)
+#   BENCH_FILE_MB      the file size of the transfer workloads (64)
+#   BENCH_BLOCKS       the block sizes of the transfer workloads
+#                      ("4096 65536 1048576")
+#   BENCH_FILES        the files of the create and stat workloads (1000)
+#   BENCH_OPENS        the opens of the churn workload (2000)
+#   BENCH_CLIENTS      the clients mounted for the contention workload (2)
+#   BENCH_THREADS      the threads of the contention workload (8)
+# Any WATDFS_* settings are passed on to the server and the clients.
+
+set -e
+
+FILE_MB=${BENCH_FILE_MB:-64}
+BLOCKS=${BENCH_BLOCKS:-"4096 65536 1048576"}
+FILES=${BENCH_FILES:-1000}
+OPENS=${BENCH_OPENS:-2000}
+CLIENTS=${BENCH_CLIENTS:-2}
+THREADS=${BENCH_THREADS:-8}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+OUT=${BENCH_OUT:-bench/results/e2e-$COMMIT.json}
+
+TMP=$(mktemp -d /tmp/watdfs-bench.XXXXXX)
+SERVER_PID=
+cleanup() {
+    for m in "$TMP"/mnt*; do
+        if mountpoint -q "$m" 2>/dev/null; then fusermount -u "$m" || true; fi
+    done
+    if [ -n "$SERVER_PID" ]; then kill "$SERVER_PID" 2>/dev/null || true; fi
+    rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# The server prints the export lines for SERVER_ADDRESS and SERVER_PORT.
+mkdir -p "$TMP/server"
+./watdfs_server "$TMP/server" > "$TMP/server.out" 2> "$TMP/server.err" &
+SERVER_PID=$!
+for i in $(seq 1 100); do
+    if grep -q SERVER_PORT "$TMP/server.out"; then break; fi
+    sleep 0.1
+done
+eval "$(grep '^export SERVER_' "$TMP/server.out")"
+if [ -z "$SERVER_PORT" ]; then
+    echo "e2e.sh: the server did not start, see $TMP/server.err" >&2
+    exit 1
+fi
+
+# mount_client n: mount client n on $TMP/mntn with its own cache, leaving its RPC
+# counts in $TMP/rpcsn.json when it is unmounted.
+mount_client() {
+    mkdir -p "$TMP/cache$1" "$TMP/mnt$1"
+    rm -f "$TMP/rpcs$1.json"
+    WATDFS_RPC_COUNTS="$TMP/rpcs$1.json" ./watdfs_client -s -f -o direct_io \
+        "$TMP/cache$1" "$TMP/mnt$1" > /dev/null 2> "$TMP/client$1.err" &
+    eval "CLIENT_PID$1=$!"
+    for i in $(seq 1 100); do
+        if mountpoint -q "$TMP/mnt$1"; then return 0; fi
+        sleep 0.1
+    done
+    echo "e2e.sh: client $1 did not mount, see $TMP/client$1.err" >&2
+    exit 1
+}
+
+# unmount_client n: unmount client n and wait for it to write its RPC counts.
+unmount_client() {
+    fusermount -u "$TMP/mnt$1"
+    eval "wait \$CLIENT_PID$1" || true
+}
+
+FIRST=1
+FAILED=0
+# failed workload status: the result of a workload that exited with status.
+failed() {
+    echo "e2e.sh: workload $1 failed with status $2" >&2
+    printf '{"workload": "%s", "failed": true, "exit_status": %s}' "$1" "$2"
+}
+
+# record json clients...: add a workload result with the RPC counts of each
+# of the clients.
+record() {
+    result=$1
+    shift
+    rpcs=""
+    for n in "$@"; do
+        if [ -s "$TMP/rpcs$n.json" ]; then
+            rpcs="$rpcs${rpcs:+, }\"client$n\": $(cat "$TMP/rpcs$n.json")"
+        fi
+    done
+    if [ $FIRST -eq 0 ]; then printf ',\n' >> "$OUT"; fi
+    FIRST=0
+    # Splice the counts into the result object.
+    printf '    %s, "rpcs": {%s}}' "${result%\}}" "$rpcs" >> "$OUT"
+    echo "$result"
+}
+
+# run workload args...: one workload on a fresh mount of client 1.
+run() {
+    mount_client 1
+    if result=$(bench/e2e_bench "$1" "$TMP/mnt1" "$2" "$3"); then :; else
+        result=$(failed "$1" $?)
+        FAILED=1
+    fi
+    unmount_client 1
+    record "$result" 1
+}
+
+mkdir -p "$(dirname "$OUT")"
+printf '{"commit": "%s", "date": "%s", "file_mb": %s,\n "results": [\n' \
+    "$COMMIT" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$FILE_MB" > "$OUT"
+
+mount_client 1
+bench/e2e_bench prepare "$TMP/mnt1" "$FILE_MB"
+unmount_client 1
+
+for block in $BLOCKS; do
+    for workload in seqwrite randwrite seqread randread; do
+        run $workload "$block" "$FILE_MB"
+    done
+done
+run create "$FILES"
+run stat "$FILES"
+run churn "$OPENS"
+
+# Several clients on the same server, every thread with a file of its own.
+DIRS=""
+NS=""
+for n in $(seq 1 "$CLIENTS"); do
+    mount_client "$n"
+    DIRS="$DIRS $TMP/mnt$n"
+    NS="$NS $n"
+done
+if result=$(bench/e2e_bench contention $DIRS "$THREADS" 4096 "$FILE_MB"); then :; else
+    result=$(failed contention $?)
+    FAILED=1
+fi
+for n in $NS; do
+    unmount_client "$n"
+done
+record "$result" $NS
+
+printf '\n ]}\n' >> "$OUT"
+echo "results in $OUT"
+exit $FAILED
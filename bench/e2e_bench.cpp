@@ -0,0 +1,239 @@
+
+// e2e_bench.cpp
+// fio-style workloads against a mounted watdfs, through plain file system
+// calls. Runs one workload per invocation and prints its results as one JSON
+// object: throughput, and p50/p99/p999 latency of the timed operations.
+// bench/e2e.sh mounts a fresh client for every run and adds the RPC counts.
+//
+// Usage: e2e_bench workload dir [args]
+//   prepare dir file_mb          write the file the read workloads use
+//   seqwrite dir block file_mb   write a file front to back
+//   randwrite dir block file_mb  write random blocks of a file
+//   seqread dir block file_mb    read the prepared file front to back
+//   randread dir block file_mb   read random blocks of the prepared file
+//   create dir files             create, write 4 KiB to, and close files
+//   stat dir files               stat the files create made
+//   churn dir opens              open and close one file over and over
+//   contention dir... threads block file_mb
+//                                threads spread over the dirs (one per
+//                                mounted client) write and read random
+//                                blocks of a file of their own, file_mb
+//                                split between them, all on one server
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_FILE "e2e_bench_data"
+#define BENCH_CONTENTION_FILE "e2e_bench_contention_"
+#define BENCH_SMALL_FILE_SIZE 4096
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// The latencies of the timed operations, and the bytes they moved.
+struct bench_result {
+    std::vector<long> latencies_ns;
+    long bytes = 0;
+    long elapsed_ns = 0;
+};
+
+static void die(const char *what, const std::string &path) {
+    fprintf(stderr, "e2e_bench: %s %s: %s\n", what, path.c_str(), strerror(errno));
+    exit(1);
+}
+
+static double percentile_us(std::vector<long> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+static void print_result(const char *workload, long block, int threads,
+                         struct bench_result &r) {
+    std::sort(r.latencies_ns.begin(), r.latencies_ns.end());
+    double seconds = r.elapsed_ns / 1e9;
+    printf("{\"workload\": \"%s\", \"block_size\": %ld, \"threads\": %d, "
+           "\"ops\": %zu, \"seconds\": %.3f, \"ops_per_s\": %.1f, "
+           "\"mb_per_s\": %.2f, \"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, "
+           "\"p999\": %.1f}}\n",
+           workload, block, threads, r.latencies_ns.size(), seconds,
+           seconds > 0 ? r.latencies_ns.size() / seconds : 0,
+           seconds > 0 ? r.bytes / seconds / 1e6 : 0,
+           percentile_us(r.latencies_ns, 0.50), percentile_us(r.latencies_ns, 0.99),
+           percentile_us(r.latencies_ns, 0.999));
+}
+
+// Fill buf with bytes that do not compress to nothing.
+static void fill(std::vector<char> &buf, unsigned seed) {
+    std::mt19937 gen(seed);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = (char)gen();
+    }
+}
+
+static void prepare(const std::string &dir, long file_mb) {
+    std::string path = dir + "/" + BENCH_FILE;
+    int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) die("open", path);
+    std::vector<char> buf(1 << 20);
+    fill(buf, 1);
+    for (long i = 0; i < file_mb; i++) {
+        if (pwrite(fd, buf.data(), buf.size(), i << 20) != (ssize_t)buf.size()) {
+            die("pwrite", path);
+        }
+    }
+    if (close(fd) < 0) die("close", path);
+}
+
+// Read or write file_mb of path in blocks, in order or at random offsets.
+static void transfer(const std::string &path, long block, long file_mb,
+                     bool is_write, bool random, unsigned seed,
+                     struct bench_result &r, std::mutex *lock) {
+    int fd = open(path.c_str(), is_write ? O_CREAT | O_RDWR : O_RDONLY, 0644);
+    if (fd < 0) die("open", path);
+    std::vector<char> buf(block);
+    fill(buf, seed);
+    long blocks = (file_mb << 20) / block;
+    std::mt19937_64 gen(seed);
+    std::vector<long> latencies;
+    long bytes = 0;
+    for (long i = 0; i < blocks; i++) {
+        off_t offset = (random ? (long)(gen() % blocks) : i) * block;
+        long start = now_ns();
+        ssize_t n = is_write ? pwrite(fd, buf.data(), block, offset)
+                             : pread(fd, buf.data(), block, offset);
+        latencies.push_back(now_ns() - start);
+        if (n < 0) die(is_write ? "pwrite" : "pread", path);
+        bytes += n;
+    }
+    if (close(fd) < 0) die("close", path);
+    if (lock != nullptr) lock->lock();
+    r.latencies_ns.insert(r.latencies_ns.end(), latencies.begin(), latencies.end());
+    r.bytes += bytes;
+    if (lock != nullptr) lock->unlock();
+}
+
+static void create_files(const std::string &dir, long files, struct bench_result &r) {
+    std::vector<char> buf(BENCH_SMALL_FILE_SIZE);
+    fill(buf, 2);
+    for (long i = 0; i < files; i++) {
+        std::string path = dir + "/small_" + std::to_string(i);
+        long start = now_ns();
+        int fd = open(path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0) die("open", path);
+        if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) die("write", path);
+        if (close(fd) < 0) die("close", path);
+        r.latencies_ns.push_back(now_ns() - start);
+        r.bytes += buf.size();
+    }
+}
+
+static void stat_files(const std::string &dir, long files, struct bench_result &r) {
+    for (long i = 0; i < files; i++) {
+        std::string path = dir + "/small_" + std::to_string(i);
+        struct stat st;
+        long start = now_ns();
+        if (stat(path.c_str(), &st) < 0) die("stat", path);
+        r.latencies_ns.push_back(now_ns() - start);
+    }
+}
+
+static void churn(const std::string &dir, long opens, struct bench_result &r) {
+    std::string path = dir + "/churn";
+    int fd = open(path.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd < 0 || close(fd) < 0) die("create", path);
+    for (long i = 0; i < opens; i++) {
+        long start = now_ns();
+        fd = open(path.c_str(), i % 2 == 0 ? O_RDONLY : O_RDWR);
+        if (fd < 0) die("open", path);
+        if (close(fd) < 0) die("close", path);
+        r.latencies_ns.push_back(now_ns() - start);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: e2e_bench prepare|seqwrite|randwrite|seqread|randread|"
+                    "create|stat|churn|contention dir [args], see e2e_bench.cpp\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) usage();
+    std::string workload = argv[1];
+    std::string dir = argv[2];
+    struct bench_result r;
+    long block = 0;
+    int threads = 1;
+
+    long start = now_ns();
+    if (workload == "prepare") {
+        prepare(dir, atol(argv[3]));
+        return 0;
+    } else if (workload == "seqwrite" || workload == "randwrite" ||
+               workload == "seqread" || workload == "randread") {
+        if (argc < 5) usage();
+        block = atol(argv[3]);
+        bool is_write = workload.find("write") != std::string::npos;
+        std::string path = dir + "/" + (is_write ? workload + "_" + std::to_string(block)
+                                                 : std::string(BENCH_FILE));
+        transfer(path, block, atol(argv[4]), is_write, workload.compare(0, 4, "rand") == 0,
+                 3, r, nullptr);
+    } else if (workload == "create") {
+        create_files(dir, atol(argv[3]), r);
+    } else if (workload == "stat") {
+        stat_files(dir, atol(argv[3]), r);
+    } else if (workload == "churn") {
+        churn(dir, atol(argv[3]), r);
+    } else if (workload == "contention") {
+        // contention dir... threads block file_mb
+        if (argc < 6) usage();
+        std::vector<std::string> dirs(argv + 2, argv + argc - 3);
+        threads = atoi(argv[argc - 3]);
+        block = atol(argv[argc - 2]);
+        long file_mb = std::max(atol(argv[argc - 1]) / std::max(threads, 1), 1L);
+        // Every thread has a file of its own: the server lets one client at
+        // a time open a file for writing, and the client caps the opens of
+        // one file. The readers need the whole file there from the start.
+        std::vector<std::string> paths;
+        for (int t = 0; t < threads; t++) {
+            paths.push_back(dirs[t % dirs.size()] + "/" + BENCH_CONTENTION_FILE +
+                            std::to_string(t));
+            int fd = open(paths[t].c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+            if (fd < 0 || ftruncate(fd, file_mb << 20) < 0 || close(fd) < 0) {
+                die("create", paths[t]);
+            }
+        }
+        start = now_ns();
+        std::mutex lock;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                transfer(paths[t], block, file_mb, t % 2 == 0, true, 10 + t, r, &lock);
+            });
+        }
+        for (std::thread &w : workers) {
+            w.join();
+        }
+    } else {
+        usage();
+    }
+    r.elapsed_ns = now_ns() - start;
+    print_result(workload.c_str(), block, threads, r);
+    return 0;
+}
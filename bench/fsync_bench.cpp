@@ -0,0 +1,118 @@
+
+// fsync_bench.cpp
+// Compares server-side fsync throughput with and without group commit. Each
+// simulated client owns one file in the bench directory and loops on a 4 KiB
+// pwrite followed by a sync, exactly what watdfs_write + watdfs_fsync do on
+// the server. Usage: fsync_bench [dir] [seconds_per_run]
+
+#include "../debug.h"
+#include "../fsync_batcher.h"
+#include "../io_engine.h"
+
+INIT_LOG
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_WRITE_SIZE 4096
+#define BENCH_MAX_CLIENTS 64
+
+struct bench_client {
+    int fd;
+    int batched;
+    volatile int *stop;
+    long ops;
+};
+
+static void *client_main(void *arg) {
+    struct bench_client *c = (struct bench_client *)arg;
+    char buf[BENCH_WRITE_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    off_t offset = 0;
+    while (!*c->stop) {
+        if (io_engine_pwrite(c->fd, buf, sizeof(buf), offset) < 0) {
+            break;
+        }
+        offset = (offset + BENCH_WRITE_SIZE) % (1 << 20);
+        int ret = c->batched ? fsync_batcher_sync(c->fd, 0)
+                             : io_engine_fsync(c->fd, 0);
+        if (ret < 0) {
+            break;
+        }
+        c->ops++;
+    }
+    return nullptr;
+}
+
+// Returns fsync operations per second for nclients concurrent clients.
+static double run(const char *dir, int nclients, int batched, int seconds) {
+    struct bench_client clients[BENCH_MAX_CLIENTS];
+    pthread_t threads[BENCH_MAX_CLIENTS];
+    volatile int stop = 0;
+
+    for (int i = 0; i < nclients; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/fsync_bench_%d", dir, i);
+        clients[i].fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (clients[i].fd < 0) {
+            perror("open");
+            exit(1);
+        }
+        clients[i].batched = batched;
+        clients[i].stop = &stop;
+        clients[i].ops = 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nclients; i++) {
+        pthread_create(&threads[i], nullptr, client_main, &clients[i]);
+    }
+    sleep(seconds);
+    stop = 1;
+    long total = 0;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(threads[i], nullptr);
+        total += clients[i].ops;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < nclients; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/fsync_bench_%d", dir, i);
+        close(clients[i].fd);
+        unlink(path);
+    }
+    double elapsed = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    return total / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    int seconds = argc > 2 ? atoi(argv[2]) : 2;
+
+    io_engine_init(IO_ENGINE_QUEUE_DEPTH);
+    fsync_batcher_init(FSYNC_BATCH_WINDOW_US);
+
+    printf("engine: %s\n", io_engine_uses_uring() ? "io_uring" : "sync");
+    printf("%8s %16s %16s %8s\n", "clients", "fsync ops/s", "batched ops/s",
+           "speedup");
+    for (int n = 1; n <= BENCH_MAX_CLIENTS; n *= 2) {
+        double direct = run(dir, n, 0, seconds);
+        double batched = run(dir, n, 1, seconds);
+        printf("%8d %16.0f %16.0f %7.2fx\n", n, direct, batched,
+               direct > 0 ? batched / direct : 0.0);
+        fflush(stdout);
+    }
+
+    fsync_batcher_destroy();
+    io_engine_destroy();
+    return 0;
+}
@@ -0,0 +1,132 @@
+
+// pool_bench.cpp
+// How the server's work pool scales from 1 to N cores. BENCH_CONNECTIONS
+// threads stand in for the connection threads, each handing skeleton-like
+// tasks to the pool back to back: a CRC32C of 64 KiB, as watdfs_write does
+// to check its payload, then io_us microseconds of blocking disk time (a
+// sleep, through work_pool_block like an io_engine call). For every worker
+// count it prints tasks per second and steals per task, and first the same
+// work done on the connection threads themselves, as without the pool.
+// Usage: pool_bench [max_workers] [seconds_per_run] [io_us]
+//
+// max_workers defaults to the cores the process may run on. Counts double
+// from 1, with max_workers last. WATDFS_POOL_NUMA=1 pins the workers.
+
+#include "../checksum.h"
+#include "../debug.h"
+#include "../stats.h"
+#include "../work_pool.h"
+
+INIT_LOG
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_CONNECTIONS 64
+#define BENCH_PAYLOAD (64 << 10)
+
+static long io_us = 100;
+static char payload[BENCH_PAYLOAD];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int disk_wait(void *arg) {
+    (void)arg;
+    struct timespec ts = {0, io_us * 1000};
+    nanosleep(&ts, nullptr);
+    return 0;
+}
+
+static int task(void *arg) {
+    volatile uint64_t sum = checksum_compute(CHECKSUM_CRC32C, payload, BENCH_PAYLOAD);
+    (void)sum;
+    if (io_us > 0) {
+        work_pool_block(disk_wait, arg);
+    }
+    return 0;
+}
+
+// The tasks stolen so far, from the stats report.
+static long steals() {
+    std::string report = stats_report();
+    const char *name = "counter server.pool_steals ";
+    size_t at = report.find(name);
+    return at == std::string::npos ? 0 : atol(report.c_str() + at + strlen(name));
+}
+
+// Returns the tasks per second all connections got done in about seconds.
+static double run(double seconds) {
+    std::vector<long> counts(BENCH_CONNECTIONS, 0);
+    std::vector<std::thread> connections;
+    double start = now();
+    for (int t = 0; t < BENCH_CONNECTIONS; t++) {
+        connections.emplace_back([&, t] {
+            long n = 0;
+            while (now() - start < seconds) {
+                work_pool_run(task, nullptr);
+                n++;
+            }
+            counts[t] = n;
+        });
+    }
+    for (auto &c : connections) {
+        c.join();
+    }
+    double elapsed = now() - start;
+    long total = 0;
+    for (long n : counts) {
+        total += n;
+    }
+    return total / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    cpu_set_t allowed;
+    int cores = 1;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cores = CPU_COUNT(&allowed);
+    }
+    int max_workers = argc > 1 ? atoi(argv[1]) : cores;
+    double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+    if (argc > 3) {
+        io_us = atol(argv[3]);
+    }
+    const char *numa_env = getenv("WATDFS_POOL_NUMA");
+    int numa = numa_env != nullptr && strcmp(numa_env, "1") == 0;
+    memset(payload, 0x5a, sizeof(payload));
+    trace_mode = TRACE_OFF;
+
+    printf("%d connections, %d KiB CRC32C + %ld us I/O per task, %d cores\n",
+           BENCH_CONNECTIONS, BENCH_PAYLOAD >> 10, io_us, cores);
+    printf("%-12s %12s %14s\n", "workers", "tasks/s", "steals/task");
+    printf("%-12s %12.0f %14s\n", "none", run(seconds), "-");
+    std::vector<int> counts;
+    for (int w = 1; w < max_workers; w *= 2) {
+        counts.push_back(w);
+    }
+    counts.push_back(std::max(max_workers, 1));
+    for (int w : counts) {
+        if (work_pool_init(w, WORK_POOL_SPARES, numa) < 0) {
+            fprintf(stderr, "cannot start %d workers\n", w);
+            return 1;
+        }
+        long steals_before = steals();
+        double rate = run(seconds);
+        long stolen = steals() - steals_before;
+        work_pool_destroy();
+        printf("%-12d %12.0f %14.3f\n", w, rate, stolen / (rate * seconds));
+        fflush(stdout);
+    }
+    return 0;
+}
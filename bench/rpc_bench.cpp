@@ -0,0 +1,290 @@
+
+// rpc_bench.cpp
+// Microbenchmarks of the client's chunked transfer paths, without FUSE:
+// rpc_call_write, rpc_call_read, upload() and download() are called directly
+// against a watdfs_server started on a temporary directory and reached over
+// loopback. File sizes go up by 4x from 1 B to max_bytes (64 MiB by default,
+// up to 4 GiB). Per operation it reports throughput, RPCs, heap allocations
+// and bytes copied by memcpy in the client. Usage:
+// rpc_bench [max_bytes] [seconds_per_size] [port]
+//
+// Allocations and copies are counted by wrapping malloc, calloc, realloc and
+// memcpy at link time (see the Makefile) and by replacing operator new, so
+// they cover the client code linked into this binary, not libc or the
+// kernel. WATDFS_* settings such as WATDFS_COMPRESS apply as for a mount.
+//
+// With port 0 the server runs in this process instead, reached over the
+// loopback address of rpc_conn (see watdfs_server.h), which leaves the
+// network out of the numbers. The counts then include the server's work.
+
+#include "../rpc_conn.h"
+#include "../watdfs_client.h"
+#include "../watdfs_server.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+#include <string>
+
+#define BENCH_MAX_BYTES (64L << 20)
+#define BENCH_PORT 9870
+// rpc_call_read and rpc_call_write return an int, so larger transfers are
+// issued as several calls of this size.
+#define BENCH_MAX_CALL (1L << 30)
+
+// The client functions under test, which have no header of their own.
+struct Client_information;
+int rpc_call_open(void *userdata, const char *path, struct fuse_file_info *fi);
+int rpc_call_release(void *userdata, const char *path, struct fuse_file_info *fi);
+int rpc_call_mknod(void *userdata, const char *path, mode_t mode, dev_t dev);
+int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
+                  off_t offset, struct fuse_file_info *fi);
+int rpc_call_write(void *userdata, const char *path, const char *buf,
+                   size_t size, off_t offset, struct fuse_file_info *fi);
+int upload(struct Client_information *userdata, const char *path, const char *full_path);
+int download(struct Client_information *userdata, const char *path, const char *full_path);
+long rpc_call_count(void *userdata);
+
+static long allocations = 0;
+static long copied = 0;
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__real_memcpy(void *dst, const void *src, size_t n);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+void *__wrap_calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *p, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+void *__wrap_memcpy(void *dst, const void *src, size_t n) {
+    __atomic_add_fetch(&copied, (long)n, __ATOMIC_RELAXED);
+    return __real_memcpy(dst, src, n);
+}
+}
+
+void *operator new(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    void *p = __real_malloc(size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// What one operation cost on average.
+struct op_cost {
+    double bytes_per_s;
+    double rpcs;
+    double allocations;
+    double copied;
+    int failed;
+};
+
+// Run op for about seconds (at least once) and average its costs.
+template <class F>
+static struct op_cost measure(void *userdata, size_t size, double seconds, F op) {
+    long rpcs0 = rpc_call_count(userdata);
+    long allocs0 = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    long copied0 = __atomic_load_n(&copied, __ATOMIC_RELAXED);
+    long iterations = 0;
+    struct op_cost cost;
+    cost.failed = 0;
+    double start = now();
+    double elapsed = 0;
+    while (iterations == 0 || (elapsed < seconds && iterations < 10000)) {
+        if (op() < 0) {
+            cost.failed = 1;
+        }
+        iterations++;
+        elapsed = now() - start;
+    }
+    cost.bytes_per_s = (double)size * iterations / elapsed;
+    cost.rpcs = (double)(rpc_call_count(userdata) - rpcs0) / iterations;
+    cost.allocations =
+        (double)(__atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocs0) / iterations;
+    cost.copied = (double)(__atomic_load_n(&copied, __ATOMIC_RELAXED) - copied0) / iterations;
+    return cost;
+}
+
+static void print_cost(const char *op, size_t size, const struct op_cost &c) {
+    printf("%-9s %12zu %12.2f %10.1f %10.1f %14.0f%s\n", op, size,
+           c.bytes_per_s / 1e6, c.rpcs, c.allocations, c.copied,
+           c.failed ? "  (failed)" : "");
+}
+
+// Start the server on dir with its second transport on port, and wait until
+// it accepts connections. Returns its pid.
+static pid_t start_server(const char *dir, int port) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::string p = std::to_string(port);
+        setenv("WATDFS_CONN_PORT", p.c_str(), 1);
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        execl("./watdfs_server", "watdfs_server", dir, (char *)nullptr);
+        _exit(127);
+    }
+    for (int i = 0; i < 100; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ret = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+        if (ret == 0) {
+            return pid;
+        }
+        usleep(100000);
+    }
+    fprintf(stderr, "rpc_bench: ./watdfs_server did not start on port %d\n", port);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    long max_bytes = argc > 1 ? atol(argv[1]) : BENCH_MAX_BYTES;
+    double seconds = argc > 2 ? atof(argv[2]) : 0.2;
+    int port = argc > 3 ? atoi(argv[3]) : BENCH_PORT;
+    if (max_bytes < 1 || max_bytes > (4L << 30)) {
+        fprintf(stderr, "rpc_bench: max_bytes must be from 1 to 4 GiB\n");
+        return 2;
+    }
+
+    char server_dir[] = "/tmp/rpc_bench_server.XXXXXX";
+    char cache_dir[] = "/tmp/rpc_bench_cache.XXXXXX";
+    if (mkdtemp(server_dir) == nullptr || mkdtemp(cache_dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    pid_t server = 0;
+    std::string servers = std::string(RPC_CONN_LOOPBACK) + ":0";
+    if (port == 0) {
+        if (watdfs_server_setup(server_dir, 0) < 0) {
+            fprintf(stderr, "rpc_bench: cannot set up the server in %s\n", server_dir);
+            return 1;
+        }
+    } else {
+        server = start_server(server_dir, port);
+        servers = "localhost:" + std::to_string(port);
+    }
+    setenv("WATDFS_SERVERS", servers.c_str(), 1);
+    struct fuse_conn_info conn;
+    int ret_code = 0;
+    void *userdata = watdfs_cli_init(&conn, cache_dir, 0, &ret_code);
+    if (ret_code != 0) {
+        fprintf(stderr, "rpc_bench: client init failed with %d\n", ret_code);
+        if (server > 0) kill(server, SIGTERM);
+        return 1;
+    }
+
+    char *buf = (char *)malloc(max_bytes);
+    srand(1);
+    for (long i = 0; i < max_bytes; i++) {
+        buf[i] = (char)rand();
+    }
+
+    printf("%-9s %12s %12s %10s %10s %14s\n", "op", "bytes", "MB/s", "rpcs/op",
+           "allocs/op", "memcpy B/op");
+    for (long size = 1; size <= max_bytes; size *= 4) {
+        std::string path = "/bench_" + std::to_string(size);
+        std::string full_path = std::string(cache_dir) + path;
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_RDWR;
+        rpc_call_mknod(userdata, path.c_str(), S_IFREG | 0644, 0);
+        if (rpc_call_open(userdata, path.c_str(), &fi) < 0) {
+            fprintf(stderr, "rpc_bench: cannot open %s\n", path.c_str());
+            break;
+        }
+        auto transfer = [&](bool is_write) {
+            for (long done = 0; done < size;) {
+                long n = std::min(size - done, BENCH_MAX_CALL);
+                int ret = is_write ? rpc_call_write(userdata, path.c_str(), buf + done,
+                                                    n, done, &fi)
+                                   : rpc_call_read(userdata, path.c_str(), buf + done,
+                                                   n, done, &fi);
+                if (ret <= 0) return -1;
+                done += ret;
+            }
+            return 0;
+        };
+        print_cost("write", size, measure(userdata, size, seconds, [&] {
+            return transfer(true);
+        }));
+        print_cost("read", size, measure(userdata, size, seconds, [&] {
+            return transfer(false);
+        }));
+        rpc_call_release(userdata, path.c_str(), &fi);
+
+        int fd = open(full_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        for (long done = 0; fd >= 0 && done < size;) {
+            ssize_t n = pwrite(fd, buf + done, size - done, done);
+            if (n <= 0) break;
+            done += n;
+        }
+        if (fd >= 0) close(fd);
+        print_cost("upload", size, measure(userdata, size, seconds, [&] {
+            return upload((struct Client_information *)userdata, path.c_str(),
+                          full_path.c_str());
+        }));
+        print_cost("download", size, measure(userdata, size, seconds, [&] {
+            return download((struct Client_information *)userdata, path.c_str(),
+                            full_path.c_str());
+        }));
+        unlink(full_path.c_str());
+    }
+
+    watdfs_cli_destroy(userdata);
+    free(buf);
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, nullptr, 0);
+    } else {
+        watdfs_server_teardown();
+    }
+    std::string cleanup = std::string("rm -rf ") + server_dir + " " + cache_dir;
+    if (system(cleanup.c_str()) != 0) {
+        fprintf(stderr, "rpc_bench: could not remove %s and %s\n", server_dir, cache_dir);
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+
+// trace_bench.cpp
+// How many DLOG messages per second 1 to 16 threads log together, for each
+// WATDFS_TRACE mode: off, the binary trace, and text on stderr (sent to
+// /dev/null here, so no terminal is involved). The message is a typical one,
+// a path and two integers. Usage:
+// trace_bench [seconds_per_run]
+
+#include "../debug.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+INIT_LOG
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the millions of messages per second threads log together, over
+// about seconds.
+static double run(int threads, double seconds) {
+    std::vector<long> counts(threads, 0);
+    std::vector<std::thread> workers;
+    double start = now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            long n = 0;
+            while (now() - start < seconds) {
+                for (int i = 0; i < 1000; i++) {
+                    DLOG("read: %s at %ld, %d bytes", "/some/file/in/the/mount", n + i, 4096);
+                }
+                n += 1000;
+            }
+            counts[t] = n;
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    double elapsed = now() - start;
+    long total = 0;
+    for (long n : counts) {
+        total += n;
+    }
+    return total / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, 2);
+    char path[] = "/tmp/trace_bench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    const int thread_counts[] = {1, 2, 4, 8, 16};
+    printf("%-8s", "threads");
+    for (int threads : thread_counts) {
+        printf(" %8d", threads);
+    }
+    printf("   (million messages/s, all threads)\n");
+    const struct {
+        int mode;
+        const char *name;
+    } modes[] = {{TRACE_OFF, "off"}, {TRACE_BINARY, "binary"}, {TRACE_TEXT, "text"}};
+    for (auto &m : modes) {
+        if (m.mode == TRACE_BINARY && trace_open(path) < 0) {
+            perror("trace_open");
+            return 1;
+        }
+        trace_mode = m.mode;
+        printf("%-8s", m.name);
+        for (int threads : thread_counts) {
+            printf(" %8.2f", run(threads, seconds));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,568 @@
+
+#include "checksum.h"
+
+#include <string.h>
+#include <immintrin.h>
+
+// GCC 12's AVX-512 intrinsics trip false uninitialized warnings wherever
+// they are inlined (GCC bug 105593).
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// CRC32C, reflected form of the Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78u
+
+// XXH3 constants.
+#define XXH_PRIME32_1 0x9e3779b1u
+#define XXH_PRIME32_2 0x85ebca77u
+#define XXH_PRIME32_3 0xc2b2ae3du
+#define XXH_PRIME64_1 0x9e3779b185ebca87ull
+#define XXH_PRIME64_2 0xc2b2ae3d27d4eb4full
+#define XXH_PRIME64_3 0x165667b19e3779f9ull
+#define XXH_PRIME64_4 0x85ebca77c2b2ae63ull
+#define XXH_PRIME64_5 0x27d4eb2f165667c5ull
+#define XXH_PRIME_MX1 0x165667919e3779f9ull
+#define XXH_PRIME_MX2 0x9fb21c651e98df25ull
+#define XXH_STRIPE_LEN 64
+#define XXH_SECRET_SIZE 192
+#define XXH_SECRET_CONSUME_RATE 8
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / XXH_SECRET_CONSUME_RATE)
+#define XXH_BLOCK_LEN (XXH_STRIPE_LEN * XXH_STRIPES_PER_BLOCK)
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// CRC32C
+
+// Slicing-by-8 tables, and the folding constants of the AVX-512 kernel.
+static uint32_t crc_table[8][256];
+
+// A pair of carry-less multiply constants that move a 128-bit block of the
+// message distance bits further along: the low half is x^(distance+63) mod P
+// for the first 64 bits of the block, the high half x^(distance-1) mod P for
+// the last 64, both bit-reflected into the top of a 64-bit word.
+struct fold_constants {
+    uint64_t lo_;
+    uint64_t hi_;
+};
+static struct fold_constants fold_2048, fold_512, fold_384, fold_256, fold_128;
+
+// x^n mod P, in the normal (unreflected) bit order.
+static uint32_t xpow_mod(unsigned n) {
+    uint64_t r = 1;
+    for (unsigned i = 0; i < n; i++) {
+        r <<= 1;
+        if (r & (1ull << 32)) {
+            r ^= 0x11edc6f41ull;
+        }
+    }
+    return (uint32_t)r;
+}
+
+static uint64_t reflect_constant(uint32_t k) {
+    uint64_t r = 0;
+    for (int d = 0; d < 32; d++) {
+        if (k & (1u << d)) {
+            r |= 1ull << (63 - d);
+        }
+    }
+    return r;
+}
+
+static struct fold_constants make_fold(unsigned distance) {
+    struct fold_constants k;
+    k.lo_ = reflect_constant(xpow_mod(distance + 63));
+    k.hi_ = reflect_constant(xpow_mod(distance - 1));
+    return k;
+}
+
+static void crc32c_init_tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^
+                              crc_table[0][crc_table[t - 1][i] & 0xff];
+        }
+    }
+    fold_2048 = make_fold(2048);
+    fold_512 = make_fold(512);
+    fold_384 = make_fold(384);
+    fold_256 = make_fold(256);
+    fold_128 = make_fold(128);
+}
+
+// The kernels work on the raw register value (~crc).
+static uint32_t crc32c_scalar(uint32_t state, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = read32(p) ^ state;
+        uint32_t hi = read32(p + 4);
+        state = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+                crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+                crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+                crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        state = (state >> 8) ^ crc_table[0][(state ^ *p++) & 0xff];
+    }
+    return state;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t state, const uint8_t *p, size_t len) {
+    uint64_t s = state;
+    while (len >= 8) {
+        s = _mm_crc32_u64(s, read64(p));
+        p += 8;
+        len -= 8;
+    }
+    state = (uint32_t)s;
+    while (len-- > 0) {
+        state = _mm_crc32_u8(state, *p++);
+    }
+    return state;
+}
+
+#define AVX512_CRC_TARGET "avx512f,avx512vl,vpclmulqdq,pclmul,sse4.2"
+
+__attribute__((target(AVX512_CRC_TARGET)))
+static inline __m512i fold512(__m512i x, __m512i k, __m512i data) {
+    // x.lo * k.lo ^ x.hi * k.hi ^ data, per 128-bit lane.
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                     _mm512_clmulepi64_epi128(x, k, 0x11), data, 0x96);
+}
+
+__attribute__((target(AVX512_CRC_TARGET)))
+static inline __m128i fold128(__m128i x, const struct fold_constants &c) {
+    __m128i k = _mm_set_epi64x((long long)c.hi_, (long long)c.lo_);
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                         _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target(AVX512_CRC_TARGET)))
+static inline __m512i broadcast_fold(const struct fold_constants &c) {
+    long long lo = (long long)c.lo_;
+    long long hi = (long long)c.hi_;
+    return _mm512_set_epi64(hi, lo, hi, lo, hi, lo, hi, lo);
+}
+
+// Fold the message four 512-bit registers at a time, so sixteen independent
+// carry-less multiplies are in flight, then fold the registers down to one
+// 128-bit block that is congruent to the message and finish with the crc32
+// instruction.
+__attribute__((target(AVX512_CRC_TARGET)))
+static uint32_t crc32c_avx512(uint32_t state, const uint8_t *p, size_t len) {
+    if (len < 256) {
+        return crc32c_sse42(state, p, len);
+    }
+    __m512i x0 = _mm512_loadu_si512((const void *)p);
+    __m512i x1 = _mm512_loadu_si512((const void *)(p + 64));
+    __m512i x2 = _mm512_loadu_si512((const void *)(p + 128));
+    __m512i x3 = _mm512_loadu_si512((const void *)(p + 192));
+    // Continuing a CRC is the same as xoring the register into the first
+    // four message bytes.
+    x0 = _mm512_xor_si512(x0, _mm512_inserti32x4(_mm512_setzero_si512(),
+                                                 _mm_cvtsi32_si128((int)state), 0));
+    p += 256;
+    len -= 256;
+
+    __m512i k = broadcast_fold(fold_2048);
+    while (len >= 256) {
+        x0 = fold512(x0, k, _mm512_loadu_si512((const void *)p));
+        x1 = fold512(x1, k, _mm512_loadu_si512((const void *)(p + 64)));
+        x2 = fold512(x2, k, _mm512_loadu_si512((const void *)(p + 128)));
+        x3 = fold512(x3, k, _mm512_loadu_si512((const void *)(p + 192)));
+        p += 256;
+        len -= 256;
+    }
+
+    k = broadcast_fold(fold_512);
+    x1 = fold512(x0, k, x1);
+    x2 = fold512(x1, k, x2);
+    x3 = fold512(x2, k, x3);
+
+    alignas(64) uint8_t lanes[64];
+    _mm512_store_si512((void *)lanes, x3);
+    __m128i r = _mm_xor_si128(fold128(_mm_load_si128((const __m128i *)lanes), fold_384),
+                              fold128(_mm_load_si128((const __m128i *)(lanes + 16)), fold_256));
+    r = _mm_xor_si128(r, fold128(_mm_load_si128((const __m128i *)(lanes + 32)), fold_128));
+    r = _mm_xor_si128(r, _mm_load_si128((const __m128i *)(lanes + 48)));
+
+    uint64_t s = _mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(r));
+    s = _mm_crc32_u64(s, (uint64_t)_mm_extract_epi64(r, 1));
+    return crc32c_sse42((uint32_t)s, p, len);
+}
+
+// XXH3
+
+static const uint8_t xxh_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c,
+    0xf7, 0x21, 0xad, 0x1c, 0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+    0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, 0xcb, 0x79, 0xe6, 0x4e,
+    0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6,
+    0x81, 0x3a, 0x26, 0x4c, 0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+    0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, 0x71, 0x64, 0x48, 0x97,
+    0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7,
+    0xc7, 0x0b, 0x4f, 0x1d, 0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+    0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, 0xea, 0xc5, 0xac, 0x83,
+    0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26,
+    0x29, 0xd4, 0x68, 0x9e, 0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+    0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, 0x45, 0xcb, 0x3a, 0x8f,
+    0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t xxh3_rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= XXH_PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline uint64_t xxh3_mix16(const uint8_t *p, const uint8_t *s) {
+    return mul128_fold64(read64(p) ^ read64(s), read64(p + 8) ^ read64(s + 8));
+}
+
+static uint64_t xxh3_short(const uint8_t *p, size_t len) {
+    const uint8_t *s = xxh_secret;
+    if (len > 8) {
+        uint64_t lo = read64(p) ^ (read64(s + 24) ^ read64(s + 32));
+        uint64_t hi = read64(p + len - 8) ^ (read64(s + 40) ^ read64(s + 48));
+        uint64_t acc = len + __builtin_bswap64(lo) + hi + mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    if (len >= 4) {
+        uint64_t in = read32(p + len - 4) + ((uint64_t)read32(p) << 32);
+        return xxh3_rrmxmx(in ^ (read64(s + 8) ^ read64(s + 16)), len);
+    }
+    if (len > 0) {
+        uint32_t combined = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) |
+                            (uint32_t)p[len - 1] | ((uint32_t)len << 8);
+        return xxh64_avalanche(combined ^ (uint64_t)(read32(s) ^ read32(s + 4)));
+    }
+    return xxh64_avalanche(read64(s + 56) ^ read64(s + 64));
+}
+
+static uint64_t xxh3_medium(const uint8_t *p, size_t len) {
+    const uint8_t *s = xxh_secret;
+    uint64_t acc = len * XXH_PRIME64_1;
+    if (len <= 128) {
+        if (len > 32) {
+            if (len > 64) {
+                if (len > 96) {
+                    acc += xxh3_mix16(p + 48, s + 96);
+                    acc += xxh3_mix16(p + len - 64, s + 112);
+                }
+                acc += xxh3_mix16(p + 32, s + 64);
+                acc += xxh3_mix16(p + len - 48, s + 80);
+            }
+            acc += xxh3_mix16(p + 16, s + 32);
+            acc += xxh3_mix16(p + len - 32, s + 48);
+        }
+        acc += xxh3_mix16(p, s);
+        acc += xxh3_mix16(p + len - 16, s + 16);
+        return xxh3_avalanche(acc);
+    }
+    // 129 to 240 bytes.
+    for (int i = 0; i < 8; i++) {
+        acc += xxh3_mix16(p + 16 * i, s + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+    int rounds = (int)(len / 16);
+    for (int i = 8; i < rounds; i++) {
+        acc += xxh3_mix16(p + 16 * i, s + 16 * (i - 8) + 3);
+    }
+    acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+    return xxh3_avalanche(acc);
+}
+
+// The long-input loop is written once over a kernel that accumulates a run of
+// stripes and scrambles the accumulators; each kernel is compiled for its own
+// instruction set.
+struct xxh3_scalar_kernel {
+    static void accumulate(uint64_t *acc, const uint8_t *p, const uint8_t *s,
+                           size_t stripes) {
+        for (size_t n = 0; n < stripes; n++) {
+            const uint8_t *in = p + n * XXH_STRIPE_LEN;
+            const uint8_t *key_in = s + n * XXH_SECRET_CONSUME_RATE;
+            for (int i = 0; i < 8; i++) {
+                uint64_t data = read64(in + 8 * i);
+                uint64_t key = data ^ read64(key_in + 8 * i);
+                acc[i ^ 1] += data;
+                acc[i] += (key & 0xffffffffull) * (key >> 32);
+            }
+        }
+    }
+    static void scramble(uint64_t *acc, const uint8_t *s) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t a = acc[i];
+            a ^= a >> 47;
+            a ^= read64(s + 8 * i);
+            acc[i] = a * XXH_PRIME32_1;
+        }
+    }
+};
+
+struct xxh3_avx2_kernel {
+    __attribute__((target("avx2")))
+    static void accumulate(uint64_t *acc, const uint8_t *p, const uint8_t *s,
+                           size_t stripes) {
+        __m256i a[2];
+        for (int i = 0; i < 2; i++) {
+            a[i] = _mm256_loadu_si256((const __m256i *)(acc + 4 * i));
+        }
+        for (size_t n = 0; n < stripes; n++) {
+            const uint8_t *in = p + n * XXH_STRIPE_LEN;
+            const uint8_t *key_in = s + n * XXH_SECRET_CONSUME_RATE;
+            for (int i = 0; i < 2; i++) {
+                __m256i data = _mm256_loadu_si256((const __m256i *)(in + 32 * i));
+                __m256i key = _mm256_xor_si256(
+                    data, _mm256_loadu_si256((const __m256i *)(key_in + 32 * i)));
+                __m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+                __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+                a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            _mm256_storeu_si256((__m256i *)(acc + 4 * i), a[i]);
+        }
+    }
+    __attribute__((target("avx2")))
+    static void scramble(uint64_t *acc, const uint8_t *s) {
+        const __m256i prime = _mm256_set1_epi32((int)XXH_PRIME32_1);
+        for (int i = 0; i < 2; i++) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(acc + 4 * i));
+            a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+            a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(s + 32 * i)));
+            __m256i lo = _mm256_mul_epu32(a, prime);
+            __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+            a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+            _mm256_storeu_si256((__m256i *)(acc + 4 * i), a);
+        }
+    }
+};
+
+struct xxh3_avx512_kernel {
+    __attribute__((target("avx512f")))
+    static void accumulate(uint64_t *acc, const uint8_t *p, const uint8_t *s,
+                           size_t stripes) {
+        __m512i a = _mm512_loadu_si512((const void *)acc);
+        for (size_t n = 0; n < stripes; n++) {
+            __m512i data = _mm512_loadu_si512((const void *)(p + n * XXH_STRIPE_LEN));
+            __m512i key = _mm512_xor_si512(
+                data, _mm512_loadu_si512((const void *)(s + n * XXH_SECRET_CONSUME_RATE)));
+            __m512i product = _mm512_mul_epu32(key, _mm512_srli_epi64(key, 32));
+            __m512i swapped = _mm512_shuffle_epi32(data, (_MM_PERM_ENUM)_MM_SHUFFLE(1, 0, 3, 2));
+            a = _mm512_add_epi64(a, _mm512_add_epi64(product, swapped));
+        }
+        _mm512_storeu_si512((void *)acc, a);
+    }
+    __attribute__((target("avx512f")))
+    static void scramble(uint64_t *acc, const uint8_t *s) {
+        const __m512i prime = _mm512_set1_epi32((int)XXH_PRIME32_1);
+        __m512i a = _mm512_loadu_si512((const void *)acc);
+        a = _mm512_ternarylogic_epi64(a, _mm512_srli_epi64(a, 47),
+                                      _mm512_loadu_si512((const void *)s), 0x96);
+        __m512i lo = _mm512_mul_epu32(a, prime);
+        __m512i hi = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), prime);
+        a = _mm512_add_epi64(lo, _mm512_slli_epi64(hi, 32));
+        _mm512_storeu_si512((void *)acc, a);
+    }
+};
+
+template <class K>
+static uint64_t xxh3_long(const uint8_t *p, size_t len) {
+    const uint8_t *s = xxh_secret;
+    alignas(64) uint64_t acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2,
+                                   XXH_PRIME64_3, XXH_PRIME64_4, XXH_PRIME32_2,
+                                   XXH_PRIME64_5, XXH_PRIME32_1};
+    size_t blocks = (len - 1) / XXH_BLOCK_LEN;
+    for (size_t b = 0; b < blocks; b++) {
+        K::accumulate(acc, p + b * XXH_BLOCK_LEN, s, XXH_STRIPES_PER_BLOCK);
+        K::scramble(acc, s + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+    }
+    const uint8_t *last = p + blocks * XXH_BLOCK_LEN;
+    size_t stripes = ((len - 1) - blocks * XXH_BLOCK_LEN) / XXH_STRIPE_LEN;
+    K::accumulate(acc, last, s, stripes);
+    K::accumulate(acc, p + len - XXH_STRIPE_LEN, s + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7, 1);
+
+    uint64_t result = len * XXH_PRIME64_1;
+    for (int i = 0; i < 4; i++) {
+        result += mul128_fold64(acc[2 * i] ^ read64(s + 11 + 16 * i),
+                                acc[2 * i + 1] ^ read64(s + 11 + 16 * i + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+// DISPATCH
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+typedef uint64_t (*xxh3_long_fn)(const uint8_t *, size_t);
+
+static crc32c_fn crc32c_impl = crc32c_scalar;
+static int crc32c_impl_id = CHECKSUM_IMPL_SCALAR;
+static xxh3_long_fn xxh3_long_impl = xxh3_long<xxh3_scalar_kernel>;
+static int xxh3_impl_id = CHECKSUM_IMPL_SCALAR;
+
+static bool cpu_supports(int impl) {
+    switch (impl) {
+    case CHECKSUM_IMPL_SCALAR:
+        return true;
+    case CHECKSUM_IMPL_SSE42:
+        return __builtin_cpu_supports("sse4.2");
+    case CHECKSUM_IMPL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case CHECKSUM_IMPL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    }
+    return false;
+}
+
+int checksum_set_impl(int kind, int impl) {
+    if (!cpu_supports(impl)) {
+        return -1;
+    }
+    if (kind == CHECKSUM_CRC32C) {
+        switch (impl) {
+        case CHECKSUM_IMPL_SCALAR:
+            crc32c_impl = crc32c_scalar;
+            break;
+        case CHECKSUM_IMPL_SSE42:
+            crc32c_impl = crc32c_sse42;
+            break;
+        case CHECKSUM_IMPL_AVX512:
+            if (!__builtin_cpu_supports("avx512vl") ||
+                !__builtin_cpu_supports("vpclmulqdq") ||
+                !__builtin_cpu_supports("sse4.2")) {
+                return -1;
+            }
+            crc32c_impl = crc32c_avx512;
+            break;
+        default:
+            return -1;
+        }
+        crc32c_impl_id = impl;
+        return 0;
+    }
+    if (kind == CHECKSUM_XXH3) {
+        switch (impl) {
+        case CHECKSUM_IMPL_SCALAR:
+            xxh3_long_impl = xxh3_long<xxh3_scalar_kernel>;
+            break;
+        case CHECKSUM_IMPL_AVX2:
+            xxh3_long_impl = xxh3_long<xxh3_avx2_kernel>;
+            break;
+        case CHECKSUM_IMPL_AVX512:
+            xxh3_long_impl = xxh3_long<xxh3_avx512_kernel>;
+            break;
+        default:
+            return -1;
+        }
+        xxh3_impl_id = impl;
+        return 0;
+    }
+    return -1;
+}
+
+// Pick the fastest implementations once, at startup.
+static int checksum_init() {
+    crc32c_init_tables();
+    if (checksum_set_impl(CHECKSUM_CRC32C, CHECKSUM_IMPL_AVX512) < 0) {
+        checksum_set_impl(CHECKSUM_CRC32C, CHECKSUM_IMPL_SSE42);
+    }
+    if (checksum_set_impl(CHECKSUM_XXH3, CHECKSUM_IMPL_AVX512) < 0) {
+        checksum_set_impl(CHECKSUM_XXH3, CHECKSUM_IMPL_AVX2);
+    }
+    return 0;
+}
+static int checksum_ready = checksum_init();
+
+static const char *impl_name(int impl) {
+    switch (impl) {
+    case CHECKSUM_IMPL_SSE42:
+        return "sse4.2";
+    case CHECKSUM_IMPL_AVX2:
+        return "avx2";
+    case CHECKSUM_IMPL_AVX512:
+        return "avx512";
+    }
+    return "scalar";
+}
+
+const char *checksum_impl_name(int kind) {
+    if (kind == CHECKSUM_CRC32C) {
+        return impl_name(crc32c_impl_id);
+    }
+    if (kind == CHECKSUM_XXH3) {
+        return impl_name(xxh3_impl_id);
+    }
+    return "none";
+}
+
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len) {
+    (void)checksum_ready;
+    return ~crc32c_impl(~crc, (const uint8_t *)data, len);
+}
+
+uint64_t checksum_xxh3(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    if (len <= 16) {
+        return xxh3_short(p, len);
+    }
+    if (len <= 240) {
+        return xxh3_medium(p, len);
+    }
+    return xxh3_long_impl(p, len);
+}
+
+uint64_t checksum_compute(int kind, const void *data, size_t len) {
+    switch (kind) {
+    case CHECKSUM_CRC32C:
+        return checksum_crc32c(0, data, len);
+    case CHECKSUM_XXH3:
+        return checksum_xxh3(data, len);
+    }
+    return 0;
+}
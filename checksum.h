@@ -0,0 +1,65 @@
+
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// checksum.h
+// End-to-end checksums for the data carried by the read and write RPCs,
+// shared by the client and the server. The sender computes the checksum of
+// every RPC's payload (at most one MAX_ARRAY_LEN chunk, or the raw bytes of a
+// batch of compressed frames) and the receiver checks it before using the
+// data. Two kernels are available:
+// - CRC32C (Castagnoli), using the SSE4.2 crc32 instruction, or carry-less
+//   multiply folding over 512-bit registers on CPUs with AVX-512 VPCLMULQDQ;
+// - XXH3 (64-bit, seed 0), using AVX2 or AVX-512 for the long-input loop.
+// The fastest implementation the CPU supports is picked at startup; every
+// kernel has a portable scalar fallback producing the same values.
+
+// The checksum kinds carried by the read and write RPCs.
+#define CHECKSUM_NONE 0
+#define CHECKSUM_CRC32C 1
+#define CHECKSUM_XXH3 2
+
+// Implementations, for checksum_set_impl. CRC32C has SCALAR, SSE42 and
+// AVX512; XXH3 has SCALAR, AVX2 and AVX512.
+#define CHECKSUM_IMPL_SCALAR 0
+#define CHECKSUM_IMPL_SSE42 1
+#define CHECKSUM_IMPL_AVX2 2
+#define CHECKSUM_IMPL_AVX512 3
+
+// How often a transfer is retried after a checksum mismatch before the
+// operation fails with -EIO.
+#define CHECKSUM_RETRIES 2
+
+// FUNCTIONS
+
+// Continue the CRC32C crc (0 to start) over len bytes of data.
+uint32_t checksum_crc32c(uint32_t crc, const void *data, size_t len);
+
+// XXH3 64-bit hash of len bytes of data.
+uint64_t checksum_xxh3(const void *data, size_t len);
+
+// The checksum of the given kind (CHECKSUM_*) over len bytes; 0 for
+// CHECKSUM_NONE or an unknown kind.
+uint64_t checksum_compute(int kind, const void *data, size_t len);
+
+// Force the implementation (CHECKSUM_IMPL_*) of a kind. Returns 0, or -1 if
+// the kind has no such implementation or the CPU does not support it. Meant
+// for benchmarks.
+int checksum_set_impl(int kind, int impl);
+
+// The name of the implementation in use for a kind.
+const char *checksum_impl_name(int kind);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
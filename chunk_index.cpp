@@ -0,0 +1,199 @@
+
+#include "chunk_index.h"
+#include "debug.h"
+#include "io_engine.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Where the bytes of a chunk were last seen.
+struct chunk_location {
+    std::string path_;
+    uint64_t offset_;
+    uint32_t len_;
+};
+
+static std::string index_root;
+
+// To protect the index and the indexer queue.
+static std::mutex index_lock;
+// Chunk ID (the raw digest) -> location.
+static std::unordered_map<std::string, struct chunk_location> chunks;
+// Short path -> the IDs whose location is in that file, to drop them when the
+// file is indexed again.
+static std::unordered_map<std::string, std::vector<std::string>> file_chunks;
+
+static std::condition_variable queue_cv;
+static std::deque<std::string> queue;
+static std::set<std::string> queued;
+static std::thread indexer;
+static bool stopping = false;
+
+// Called with index_lock held.
+static void forget_file(const std::string &path) {
+    auto it = file_chunks.find(path);
+    if (it == file_chunks.end()) {
+        return;
+    }
+    for (const std::string &id : it->second) {
+        auto c = chunks.find(id);
+        if (c != chunks.end() && c->second.path_ == path) {
+            chunks.erase(c);
+        }
+    }
+    file_chunks.erase(it);
+}
+
+// Chunk the whole file and point the index at it.
+static void index_file(const std::string &path) {
+    std::vector<std::pair<std::string, struct chunk_location>> found;
+    std::string full_path = index_root + path;
+    int fd = open(full_path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        // Keep at least CHUNK_MAX_SIZE bytes ahead of every cut, so the
+        // boundaries match what a client computes over the whole file.
+        std::vector<char> buf(4 * CHUNK_MAX_SIZE);
+        size_t have = 0;
+        uint64_t buf_offset = 0;
+        bool eof = false;
+        while (!eof || have > 0) {
+            while (!eof && have < buf.size()) {
+                ssize_t n = read(fd, buf.data() + have, buf.size() - have);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    eof = true;
+                } else {
+                    have += n;
+                }
+            }
+            size_t pos = 0;
+            while (pos < have && (eof || have - pos >= CHUNK_MAX_SIZE)) {
+                size_t n = chunker_cut(buf.data() + pos, have - pos);
+                unsigned char id[SHA256_DIGEST_LEN];
+                sha256(buf.data() + pos, n, id);
+                found.push_back({std::string((char *)id, SHA256_DIGEST_LEN),
+                                 {path, buf_offset + pos, (uint32_t)n}});
+                pos += n;
+            }
+            memmove(buf.data(), buf.data() + pos, have - pos);
+            have -= pos;
+            buf_offset += pos;
+        }
+        close(fd);
+    }
+
+    std::lock_guard<std::mutex> guard(index_lock);
+    forget_file(path);
+    if (found.empty()) {
+        return;
+    }
+    std::vector<std::string> &ids = file_chunks[path];
+    for (auto &f : found) {
+        chunks[f.first] = f.second;
+        ids.push_back(f.first);
+    }
+    DLOG("chunk index: %s has %zu chunks, %zu indexed in total", path.c_str(),
+         found.size(), chunks.size());
+}
+
+static void indexer_main() {
+    std::unique_lock<std::mutex> guard(index_lock);
+    while (true) {
+        queue_cv.wait(guard, [] { return stopping || !queue.empty(); });
+        if (stopping) {
+            return;
+        }
+        std::string path = queue.front();
+        queue.pop_front();
+        queued.erase(path);
+        guard.unlock();
+        index_file(path);
+        guard.lock();
+    }
+}
+
+void chunk_index_init(const char *root) {
+    index_root = root;
+    indexer = std::thread(indexer_main);
+}
+
+void chunk_index_destroy() {
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (indexer.joinable()) {
+        indexer.join();
+    }
+}
+
+void chunk_index_add_file(const char *short_path) {
+    std::lock_guard<std::mutex> guard(index_lock);
+    if (queued.insert(short_path).second) {
+        queue.push_back(short_path);
+        queue_cv.notify_one();
+    }
+}
+
+int chunk_index_has(const unsigned char id[SHA256_DIGEST_LEN]) {
+    std::lock_guard<std::mutex> guard(index_lock);
+    return chunks.count(std::string((const char *)id, SHA256_DIGEST_LEN)) ? 1 : 0;
+}
+
+long chunk_index_place(const struct chunk_ref *ref, int dst_fd) {
+    std::string id((const char *)ref->id, SHA256_DIGEST_LEN);
+    struct chunk_location loc;
+    {
+        std::lock_guard<std::mutex> guard(index_lock);
+        auto it = chunks.find(id);
+        if (it == chunks.end() || it->second.len_ != ref->len) {
+            return -ENOENT;
+        }
+        loc = it->second;
+    }
+
+    std::string full_path = index_root + loc.path_;
+    int src_fd = io_engine_open(full_path.c_str(), O_RDONLY, 0);
+    if (src_fd < 0) {
+        return -ENOENT;
+    }
+    char *buf = (char *)malloc(loc.len_);
+    ssize_t n = io_engine_pread(src_fd, buf, loc.len_, loc.offset_);
+    close(src_fd);
+
+    unsigned char digest[SHA256_DIGEST_LEN];
+    if (n == (ssize_t)loc.len_) {
+        sha256(buf, n, digest);
+    }
+    if (n != (ssize_t)loc.len_ || memcmp(digest, ref->id, SHA256_DIGEST_LEN) != 0) {
+        // The file changed since it was indexed; it gets indexed again when
+        // its writer releases it.
+        std::lock_guard<std::mutex> guard(index_lock);
+        auto it = chunks.find(id);
+        if (it != chunks.end() && it->second.path_ == loc.path_ &&
+            it->second.offset_ == loc.offset_) {
+            chunks.erase(it);
+        }
+        free(buf);
+        return -ENOENT;
+    }
+
+    ssize_t written = io_engine_pwrite(dst_fd, buf, loc.len_, ref->offset);
+    free(buf);
+    if (written < 0) {
+        return written;
+    }
+    return written == (ssize_t)loc.len_ ? written : -EIO;
+}
@@ -0,0 +1,58 @@
+
+
+#ifndef CHUNK_INDEX_H
+#define CHUNK_INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chunker.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// chunk_index.h
+// The server's content-addressed chunk store for deduplicated uploads. The
+// files under server_persist_dir stay plain files, since every skeleton reads
+// and writes them directly; the store is an in-memory index from chunk ID to
+// a place in some file where those bytes live, so it costs no disk space.
+// Uploads place chunks the index knows by copying them inside the server
+// instead of receiving them again, and a committed file is chunked in the
+// background to feed the index. A location is only trusted after re-hashing
+// the bytes, so files changed in place since they were indexed simply miss.
+//
+// The index is shared by all clients: whichever client asks, it answers for
+// the chunks of every file on the server. So a client can find out whether
+// some file holds content it already knows or can guess, e.g. a file that
+// differs from a template only in a few bytes. The server cannot tell
+// clients apart reliably (librpc gives it no peer at all), so this is not
+// scoped per client. Deduplication is off unless the server runs with
+// WATDFS_DEDUP=1, which should only be set where the clients trust each
+// other.
+
+// FUNCTIONS
+
+// Start the index over the files in root (server_persist_dir), starting the
+// indexer thread. Existing files are indexed in the background.
+void chunk_index_init(const char *root);
+// Stop the indexer thread.
+void chunk_index_destroy();
+
+// (Re)index the file at short_path (relative to root) in the background,
+// after it was created or replaced.
+void chunk_index_add_file(const char *short_path);
+
+// Returns 1 if the index has a location for the chunk, 0 otherwise.
+int chunk_index_has(const unsigned char id[SHA256_DIGEST_LEN]);
+
+// Copy the chunk described by ref from where the index has it into dst_fd at
+// ref->offset. Returns the chunk length, or -ENOENT if the chunk is unknown
+// or its location no longer holds it, or another -errno.
+long chunk_index_place(const struct chunk_ref *ref, int dst_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
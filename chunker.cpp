@@ -0,0 +1,70 @@
+
+#include "chunker.h"
+
+// The gear hash shifts one bit per byte, so the hash only depends on the
+// last 64 bytes. Before the average size is reached a cut needs more zero
+// bits than after it, which narrows the chunk size distribution around
+// CHUNK_AVG_SIZE (normalized chunking, as in FastCDC).
+#define MASK_SMALL 0x0000d9f003530000ull // 15 bits
+#define MASK_LARGE 0x0000d90003530000ull // 11 bits
+
+// 256 random 64-bit values, the same on every host so that the client and
+// the server agree on the boundaries.
+static const uint64_t *gear_table() {
+    static uint64_t table[256];
+    static bool ready = [] {
+        uint64_t x = 0x5741544446534744ull; // splitmix64 seed
+        for (int i = 0; i < 256; i++) {
+            x += 0x9e3779b97f4a7c15ull;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            table[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)ready;
+    return table;
+}
+
+size_t chunker_cut(const char *data, size_t len) {
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+    const uint64_t *gear = gear_table();
+    const unsigned char *p = (const unsigned char *)data;
+    size_t limit = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+    size_t normal = limit < CHUNK_AVG_SIZE ? limit : CHUNK_AVG_SIZE;
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[p[i]];
+        if ((hash & MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; i++) {
+        hash = (hash << 1) + gear[p[i]];
+        if ((hash & MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+size_t chunker_split(const char *data, size_t len, uint64_t base_offset,
+                     struct chunk_ref *refs, size_t max_refs) {
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        size_t n = chunker_cut(data + pos, len - pos);
+        if (count < max_refs) {
+            refs[count].offset = base_offset + pos;
+            refs[count].len = (uint32_t)n;
+            sha256(data + pos, n, refs[count].id);
+        }
+        count++;
+        pos += n;
+    }
+    return count;
+}
@@ -0,0 +1,59 @@
+
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha256.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// chunker.h
+// Content-defined chunking for deduplicated uploads, shared by the client and
+// the server. Chunk boundaries come from a gear rolling hash over the data,
+// so they move with the content: inserting or deleting bytes only changes the
+// chunks around the edit, and the rest of a modified file still matches what
+// the server has. A chunk is named by the SHA-256 of its contents.
+
+// Capability bit exchanged by the "caps" RPC (see compress.h).
+#define WATDFS_CAP_DEDUP (1 << 1)
+
+#define CHUNK_MIN_SIZE 2048
+#define CHUNK_AVG_SIZE 8192
+#define CHUNK_MAX_SIZE 65536
+// Whole-file uploads smaller than this are sent as they are.
+#define DEDUP_MIN_UPLOAD 65536
+
+// One chunk of a file, as carried by the chunk RPCs. Both ends share the
+// layout, like struct fuse_file_info.
+struct chunk_ref {
+    uint64_t offset;
+    uint32_t len;
+    unsigned char id[SHA256_DIGEST_LEN];
+} __attribute__((packed));
+
+// The most chunk IDs or chunk_refs that fit in one RPC array.
+#define CHUNK_IDS_PER_RPC (65535 / SHA256_DIGEST_LEN)
+#define CHUNK_REFS_PER_RPC (65535 / sizeof(struct chunk_ref))
+
+// FUNCTIONS
+
+// Returns the length of the first chunk of data. Unless data holds the rest
+// of the file, len must be at least CHUNK_MAX_SIZE, or the cut is not stable.
+size_t chunker_cut(const char *data, size_t len);
+
+// Cut len bytes into chunks, filling refs with up to max_refs entries whose
+// offsets start at base_offset. Returns the number of chunks, or the number
+// needed if max_refs is too small (len / CHUNK_MIN_SIZE + 1 always suffices).
+size_t chunker_split(const char *data, size_t len, uint64_t base_offset,
+                     struct chunk_ref *refs, size_t max_refs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,393 @@
+
+#include "compress.h"
+#include "debug.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// LZ4 block format parameters.
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_HASH_LOG 12
+#define LZ4_MAX_DISTANCE 65535
+
+// The payload_len bit marking a stored (uncompressed) frame.
+#define FRAME_STORED 0x80000000u
+
+// Blocks whose sampled entropy is above this many bits per byte are stored.
+#define ENTROPY_THRESHOLD 7.2
+#define ENTROPY_SAMPLE 1024
+// A high-entropy block may still be made of long runs (the byte histogram
+// cannot tell), so it gets a trial compression of this prefix and is only
+// stored if the trial saves less than an eighth.
+#define TRIAL_SIZE 2048
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void write32le(char *p, uint32_t v) {
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)((v >> 24) & 0xff);
+}
+
+static inline uint32_t read32le(const char *p) {
+    const uint8_t *u = (const uint8_t *)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) |
+           ((uint32_t)u[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// Write an LZ4 length continuation (the part above 15) at op.
+static inline bool put_length(uint8_t **op, uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (*op >= oend) return false;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend) return false;
+    *(*op)++ = (uint8_t)len;
+    return true;
+}
+
+// Emit one sequence: literals [lit, lit + lit_len), then a match of
+// match_len bytes at distance offset (no match if match_len is 0, which is
+// only allowed for the final sequence).
+static bool put_sequence(uint8_t **op, uint8_t *oend, const uint8_t *lit,
+                         size_t lit_len, uint32_t offset, size_t match_len) {
+    if (*op >= oend) return false;
+    uint8_t *token = (*op)++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15 && !put_length(op, oend, lit_len - 15)) return false;
+    if ((size_t)(oend - *op) < lit_len) return false;
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+    if (match_len == 0) {
+        return true;
+    }
+    if (oend - *op < 2) return false;
+    *(*op)++ = (uint8_t)(offset & 0xff);
+    *(*op)++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - LZ4_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15 && !put_length(op, oend, ml - 15)) return false;
+    return true;
+}
+
+// Greedy single-pass LZ4 block compressor. Returns the compressed size, or 0
+// if it does not fit in cap.
+static size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst,
+                           size_t cap) {
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t anchor = 0;
+
+    if (n >= LZ4_MF_LIMIT + 1) {
+        // Positions are stored + 1 so that 0 means empty.
+        uint32_t table[1 << LZ4_HASH_LOG];
+        memset(table, 0, sizeof(table));
+        size_t mflimit = n - LZ4_MF_LIMIT;
+        size_t matchlimit = n - LZ4_LAST_LITERALS;
+        size_t ip = 0;
+        while (ip < mflimit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = lz4_hash(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip + 1;
+            if (ref == 0 || ip - (ref - 1) > LZ4_MAX_DISTANCE ||
+                read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+            size_t len = LZ4_MIN_MATCH;
+            while (ip + len < matchlimit && src[ref + len] == src[ip + len]) {
+                len++;
+            }
+            if (!put_sequence(&op, oend, src + anchor, ip - anchor,
+                              (uint32_t)(ip - ref), len)) {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+        }
+    }
+    if (!put_sequence(&op, oend, src + anchor, n - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+// Returns the decompressed size, or -1 if the block is malformed or does not
+// fit in cap.
+static long lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                           size_t cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + n;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) {
+            return -1;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) {
+            break; // The last sequence has no match.
+        }
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) return -1;
+        // Byte by byte, the match may overlap the output it is copying.
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+    return op - dst;
+}
+
+// Estimate the Shannon entropy (bits per byte) of a block from a sample.
+static double sample_entropy(const uint8_t *data, size_t len) {
+    size_t stride = len > ENTROPY_SAMPLE ? len / ENTROPY_SAMPLE : 1;
+    unsigned counts[256];
+    memset(counts, 0, sizeof(counts));
+    size_t samples = 0;
+    for (size_t i = 0; i < len; i += stride) {
+        counts[data[i]]++;
+        samples++;
+    }
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] == 0) continue;
+        double p = (double)counts[i] / samples;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+// Whether a block looks compressible enough to spend an LZ4 pass on.
+static bool worth_compressing(const uint8_t *data, size_t len) {
+    if (sample_entropy(data, len) < ENTROPY_THRESHOLD) {
+        return true;
+    }
+    if (len <= TRIAL_SIZE) {
+        return false;
+    }
+    uint8_t trial[TRIAL_SIZE];
+    size_t n = lz4_compress(data, TRIAL_SIZE, trial, TRIAL_SIZE - TRIAL_SIZE / 8);
+    return n != 0;
+}
+
+size_t compress_bound(size_t raw_len) {
+    size_t blocks = (raw_len + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+    return raw_len + (blocks > 0 ? blocks : 1) * COMPRESS_FRAME_HEADER;
+}
+
+size_t compress_frame_encode(const char *raw, size_t raw_len, char *out,
+                             size_t out_cap) {
+    if (raw_len > COMPRESS_BLOCK_SIZE || out_cap < COMPRESS_FRAME_HEADER) {
+        return 0;
+    }
+    size_t payload_cap = out_cap - COMPRESS_FRAME_HEADER;
+    size_t payload = 0;
+    // Only bother when the sample says the data is compressible, and only
+    // keep the result when it is actually smaller.
+    if (raw_len > 0 && worth_compressing((const uint8_t *)raw, raw_len)) {
+        size_t limit = payload_cap < raw_len ? payload_cap : raw_len - 1;
+        payload = lz4_compress((const uint8_t *)raw, raw_len,
+                               (uint8_t *)out + COMPRESS_FRAME_HEADER, limit);
+    }
+    uint32_t payload_word = (uint32_t)payload;
+    if (payload == 0) {
+        if (payload_cap < raw_len) {
+            return 0;
+        }
+        memcpy(out + COMPRESS_FRAME_HEADER, raw, raw_len);
+        payload = raw_len;
+        payload_word = (uint32_t)raw_len | FRAME_STORED;
+    }
+    write32le(out, (uint32_t)raw_len);
+    write32le(out + 4, payload_word);
+    return COMPRESS_FRAME_HEADER + payload;
+}
+
+size_t compress_frame_size(const char *in, size_t in_len, size_t *raw_len) {
+    if (in_len < COMPRESS_FRAME_HEADER) {
+        return 0;
+    }
+    uint32_t payload_word = read32le(in + 4);
+    size_t payload = payload_word & ~FRAME_STORED;
+    if (in_len - COMPRESS_FRAME_HEADER < payload) {
+        return 0;
+    }
+    // raw_len sizes the receiver's buffer, so it must not be taken on trust.
+    size_t raw = read32le(in);
+    if (raw > COMPRESS_BLOCK_SIZE ||
+        ((payload_word & FRAME_STORED) ? raw != payload : raw > payload * COMPRESS_MAX_RATIO)) {
+        return 0;
+    }
+    *raw_len = raw;
+    return COMPRESS_FRAME_HEADER + payload;
+}
+
+long compress_frame_decode(const char *in, size_t in_len, char *raw,
+                           size_t raw_cap) {
+    size_t raw_len;
+    size_t frame = compress_frame_size(in, in_len, &raw_len);
+    if (frame == 0 || raw_len > raw_cap) {
+        return -1;
+    }
+    uint32_t payload_word = read32le(in + 4);
+    size_t payload = frame - COMPRESS_FRAME_HEADER;
+    if (payload_word & FRAME_STORED) {
+        if (payload != raw_len) return -1;
+        memcpy(raw, in + COMPRESS_FRAME_HEADER, raw_len);
+        return (long)raw_len;
+    }
+    long n = lz4_decompress((const uint8_t *)in + COMPRESS_FRAME_HEADER,
+                            payload, (uint8_t *)raw, raw_len);
+    return n == (long)raw_len ? n : -1;
+}
+
+// The compressor thread pool. Workers are started on first use.
+static std::mutex pool_lock;
+static std::condition_variable pool_cv;
+static std::deque<std::function<void()>> pool_jobs;
+static std::vector<std::thread> pool_threads;
+static bool pool_stopping = false;
+
+static void pool_worker() {
+    std::unique_lock<std::mutex> lock(pool_lock);
+    while (true) {
+        pool_cv.wait(lock, [] { return pool_stopping || !pool_jobs.empty(); });
+        if (pool_jobs.empty()) {
+            return;
+        }
+        std::function<void()> job = std::move(pool_jobs.front());
+        pool_jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+// Called with pool_lock held.
+static void pool_start() {
+    unsigned threads = std::thread::hardware_concurrency();
+    const char *env = getenv("WATDFS_COMPRESS_THREADS");
+    if (env != nullptr) {
+        threads = (unsigned)atoi(env);
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    DLOG("starting %u compressor threads", threads);
+    pool_stopping = false;
+    for (unsigned i = 0; i < threads; i++) {
+        pool_threads.emplace_back(pool_worker);
+    }
+}
+
+size_t compress_encode(const char *raw, size_t raw_len, char *out) {
+    size_t blocks = (raw_len + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+    if (blocks <= 1) {
+        return compress_frame_encode(raw, raw_len, out, compress_bound(raw_len));
+    }
+
+    // Every block gets its worst-case slot in out, so workers never touch the
+    // same bytes; the frames are packed together once all are done.
+    size_t slot = COMPRESS_FRAME_HEADER + COMPRESS_BLOCK_SIZE;
+    std::vector<size_t> sizes(blocks);
+    std::vector<char> scratch(blocks * slot);
+    size_t remaining = blocks;
+    std::mutex done_lock;
+    std::condition_variable done_cv;
+
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        if (pool_threads.empty()) {
+            pool_start();
+        }
+        for (size_t b = 0; b < blocks; b++) {
+            pool_jobs.push_back([&, b] {
+                size_t off = b * COMPRESS_BLOCK_SIZE;
+                size_t len = raw_len - off < COMPRESS_BLOCK_SIZE
+                                 ? raw_len - off
+                                 : COMPRESS_BLOCK_SIZE;
+                sizes[b] = compress_frame_encode(raw + off, len,
+                                                 &scratch[b * slot], slot);
+                std::lock_guard<std::mutex> done(done_lock);
+                if (--remaining == 0) {
+                    done_cv.notify_one();
+                }
+            });
+        }
+    }
+    pool_cv.notify_all();
+
+    std::unique_lock<std::mutex> done(done_lock);
+    done_cv.wait(done, [&] { return remaining == 0; });
+
+    size_t used = 0;
+    for (size_t b = 0; b < blocks; b++) {
+        memcpy(out + used, &scratch[b * slot], sizes[b]);
+        used += sizes[b];
+    }
+    return used;
+}
+
+void compress_pool_destroy() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        pool_stopping = true;
+        threads.swap(pool_threads);
+    }
+    pool_cv.notify_all();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
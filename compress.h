@@ -0,0 +1,71 @@
+
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// compress.h
+// Compression of bulk file data on the read/write RPC path, shared by the
+// client and the server. Data is cut into blocks of COMPRESS_BLOCK_SIZE raw
+// bytes and every block becomes one self-describing frame:
+//
+//   u32 raw_len | u32 payload_len (high bit set: payload stored raw) | payload
+//
+// The payload is an LZ4 block (the standard LZ4 block format). A block is
+// stored raw when a quick entropy sample says it will not compress (already
+// compressed media, encrypted data) or when compressing did not make it
+// smaller, so incompressible data costs only the frame header.
+
+// Capability bits exchanged by the "caps" RPC.
+#define WATDFS_CAP_LZ4 (1 << 0)
+
+// The raw bytes in one frame. Small enough that a stored frame always fits in
+// a single RPC array (MAX_ARRAY_LEN).
+#define COMPRESS_BLOCK_SIZE 32768
+#define COMPRESS_FRAME_HEADER 8
+// The most raw bytes one payload byte of an LZ4 block can decode to: a match
+// length byte of 255. A frame claiming more is corrupt, so a message of n
+// encoded bytes never holds more than n * COMPRESS_MAX_RATIO raw bytes.
+#define COMPRESS_MAX_RATIO 255
+// Transfers smaller than this are not worth compressing.
+#define COMPRESS_MIN_TRANSFER 4096
+
+// FUNCTIONS
+
+// The largest encoding raw_len raw bytes can take.
+size_t compress_bound(size_t raw_len);
+
+// Encode one frame of raw_len <= COMPRESS_BLOCK_SIZE bytes into out. Returns
+// the frame size, or 0 if out_cap is too small to hold it.
+size_t compress_frame_encode(const char *raw, size_t raw_len, char *out,
+                             size_t out_cap);
+
+// Read the header of the frame at in. Returns the total frame size and sets
+// *raw_len, or 0 if in_len does not hold a whole frame or the header is
+// impossible (raw_len above COMPRESS_BLOCK_SIZE, or more than the payload can
+// decode to).
+size_t compress_frame_size(const char *in, size_t in_len, size_t *raw_len);
+
+// Decode the frame at in into raw, which must hold the frame's raw_len bytes.
+// Returns the number of raw bytes, or -1 if the frame is corrupt.
+long compress_frame_decode(const char *in, size_t in_len, char *raw,
+                           size_t raw_cap);
+
+// Encode raw_len bytes as consecutive frames into out (which must hold
+// compress_bound(raw_len) bytes), compressing the blocks in parallel on the
+// compressor thread pool. Returns the encoded size.
+size_t compress_encode(const char *raw, size_t raw_len, char *out);
+
+// Stop the compressor threads.
+void compress_pool_destroy();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,21 +11,18 @@
 #else
 
 #include <pthread.h>
-#include <stdio.h>
 
+#include "trace.h"
+
+// DLOG no longer takes this lock (see trace.h); it is still defined for the
+// programs that expect it.
 extern pthread_mutex_t __nfs_debug_lock__;
 
 #define INIT_LOG pthread_mutex_t __nfs_debug_lock__ = PTHREAD_MUTEX_INITIALIZER;
 
-#define DLOG(fmt, ...)                                                         \
-    do {                                                                       \
-        pthread_mutex_lock(&__nfs_debug_lock__);                               \
-        fprintf(stderr, "DEBUG %lu [%s:%d] ", pthread_self(), __FILE__,         \
-                __LINE__);                                                     \
-        fprintf(stderr, fmt, ##__VA_ARGS__);                                   \
-        fprintf(stderr, "\n");                                                 \
-        pthread_mutex_unlock(&__nfs_debug_lock__);                             \
-    } while (0)
+// Printed to stderr, or recorded in a binary trace, depending on
+// WATDFS_TRACE.
+#define DLOG(fmt, ...) TRACE(fmt, ##__VA_ARGS__)
 #endif // NDEBUG
 
 #endif
@@ -0,0 +1,120 @@
+#include "file_clone.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+// The buffer size for the user space copy fallback.
+#define CLONE_COPY_CHUNK (1 << 20)
+
+// Copy through a buffer, for file systems that support neither reflinks nor
+// copy_file_range.
+static int copy_with_buffer(int src_fd, int dst_fd) {
+    char *buf = (char *)malloc(CLONE_COPY_CHUNK);
+    if (buf == nullptr) {
+        return -ENOMEM;
+    }
+    off_t offset = 0;
+    int ret = 0;
+    while (true) {
+        ssize_t nread = pread(src_fd, buf, CLONE_COPY_CHUNK, offset);
+        if (nread < 0) {
+            ret = -errno;
+            break;
+        }
+        if (nread == 0) {
+            break;
+        }
+        ssize_t written = 0;
+        while (written < nread) {
+            ssize_t n = pwrite(dst_fd, buf + written, nread - written,
+                               offset + written);
+            if (n < 0) {
+                ret = -errno;
+                break;
+            }
+            written += n;
+        }
+        if (ret < 0) {
+            break;
+        }
+        offset += nread;
+    }
+    free(buf);
+    return ret;
+}
+
+int file_clone(int src_fd, int dst_fd) {
+    if (ftruncate(dst_fd, 0) < 0) {
+        return -errno;
+    }
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        return 0;
+    }
+    DLOG("FICLONE unsupported (errno %d), copying", errno);
+
+    struct stat statbuf;
+    if (fstat(src_fd, &statbuf) < 0) {
+        return -errno;
+    }
+    loff_t in_off = 0;
+    loff_t out_off = 0;
+    while (in_off < statbuf.st_size) {
+        ssize_t n = copy_file_range(src_fd, &in_off, dst_fd, &out_off,
+                                    statbuf.st_size - in_off, 0);
+        if (n < 0) {
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP) {
+                if (ftruncate(dst_fd, 0) < 0) {
+                    return -errno;
+                }
+                return copy_with_buffer(src_fd, dst_fd);
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            // The source shrank under us.
+            break;
+        }
+    }
+    return 0;
+}
+
+int file_open_snapshot(const char *path) {
+    int src_fd = open(path, O_RDONLY);
+    if (src_fd < 0) {
+        return -errno;
+    }
+
+    std::string dir(path);
+    size_t slash = dir.find_last_of('/');
+    dir = slash == std::string::npos ? std::string(".") : dir.substr(0, slash + 1);
+
+    int snap_fd = open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+    if (snap_fd < 0) {
+        // No O_TMPFILE support, use a named file and unlink it right away.
+        std::string tmp = std::string(path) + ".watdfs-snap-XXXXXX";
+        snap_fd = mkstemp(&tmp[0]);
+        if (snap_fd < 0) {
+            int err = -errno;
+            close(src_fd);
+            return err;
+        }
+        unlink(tmp.c_str());
+    }
+
+    int ret = file_clone(src_fd, snap_fd);
+    close(src_fd);
+    if (ret < 0) {
+        close(snap_fd);
+        return ret;
+    }
+    return snap_fd;
+}
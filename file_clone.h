@@ -0,0 +1,31 @@
+
+
+#ifndef FILE_CLONE_H
+#define FILE_CLONE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// file_clone.h
+// Helpers for the server's copy-on-write file versions. Where the file system
+// supports reflinks (btrfs, XFS, ...) a clone shares the data extents and is
+// O(1); otherwise the data is copied in the kernel with copy_file_range, and
+// as a last resort through a user space buffer.
+
+// FUNCTIONS
+// All functions return 0 (or a file descriptor) on success or -errno.
+
+// Replace the contents of dst_fd with the contents of src_fd.
+int file_clone(int src_fd, int dst_fd);
+
+// Open a private read-only snapshot of path. The snapshot has no name (it is
+// an O_TMPFILE in the same directory where possible), so it disappears when
+// the descriptor is closed.
+int file_open_snapshot(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+
+#include "fsync_batcher.h"
+#include "debug.h"
+#include "io_engine.h"
+#include "work_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+
+// A thread waiting for its file to become durable.
+struct fsync_waiter {
+    int fd_;
+    int datasync_;
+    int result_;
+    int done_;
+};
+
+// To protect the batcher state.
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled when a batch has been flushed.
+static pthread_cond_t batch_cv = PTHREAD_COND_INITIALIZER;
+// Requests that have not been picked up by a leader yet.
+static std::vector<struct fsync_waiter *> pending;
+// Whether some thread is currently leading a batch.
+static int leader_active = 0;
+// The size of the last flushed batch, to decide whether lingering pays off.
+static size_t last_batch_size = 0;
+static long batch_window_us = FSYNC_BATCH_WINDOW_US;
+
+// Flush every file in the batch and fill in each waiter's result.
+static void flush_batch(std::vector<struct fsync_waiter *> &batch) {
+    // Merge the requests per descriptor: one flush covers every waiter on the
+    // same file, and it only needs to be a datasync if all of them asked for
+    // one.
+    std::map<int, int> files;
+    for (struct fsync_waiter *w : batch) {
+        auto it = files.find(w->fd_);
+        if (it == files.end()) {
+            files[w->fd_] = w->datasync_;
+        } else {
+            it->second = it->second && w->datasync_;
+        }
+    }
+
+    // Every file gets its own flush, submitted together so the device sees
+    // them at once. A syncfs would be one journal commit, but it reports
+    // writeback errors of other files on the file system and does not report
+    // one of these that an earlier fsync already consumed.
+    std::vector<int> fds;
+    std::vector<int> datasync;
+    for (auto &f : files) {
+        fds.push_back(f.first);
+        datasync.push_back(f.second);
+    }
+    std::vector<int> rets(fds.size());
+    int ret = io_engine_fsync_batch(fds.data(), datasync.data(), rets.data(), (int)fds.size());
+    std::map<int, int> results;
+    for (size_t i = 0; i < fds.size(); i++) {
+        results[fds[i]] = ret < 0 ? ret : rets[i];
+    }
+
+    for (struct fsync_waiter *w : batch) {
+        w->result_ = results[w->fd_];
+    }
+}
+
+// Called with batch_lock held, returns with it held.
+static void lead_batch() {
+    leader_active = 1;
+    if (batch_window_us > 0 && last_batch_size > 1) {
+        pthread_mutex_unlock(&batch_lock);
+        usleep(batch_window_us);
+        pthread_mutex_lock(&batch_lock);
+    }
+    std::vector<struct fsync_waiter *> batch;
+    batch.swap(pending);
+    pthread_mutex_unlock(&batch_lock);
+
+    flush_batch(batch);
+
+    pthread_mutex_lock(&batch_lock);
+    for (struct fsync_waiter *w : batch) {
+        w->done_ = 1;
+    }
+    last_batch_size = batch.size();
+    leader_active = 0;
+    pthread_cond_broadcast(&batch_cv);
+}
+
+int fsync_batcher_init(long window_us) {
+    pthread_mutex_lock(&batch_lock);
+    batch_window_us = window_us;
+    pthread_mutex_unlock(&batch_lock);
+    return 0;
+}
+
+void fsync_batcher_destroy() {
+    // Wait for an in-progress batch, so no waiter is left behind.
+    pthread_mutex_lock(&batch_lock);
+    while (leader_active || !pending.empty()) {
+        pthread_cond_wait(&batch_cv, &batch_lock);
+    }
+    pthread_mutex_unlock(&batch_lock);
+}
+
+static int sync_now(int fd, int datasync) {
+    struct fsync_waiter w;
+    w.fd_ = fd;
+    w.datasync_ = datasync;
+    w.result_ = 0;
+    w.done_ = 0;
+
+    pthread_mutex_lock(&batch_lock);
+    pending.push_back(&w);
+    while (!w.done_) {
+        if (!leader_active) {
+            // Either nobody is flushing, or the last flush started before we
+            // arrived and has finished without us. Lead the next one.
+            lead_batch();
+        } else {
+            pthread_cond_wait(&batch_cv, &batch_lock);
+        }
+    }
+    pthread_mutex_unlock(&batch_lock);
+    return w.result_;
+}
+
+struct sync_call {
+    int fd_;
+    int datasync_;
+};
+
+static int run_sync(void *arg) {
+    struct sync_call *call = (struct sync_call *)arg;
+    return sync_now(call->fd_, call->datasync_);
+}
+
+// Waiting for a batch blocks, so a worker of the work pool waiting here is
+// stood in for by a spare (see work_pool.h).
+int fsync_batcher_sync(int fd, int datasync) {
+    struct sync_call call = {fd, datasync};
+    return work_pool_block(run_sync, &call);
+}
@@ -0,0 +1,39 @@
+
+
+#ifndef FSYNC_BATCHER_H
+#define FSYNC_BATCHER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// fsync_batcher.h
+// Group commit for the server's fsync skeleton. Concurrent sync requests are
+// collected into a batch; the first waiter becomes the leader, optionally
+// lingers for a short window so more requests can join, then flushes the
+// whole batch, one fsync or fdatasync per file submitted together, and
+// acknowledges every waiter together. A file is only reported durable after
+// a flush of it that started after its request arrived, so the guarantees of
+// a plain fsync are unchanged.
+
+// The default time, in microseconds, a leader waits for more requests to
+// join its batch. Only used when the previous batch had company.
+#define FSYNC_BATCH_WINDOW_US 100
+
+// FUNCTIONS
+// Set up the batcher. window_us is the linger window described above; 0
+// disables lingering, leaving only the natural batching of requests that
+// arrive while a flush is running.
+int fsync_batcher_init(long window_us);
+void fsync_batcher_destroy();
+
+// Block until everything written to fd before this call is durable. If
+// datasync is set, only the data (and the metadata needed to read it back)
+// must be durable. Returns 0 or -errno.
+int fsync_batcher_sync(int fd, int datasync);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,588 @@
+
+#include "io_engine.h"
+#include "debug.h"
+#include "work_pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+// One outstanding operation. It lives on the stack of the RPC thread that
+// issued it; user_data of the sqe points back at it.
+struct io_request {
+    int result_;
+    int done_;
+};
+
+// The state of the shared ring.
+struct io_ring {
+    int ring_fd_;
+    // Signalled by submitters when there are new sqes to hand to the kernel.
+    int wake_fd_;
+    // Registered with the ring, signalled by the kernel on every completion.
+    int cq_event_fd_;
+
+    // Submission ring.
+    void *sq_ptr_;
+    size_t sq_size_;
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned *sq_mask_;
+    unsigned *sq_array_;
+    struct io_uring_sqe *sqes_;
+    size_t sqes_size_;
+    unsigned sq_entries_;
+
+    // Completion ring.
+    void *cq_ptr_;
+    size_t cq_size_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned *cq_mask_;
+    struct io_uring_cqe *cqes_;
+
+    // To protect the fields below and the sq tail.
+    pthread_mutex_t mutex_;
+    // Waited on by submitters, for ring space or for their completion.
+    pthread_cond_t cv_;
+    // The number of sqes written to the ring but not yet io_uring_enter'ed.
+    unsigned unsubmitted_;
+    // The number of operations that have not completed yet.
+    unsigned inflight_;
+    int running_;
+    pthread_t reaper_;
+
+    // The opcodes the kernel supports, from IORING_REGISTER_PROBE. The
+    // others take the synchronous path.
+    bool supported_[IORING_OP_LAST];
+};
+
+// Null when the synchronous fallback is in use.
+static struct io_ring *ring = nullptr;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                        nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void reap_completions(struct io_ring *r);
+
+// Hand every queued sqe to the kernel in a single call. The kernel refuses
+// new sqes with EBUSY while its completion queue is full, and with EAGAIN
+// when it is short of memory for them; either way completions are reaped to
+// make room before trying again.
+static void submit_pending(struct io_ring *r) {
+    pthread_mutex_lock(&r->mutex_);
+    unsigned to_submit = r->unsubmitted_;
+    pthread_mutex_unlock(&r->mutex_);
+
+    while (to_submit > 0) {
+        int ret = sys_io_uring_enter(r->ring_fd_, to_submit, 0, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EBUSY || errno == EAGAIN) {
+                reap_completions(r);
+                sched_yield();
+                continue;
+            }
+            DLOG("io_uring_enter failed with errno %d", errno);
+            return;
+        }
+        pthread_mutex_lock(&r->mutex_);
+        r->unsubmitted_ -= ret;
+        pthread_mutex_unlock(&r->mutex_);
+        to_submit -= ret;
+    }
+}
+
+// Complete every finished request and wake up the waiters once per batch.
+static void reap_completions(struct io_ring *r) {
+    unsigned head = *r->cq_head_;
+    unsigned tail = __atomic_load_n(r->cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+
+    pthread_mutex_lock(&r->mutex_);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &r->cqes_[head & *r->cq_mask_];
+        struct io_request *req = (struct io_request *)(uintptr_t)cqe->user_data;
+        req->result_ = cqe->res;
+        req->done_ = 1;
+        r->inflight_--;
+        head++;
+    }
+    __atomic_store_n(r->cq_head_, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->cv_);
+    pthread_mutex_unlock(&r->mutex_);
+}
+
+static void *reaper_main(void *arg) {
+    struct io_ring *r = (struct io_ring *)arg;
+    struct pollfd fds[2];
+    fds[0].fd = r->wake_fd_;
+    fds[0].events = POLLIN;
+    fds[1].fd = r->cq_event_fd_;
+    fds[1].events = POLLIN;
+
+    while (__atomic_load_n(&r->running_, __ATOMIC_ACQUIRE)) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            DLOG("io engine poll failed with errno %d", errno);
+            break;
+        }
+        uint64_t count;
+        if (fds[0].revents & POLLIN) {
+            (void)read(r->wake_fd_, &count, sizeof(count));
+        }
+        if (fds[1].revents & POLLIN) {
+            (void)read(r->cq_event_fd_, &count, sizeof(count));
+        }
+        submit_pending(r);
+        reap_completions(r);
+    }
+    return nullptr;
+}
+
+// Grab a free sqe, let prep fill it in and queue it. The reaper does not see
+// it until ring_kick is called, so several requests can be queued at once.
+template <typename Prep>
+static void ring_queue(struct io_ring *r, struct io_request *req, Prep prep) {
+    req->result_ = 0;
+    req->done_ = 0;
+
+    pthread_mutex_lock(&r->mutex_);
+    while (r->inflight_ >= r->sq_entries_) {
+        pthread_cond_wait(&r->cv_, &r->mutex_);
+    }
+    unsigned tail = *r->sq_tail_;
+    unsigned index = tail & *r->sq_mask_;
+    struct io_uring_sqe *sqe = &r->sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    prep(sqe);
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    r->sq_array_[index] = index;
+    __atomic_store_n(r->sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    r->unsubmitted_++;
+    r->inflight_++;
+    pthread_mutex_unlock(&r->mutex_);
+}
+
+// Wake the reaper so it submits everything queued so far.
+static void ring_kick(struct io_ring *r) {
+    uint64_t one = 1;
+    (void)write(r->wake_fd_, &one, sizeof(one));
+}
+
+// Block until the kernel completes req. Returns the cqe result.
+static int ring_wait(struct io_ring *r, struct io_request *req) {
+    pthread_mutex_lock(&r->mutex_);
+    while (!req->done_) {
+        pthread_cond_wait(&r->cv_, &r->mutex_);
+    }
+    pthread_mutex_unlock(&r->mutex_);
+    return req->result_;
+}
+
+template <typename Prep> static int ring_execute(struct io_ring *r, Prep prep) {
+    struct io_request req;
+    ring_queue(r, &req, prep);
+    ring_kick(r);
+    return ring_wait(r, &req);
+}
+
+static void ring_unmap(struct io_ring *r) {
+    if (r->sqes_ != nullptr && r->sqes_ != MAP_FAILED) {
+        munmap(r->sqes_, r->sqes_size_);
+    }
+    if (r->cq_ptr_ != nullptr && r->cq_ptr_ != MAP_FAILED &&
+        r->cq_ptr_ != r->sq_ptr_) {
+        munmap(r->cq_ptr_, r->cq_size_);
+    }
+    if (r->sq_ptr_ != nullptr && r->sq_ptr_ != MAP_FAILED) {
+        munmap(r->sq_ptr_, r->sq_size_);
+    }
+}
+
+static void ring_free(struct io_ring *r) {
+    ring_unmap(r);
+    if (r->cq_event_fd_ >= 0) close(r->cq_event_fd_);
+    if (r->wake_fd_ >= 0) close(r->wake_fd_);
+    if (r->ring_fd_ >= 0) close(r->ring_fd_);
+    pthread_mutex_destroy(&r->mutex_);
+    pthread_cond_destroy(&r->cv_);
+    free(r);
+}
+
+// Find out which opcodes the kernel supports. Kernels without the probe
+// (before 5.6) have IORING_OP_FSYNC but none of the other opcodes used here.
+static void probe_opcodes(struct io_ring *r) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    if (probe != nullptr &&
+        sys_io_uring_register(r->ring_fd_, IORING_REGISTER_PROBE, probe,
+                              IORING_OP_LAST) == 0) {
+        for (int op = 0; op < IORING_OP_LAST && op <= probe->last_op; op++) {
+            r->supported_[op] = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    } else {
+        DLOG("io_uring probe failed with errno %d, only fsync goes through the ring",
+             errno);
+        r->supported_[IORING_OP_FSYNC] = true;
+    }
+    free(probe);
+    static const int used[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+                               IORING_OP_FSYNC, IORING_OP_STATX};
+    for (int op : used) {
+        if (!r->supported_[op]) {
+            DLOG("io engine: opcode %d unsupported, using the syscall", op);
+        }
+    }
+}
+
+// Whether operations with opcode go through the ring.
+static bool ring_supports(int opcode) {
+    return ring != nullptr && ring->supported_[opcode];
+}
+
+static struct io_ring *ring_create(unsigned queue_depth) {
+    struct io_ring *r = (struct io_ring *)calloc(1, sizeof(struct io_ring));
+    if (r == nullptr) {
+        return nullptr;
+    }
+    r->wake_fd_ = -1;
+    r->cq_event_fd_ = -1;
+    pthread_mutex_init(&r->mutex_, nullptr);
+    pthread_cond_init(&r->cv_, nullptr);
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    r->ring_fd_ = sys_io_uring_setup(queue_depth, &params);
+    if (r->ring_fd_ < 0) {
+        DLOG("io_uring_setup failed with errno %d", errno);
+        ring_free(r);
+        return nullptr;
+    }
+
+    r->sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size_ > r->sq_size_) r->sq_size_ = r->cq_size_;
+        r->cq_size_ = r->sq_size_;
+    }
+    r->sq_ptr_ = mmap(nullptr, r->sq_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->ring_fd_, IORING_OFF_SQ_RING);
+    if (r->sq_ptr_ == MAP_FAILED) {
+        ring_free(r);
+        return nullptr;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr_ = r->sq_ptr_;
+    } else {
+        r->cq_ptr_ = mmap(nullptr, r->cq_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->ring_fd_,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ptr_ == MAP_FAILED) {
+            ring_free(r);
+            return nullptr;
+        }
+    }
+    r->sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes_ = (struct io_uring_sqe *)mmap(
+        nullptr, r->sqes_size_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->ring_fd_, IORING_OFF_SQES);
+    if (r->sqes_ == MAP_FAILED) {
+        ring_free(r);
+        return nullptr;
+    }
+
+    char *sq = (char *)r->sq_ptr_;
+    r->sq_head_ = (unsigned *)(sq + params.sq_off.head);
+    r->sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_array_ = (unsigned *)(sq + params.sq_off.array);
+    r->sq_entries_ = params.sq_entries;
+    char *cq = (char *)r->cq_ptr_;
+    r->cq_head_ = (unsigned *)(cq + params.cq_off.head);
+    r->cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes_ = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    r->wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    r->cq_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->wake_fd_ < 0 || r->cq_event_fd_ < 0 ||
+        sys_io_uring_register(r->ring_fd_, IORING_REGISTER_EVENTFD,
+                              &r->cq_event_fd_, 1) < 0) {
+        DLOG("io engine eventfd setup failed with errno %d", errno);
+        ring_free(r);
+        return nullptr;
+    }
+
+    probe_opcodes(r);
+
+    r->running_ = 1;
+    if (pthread_create(&r->reaper_, nullptr, reaper_main, r) != 0) {
+        ring_free(r);
+        return nullptr;
+    }
+    return r;
+}
+
+int io_engine_init(unsigned queue_depth) {
+    const char *mode = getenv("WATDFS_IO_ENGINE");
+    if (mode != nullptr && strcmp(mode, "sync") == 0) {
+        DLOG("io engine: synchronous mode requested");
+        return 0;
+    }
+    ring = ring_create(queue_depth);
+    DLOG("io engine: using %s", ring != nullptr ? "io_uring" : "sync");
+    return 0;
+}
+
+void io_engine_destroy() {
+    if (ring == nullptr) {
+        return;
+    }
+    __atomic_store_n(&ring->running_, 0, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    (void)write(ring->wake_fd_, &one, sizeof(one));
+    pthread_join(ring->reaper_, nullptr);
+    ring_free(ring);
+    ring = nullptr;
+}
+
+int io_engine_uses_uring() { return ring != nullptr; }
+
+static int open_now(const char *path, int flags, mode_t mode) {
+    if (!ring_supports(IORING_OP_OPENAT)) {
+        int fd = open(path, flags, mode);
+        return fd < 0 ? -errno : fd;
+    }
+    return ring_execute(ring, [&](struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->len = mode;
+        sqe->open_flags = flags;
+    });
+}
+
+static ssize_t pread_now(int fd, void *buf, size_t size, off_t offset) {
+    if (!ring_supports(IORING_OP_READ)) {
+        ssize_t ret = pread(fd, buf, size, offset);
+        return ret < 0 ? -errno : ret;
+    }
+    return ring_execute(ring, [&](struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = size;
+        sqe->off = offset;
+    });
+}
+
+static ssize_t pwrite_now(int fd, const void *buf, size_t size, off_t offset) {
+    if (!ring_supports(IORING_OP_WRITE)) {
+        ssize_t ret = pwrite(fd, buf, size, offset);
+        return ret < 0 ? -errno : ret;
+    }
+    return ring_execute(ring, [&](struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = size;
+        sqe->off = offset;
+    });
+}
+
+static int fsync_now(int fd, int datasync) {
+    if (!ring_supports(IORING_OP_FSYNC)) {
+        int ret = datasync ? fdatasync(fd) : fsync(fd);
+        return ret < 0 ? -errno : 0;
+    }
+    return ring_execute(ring, [&](struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+    });
+}
+
+static int fsync_batch_now(const int *fds, const int *datasync, int *results,
+                           int count) {
+    if (!ring_supports(IORING_OP_FSYNC)) {
+        for (int i = 0; i < count; i++) {
+            results[i] = fsync_now(fds[i], datasync[i]);
+        }
+        return 0;
+    }
+    struct io_request *reqs =
+        (struct io_request *)malloc(count * sizeof(struct io_request));
+    if (reqs == nullptr) {
+        return -ENOMEM;
+    }
+    // Queue in slices of at most the ring size, or we would wait for space
+    // that only our own unsubmitted requests could free.
+    int queued = 0;
+    while (queued < count) {
+        int slice = count - queued;
+        if ((unsigned)slice > ring->sq_entries_) slice = ring->sq_entries_;
+        for (int i = queued; i < queued + slice; i++) {
+            ring_queue(ring, &reqs[i], [&](struct io_uring_sqe *sqe) {
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fd = fds[i];
+                sqe->fsync_flags = datasync[i] ? IORING_FSYNC_DATASYNC : 0;
+            });
+        }
+        ring_kick(ring);
+        for (int i = queued; i < queued + slice; i++) {
+            results[i] = ring_wait(ring, &reqs[i]);
+        }
+        queued += slice;
+    }
+    free(reqs);
+    return 0;
+}
+
+static int stat_now(const char *path, struct stat *statbuf) {
+    if (!ring_supports(IORING_OP_STATX)) {
+        return stat(path, statbuf) < 0 ? -errno : 0;
+    }
+    struct statx stx;
+    int ret = ring_execute(ring, [&](struct io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)path;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uint64_t)(uintptr_t)&stx;
+        sqe->statx_flags = 0;
+    });
+    if (ret < 0) {
+        return ret;
+    }
+
+    // The clients expect a struct stat, so translate.
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    statbuf->st_ino = stx.stx_ino;
+    statbuf->st_mode = stx.stx_mode;
+    statbuf->st_nlink = stx.stx_nlink;
+    statbuf->st_uid = stx.stx_uid;
+    statbuf->st_gid = stx.stx_gid;
+    statbuf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    statbuf->st_size = stx.stx_size;
+    statbuf->st_blksize = stx.stx_blksize;
+    statbuf->st_blocks = stx.stx_blocks;
+    statbuf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    statbuf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    statbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    statbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    statbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    statbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+    return 0;
+}
+
+static int truncate_now(const char *path, off_t size) {
+    return truncate(path, size) < 0 ? -errno : 0;
+}
+
+static int close_now(int fd) {
+    return close(fd) < 0 ? -errno : 0;
+}
+
+static int rename_now(const char *from, const char *to) {
+    return rename(from, to) < 0 ? -errno : 0;
+}
+
+static int unlink_now(const char *path) {
+    return unlink(path) < 0 ? -errno : 0;
+}
+
+static int futimens_now(int fd, const struct timespec ts[2]) {
+    return futimens(fd, ts) < 0 ? -errno : 0;
+}
+
+// The operations go through work_pool_block, so a worker of the work pool
+// that waits on one is stood in for (see work_pool.h).
+
+template <typename Op> static auto offload(Op op) -> decltype(op()) {
+    struct Call {
+        Op *op_;
+        decltype(op()) ret_;
+    } call = {&op, 0};
+    work_pool_block([](void *arg) {
+        struct Call *c = (struct Call *)arg;
+        c->ret_ = (*c->op_)();
+        return 0;
+    }, &call);
+    return call.ret_;
+}
+
+int io_engine_open(const char *path, int flags, mode_t mode) {
+    return offload([&]() { return open_now(path, flags, mode); });
+}
+
+ssize_t io_engine_pread(int fd, void *buf, size_t size, off_t offset) {
+    return offload([&]() { return pread_now(fd, buf, size, offset); });
+}
+
+ssize_t io_engine_pwrite(int fd, const void *buf, size_t size, off_t offset) {
+    return offload([&]() { return pwrite_now(fd, buf, size, offset); });
+}
+
+int io_engine_fsync(int fd, int datasync) {
+    return offload([&]() { return fsync_now(fd, datasync); });
+}
+
+int io_engine_fsync_batch(const int *fds, const int *datasync, int *results,
+                          int count) {
+    return offload([&]() { return fsync_batch_now(fds, datasync, results, count); });
+}
+
+int io_engine_stat(const char *path, struct stat *statbuf) {
+    return offload([&]() { return stat_now(path, statbuf); });
+}
+
+int io_engine_truncate(const char *path, off_t size) {
+    return offload([&]() { return truncate_now(path, size); });
+}
+
+int io_engine_close(int fd) {
+    return offload([&]() { return close_now(fd); });
+}
+
+int io_engine_rename(const char *from, const char *to) {
+    return offload([&]() { return rename_now(from, to); });
+}
+
+int io_engine_unlink(const char *path) {
+    return offload([&]() { return unlink_now(path); });
+}
+
+int io_engine_futimens(int fd, const struct timespec ts[2]) {
+    return offload([&]() { return futimens_now(fd, ts); });
+}
@@ -0,0 +1,63 @@
+
+
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// io_engine.h
+// The disk I/O engine used by the server skeletons. When the kernel supports
+// io_uring the operations are queued on a single shared ring: a reaper thread
+// submits everything that was queued since its last wake-up in one
+// io_uring_enter call and completes all finished requests in one pass, so a
+// handful of RPC threads can keep many disk operations in flight. When
+// io_uring is unavailable (old kernel, seccomp, WATDFS_IO_ENGINE=sync) every
+// call falls back to the plain blocking syscall, and so does every operation
+// whose opcode the kernel's ring does not support. Called on a worker of the
+// work pool, an operation parks the worker and a spare stands in for it (see
+// work_pool.h).
+
+// The default number of submission queue entries.
+#define IO_ENGINE_QUEUE_DEPTH 256
+
+// FUNCTIONS
+// Unless noted otherwise, all functions return 0 (or a byte count / file
+// descriptor) on success or -errno on failure, like the server skeletons
+// expect.
+
+// Set up the engine with room for queue_depth outstanding operations. This
+// never fails: if the ring cannot be created the synchronous path is used.
+int io_engine_init(unsigned queue_depth);
+// Tear down the engine, waiting for the reaper thread to exit.
+void io_engine_destroy();
+// Returns 1 if operations are going through io_uring, 0 otherwise.
+int io_engine_uses_uring();
+
+int io_engine_open(const char *path, int flags, mode_t mode);
+ssize_t io_engine_pread(int fd, void *buf, size_t size, off_t offset);
+ssize_t io_engine_pwrite(int fd, const void *buf, size_t size, off_t offset);
+int io_engine_fsync(int fd, int datasync);
+// Sync count descriptors at once, all in flight together. results[i] gets the
+// outcome for fds[i]. Returns 0, or -errno if the batch could not be issued.
+int io_engine_fsync_batch(const int *fds, const int *datasync, int *results,
+                          int count);
+int io_engine_stat(const char *path, struct stat *statbuf);
+// There is no ring opcode for truncate in every kernel we support, so this
+// always takes the synchronous path.
+int io_engine_truncate(const char *path, off_t size);
+// These take the synchronous path too.
+int io_engine_close(int fd);
+int io_engine_rename(const char *from, const char *to);
+int io_engine_unlink(const char *path);
+int io_engine_futimens(int fd, const struct timespec ts[2]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+
+#include "rpc_async.h"
+#include "debug.h"
+
+#include <stdlib.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::mutex pool_lock;
+static std::condition_variable pool_cv;
+static std::deque<std::function<void()>> pool_jobs;
+static std::vector<std::thread> pool_threads;
+static bool pool_stopping = false;
+// Set on the worker threads.
+static thread_local bool on_worker = false;
+
+static void pool_worker() {
+    on_worker = true;
+    std::unique_lock<std::mutex> lock(pool_lock);
+    while (true) {
+        pool_cv.wait(lock, [] { return pool_stopping || !pool_jobs.empty(); });
+        if (pool_jobs.empty()) {
+            return;
+        }
+        std::function<void()> job = std::move(pool_jobs.front());
+        pool_jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+// Called with pool_lock held.
+static void pool_start() {
+    int threads = RPC_ASYNC_THREADS;
+    const char *env = getenv("WATDFS_ASYNC_THREADS");
+    if (env != nullptr) {
+        threads = atoi(env);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    DLOG("starting %d async rpc threads", threads);
+    pool_stopping = false;
+    for (int i = 0; i < threads; i++) {
+        pool_threads.emplace_back(pool_worker);
+    }
+}
+
+std::future<int> rpc_async(std::function<int()> call) {
+    // std::function needs a copyable target, so the task is shared.
+    auto task = std::make_shared<std::packaged_task<int()>>(std::move(call));
+    std::future<int> result = task->get_future();
+    if (on_worker) {
+        (*task)();
+        return result;
+    }
+    std::lock_guard<std::mutex> lock(pool_lock);
+    if (pool_threads.empty()) {
+        pool_start();
+    }
+    pool_jobs.push_back([task] { (*task)(); });
+    pool_cv.notify_one();
+    return result;
+}
+
+void rpc_async_destroy() {
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(pool_lock);
+        pool_stopping = true;
+        threads.swap(pool_threads);
+    }
+    pool_cv.notify_all();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,31 @@
+
+
+#ifndef RPC_ASYNC_H
+#define RPC_ASYNC_H
+
+#include <functional>
+#include <future>
+
+// rpc_async.h
+// Asynchronous RPCs for the client. A call is handed to a pool of worker
+// threads and the caller gets a std::future for its return value, so it can
+// issue several RPCs (or an RPC and some local disk work) at once and wait
+// for them together. The blocking rpc_call_* helpers are what the workers
+// run; the client wraps them as rpc_call_*_async.
+//
+// Unlike the other headers this one is C++ only, futures have no C form.
+
+// The default number of worker threads, WATDFS_ASYNC_THREADS.
+#define RPC_ASYNC_THREADS 8
+
+// FUNCTIONS
+
+// Run call on a worker thread. The workers are started on first use. A call
+// made from a worker runs right away on that worker instead, so waiting on it
+// there cannot deadlock the pool.
+std::future<int> rpc_async(std::function<int()> call);
+
+// Stop the worker threads, after running every queued call.
+void rpc_async_destroy();
+
+#endif
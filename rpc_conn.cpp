@@ -0,0 +1,1010 @@
+
+#include "rpc_conn.h"
+#include "debug.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define RPC_CONN_MAGIC 0x57525043u // "WRPC"
+// Calls with more arguments than this are refused.
+#define RPC_CONN_MAX_ARGS 64
+#define RPC_CONN_MAX_NAME 256
+// Local connections: a client on the server's host connects over a Unix
+// socket instead of TCP and hands the server a shared-memory region (a
+// memfd), through which its calls then go. The socket only carries a
+// doorbell per call and the reply status. Calls that do not fit in the
+// region go over the socket as they would over TCP.
+#define RPC_CONN_SHM_MAGIC 0x5753484du // "WSHM"
+#define RPC_CONN_SHM_SIZE (1 << 20)
+// Enough for the header, name and argTypes of any call.
+#define RPC_CONN_SHM_MIN 4096
+
+struct call_header {
+    uint32_t magic_;
+    uint32_t name_len_;
+    uint32_t nargs_;
+    uint32_t pad_;
+    // The caller's request (see trace.h), or 0.
+    uint64_t request_;
+};
+
+struct reply_header {
+    uint32_t magic_;
+    int32_t status_;
+};
+
+// The first message on a local connection, carrying the memfd if size_ > 0.
+struct shm_hello {
+    uint32_t magic_;
+    uint32_t pad_;
+    uint64_t size_;
+};
+
+// The start of the shared-memory region while a call is in it.
+struct shm_header {
+    uint32_t name_len_;
+    uint32_t nargs_;
+    uint64_t request_;
+};
+
+struct rpc_conn {
+    // -1 for a loopback connection.
+    int fd_;
+    // The shared-memory region of a local connection, or nullptr.
+    char *shm_;
+    size_t shm_size_;
+    // Calls on one connection are serialized.
+    pthread_mutex_t lock_;
+};
+
+// The size in bytes of an argument of type arg_type.
+static size_t arg_size(int arg_type) {
+    size_t elem = 0;
+    switch ((arg_type >> 16) & 0xff) {
+    case ARG_CHAR:
+        elem = 1;
+        break;
+    case ARG_SHORT:
+        elem = 2;
+        break;
+    case ARG_INT:
+    case ARG_FLOAT:
+        elem = 4;
+        break;
+    case ARG_LONG:
+    case ARG_DOUBLE:
+        elem = 8;
+        break;
+    }
+    if (arg_type & (1u << ARG_ARRAY)) {
+        return elem * (arg_type & 0xffff);
+    }
+    return elem;
+}
+
+static bool is_input(int arg_type) {
+    return arg_type & (1u << ARG_INPUT);
+}
+
+static bool is_output(int arg_type) {
+    return arg_type & (1u << ARG_OUTPUT);
+}
+
+// Send or receive exactly len bytes. Returns 0 or -1.
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send a list of buffers with as few syscalls as possible.
+static int send_iov(int fd, std::vector<struct iovec> &iov) {
+    size_t first = 0;
+    while (first < iov.size()) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = std::min(iov.size() - first, (size_t)IOV_MAX);
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        // Skip what was sent, possibly ending inside a buffer.
+        while (first < iov.size() && (size_t)n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (n > 0) {
+            iov[first].iov_base = (char *)iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void set_nodelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// The abstract Unix socket on which the server listening on port accepts
+// local connections.
+static socklen_t local_address(int port, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "watdfs-rpc-%d", port);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+// A call in the shared-memory region is a shm_header, the name, the argTypes,
+// then a slot for every argument, each 8-byte aligned. The outputs are left
+// in their slots.
+static size_t shm_types_offset(uint32_t name_len) {
+    return align8(sizeof(struct shm_header) + name_len);
+}
+
+// Fill in where the argument slots are. Returns the bytes the call needs.
+static size_t shm_layout(uint32_t name_len, uint32_t nargs, const int *arg_types,
+                         size_t *offsets) {
+    size_t at = shm_types_offset(name_len) + align8(nargs * sizeof(int));
+    for (uint32_t i = 0; i < nargs; i++) {
+        offsets[i] = at;
+        at += align8(std::max(arg_size(arg_types[i]), (size_t)1));
+    }
+    return at;
+}
+
+// Send or receive msg along with the descriptor fd_to_send (if not -1), or
+// into *received (-1 if none came). Return 0 or -1.
+static int send_with_fd(int fd, const void *msg, size_t len, int fd_to_send) {
+    struct iovec iov = {(void *)msg, len};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (fd_to_send >= 0) {
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd_to_send, sizeof(int));
+    }
+    return sendmsg(fd, &hdr, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+static int recv_with_fd(int fd, void *msg, size_t len, int *received) {
+    struct iovec iov = {msg, len};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    *received = -1;
+    ssize_t n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&hdr) : nullptr;
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(received, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+// SERVER
+
+struct registration {
+    std::vector<int> arg_types_;
+    skeleton f_;
+};
+
+static int listen_fd = -1;
+// The Unix socket for local connections, or -1.
+static int local_fd = -1;
+static std::multimap<std::string, struct registration> registry;
+static std::thread acceptor;
+static std::thread local_acceptor;
+static volatile bool stopping = false;
+
+// Like librpc, a call matches a registration when the types and directions
+// agree; array lengths may differ.
+static bool types_match(const std::vector<int> &registered, const int *arg_types,
+                        uint32_t nargs) {
+    if (registered.size() != nargs) {
+        return false;
+    }
+    for (uint32_t i = 0; i < nargs; i++) {
+        if ((registered[i] & ~0xffff) != (arg_types[i] & ~0xffff)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static skeleton find_skeleton(const std::string &name, const int *arg_types,
+                              uint32_t nargs) {
+    auto range = registry.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (types_match(it->second.arg_types_, arg_types, nargs)) {
+            return it->second.f_;
+        }
+    }
+    return nullptr;
+}
+
+// Serve the call the client left in the shared-memory region shm. The client
+// can still write to the region, so the skeleton runs on copies of the
+// arguments, made as serve_call makes them from the socket, and only the
+// outputs are copied back. Returns -1 when the connection is done.
+static int serve_shm_call(int fd, char *shm, size_t shm_size) {
+    struct shm_header header;
+    memcpy(&header, shm, sizeof(header));
+    if (header.name_len_ > RPC_CONN_MAX_NAME || header.nargs_ > RPC_CONN_MAX_ARGS) {
+        return -1;
+    }
+    int arg_types[RPC_CONN_MAX_ARGS + 1];
+    size_t offsets[RPC_CONN_MAX_ARGS];
+    memcpy(arg_types, shm + shm_types_offset(header.name_len_),
+           header.nargs_ * sizeof(int));
+    arg_types[header.nargs_] = 0;
+    if (shm_layout(header.name_len_, header.nargs_, arg_types, offsets) > shm_size) {
+        return -1;
+    }
+    std::string name(shm + sizeof(header), header.name_len_);
+    std::vector<std::vector<char>> bufs(header.nargs_);
+    void *args[RPC_CONN_MAX_ARGS];
+    for (uint32_t i = 0; i < header.nargs_; i++) {
+        // Outputs start out zeroed, as on the other transports.
+        bufs[i].assign(std::max(arg_size(arg_types[i]), (size_t)1), 0);
+        args[i] = bufs[i].data();
+        if (is_input(arg_types[i]) && arg_size(arg_types[i]) > 0) {
+            memcpy(args[i], shm + offsets[i], arg_size(arg_types[i]));
+        }
+    }
+
+    struct reply_header reply;
+    reply.magic_ = RPC_CONN_SHM_MAGIC;
+    reply.status_ = OK;
+    skeleton f = find_skeleton(name, arg_types, header.nargs_);
+    if (f == nullptr) {
+        DLOG("rpc_conn: no function %s", name.c_str());
+        reply.status_ = FUNCTION_NOT_FOUND;
+    } else {
+        trace_set_request(header.request_);
+        if (f(arg_types, args) < 0) {
+            reply.status_ = FUNCTION_FAILURE;
+        }
+        trace_set_request(0);
+    }
+    if (reply.status_ == OK) {
+        for (uint32_t i = 0; i < header.nargs_; i++) {
+            if (is_output(arg_types[i]) && arg_size(arg_types[i]) > 0) {
+                memcpy(shm + offsets[i], args[i], arg_size(arg_types[i]));
+            }
+        }
+    }
+    return send_all(fd, &reply, sizeof(reply));
+}
+
+// Serve one call, from the socket or, on a local connection with a region,
+// from shm. Returns -1 when the connection is done.
+static int serve_call(int fd, char *shm, size_t shm_size) {
+    struct call_header header;
+    if (recv_all(fd, &header.magic_, sizeof(header.magic_)) < 0) {
+        return -1;
+    }
+    if (header.magic_ == RPC_CONN_SHM_MAGIC && shm != nullptr) {
+        return serve_shm_call(fd, shm, shm_size);
+    }
+    if (header.magic_ != RPC_CONN_MAGIC ||
+        recv_all(fd, &header.name_len_, sizeof(header) - sizeof(header.magic_)) < 0 ||
+        header.name_len_ > RPC_CONN_MAX_NAME || header.nargs_ > RPC_CONN_MAX_ARGS) {
+        return -1;
+    }
+    std::string name(header.name_len_, '\0');
+    int arg_types[RPC_CONN_MAX_ARGS + 1];
+    if (recv_all(fd, &name[0], header.name_len_) < 0 ||
+        recv_all(fd, arg_types, header.nargs_ * sizeof(int)) < 0) {
+        return -1;
+    }
+    arg_types[header.nargs_] = 0;
+
+    std::vector<std::vector<char>> bufs(header.nargs_);
+    void *args[RPC_CONN_MAX_ARGS];
+    for (uint32_t i = 0; i < header.nargs_; i++) {
+        bufs[i].assign(std::max(arg_size(arg_types[i]), (size_t)1), 0);
+        args[i] = bufs[i].data();
+        if (is_input(arg_types[i]) &&
+            recv_all(fd, args[i], arg_size(arg_types[i])) < 0) {
+            return -1;
+        }
+    }
+
+    struct reply_header reply;
+    reply.magic_ = RPC_CONN_MAGIC;
+    reply.status_ = OK;
+    skeleton f = find_skeleton(name, arg_types, header.nargs_);
+    if (f == nullptr) {
+        DLOG("rpc_conn: no function %s", name.c_str());
+        reply.status_ = FUNCTION_NOT_FOUND;
+    } else {
+        trace_set_request(header.request_);
+        if (f(arg_types, args) < 0) {
+            reply.status_ = FUNCTION_FAILURE;
+        }
+        trace_set_request(0);
+    }
+
+    std::vector<struct iovec> iov;
+    iov.push_back({&reply, sizeof(reply)});
+    if (reply.status_ == OK) {
+        for (uint32_t i = 0; i < header.nargs_; i++) {
+            if (is_output(arg_types[i]) && arg_size(arg_types[i]) > 0) {
+                iov.push_back({args[i], arg_size(arg_types[i])});
+            }
+        }
+    }
+    return send_iov(fd, iov);
+}
+
+// The client of the connection this thread serves; see rpc_conn_peer.
+static thread_local const char *peer = nullptr;
+
+const char *rpc_conn_peer() {
+    return peer;
+}
+
+// Serve a call made in this process, as serve_call serves one from a socket.
+static int serve_loopback(const char *name, int *argTypes, void **args,
+                          uint32_t nargs) {
+    int arg_types[RPC_CONN_MAX_ARGS + 1];
+    memcpy(arg_types, argTypes, (nargs + 1) * sizeof(int));
+    skeleton f = find_skeleton(name, arg_types, nargs);
+    if (f == nullptr) {
+        DLOG("rpc_conn: no function %s", name);
+        return FUNCTION_NOT_FOUND;
+    }
+    std::vector<std::vector<char>> bufs(nargs);
+    void *callee_args[RPC_CONN_MAX_ARGS];
+    for (uint32_t i = 0; i < nargs; i++) {
+        bufs[i].assign(std::max(arg_size(arg_types[i]), (size_t)1), 0);
+        callee_args[i] = bufs[i].data();
+        if (is_input(arg_types[i]) && arg_size(arg_types[i]) > 0) {
+            memcpy(callee_args[i], args[i], arg_size(arg_types[i]));
+        }
+    }
+    const char *saved = peer;
+    peer = "loopback";
+    int ret = f(arg_types, callee_args);
+    peer = saved;
+    if (ret < 0) {
+        return FUNCTION_FAILURE;
+    }
+    for (uint32_t i = 0; i < nargs; i++) {
+        if (is_output(arg_types[i]) && arg_size(arg_types[i]) > 0) {
+            memcpy(args[i], callee_args[i], arg_size(arg_types[i]));
+        }
+    }
+    return OK;
+}
+
+static void serve_connection(int fd) {
+    set_nodelay(fd);
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    char host[NI_MAXHOST] = "";
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0 ||
+        getnameinfo((struct sockaddr *)&addr, len, host, sizeof(host), nullptr, 0,
+                    NI_NUMERICHOST) != 0) {
+        strcpy(host, "unknown");
+    }
+    // IPv4 clients of the dual-stack socket by their IPv4 address.
+    peer = strncmp(host, "::ffff:", 7) == 0 && strchr(host, '.') != nullptr ? host + 7 : host;
+    while (!stopping && serve_call(fd, nullptr, 0) == 0) {
+    }
+    close(fd);
+}
+
+// Map the region a local client sent, if it is sealed against shrinking, so
+// the client cannot pull it from under the server. Returns nullptr if not.
+static char *map_region(int memfd, uint64_t size) {
+    struct stat st;
+    if (memfd < 0 || size < RPC_CONN_SHM_MIN || size > RPC_CONN_SHM_SIZE ||
+        fstat(memfd, &st) < 0 || (uint64_t)st.st_size < size ||
+        !(fcntl(memfd, F_GET_SEALS) & F_SEAL_SHRINK)) {
+        return nullptr;
+    }
+    void *shm = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    return shm == MAP_FAILED ? nullptr : (char *)shm;
+}
+
+// A local connection starts with a shm_hello, acknowledged with OK if its
+// region is mapped, and then carries calls like any other.
+static void serve_local_connection(int fd) {
+    struct shm_hello hello;
+    int memfd;
+    if (recv_with_fd(fd, &hello, sizeof(hello), &memfd) < 0 ||
+        hello.magic_ != RPC_CONN_SHM_MAGIC) {
+        if (memfd >= 0) close(memfd);
+        close(fd);
+        return;
+    }
+    char *shm = map_region(memfd, hello.size_);
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    std::string name = "local";
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+        name += "#" + std::to_string(cred.pid);
+    }
+    peer = name.c_str();
+    struct reply_header ack;
+    ack.magic_ = RPC_CONN_SHM_MAGIC;
+    ack.status_ = shm != nullptr ? OK : FUNCTION_FAILURE;
+    if (send_all(fd, &ack, sizeof(ack)) == 0) {
+        while (!stopping && serve_call(fd, shm, hello.size_) == 0) {
+        }
+    }
+    if (shm != nullptr) {
+        munmap(shm, hello.size_);
+    }
+    close(fd);
+}
+
+static void accept_loop(int fd_to_accept, void (*serve)(int)) {
+    while (!stopping) {
+        int fd = accept(fd_to_accept, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        std::thread(serve, fd).detach();
+    }
+}
+
+// Listen for local connections next to the TCP port. The server does fine
+// without them.
+static void listen_local(int port) {
+    local_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    socklen_t len = local_address(port, &addr);
+    if (local_fd >= 0 && (bind(local_fd, (struct sockaddr *)&addr, len) < 0 ||
+                          listen(local_fd, SOMAXCONN) < 0)) {
+        DLOG("rpc_conn: no local connections: %s", strerror(errno));
+        close(local_fd);
+        local_fd = -1;
+    }
+}
+
+int rpc_conn_server_init(int port) {
+    listen_fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -errno;
+    }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Accept IPv4 as well, whatever the system default.
+    int zero = 0;
+    setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    struct sockaddr_in6 addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    socklen_t len = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) < 0) {
+        int err = -errno;
+        close(listen_fd);
+        listen_fd = -1;
+        return err;
+    }
+    listen_local(ntohs(addr.sin6_port));
+    return ntohs(addr.sin6_port);
+}
+
+int rpc_conn_register(const char *name, int *argTypes, skeleton f) {
+    struct registration r;
+    for (int i = 0; argTypes[i] != 0; i++) {
+        r.arg_types_.push_back(argTypes[i]);
+    }
+    r.f_ = f;
+    registry.insert({std::string(name), r});
+    return OK;
+}
+
+int rpc_conn_server_start() {
+    if (listen_fd < 0) {
+        return NOT_INIT;
+    }
+    acceptor = std::thread(accept_loop, listen_fd, serve_connection);
+    if (local_fd >= 0) {
+        local_acceptor = std::thread(accept_loop, local_fd, serve_local_connection);
+    }
+    return OK;
+}
+
+void rpc_conn_server_stop() {
+    stopping = true;
+    if (listen_fd >= 0) {
+        // Wakes the acceptor up.
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+    if (local_fd >= 0) {
+        shutdown(local_fd, SHUT_RDWR);
+    }
+    if (acceptor.joinable()) {
+        acceptor.join();
+    }
+    if (local_acceptor.joinable()) {
+        local_acceptor.join();
+    }
+    if (local_fd >= 0) {
+        close(local_fd);
+        local_fd = -1;
+    }
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+// CLIENT
+
+static struct rpc_conn *new_conn(int fd, char *shm, size_t shm_size) {
+    struct rpc_conn *conn = new struct rpc_conn;
+    conn->fd_ = fd;
+    conn->shm_ = shm;
+    conn->shm_size_ = shm_size;
+    pthread_mutex_init(&conn->lock_, nullptr);
+    return conn;
+}
+
+// Whether addr is on this host: a loopback address or one of its interfaces.
+static bool is_local(const struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET) {
+        const struct in_addr *a = &((const struct sockaddr_in *)addr)->sin_addr;
+        if ((ntohl(a->s_addr) >> 24) == 127) return true;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127)) {
+            return true;
+        }
+    } else {
+        return false;
+    }
+    struct ifaddrs *ifs;
+    if (getifaddrs(&ifs) < 0) {
+        return false;
+    }
+    bool local = false;
+    for (struct ifaddrs *i = ifs; i != nullptr && !local; i = i->ifa_next) {
+        if (i->ifa_addr == nullptr || i->ifa_addr->sa_family != addr->sa_family) continue;
+        if (addr->sa_family == AF_INET) {
+            local = ((const struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr ==
+                    ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+        } else {
+            local = memcmp(&((const struct sockaddr_in6 *)i->ifa_addr)->sin6_addr,
+                           &((const struct sockaddr_in6 *)addr)->sin6_addr,
+                           sizeof(struct in6_addr)) == 0;
+        }
+    }
+    freeifaddrs(ifs);
+    return local;
+}
+
+// Connect to the local socket of the server on port and hand it a sealed
+// shared-memory region. Returns nullptr if there is no such server; without
+// the region the connection still works, over the socket alone.
+static struct rpc_conn *open_local(int port) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr;
+    socklen_t len = local_address(port, &addr);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, len) < 0) {
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+    size_t size = RPC_CONN_SHM_SIZE;
+    char *shm = nullptr;
+    int memfd = memfd_create("watdfs-rpc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd >= 0 && ftruncate(memfd, size) == 0 &&
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        shm = p == MAP_FAILED ? nullptr : (char *)p;
+    }
+    struct shm_hello hello;
+    hello.magic_ = RPC_CONN_SHM_MAGIC;
+    hello.pad_ = 0;
+    hello.size_ = shm != nullptr ? size : 0;
+    struct reply_header ack;
+    int ret = send_with_fd(fd, &hello, sizeof(hello), shm != nullptr ? memfd : -1);
+    if (ret == 0) {
+        ret = recv_all(fd, &ack, sizeof(ack));
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    if (ret < 0 || ack.magic_ != RPC_CONN_SHM_MAGIC) {
+        if (shm != nullptr) munmap(shm, size);
+        close(fd);
+        return nullptr;
+    }
+    if (ack.status_ != OK && shm != nullptr) {
+        munmap(shm, size);
+        shm = nullptr;
+    }
+    DLOG("rpc_conn: local connection to port %d, %s shared memory", port,
+         shm != nullptr ? "with" : "without");
+    return new_conn(fd, shm, shm != nullptr ? size : 0);
+}
+
+struct rpc_conn *rpc_conn_open(const char *address, int port) {
+    if (strcmp(address, RPC_CONN_LOOPBACK) == 0) {
+        return new_conn(-1, nullptr, 0);
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = nullptr;
+    std::string service = std::to_string(port);
+    if (getaddrinfo(address, service.c_str(), &hints, &res) != 0) {
+        return nullptr;
+    }
+    // A server on this host is reached through its local socket, unless
+    // WATDFS_SHM=0.
+    const char *shm_env = getenv("WATDFS_SHM");
+    if ((shm_env == nullptr || strcmp(shm_env, "0") != 0) && res != nullptr &&
+        is_local(res->ai_addr)) {
+        struct rpc_conn *conn = open_local(port);
+        if (conn != nullptr) {
+            freeaddrinfo(res);
+            return conn;
+        }
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        DLOG("rpc_conn: cannot connect to %s:%d", address, port);
+        return nullptr;
+    }
+    set_nodelay(fd);
+    return new_conn(fd, nullptr, 0);
+}
+
+// Make a call through the region of a local connection; see serve_shm_call.
+static int call_shm(struct rpc_conn *conn, const char *name, int *argTypes,
+                    void **args, const struct shm_header &header,
+                    const size_t *offsets) {
+    char *shm = conn->shm_;
+    memcpy(shm, &header, sizeof(header));
+    memcpy(shm + sizeof(header), name, header.name_len_);
+    memcpy(shm + shm_types_offset(header.name_len_), argTypes,
+           header.nargs_ * sizeof(int));
+    for (uint32_t i = 0; i < header.nargs_; i++) {
+        if (is_input(argTypes[i]) && arg_size(argTypes[i]) > 0) {
+            memcpy(shm + offsets[i], args[i], arg_size(argTypes[i]));
+        }
+    }
+    uint32_t doorbell = RPC_CONN_SHM_MAGIC;
+    struct reply_header reply;
+    if (send_all(conn->fd_, &doorbell, sizeof(doorbell)) < 0) {
+        return FAILED_TO_SEND;
+    }
+    if (recv_all(conn->fd_, &reply, sizeof(reply)) < 0 ||
+        reply.magic_ != RPC_CONN_SHM_MAGIC) {
+        return TERMINATED;
+    }
+    if (reply.status_ != OK) {
+        return reply.status_;
+    }
+    for (uint32_t i = 0; i < header.nargs_; i++) {
+        if (is_output(argTypes[i]) && arg_size(argTypes[i]) > 0) {
+            memcpy(args[i], shm + offsets[i], arg_size(argTypes[i]));
+        }
+    }
+    return OK;
+}
+
+int rpc_conn_call(struct rpc_conn *conn, const char *name, int *argTypes,
+                  void **args) {
+    if (conn == nullptr) {
+        return NOT_INIT;
+    }
+    struct call_header header;
+    header.magic_ = RPC_CONN_MAGIC;
+    header.name_len_ = strlen(name);
+    header.nargs_ = 0;
+    header.pad_ = 0;
+    header.request_ = trace_request();
+    while (argTypes[header.nargs_] != 0) {
+        header.nargs_++;
+    }
+    if (header.nargs_ > RPC_CONN_MAX_ARGS || header.name_len_ > RPC_CONN_MAX_NAME) {
+        return BAD_TYPES;
+    }
+    if (conn->fd_ < 0) {
+        return serve_loopback(name, argTypes, args, header.nargs_);
+    }
+    if (conn->shm_ != nullptr) {
+        struct shm_header shm_header;
+        shm_header.name_len_ = header.name_len_;
+        shm_header.nargs_ = header.nargs_;
+        shm_header.request_ = header.request_;
+        size_t offsets[RPC_CONN_MAX_ARGS];
+        if (shm_layout(header.name_len_, header.nargs_, argTypes, offsets) <=
+            conn->shm_size_) {
+            pthread_mutex_lock(&conn->lock_);
+            int ret = call_shm(conn, name, argTypes, args, shm_header, offsets);
+            pthread_mutex_unlock(&conn->lock_);
+            return ret;
+        }
+    }
+
+    std::vector<struct iovec> iov;
+    iov.push_back({&header, sizeof(header)});
+    iov.push_back({(void *)name, header.name_len_});
+    iov.push_back({argTypes, header.nargs_ * sizeof(int)});
+    for (uint32_t i = 0; i < header.nargs_; i++) {
+        if (is_input(argTypes[i]) && arg_size(argTypes[i]) > 0) {
+            iov.push_back({args[i], arg_size(argTypes[i])});
+        }
+    }
+
+    int ret = OK;
+    struct reply_header reply;
+    pthread_mutex_lock(&conn->lock_);
+    if (send_iov(conn->fd_, iov) < 0) {
+        ret = FAILED_TO_SEND;
+    } else if (recv_all(conn->fd_, &reply, sizeof(reply)) < 0 ||
+               reply.magic_ != RPC_CONN_MAGIC) {
+        ret = TERMINATED;
+    } else if (reply.status_ != OK) {
+        ret = reply.status_;
+    } else {
+        for (uint32_t i = 0; i < header.nargs_; i++) {
+            if (is_output(argTypes[i]) && arg_size(argTypes[i]) > 0 &&
+                recv_all(conn->fd_, args[i], arg_size(argTypes[i])) < 0) {
+                ret = TERMINATED;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&conn->lock_);
+    return ret;
+}
+
+void rpc_conn_close(struct rpc_conn *conn) {
+    if (conn == nullptr) {
+        return;
+    }
+    if (conn->fd_ >= 0) {
+        close(conn->fd_);
+    }
+    if (conn->shm_ != nullptr) {
+        munmap(conn->shm_, conn->shm_size_);
+    }
+    pthread_mutex_destroy(&conn->lock_);
+    delete conn;
+}
+
+// CONNECTION POOL
+
+struct rpc_conn_pool {
+    std::string address_;
+    int port_;
+    int max_conns_;
+    pthread_mutex_t lock_;
+    // Signalled when a connection becomes idle or is dropped. Runs on
+    // CLOCK_MONOTONIC, like retry_at_ns_.
+    pthread_cond_t idle_cv_;
+    // The connection rpc_conn_pool_first returns. It stays allocated until
+    // the pool is destroyed, even after it broke and left all_.
+    struct rpc_conn *first_;
+    std::vector<struct rpc_conn *> all_;
+    std::vector<struct rpc_conn *> idle_;
+    // Connections being opened, counted against max_conns_.
+    int opening_;
+    // After an open failed, no other is tried before retry_at_ns_; the wait
+    // doubles with every failure in a row.
+    long retry_at_ns_;
+    long backoff_ms_;
+};
+
+static long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+struct rpc_conn_pool *rpc_conn_pool_create(const char *address, int port,
+                                           int max_conns) {
+    struct rpc_conn *first = rpc_conn_open(address, port);
+    if (first == nullptr) {
+        return nullptr;
+    }
+    struct rpc_conn_pool *pool = new struct rpc_conn_pool;
+    pool->address_ = address;
+    pool->port_ = port;
+    pool->max_conns_ = std::max(1, max_conns);
+    pthread_mutex_init(&pool->lock_, nullptr);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->idle_cv_, &attr);
+    pthread_condattr_destroy(&attr);
+    pool->first_ = first;
+    pool->all_.push_back(first);
+    pool->idle_.push_back(first);
+    pool->opening_ = 0;
+    pool->retry_at_ns_ = 0;
+    pool->backoff_ms_ = 0;
+    return pool;
+}
+
+struct rpc_conn *rpc_conn_pool_first(struct rpc_conn_pool *pool) {
+    return pool == nullptr ? nullptr : pool->first_;
+}
+
+// Take an idle connection, or open a new one if the pool may grow. While
+// opening fails, wait for one of the open ones, trying again once the
+// backoff passed. Returns nullptr when no connection is open and none can be
+// opened now.
+static struct rpc_conn *pool_acquire(struct rpc_conn_pool *pool) {
+    pthread_mutex_lock(&pool->lock_);
+    for (;;) {
+        if (!pool->idle_.empty()) {
+            struct rpc_conn *conn = pool->idle_.back();
+            pool->idle_.pop_back();
+            pthread_mutex_unlock(&pool->lock_);
+            return conn;
+        }
+        bool may_grow = (int)pool->all_.size() + pool->opening_ < pool->max_conns_;
+        if (may_grow && monotonic_ns() >= pool->retry_at_ns_) {
+            pool->opening_++;
+            pthread_mutex_unlock(&pool->lock_);
+            struct rpc_conn *conn = rpc_conn_open(pool->address_.c_str(), pool->port_);
+            pthread_mutex_lock(&pool->lock_);
+            pool->opening_--;
+            if (conn != nullptr) {
+                pool->all_.push_back(conn);
+                pool->backoff_ms_ = 0;
+                pthread_mutex_unlock(&pool->lock_);
+                return conn;
+            }
+            pool->backoff_ms_ = std::min(std::max(pool->backoff_ms_ * 2,
+                                                  (long)RPC_CONN_POOL_RETRY_MS),
+                                         (long)RPC_CONN_POOL_MAX_RETRY_MS);
+            pool->retry_at_ns_ = monotonic_ns() + pool->backoff_ms_ * 1000000;
+            DLOG("rpc_conn pool: cannot open a connection to %s:%d, retrying in %ld ms",
+                 pool->address_.c_str(), pool->port_, pool->backoff_ms_);
+            continue;
+        }
+        if (may_grow) {
+            // Backing off. With nothing open there is nothing to wait for.
+            if (pool->all_.empty() && pool->opening_ == 0) {
+                pthread_mutex_unlock(&pool->lock_);
+                return nullptr;
+            }
+            struct timespec ts = {pool->retry_at_ns_ / 1000000000,
+                                  pool->retry_at_ns_ % 1000000000};
+            pthread_cond_timedwait(&pool->idle_cv_, &pool->lock_, &ts);
+            continue;
+        }
+        pthread_cond_wait(&pool->idle_cv_, &pool->lock_);
+    }
+}
+
+int rpc_conn_pool_call(struct rpc_conn_pool *pool, const char *name,
+                       int *argTypes, void **args) {
+    if (pool == nullptr) {
+        return NOT_INIT;
+    }
+    struct rpc_conn *conn = pool_acquire(pool);
+    if (conn == nullptr) {
+        return FAILED_TO_SEND;
+    }
+    int ret = rpc_conn_call(conn, name, argTypes, args);
+    // A connection the call broke on is out of step with the server, or
+    // gone. It is dropped, and so are the idle ones, which most likely went
+    // with the same server process; the next calls open new ones.
+    std::vector<struct rpc_conn *> dropped;
+    pthread_mutex_lock(&pool->lock_);
+    if (ret == TERMINATED || ret == FAILED_TO_SEND) {
+        dropped.swap(pool->idle_);
+        dropped.push_back(conn);
+        for (struct rpc_conn *gone : dropped) {
+            pool->all_.erase(std::find(pool->all_.begin(), pool->all_.end(), gone));
+        }
+        pthread_cond_broadcast(&pool->idle_cv_);
+    } else {
+        pool->idle_.push_back(conn);
+        pthread_cond_signal(&pool->idle_cv_);
+    }
+    pthread_mutex_unlock(&pool->lock_);
+    if (!dropped.empty()) {
+        DLOG("rpc_conn pool: call to %s:%d failed with %d, dropping %zu connections",
+             pool->address_.c_str(), pool->port_, ret, dropped.size());
+    }
+    for (struct rpc_conn *gone : dropped) {
+        if (gone != pool->first_) {
+            rpc_conn_close(gone);
+        }
+    }
+    return ret;
+}
+
+void rpc_conn_pool_destroy(struct rpc_conn_pool *pool) {
+    if (pool == nullptr) {
+        return;
+    }
+    for (struct rpc_conn *conn : pool->all_) {
+        if (conn != pool->first_) {
+            rpc_conn_close(conn);
+        }
+    }
+    rpc_conn_close(pool->first_);
+    pthread_mutex_destroy(&pool->lock_);
+    pthread_cond_destroy(&pool->idle_cv_);
+    delete pool;
+}
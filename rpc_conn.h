@@ -0,0 +1,112 @@
+
+
+#ifndef RPC_CONN_H
+#define RPC_CONN_H
+
+#include "rpc.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// rpc_conn.h
+// A second RPC transport next to librpc, for when one connection is not
+// enough: librpc gives a client exactly one connection, to the server named
+// by SERVER_ADDRESS/SERVER_PORT. Here the client opens as many connections
+// as it likes, each one explicitly. Calls use the same conventions as rpc.h
+// (argTypes/args, the same error codes), and the server dispatches them to
+// the same skeletons it registers with librpc, so every RPC works over both.
+//
+// On the wire a call is a header (magic, name length, argument count, the
+// caller's request id from trace.h), the name, the argTypes, and the bytes of
+// every input argument; the reply is a header (magic, status) and the bytes
+// of every output argument. The server sets the request id on the thread
+// serving the call, and a loopback call runs on the caller's thread, which
+// has it already.
+//
+// A client on the server's own host connects over the server's abstract Unix
+// socket instead, and shares a memfd region with it: a call is then written
+// to the region, a doorbell goes over the socket, and the server runs the
+// skeleton on a copy of the call, writes the outputs back to the region and
+// answers with the status. WATDFS_SHM=0 turns this off on the client.
+
+// SERVER FUNCTIONS
+
+// Listen on port, or on any free port if port is 0. Returns the port or a
+// negative error code.
+int rpc_conn_server_init(int port);
+
+// Register a skeleton, as with rpcRegister.
+int rpc_conn_register(const char *name, int *argTypes, skeleton f);
+
+// Start accepting connections on a background thread. Every connection gets
+// a thread of its own that serves its calls in order.
+int rpc_conn_server_start();
+
+// Stop accepting connections.
+void rpc_conn_server_stop();
+
+// The client whose call this thread is serving, for skeletons to tell
+// clients apart: the peer's IP address for TCP, "local#<pid>" for a local
+// connection, "loopback" for a loopback call. nullptr when the call did not
+// come through rpc_conn.
+const char *rpc_conn_peer();
+
+// CLIENT FUNCTIONS
+
+struct rpc_conn;
+
+// The address of the skeletons registered in this very process, e.g. by
+// watdfs_server_setup (see watdfs_server.h); the port is ignored. A call on a
+// loopback connection runs the skeleton on the calling thread. Its inputs are
+// copied into buffers of the callee's own and its outputs copied back, as over
+// a socket, but neither the kernel nor the network is involved. Calls on one
+// loopback connection are not serialized.
+#define RPC_CONN_LOOPBACK "@loopback"
+
+// Connect to the transport of the server at address (host name or IP) and
+// port. Returns nullptr on failure.
+struct rpc_conn *rpc_conn_open(const char *address, int port);
+
+// Call the RPC name, as with rpcCall. Calls on one connection are
+// serialized; use several connections for parallel calls.
+int rpc_conn_call(struct rpc_conn *conn, const char *name, int *argTypes,
+                  void **args);
+
+void rpc_conn_close(struct rpc_conn *conn);
+
+// A pool of connections to one server, for callers on many threads. Every
+// call takes an idle connection, opening another one while there are fewer
+// than max_conns, and otherwise waits for one to come back, so up to
+// max_conns calls are in flight at once. When a call fails with TERMINATED
+// or FAILED_TO_SEND, its connection is dropped along with the idle ones. A
+// connection that cannot be opened is tried again after
+// RPC_CONN_POOL_RETRY_MS, doubling up to RPC_CONN_POOL_MAX_RETRY_MS while it
+// keeps failing. Meanwhile calls wait for
+// the connections still open, or fail with FAILED_TO_SEND if there are none.
+struct rpc_conn_pool;
+
+#define RPC_CONN_POOL_RETRY_MS 10
+#define RPC_CONN_POOL_MAX_RETRY_MS 1000
+
+// Returns nullptr if the first connection cannot be opened.
+struct rpc_conn_pool *rpc_conn_pool_create(const char *address, int port,
+                                           int max_conns);
+
+// The connection opened by rpc_conn_pool_create, which stays allocated as
+// long as the pool, though calls stop using it once it broke. It names the
+// server, e.g. to compare against.
+struct rpc_conn *rpc_conn_pool_first(struct rpc_conn_pool *pool);
+
+// Call the RPC name over an idle connection of the pool, as with rpcCall.
+int rpc_conn_pool_call(struct rpc_conn_pool *pool, const char *name,
+                       int *argTypes, void **args);
+
+// Close every connection. No call may be in flight.
+void rpc_conn_pool_destroy(struct rpc_conn_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
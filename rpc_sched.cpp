@@ -0,0 +1,189 @@
+
+#include "rpc_sched.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+
+// A call waiting for its turn.
+struct sched_waiter {
+    long cost_;
+    int admitted_;
+    pthread_cond_t cv_;
+};
+
+// The queue of one client and class.
+struct sched_flow {
+    std::string client_;
+    int cls_;
+    long quantum_;
+    long deficit_;
+    // Whether the flow got its quantum for the turn it is on.
+    int on_turn_;
+    std::deque<struct sched_waiter *> waiters_;
+};
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+// 0 when the scheduler is off.
+static int slots = 0;
+static int bulk_slots = 0;
+static int metadata_weight = SCHED_METADATA_WEIGHT;
+static int running = 0;
+static int bulk_running = 0;
+// The flows with waiters, by client and class, and in the order of their
+// turns.
+static std::map<std::pair<std::string, int>, struct sched_flow *> flows;
+static std::list<struct sched_flow *> turns;
+static std::map<std::string, int> weights;
+// How long calls waited for their turn, per class.
+static int wait_histograms[2] = {-1, -1};
+
+int sched_init(int num_slots, int weight) {
+    pthread_mutex_lock(&sched_lock);
+    slots = std::max(num_slots, 0);
+    bulk_slots = slots > 1 ? slots - 1 : slots;
+    metadata_weight = std::max(weight, 1);
+    pthread_mutex_unlock(&sched_lock);
+    wait_histograms[SCHED_METADATA] = stats_histogram("server.sched_wait.metadata");
+    wait_histograms[SCHED_BULK] = stats_histogram("server.sched_wait.bulk");
+    DLOG("sched: %d slots, metadata weight %d", slots, metadata_weight);
+    return 0;
+}
+
+void sched_destroy() {
+    pthread_mutex_lock(&sched_lock);
+    slots = 0;
+    // Nobody would dispatch the calls still queued: they all start now, and
+    // their sched_exit finds them counted as running.
+    for (struct sched_flow *flow : turns) {
+        for (struct sched_waiter *waiter : flow->waiters_) {
+            running++;
+            if (flow->cls_ == SCHED_BULK) {
+                bulk_running++;
+            }
+            waiter->admitted_ = 1;
+            pthread_cond_broadcast(&waiter->cv_);
+        }
+        delete flow;
+    }
+    turns.clear();
+    flows.clear();
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void sched_set_weight(const char *client, int weight) {
+    pthread_mutex_lock(&sched_lock);
+    weights[client] = std::max(weight, 1);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+// Called with sched_lock held.
+static int weight_of(const std::string &client) {
+    auto it = weights.find(client);
+    if (it == weights.end()) {
+        it = weights.find(client.substr(0, client.find('#')));
+    }
+    return it == weights.end() ? 1 : it->second;
+}
+
+// Start waiting calls while there are slots for them, the flows taking
+// turns. Called with sched_lock held.
+static void dispatch() {
+    while (running < slots && !turns.empty()) {
+        auto it = turns.begin();
+        if (bulk_running >= bulk_slots) {
+            it = std::find_if(turns.begin(), turns.end(), [](struct sched_flow *flow) {
+                return flow->cls_ == SCHED_METADATA;
+            });
+            if (it == turns.end()) {
+                return;
+            }
+        }
+        struct sched_flow *flow = *it;
+        if (!flow->on_turn_) {
+            flow->deficit_ += flow->quantum_;
+            flow->on_turn_ = 1;
+        }
+        struct sched_waiter *waiter = flow->waiters_.front();
+        if (waiter->cost_ > flow->deficit_) {
+            // Its turn is over; the deficit carries over to the next.
+            flow->on_turn_ = 0;
+            turns.splice(turns.end(), turns, it);
+            continue;
+        }
+        flow->deficit_ -= waiter->cost_;
+        flow->waiters_.pop_front();
+        running++;
+        if (flow->cls_ == SCHED_BULK) {
+            bulk_running++;
+        }
+        waiter->admitted_ = 1;
+        pthread_cond_signal(&waiter->cv_);
+        if (flow->waiters_.empty()) {
+            turns.erase(it);
+            flows.erase({flow->client_, flow->cls_});
+            delete flow;
+        }
+    }
+}
+
+int sched_enter(const char *client, int cls, long cost) {
+    long start = stats_now_ns();
+    pthread_mutex_lock(&sched_lock);
+    if (slots == 0) {
+        pthread_mutex_unlock(&sched_lock);
+        return 0;
+    }
+    if (turns.empty() && running < slots &&
+        (cls == SCHED_METADATA || bulk_running < bulk_slots)) {
+        running++;
+        if (cls == SCHED_BULK) {
+            bulk_running++;
+        }
+        pthread_mutex_unlock(&sched_lock);
+        stats_record(wait_histograms[cls], stats_now_ns() - start);
+        return 0;
+    }
+
+    struct sched_flow *&flow = flows[{client, cls}];
+    if (flow == nullptr) {
+        flow = new struct sched_flow;
+        flow->client_ = client;
+        flow->cls_ = cls;
+        flow->quantum_ = (long)SCHED_QUANTUM * weight_of(client) *
+                         (cls == SCHED_METADATA ? metadata_weight : 1);
+        flow->deficit_ = 0;
+        flow->on_turn_ = 0;
+        turns.push_back(flow);
+    }
+    struct sched_waiter waiter;
+    waiter.cost_ = std::max(cost, (long)SCHED_MIN_COST);
+    waiter.admitted_ = 0;
+    pthread_cond_init(&waiter.cv_, nullptr);
+    flow->waiters_.push_back(&waiter);
+    dispatch();
+    while (!waiter.admitted_) {
+        pthread_cond_wait(&waiter.cv_, &sched_lock);
+    }
+    pthread_mutex_unlock(&sched_lock);
+    pthread_cond_destroy(&waiter.cv_);
+    stats_record(wait_histograms[cls], stats_now_ns() - start);
+    return 1;
+}
+
+void sched_exit(int cls) {
+    pthread_mutex_lock(&sched_lock);
+    if (running > 0) {
+        running--;
+        if (cls == SCHED_BULK) {
+            bulk_running--;
+        }
+        dispatch();
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
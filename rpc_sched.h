@@ -0,0 +1,61 @@
+
+
+#ifndef RPC_SCHED_H
+#define RPC_SCHED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// rpc_sched.h
+// Fair scheduling of the server's RPCs across clients. Every connection has
+// a thread of its own, so without it a client streaming large writes over
+// several connections keeps the disk and CPUs to itself, and another
+// client's getattr waits behind them. Here at most `slots` calls run at
+// once; the others wait in a queue per client and class, and the queues take
+// turns by deficit round robin: on its turn a queue may start calls worth
+// its quantum of bytes, and what it did not use is carried over.
+//
+// Calls are metadata (small, latency bound) or bulk (reads and writes of
+// file data). Metadata queues get metadata_weight times the quantum of bulk
+// ones, and bulk calls may only take slots - 1 of the slots, so metadata
+// never waits for a slot behind them. A client can be given a weight, which
+// multiplies the quantum of both its queues.
+//
+// Calls are only queued when all slots are taken or others are waiting; an
+// idle server starts every call right away.
+
+#define SCHED_METADATA 0
+#define SCHED_BULK 1
+
+// The default number of calls running at once, WATDFS_SCHED_SLOTS.
+#define SCHED_SLOTS 8
+// The default weight of metadata over bulk, WATDFS_SCHED_METADATA_WEIGHT.
+#define SCHED_METADATA_WEIGHT 8
+// The bytes a bulk queue of weight 1 may start per turn.
+#define SCHED_QUANTUM 65536
+// What a call costs at least, in bytes, however little data it moves.
+#define SCHED_MIN_COST 4096
+
+// FUNCTIONS
+// Start scheduling. slots of 0 turns the scheduler off, leaving
+// sched_enter and sched_exit with nothing to do.
+int sched_init(int slots, int metadata_weight);
+// Turn the scheduler off. The calls still queued start right away.
+void sched_destroy();
+
+// Give client (as named by sched_enter) a weight other than 1. A name
+// without "#" also covers the clients named name#anything.
+void sched_set_weight(const char *client, int weight);
+
+// Wait for the turn of a call of class cls moving cost bytes for client.
+// Every sched_enter must be followed by a sched_exit once the call is done.
+// Returns 1 if the call was queued, 0 if it started right away.
+int sched_enter(const char *client, int cls, long cost);
+void sched_exit(int cls);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,24 @@
+
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// sha256.h
+// A small self-contained SHA-256 (FIPS 180-4), used to name deduplicated
+// chunks. It keeps the client library free of a crypto dependency.
+
+#define SHA256_DIGEST_LEN 32
+
+void sha256(const void *data, size_t len, unsigned char digest[SHA256_DIGEST_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,46 @@
+
+#include "shard_ring.h"
+#include "checksum.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct shard_ring {
+    // (point, server index), sorted by point.
+    std::vector<std::pair<uint64_t, int>> points_;
+};
+
+struct shard_ring *shard_ring_create(const char *const *names, int count) {
+    if (count < 1) {
+        return nullptr;
+    }
+    struct shard_ring *ring = new struct shard_ring;
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < SHARD_RING_VNODES; v++) {
+            std::string point = std::string(names[i]) + "#" + std::to_string(v);
+            ring->points_.push_back({checksum_xxh3(point.data(), point.size()), i});
+        }
+    }
+    std::sort(ring->points_.begin(), ring->points_.end());
+    return ring;
+}
+
+void shard_ring_destroy(struct shard_ring *ring) {
+    delete ring;
+}
+
+int shard_ring_lookup(const struct shard_ring *ring, const char *path) {
+    uint64_t hash = checksum_xxh3(path, strlen(path));
+    auto it = std::lower_bound(ring->points_.begin(), ring->points_.end(),
+                               std::make_pair(hash, 0));
+    if (it == ring->points_.end()) {
+        // Wrap around.
+        it = ring->points_.begin();
+    }
+    return it->second;
+}
@@ -0,0 +1,38 @@
+
+
+#ifndef SHARD_RING_H
+#define SHARD_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// shard_ring.h
+// Placement of files on several servers by consistent hashing of their
+// paths. Every server owns SHARD_RING_VNODES points on a 64-bit hash ring,
+// and a path belongs to the server owning the first point at or after the
+// hash of the path. Adding or removing a server only moves the paths next to
+// its own points, about 1/N of them, and the many points per server keep the
+// shares even.
+
+// The points on the ring per server.
+#define SHARD_RING_VNODES 128
+
+struct shard_ring;
+
+// FUNCTIONS
+
+// Build a ring of count servers. Each server is named by a string that
+// identifies it across clients and restarts (such as "host:port"), so that
+// every client computes the same placement. Returns nullptr if count < 1.
+struct shard_ring *shard_ring_create(const char *const *names, int count);
+void shard_ring_destroy(struct shard_ring *ring);
+
+// The index, in names, of the server that holds path.
+int shard_ring_lookup(const struct shard_ring *ring, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
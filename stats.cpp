@@ -0,0 +1,275 @@
+
+#include "stats.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Buckets below STATS_SUB_BUCKETS hold one nanosecond value each; above,
+// every power of two up to 2^35 ns has STATS_SUB_BUCKETS of them. Longer
+// latencies go in the last bucket.
+#define STATS_SUB_BITS 3
+#define STATS_MAX_EXPONENT 35
+#define STATS_BUCKETS ((STATS_MAX_EXPONENT - STATS_SUB_BITS + 2) * STATS_SUB_BUCKETS)
+
+struct histogram_shard {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+// The samples of one thread. Only that thread writes to it.
+struct stats_shard {
+    struct histogram_shard histograms[STATS_MAX_HISTOGRAMS];
+    uint64_t counters[STATS_MAX_COUNTERS];
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::string> histogram_names;
+static std::vector<std::string> counter_names;
+// Every shard ever made, and those whose threads have exited.
+static std::vector<struct stats_shard *> all_shards;
+static std::vector<struct stats_shard *> free_shards;
+
+// Hands the shard of an exiting thread on to the next new one.
+struct Shard_owner {
+    struct stats_shard *shard = nullptr;
+    ~Shard_owner() {
+        if (shard != nullptr) {
+            pthread_mutex_lock(&stats_lock);
+            free_shards.push_back(shard);
+            pthread_mutex_unlock(&stats_lock);
+        }
+    }
+};
+static thread_local struct Shard_owner owner;
+
+static struct stats_shard *my_shard() {
+    if (owner.shard == nullptr) {
+        pthread_mutex_lock(&stats_lock);
+        if (!free_shards.empty()) {
+            owner.shard = free_shards.back();
+            free_shards.pop_back();
+        } else {
+            owner.shard = (struct stats_shard *)calloc(1, sizeof(struct stats_shard));
+            all_shards.push_back(owner.shard);
+        }
+        pthread_mutex_unlock(&stats_lock);
+    }
+    return owner.shard;
+}
+
+// Add to a value only this thread writes, which reports read concurrently.
+static void bump(uint64_t *value, uint64_t n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int bucket_of(uint64_t ns) {
+    if (ns < STATS_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    if (e > STATS_MAX_EXPONENT) {
+        return STATS_BUCKETS - 1;
+    }
+    return (e - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS +
+           (int)((ns >> (e - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+// The smallest latency in bucket b.
+static uint64_t bucket_floor(int b) {
+    if (b < STATS_SUB_BUCKETS) {
+        return b;
+    }
+    int e = b / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    return (uint64_t)(STATS_SUB_BUCKETS + b % STATS_SUB_BUCKETS) << (e - STATS_SUB_BITS);
+}
+
+static int register_name(std::vector<std::string> &names, const char *name, int max) {
+    pthread_mutex_lock(&stats_lock);
+    auto it = std::find(names.begin(), names.end(), name);
+    int id = (int)(it - names.begin());
+    if (it == names.end()) {
+        if ((int)names.size() < max) {
+            names.push_back(name);
+        } else {
+            DLOG("stats: no room for %s", name);
+            id = -1;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return id;
+}
+
+int stats_histogram(const char *name) {
+    return register_name(histogram_names, name, STATS_MAX_HISTOGRAMS);
+}
+
+int stats_counter(const char *name) {
+    return register_name(counter_names, name, STATS_MAX_COUNTERS);
+}
+
+long stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void stats_record(int histogram, long ns) {
+    if (histogram < 0) {
+        return;
+    }
+    struct histogram_shard *h = &my_shard()->histograms[histogram];
+    uint64_t value = ns > 0 ? (uint64_t)ns : 0;
+    bump(&h->count, 1);
+    bump(&h->sum_ns, value);
+    bump(&h->buckets[bucket_of(value)], 1);
+    if (value > __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max_ns, value, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_add(int counter, long n) {
+    if (counter >= 0) {
+        bump(&my_shard()->counters[counter], (uint64_t)n);
+    }
+}
+
+// The latency at quantile q of the summed buckets, in microseconds: the
+// middle of the bucket it falls in, but no more than the largest sample.
+static double quantile_us(const std::vector<uint64_t> &buckets, uint64_t count,
+                          uint64_t max, double q) {
+    uint64_t rank = std::min(count - 1, (uint64_t)(q * count));
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen > rank) {
+            uint64_t low = bucket_floor(b);
+            uint64_t high = b + 1 < STATS_BUCKETS ? bucket_floor(b + 1) : low;
+            return std::min((low + high) / 2, max) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+std::string stats_report() {
+    pthread_mutex_lock(&stats_lock);
+    std::vector<struct stats_shard *> shards = all_shards;
+    std::vector<std::string> histograms = histogram_names;
+    std::vector<std::string> counters = counter_names;
+    pthread_mutex_unlock(&stats_lock);
+
+    std::string out = "# name count mean_us p50_us p90_us p99_us p999_us max_us\n";
+    char line[512];
+    for (size_t i = 0; i < histograms.size(); i++) {
+        std::vector<uint64_t> buckets(STATS_BUCKETS, 0);
+        uint64_t count = 0, sum = 0, max = 0;
+        for (struct stats_shard *shard : shards) {
+            struct histogram_shard *h = &shard->histograms[i];
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+            }
+            sum += __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+            max = std::max(max, (uint64_t)__atomic_load_n(&h->max_ns, __ATOMIC_RELAXED));
+        }
+        // The count the buckets add up to, which may be a little ahead of
+        // the sums while threads are recording.
+        for (uint64_t n : buckets) {
+            count += n;
+        }
+        if (count == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s %lu %.1f %.1f %.1f %.1f %.1f %.1f\n",
+                 histograms[i].c_str(), (unsigned long)count, sum / 1000.0 / count,
+                 quantile_us(buckets, count, max, 0.50), quantile_us(buckets, count, max, 0.90),
+                 quantile_us(buckets, count, max, 0.99), quantile_us(buckets, count, max, 0.999),
+                 max / 1000.0);
+        out += line;
+    }
+    for (size_t i = 0; i < counters.size(); i++) {
+        uint64_t value = 0;
+        for (struct stats_shard *shard : shards) {
+            value += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        snprintf(line, sizeof(line), "counter %s %lu\n", counters[i].c_str(),
+                 (unsigned long)value);
+        out += line;
+    }
+    return out;
+}
+
+// STATS SOCKET
+
+static int socket_fd = -1;
+static std::string socket_path;
+static std::thread socket_thread;
+
+static void serve_socket(std::function<std::string()> report) {
+    while (true) {
+        int fd = accept(socket_fd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+        std::string text = report();
+        const char *p = text.data();
+        size_t left = text.size();
+        while (left > 0) {
+            ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+            if (n <= 0) break;
+            p += n;
+            left -= n;
+        }
+        close(fd);
+    }
+}
+
+int stats_socket_start(const char *path, std::function<std::string()> report) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+    socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        return -errno;
+    }
+    unlink(path);
+    if (bind(socket_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(socket_fd, 16) < 0) {
+        int err = -errno;
+        close(socket_fd);
+        socket_fd = -1;
+        return err;
+    }
+    socket_path = path;
+    socket_thread = std::thread(serve_socket, report);
+    return 0;
+}
+
+void stats_socket_stop() {
+    if (socket_fd < 0) {
+        return;
+    }
+    // Wakes the thread up.
+    shutdown(socket_fd, SHUT_RDWR);
+    socket_thread.join();
+    close(socket_fd);
+    socket_fd = -1;
+    unlink(socket_path.c_str());
+}
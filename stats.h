@@ -0,0 +1,54 @@
+
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <functional>
+#include <string>
+
+// stats.h
+// Latency histograms and counters, cheap enough to always be on. Every
+// thread records into a shard of its own with plain relaxed stores, so
+// recording takes no lock and no locked instruction; a report sums the
+// shards. Shards outlive their threads and are reused by new ones.
+//
+// Histograms are log-linear, HDR style: every power of two of nanoseconds is
+// split into STATS_SUB_BUCKETS buckets, so a percentile is within 1/8 of the
+// true value, up to about 68 s. The client records every watdfs_cli_* op
+// ("op.*") and RPC round trip ("rpc.*"), the server every RPC it serves
+// ("server.*").
+//
+// Like rpc_async.h this header is C++ only.
+
+#define STATS_MAX_HISTOGRAMS 64
+#define STATS_MAX_COUNTERS 16
+#define STATS_SUB_BUCKETS 8
+
+// FUNCTIONS
+
+// The id of the histogram or counter called name, registered on first use.
+// Register everything up front, before recording starts. Returns -1 when
+// there are too many.
+int stats_histogram(const char *name);
+int stats_counter(const char *name);
+
+// The time to measure latencies with, in nanoseconds.
+long stats_now_ns();
+
+// Record a latency in histogram, or add to counter. An id of -1 is ignored.
+void stats_record(int histogram, long ns);
+void stats_add(int counter, long n);
+
+// A text report of every histogram that has samples, one per line: name,
+// count, then the mean, p50, p90, p99, p99.9 and max in microseconds. Then
+// every counter, as "counter name value".
+std::string stats_report();
+
+// Serve report() to every client connecting to the Unix socket at path,
+// e.g. with `socat - UNIX-CONNECT:path`. Returns 0 or -errno.
+int stats_socket_start(const char *path, std::function<std::string()> report);
+
+// Stop serving, and remove the socket.
+void stats_socket_stop();
+
+#endif
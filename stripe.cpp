@@ -0,0 +1,33 @@
+
+#include "stripe.h"
+#include "checksum.h"
+
+#include <string.h>
+#include <algorithm>
+
+int stripe_is_striped(const struct stripe_layout *layout) {
+    return layout->magic == STRIPE_LAYOUT_MAGIC && layout->width >= 2 &&
+           layout->width <= STRIPE_MAX_WIDTH && layout->block_size > 0;
+}
+
+uint64_t stripe_server_id(const char *name) {
+    return checksum_xxh3(name, strlen(name));
+}
+
+size_t stripe_split(const struct stripe_layout *layout, uint64_t offset,
+                    uint64_t len, struct stripe_extent *extents,
+                    size_t max_extents) {
+    size_t count = 0;
+    while (len > 0 && count < max_extents) {
+        uint64_t block = offset / layout->block_size;
+        uint64_t block_end = (block + 1) * layout->block_size;
+        uint64_t n = std::min(len, block_end - offset);
+        extents[count].offset = offset;
+        extents[count].len = n;
+        extents[count].stripe = (uint32_t)(block % layout->width);
+        count++;
+        offset += n;
+        len -= n;
+    }
+    return count;
+}
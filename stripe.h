@@ -0,0 +1,72 @@
+
+
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// stripe.h
+// RAID-0 striping of one file over several servers. A striped file is cut
+// into blocks of block_size bytes, and block b lives on stripe b % width.
+// Stripe 0 is the server the file is placed on (see shard_ring.h), stripe k
+// the k-th server after it at the time the file is created. Every stripe
+// server keeps a file of the same name holding its own blocks at their
+// offsets in the file, with holes in between, so the file size is the
+// largest of the stripe files' sizes.
+//
+// The layout is fixed when the file is created and stored on stripe 0 next to
+// the file, where clients fetch it before using the file. It names the
+// stripe servers by id, so a client whose server list differs in order or
+// members, or that was given more servers since, still finds every stripe.
+
+#define STRIPE_LAYOUT_MAGIC 0x57535450u // "WSTP"
+// The default block size, WATDFS_STRIPE_BLOCK.
+#define STRIPE_BLOCK_SIZE (1 << 20)
+// The most servers a file is striped over.
+#define STRIPE_MAX_WIDTH 16
+
+// The layout record, as carried by the layout RPCs. A file without one, or
+// with a width below 2, is not striped.
+struct stripe_layout {
+    uint32_t magic;
+    uint32_t width;
+    uint64_t block_size;
+    // The stripe_server_id of the server of every stripe, in stripe order.
+    uint64_t servers[STRIPE_MAX_WIDTH];
+} __attribute__((packed));
+
+#define STRIPE_LAYOUT_LEN sizeof(struct stripe_layout)
+
+// A run of bytes that lives on one stripe.
+struct stripe_extent {
+    uint64_t offset;
+    uint64_t len;
+    uint32_t stripe;
+};
+
+// FUNCTIONS
+
+// Whether layout describes a striped file.
+int stripe_is_striped(const struct stripe_layout *layout);
+
+// The id a layout names a server by, from the name it has on the ring
+// ("host:port"), so every client computes the same one.
+uint64_t stripe_server_id(const char *name);
+
+// Cut the len bytes at offset into extents, one per block touched, in file
+// order. Returns the number of extents, at most max_extents; the extents
+// then cover only a prefix of the range.
+size_t stripe_split(const struct stripe_layout *layout, uint64_t offset,
+                    uint64_t len, struct stripe_extent *extents,
+                    size_t max_extents);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+int trace_mode = TRACE_TEXT;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *trace_file = nullptr;
+// Rings no thread holds.
+static std::vector<int> free_rings;
+
+static struct trace_file_header *header() {
+    return (struct trace_file_header *)trace_file;
+}
+
+static struct trace_ring *ring_at(int i) {
+    return (struct trace_ring *)(trace_file + TRACE_RINGS_OFFSET) + i;
+}
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int trace_open(const char *path) {
+    std::string name = path;
+    size_t pid = name.find("%p");
+    if (pid != std::string::npos) {
+        name.replace(pid, 2, std::to_string(getpid()));
+    }
+    int fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (ftruncate(fd, TRACE_FILE_SIZE) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    void *file = mmap(nullptr, TRACE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return -errno;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    trace_file = (char *)file;
+    struct trace_file_header *h = header();
+    h->version = TRACE_VERSION;
+    h->max_sites = TRACE_MAX_SITES;
+    h->rings = TRACE_MAX_RINGS;
+    h->ring_records = TRACE_RING_RECORDS;
+    h->record_size = TRACE_RECORD_SIZE;
+    h->realtime_offset_ns = (int64_t)(now_ns(CLOCK_REALTIME) - now_ns(CLOCK_MONOTONIC));
+    h->pid = getpid();
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    for (int i = TRACE_MAX_RINGS - 1; i >= 0; i--) {
+        free_rings.push_back(i);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    __atomic_store_n(&trace_mode, TRACE_BINARY, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Reads WATDFS_TRACE before main, so messages from the start are recorded.
+static struct Trace_setup {
+    Trace_setup() {
+        const char *setting = getenv("WATDFS_TRACE");
+        if (setting == nullptr || strcmp(setting, "stderr") == 0) {
+            return;
+        }
+        if (strcmp(setting, "off") == 0) {
+            trace_mode = TRACE_OFF;
+            return;
+        }
+        int ret = trace_open(setting);
+        if (ret < 0) {
+            fprintf(stderr, "cannot trace to %s: %s\n", setting, strerror(-ret));
+        }
+    }
+} trace_setup;
+
+int trace_site(const char *fmt, const char *file, int line) {
+    pthread_mutex_lock(&trace_lock);
+    struct trace_file_header *h = header();
+    int id = (int)h->sites;
+    if (id < TRACE_MAX_SITES) {
+        struct trace_site_entry *site =
+            (struct trace_site_entry *)(trace_file + TRACE_SITES_OFFSET) + id;
+        const char *base = strrchr(file, '/');
+        site->line = line;
+        snprintf(site->file, sizeof(site->file), "%s", base != nullptr ? base + 1 : file);
+        snprintf(site->fmt, sizeof(site->fmt), "%s", fmt);
+        __atomic_store_n(&h->sites, id + 1, __ATOMIC_RELEASE);
+    } else {
+        id = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return id;
+}
+
+// The ring of this thread, handed back when it exits.
+struct Ring_owner {
+    int ring = -1;
+    bool tried = false;
+    uint32_t tid = 0;
+    ~Ring_owner() {
+        if (ring >= 0) {
+            pthread_mutex_lock(&trace_lock);
+            free_rings.push_back(ring);
+            pthread_mutex_unlock(&trace_lock);
+        }
+    }
+};
+static thread_local struct Ring_owner owner;
+
+// This thread's ring, or nullptr if it has none.
+static struct trace_ring *my_ring() {
+    if (!owner.tried) {
+        owner.tried = true;
+        owner.tid = (uint32_t)syscall(SYS_gettid);
+        pthread_mutex_lock(&trace_lock);
+        if (!free_rings.empty()) {
+            owner.ring = free_rings.back();
+            free_rings.pop_back();
+        }
+        pthread_mutex_unlock(&trace_lock);
+    }
+    return owner.ring >= 0 ? ring_at(owner.ring) : nullptr;
+}
+
+// Append values and strings to a payload, as far as they fit.
+struct Payload_writer {
+    uint8_t *p;
+    uint8_t *end;
+    void put_value(uint64_t value) {
+        if (end - p < 8) {
+            p = end;
+            return;
+        }
+        memcpy(p, &value, 8);
+        p += 8;
+    }
+    void put_string(const char *s) {
+        if (p == end) return;
+        size_t len = strnlen(s, std::min<size_t>(end - p - 1, 255));
+        *p++ = (uint8_t)len;
+        memcpy(p, s, len);
+        p += len;
+    }
+};
+
+// Only this thread appends to the ring; the head is published last, so a
+// reader of the live file sees whole records below it.
+static void publish(struct trace_ring *ring, struct trace_record *r, const Payload_writer &out) {
+    r->len = (uint16_t)(out.p - r->payload);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static struct trace_record *next_record(struct trace_ring *ring, int site, uint64_t ts_ns) {
+    struct trace_record *r = &ring->records[ring->head % TRACE_RING_RECORDS];
+    r->ts_ns = ts_ns;
+    r->site = (uint16_t)site;
+    r->tid = owner.tid;
+    return r;
+}
+
+void trace_write(int site, const struct trace_arg *args, int n) {
+    struct trace_ring *ring = site >= 0 ? my_ring() : nullptr;
+    if (ring == nullptr) {
+        return;
+    }
+    struct trace_record *r = next_record(ring, site, now_ns(CLOCK_MONOTONIC));
+    Payload_writer out = {r->payload, r->payload + TRACE_PAYLOAD};
+    for (int i = 0; i < n && out.p != out.end; i++) {
+        if (args[i].string != nullptr) {
+            out.put_string(args[i].string);
+        } else {
+            out.put_value(args[i].value);
+        }
+    }
+    publish(ring, r, out);
+}
+
+// REQUESTS AND SPANS
+
+static thread_local uint64_t current_request = 0;
+static uint64_t request_base = 0;
+static uint64_t request_count = 0;
+
+uint64_t trace_request() {
+    return current_request;
+}
+
+void trace_set_request(uint64_t request) {
+    current_request = request;
+}
+
+uint64_t trace_new_request() {
+    // The high half tells processes apart: the pid and the time it started.
+    if (__atomic_load_n(&request_base, __ATOMIC_RELAXED) == 0) {
+        uint64_t base = ((uint64_t)getpid() * 0x9e3779b1u ^ now_ns(CLOCK_REALTIME)) << 32;
+        uint64_t expected = 0;
+        __atomic_compare_exchange_n(&request_base, &expected, base | (1ull << 63), false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&request_base, __ATOMIC_RELAXED) |
+           (__atomic_add_fetch(&request_count, 1, __ATOMIC_RELAXED) & 0xffffffffu);
+}
+
+void trace_span(const char *category, const char *name, uint64_t start_ns, uint64_t end_ns) {
+    struct trace_ring *ring = trace_mode == TRACE_BINARY ? my_ring() : nullptr;
+    if (ring == nullptr) {
+        return;
+    }
+    struct trace_record *r = next_record(ring, TRACE_SPAN_SITE, start_ns);
+    Payload_writer out = {r->payload, r->payload + TRACE_PAYLOAD};
+    out.put_value(end_ns);
+    out.put_value(current_request);
+    out.put_string(category);
+    out.put_string(name);
+    publish(ring, r, out);
+}
+
+void trace_text(const char *file, int line, const char *fmt, ...) {
+    char buf[4096];
+    int n = snprintf(buf, sizeof(buf), "DEBUG %lu [%s:%d] ", pthread_self(), file, line);
+    va_list ap;
+    va_start(ap, fmt);
+    int m = vsnprintf(buf + n, sizeof(buf) - n - 1, fmt, ap);
+    va_end(ap);
+    n = std::min<int>(n + std::max(m, 0), sizeof(buf) - 2);
+    buf[n++] = '\n';
+    // One write, so that concurrent messages do not interleave.
+    ssize_t ret = write(2, buf, n);
+    (void)ret;
+}
@@ -0,0 +1,182 @@
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <type_traits>
+
+// trace.h
+// The log behind DLOG. By default (WATDFS_TRACE unset or "stderr") every
+// message is formatted and written to stderr with a single write, as one
+// line. With WATDFS_TRACE=path, messages are recorded in binary instead:
+// each thread appends fixed-size records, a timestamp, the call site and the
+// raw arguments, to a ring of its own, with no lock and no formatting. The
+// format strings are only stored once per call site, and checked by the
+// compiler like printf's. trace_decode formats the records offline.
+//
+// The rings live in a file mapped into memory, so the trace survives the
+// process being killed and needs no flushing; it holds the last
+// TRACE_RING_RECORDS messages of each thread. A "%p" in the path is replaced
+// by the pid, so a client and a server can share the setting.
+// WATDFS_TRACE=off drops every message.
+//
+// Strings are copied, but only as much of them as fits in the record, so a
+// record never costs more than TRACE_RECORD_SIZE bytes.
+//
+// The binary trace also holds spans: every client op ("op"), every RPC the
+// client makes ("rpc") and every RPC a server serves ("server"), with its
+// start, end and request. A request is one op together with the RPCs it
+// makes and their work on the servers: the client gives every op a request
+// id, and rpc_conn carries it to the server thread serving each call.
+// `trace_decode -c` turns the traces of a client and its servers into one
+// Chrome trace (chrome://tracing, ui.perfetto.dev).
+//
+// Like rpc_async.h this header is C++ only.
+
+#define TRACE_TEXT 0
+#define TRACE_BINARY 1
+#define TRACE_OFF 2
+
+// THE TRACE FILE
+// A header, TRACE_MAX_SITES call sites, then TRACE_MAX_RINGS rings. A thread
+// takes a ring on its first message and gives it back when it exits; threads
+// beyond TRACE_MAX_RINGS record nothing.
+
+#define TRACE_MAGIC "WATTRACE"
+#define TRACE_VERSION 2
+#define TRACE_MAX_SITES 1024
+#define TRACE_MAX_RINGS 64
+#define TRACE_RING_RECORDS 8192
+#define TRACE_RECORD_SIZE 128
+#define TRACE_PAYLOAD (TRACE_RECORD_SIZE - 16)
+// The site of span records. Their timestamp is the start, and the payload
+// the end, the request, then the category and name as strings.
+#define TRACE_SPAN_SITE 0xffff
+
+struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t sites;        // how many of the call sites are in use
+    uint32_t max_sites;
+    uint32_t rings;
+    uint32_t ring_records;
+    uint32_t record_size;
+    int64_t realtime_offset_ns; // CLOCK_REALTIME - CLOCK_MONOTONIC
+    uint32_t pid;
+    char pad[4096 - 44];
+};
+
+struct trace_site_entry {
+    uint32_t line;
+    char file[60];
+    char fmt[192];
+};
+
+// The arguments, in order: integers, pointers and doubles as 8 bytes, and
+// strings as a length byte and that many characters (not terminated). What
+// does not fit is left out.
+struct trace_record {
+    uint64_t ts_ns;        // CLOCK_MONOTONIC
+    uint16_t site;
+    uint16_t len;          // of the payload
+    uint32_t tid;
+    uint8_t payload[TRACE_PAYLOAD];
+};
+
+struct trace_ring {
+    uint64_t head;         // how many records were ever appended
+    char pad[56];
+    struct trace_record records[TRACE_RING_RECORDS];
+};
+
+#define TRACE_SITES_OFFSET sizeof(struct trace_file_header)
+#define TRACE_RINGS_OFFSET \
+    (TRACE_SITES_OFFSET + TRACE_MAX_SITES * sizeof(struct trace_site_entry))
+#define TRACE_FILE_SIZE \
+    (TRACE_RINGS_OFFSET + (size_t)TRACE_MAX_RINGS * sizeof(struct trace_ring))
+
+// One argument of a message, as recorded.
+struct trace_arg {
+    uint64_t value;
+    const char *string; // or nullptr
+};
+
+extern int trace_mode;
+
+// FUNCTIONS
+
+// Record into the file at path from now on. Returns 0 or -errno.
+int trace_open(const char *path);
+
+// The id of a call site, registered on its first message. Returns -1 when
+// there are too many.
+int trace_site(const char *fmt, const char *file, int line);
+
+// Append a record of n arguments to this thread's ring.
+void trace_write(int site, const struct trace_arg *args, int n);
+
+// The request this thread works on, or 0.
+uint64_t trace_request();
+
+// Set the request this thread works on. A thread doing work of a request for
+// another must set it itself, and set 0 when done.
+void trace_set_request(uint64_t request);
+
+// A new request id, unique across processes.
+uint64_t trace_new_request();
+
+// Record a span of the current request from start_ns to end_ns
+// (CLOCK_MONOTONIC), in the binary trace only. category and name are
+// stored like string arguments.
+void trace_span(const char *category, const char *name, uint64_t start_ns, uint64_t end_ns);
+
+// Write one message to stderr.
+void trace_text(const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static inline struct trace_arg trace_arg_of(const char *s) {
+    return {0, s != nullptr ? s : "(null)"};
+}
+static inline struct trace_arg trace_arg_of(char *s) {
+    return trace_arg_of((const char *)s);
+}
+template <class T>
+static inline struct trace_arg trace_arg_of(T *p) {
+    return {(uint64_t)(uintptr_t)p, nullptr};
+}
+template <class T>
+static inline typename std::enable_if<std::is_floating_point<T>::value, struct trace_arg>::type
+trace_arg_of(T v) {
+    union {
+        double d;
+        uint64_t u;
+    } bits;
+    bits.d = v;
+    return {bits.u, nullptr};
+}
+template <class T>
+static inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value,
+                                      struct trace_arg>::type
+trace_arg_of(T v) {
+    return {(uint64_t)(int64_t)v, nullptr};
+}
+
+template <class... T>
+static inline void trace_log(int site, T... args) {
+    const struct trace_arg list[] = {trace_arg_of(args)..., {0, nullptr}};
+    trace_write(site, list, sizeof...(T));
+}
+
+// Log a printf-style message. fmt must be a string literal.
+#define TRACE(fmt, ...)                                                        \
+    do {                                                                       \
+        if (trace_mode == TRACE_BINARY) {                                      \
+            static const int trace_site_id_ = trace_site("" fmt, __FILE__, __LINE__); \
+            trace_log(trace_site_id_, ##__VA_ARGS__);                          \
+        } else if (trace_mode == TRACE_TEXT) {                                 \
+            trace_text(__FILE__, __LINE__, fmt, ##__VA_ARGS__);                \
+        }                                                                      \
+    } while (0)
+
+#endif
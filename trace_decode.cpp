@@ -0,0 +1,409 @@
+
+// trace_decode.cpp
+// Prints traces recorded with WATDFS_TRACE=path (see trace.h), e.g. of a
+// client and its servers, merged in time order. Usage:
+// trace_decode [-c] [-n last_n] path...
+// By default every message and span is a line of text: time (UTC), thread
+// id, [file:line] and the message, or the span's duration and request. With
+// -c the output is a Chrome trace (JSON) instead, to open in chrome://tracing
+// or ui.perfetto.dev: spans become slices, messages instant events, and each
+// RPC span of a client is linked by an arrow to the span of the server that
+// served it. With -n only the last last_n records are kept. A trace may be
+// decoded while it is still being written.
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Reads the arguments of one record in order.
+struct Payload_reader {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool next_value(uint64_t *value) {
+        if (end - p < 8) return false;
+        memcpy(value, p, 8);
+        p += 8;
+        return true;
+    }
+    bool next_string(std::string *s) {
+        if (p == end || end - p - 1 < *p) return false;
+        s->assign((const char *)p + 1, *p);
+        p += 1 + *p;
+        return true;
+    }
+};
+
+// Format a record the way printf would have formatted the message. Missing
+// arguments print as "?".
+static std::string format(const char *fmt, Payload_reader in) {
+    std::string out;
+    char buf[512];
+    for (const char *f = fmt; *f != '\0'; f++) {
+        if (*f != '%') {
+            out += *f;
+            continue;
+        }
+        if (f[1] == '%') {
+            out += '%';
+            f++;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion, with the length
+        // dropped: every integer was recorded as 8 bytes.
+        std::string spec = "%";
+        const char *s = f + 1;
+        int stars[2];
+        int nstars = 0;
+        bool ok = true;
+        while (*s != '\0' && strchr("-+ #0", *s) != nullptr) spec += *s++;
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*s != '.') break;
+                spec += *s++;
+            }
+            if (*s == '*') {
+                uint64_t v = 0;
+                ok = ok && in.next_value(&v);
+                stars[nstars++] = (int)v;
+                spec += *s++;
+            }
+            while (*s >= '0' && *s <= '9') spec += *s++;
+        }
+        while (*s != '\0' && strchr("hlLqjzt", *s) != nullptr) s++;
+        char conversion = *s;
+        if (conversion == '\0') {
+            out += f;
+            break;
+        }
+        f = s;
+
+        uint64_t value = 0;
+        std::string str;
+        int n = 0;
+        if (conversion == 's') {
+            ok = ok && in.next_string(&str);
+            spec += 's';
+        } else {
+            ok = ok && in.next_value(&value);
+            if (strchr("diouxX", conversion) != nullptr) {
+                spec += "ll";
+            }
+            spec += conversion;
+        }
+        if (!ok) {
+            out += '?';
+            continue;
+        }
+        // The stars come first, as printf takes them.
+        const char *sp = spec.c_str();
+        auto print = [&](auto arg) {
+            if (nstars == 2) return snprintf(buf, sizeof(buf), sp, stars[0], stars[1], arg);
+            if (nstars == 1) return snprintf(buf, sizeof(buf), sp, stars[0], arg);
+            return snprintf(buf, sizeof(buf), sp, arg);
+        };
+        if (conversion == 's') {
+            n = print(str.c_str());
+        } else if (strchr("fFeEgGaA", conversion) != nullptr) {
+            double d;
+            memcpy(&d, &value, 8);
+            n = print(d);
+        } else if (conversion == 'p') {
+            n = print((void *)(uintptr_t)value);
+        } else if (conversion == 'c') {
+            n = print((int)value);
+        } else if (conversion == 'd' || conversion == 'i') {
+            n = print((long long)value);
+        } else if (strchr("ouxX", conversion) != nullptr) {
+            n = print((unsigned long long)value);
+        } else {
+            // %n and anything unknown.
+            continue;
+        }
+        if (n > 0) {
+            out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+        }
+    }
+    while (!out.empty() && out.back() == '\n') {
+        out.pop_back();
+    }
+    return out;
+}
+
+// One mapped trace file.
+struct Trace {
+    const char *path;
+    const struct trace_file_header *header;
+    const struct trace_site_entry *sites;
+    uint32_t nsites;
+};
+
+// A record, with the trace it came from and its time on CLOCK_REALTIME.
+struct Entry {
+    struct trace_record record;
+    size_t trace;
+    int64_t ns;
+};
+
+// A span record, unpacked.
+struct Span {
+    int64_t start;
+    int64_t end;
+    uint64_t request;
+    std::string category;
+    std::string name;
+};
+
+static bool map_trace(const char *path, struct Trace *trace) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return false;
+    }
+    if ((size_t)st.st_size < TRACE_FILE_SIZE) {
+        fprintf(stderr, "trace_decode: %s is not a trace\n", path);
+        close(fd);
+        return false;
+    }
+    const char *file =
+        (const char *)mmap(nullptr, TRACE_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    const struct trace_file_header *h = (const struct trace_file_header *)file;
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != TRACE_VERSION || h->record_size != TRACE_RECORD_SIZE ||
+        h->max_sites != TRACE_MAX_SITES || h->rings != TRACE_MAX_RINGS ||
+        h->ring_records != TRACE_RING_RECORDS) {
+        fprintf(stderr, "trace_decode: %s is not a version %d trace\n", path, TRACE_VERSION);
+        return false;
+    }
+    trace->path = path;
+    trace->header = h;
+    trace->sites = (const struct trace_site_entry *)(file + TRACE_SITES_OFFSET);
+    trace->nsites = __atomic_load_n(&h->sites, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+// Append the whole records of every ring of trace.
+static void read_records(const struct Trace &trace, size_t index, std::vector<struct Entry> *entries) {
+    const char *file = (const char *)trace.header;
+    for (int i = 0; i < TRACE_MAX_RINGS; i++) {
+        const struct trace_ring *ring =
+            (const struct trace_ring *)(file + TRACE_RINGS_OFFSET) + i;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > TRACE_RING_RECORDS ? head - TRACE_RING_RECORDS : 0;
+        size_t start = entries->size();
+        for (uint64_t r = first; r < head; r++) {
+            struct Entry e;
+            e.record = ring->records[r % TRACE_RING_RECORDS];
+            e.trace = index;
+            e.ns = (int64_t)e.record.ts_ns + trace.header->realtime_offset_ns;
+            entries->push_back(e);
+        }
+        // Records the writer went past while they were copied are torn.
+        uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (now > first + TRACE_RING_RECORDS) {
+            size_t torn = std::min(now - first - TRACE_RING_RECORDS, head - first);
+            entries->erase(entries->begin() + start, entries->begin() + start + torn);
+        }
+    }
+}
+
+static bool read_span(const struct Entry &e, const struct Trace &trace, struct Span *span) {
+    Payload_reader in{e.record.payload, e.record.payload + e.record.len};
+    uint64_t end = 0;
+    if (!in.next_value(&end) || !in.next_value(&span->request) ||
+        !in.next_string(&span->category) || !in.next_string(&span->name)) {
+        return false;
+    }
+    span->start = e.ns;
+    span->end = (int64_t)end + trace.header->realtime_offset_ns;
+    return true;
+}
+
+static std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static void print_text(const std::vector<struct Trace> &traces,
+                       const std::vector<struct Entry> &entries) {
+    for (const struct Entry &e : entries) {
+        const struct Trace &trace = traces[e.trace];
+        const struct trace_record &r = e.record;
+        time_t secs = e.ns / 1000000000;
+        struct tm tm;
+        gmtime_r(&secs, &tm);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        if (r.site == TRACE_SPAN_SITE) {
+            struct Span span;
+            if (read_span(e, trace, &span)) {
+                printf("%s.%06ld %u span %s.%s %.1f us, request %016llx\n", when,
+                       (long)(e.ns % 1000000000 / 1000), r.tid, span.category.c_str(),
+                       span.name.c_str(), (span.end - span.start) / 1000.0,
+                       (unsigned long long)span.request);
+            }
+            continue;
+        }
+        if (r.site >= trace.nsites) {
+            continue;
+        }
+        const struct trace_site_entry &site = trace.sites[r.site];
+        std::string fmt(site.fmt, strnlen(site.fmt, sizeof(site.fmt)));
+        std::string message = format(fmt.c_str(), Payload_reader{r.payload, r.payload + r.len});
+        printf("%s.%06ld %u [%.*s:%u] %s\n", when, (long)(e.ns % 1000000000 / 1000), r.tid,
+               (int)sizeof(site.file), site.file, site.line, message.c_str());
+    }
+}
+
+static void print_chrome(const std::vector<struct Trace> &traces,
+                         const std::vector<struct Entry> &entries) {
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    const char *sep = "";
+    for (const struct Trace &trace : traces) {
+        printf("%s{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %u, "
+               "\"args\": {\"name\": %s}}",
+               sep, trace.header->pid, json_string(trace.path).c_str());
+        sep = ",\n";
+    }
+
+    // The client RPC spans of every request, to link the server spans to.
+    std::vector<struct Span> spans(entries.size());
+    std::vector<bool> is_span(entries.size(), false);
+    std::map<uint64_t, std::vector<size_t>> rpcs;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (entries[i].record.site == TRACE_SPAN_SITE &&
+            read_span(entries[i], traces[entries[i].trace], &spans[i])) {
+            is_span[i] = true;
+            if (spans[i].category == "rpc" && spans[i].request != 0) {
+                rpcs[spans[i].request].push_back(i);
+            }
+        }
+    }
+
+    int flows = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const struct Entry &e = entries[i];
+        const struct Trace &trace = traces[e.trace];
+        uint32_t pid = trace.header->pid;
+        uint32_t tid = e.record.tid;
+        if (is_span[i]) {
+            const struct Span &span = spans[i];
+            char request[32];
+            snprintf(request, sizeof(request), "%016llx", (unsigned long long)span.request);
+            printf("%s{\"name\": %s, \"cat\": %s, \"ph\": \"X\", \"ts\": %.3f, "
+                   "\"dur\": %.3f, \"pid\": %u, \"tid\": %u, "
+                   "\"args\": {\"request\": \"%s\"}}",
+                   sep, json_string(span.name).c_str(), json_string(span.category).c_str(),
+                   span.start / 1000.0, (span.end - span.start) / 1000.0, pid, tid, request);
+            // An arrow from the client's call to the server's work on it:
+            // the latest call of the request, of the same name, around it.
+            if (span.category == "server" && rpcs.count(span.request) > 0) {
+                const struct Span *call = nullptr;
+                uint32_t call_pid = 0, call_tid = 0;
+                for (size_t j : rpcs[span.request]) {
+                    const struct Span &c = spans[j];
+                    if (c.name == span.name && c.start <= span.start && c.end >= span.end &&
+                        (call == nullptr || c.start > call->start)) {
+                        call = &c;
+                        call_pid = traces[entries[j].trace].header->pid;
+                        call_tid = entries[j].record.tid;
+                    }
+                }
+                if (call != nullptr) {
+                    flows++;
+                    printf(",\n{\"name\": \"rpc\", \"cat\": \"rpc\", \"ph\": \"s\", \"id\": %d, "
+                           "\"ts\": %.3f, \"pid\": %u, \"tid\": %u}",
+                           flows, call->start / 1000.0, call_pid, call_tid);
+                    printf(",\n{\"name\": \"rpc\", \"cat\": \"rpc\", \"ph\": \"f\", \"bp\": \"e\", "
+                           "\"id\": %d, \"ts\": %.3f, \"pid\": %u, \"tid\": %u}",
+                           flows, span.start / 1000.0, pid, tid);
+                }
+            }
+            continue;
+        }
+        const struct trace_record &r = e.record;
+        if (r.site == TRACE_SPAN_SITE || r.site >= trace.nsites) {
+            continue;
+        }
+        const struct trace_site_entry &site = trace.sites[r.site];
+        std::string fmt(site.fmt, strnlen(site.fmt, sizeof(site.fmt)));
+        std::string message = format(fmt.c_str(), Payload_reader{r.payload, r.payload + r.len});
+        char at[96];
+        snprintf(at, sizeof(at), "%.*s:%u", (int)sizeof(site.file), site.file, site.line);
+        printf("%s{\"name\": %s, \"cat\": \"log\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, "
+               "\"pid\": %u, \"tid\": %u, \"args\": {\"at\": %s}}",
+               sep, json_string(message).c_str(), e.ns / 1000.0, pid, tid,
+               json_string(at).c_str());
+    }
+    printf("\n]}\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool chrome = false;
+    long last = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "cn:")) != -1) {
+        if (opt == 'c') {
+            chrome = true;
+        } else if (opt == 'n') {
+            last = atol(optarg);
+        } else {
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: trace_decode [-c] [-n last_n] path...\n");
+        return 2;
+    }
+
+    std::vector<struct Trace> traces;
+    std::vector<struct Entry> entries;
+    for (int i = optind; i < argc; i++) {
+        struct Trace trace;
+        if (!map_trace(argv[i], &trace)) {
+            return 1;
+        }
+        traces.push_back(trace);
+        read_records(trace, traces.size() - 1, &entries);
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const struct Entry &a, const struct Entry &b) { return a.ns < b.ns; });
+    if (last > 0 && (size_t)last < entries.size()) {
+        entries.erase(entries.begin(), entries.end() - last);
+    }
+    if (chrome) {
+        print_chrome(traces, entries);
+    } else {
+        print_text(traces, entries);
+    }
+    return 0;
+}
@@ -1,8 +1,26 @@
 
 #include "watdfs_client.h"
 #include "debug.h"
+#include "compress.h"
+#include "chunker.h"
+#include "checksum.h"
+#include "rpc_conn.h"
+#include "shard_ring.h"
+#include "stripe.h"
+#include "rpc_async.h"
+#include "stats.h"
+#include "trace.h"
+#include "write_credit.h"
 #include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 INIT_LOG
 
@@ -12,15 +30,442 @@ struct Filedata {
     int client_mode;
     int file_descriptor;
     time_t tc;
+    // The byte range [sync_start, sync_end) uploaded to the server since the
+    // last server-side sync. Empty when sync_start == sync_end.
+    off_t sync_start;
+    off_t sync_end;
+};
+
+// A server the files are spread over.
+struct Server_endpoint {
+    // The stripe_server_id of its name in WATDFS_SERVERS, or 0.
+    uint64_t id;
+    // The connections calls go over, or nullptr for the librpc one. conn is
+    // the first of them, and stands for the server in current_conn.
+    struct rpc_conn_pool *pool;
+    struct rpc_conn *conn;
+    // Extra connections to the same server for parallel downloads.
+    std::vector<struct rpc_conn *> streams;
+    // Replicated changes and downloads in flight on this server.
+    int outstanding;
+    // Set once a call could not get through, and when (stats_now_ns). The
+    // server is left alone for SERVER_RETRY_MS, then tried again, and is up
+    // once a call gets through.
+    int down;
+    long down_at;
+    // The changes waiting for this server as a replica, or nullptr.
+    struct Replica_queue *queue;
+    // The write window it granted (see WRITE CREDIT), or nullptr when writes
+    // to it are not paced.
+    struct Write_credit *credit;
+};
+
+// The server descriptors of an open striped file, one per stripe.
+struct Stripe_handles {
+    struct stripe_layout layout;
+    std::vector<uint64_t> fhs;
+};
+
+// Which changes each replica of a file has (see REPLICATION).
+struct Replica_versions {
+    // The last change queued, and the last that reached the write quorum.
+    uint64_t queued;
+    uint64_t committed;
+    // Per replica, the last change it applied without missing any before.
+    std::vector<uint64_t> applied;
+};
+
+// The number of locks the files are hashed over.
+#define FILE_LOCKS 64
+
+// The RPCs the client makes, counted per name (see count_rpc).
+static const char *const rpc_names[] = {
+    "getattr", "mknod", "open", "release", "read", "read_z", "write", "write_z",
+    "truncate", "fsync", "utimensat", "caps", "conn_port", "upload_begin",
+    "upload_commit", "upload_abort", "chunks_has", "write_chunks", "layout_get",
+    "layout_set", "stats", "write_credit",
+};
+#define RPC_KINDS (sizeof(rpc_names) / sizeof(rpc_names[0]))
+
+// The watdfs_cli_* ops, timed per kind (see Op_timer).
+enum { OP_GETATTR, OP_MKNOD, OP_OPEN, OP_RELEASE, OP_READ, OP_WRITE, OP_TRUNCATE,
+       OP_FSYNC, OP_UTIMENSAT, OP_KINDS };
+static const char *const op_names[OP_KINDS] = {
+    "getattr", "mknod", "open", "release", "read", "write", "truncate", "fsync",
+    "utimensat",
+};
+
+// The ids of the client's histograms and counters (see stats.h).
+struct Client_stats {
+    int ops[OP_KINDS];
+    // Per rpc_names entry, the last for any other.
+    int rpcs[RPC_KINDS + 1];
+    int freshness_checks;
+    int cache_hits;
+    int cache_misses;
+    int bytes_downloaded;
+    int bytes_uploaded;
+    // How long writes waited for the next window.
+    int write_credit_waits;
 };
 
 struct Client_information {
     time_t cacheInterval;
     char *cachePath;
+    // The WATDFS_CAP_* features both ends support, negotiated at init.
+    int caps;
+    // The CHECKSUM_* kind protecting read and write payloads.
+    int checksum_kind;
+    // The servers holding the files, and the consistent hash ring placing
+    // every path on one of them (see shard_ring.h). Without WATDFS_SERVERS
+    // there is a single server reached through librpc, and no ring.
+    std::vector<struct Server_endpoint> servers;
+    struct shard_ring *ring;
+    // The layouts of the files seen so far (see stripe.h), and the layout new
+    // files get: striped over WATDFS_STRIPE_WIDTH servers, or not at all.
+    std::map<std::string, struct stripe_layout> layouts;
+    struct stripe_layout new_layout;
+    // The paths layout_get found no file at, and when. Until cacheInterval
+    // has passed they are taken for files that are not striped.
+    std::map<std::string, time_t> layout_misses;
+    // Open striped files, by path and the descriptor of stripe 0.
+    std::map<std::pair<std::string, uint64_t>, struct Stripe_handles> stripe_fhs;
+    // The copies of every file that is not striped, and how many must have a
+    // change before it returns (see REPLICATION).
+    int replicas;
+    int write_quorum;
+    // Recent read latencies and the hedges still running (see HEDGED READS),
+    // or nullptr when reads are not hedged.
+    struct Read_hedging *hedging;
+    // The replicated files this client changed, with which changes each
+    // replica applied (see REPLICATION).
+    std::map<std::string, struct Replica_versions> replica_versions;
     std::map<std::string, struct Filedata > filedatas;
+    // FUSE calls in from many threads. maps_lock guards filedatas, layouts,
+    // layout_misses, stripe_fhs and replica_versions, held only while looking
+    // up or changing an entry; map entries stay put while others come and go. Calls on one file run one
+    // at a time, under the lock its path hashes to (see File_lock).
+    pthread_mutex_t maps_lock;
+    pthread_mutex_t file_locks[FILE_LOCKS];
+    // The calls made so far, per rpc_names entry; the last counts any other.
+    long rpc_counts[RPC_KINDS + 1];
+    struct Client_stats stats;
+};
+
+// Large files are downloaded in stripes of this many bytes, fetched in
+// parallel over the extra connections.
+#define DOWNLOAD_STRIPE_SIZE (4 << 20)
+// Other downloads are read in pieces of this many bytes, all in flight at
+// once through rpc_async.
+#define DOWNLOAD_PIECE_SIZE (16 * MAX_ARRAY_LEN)
+// The default number of extra connections, WATDFS_DOWNLOAD_STREAMS.
+#define DOWNLOAD_STREAMS 4
+// The default number of pooled connections per server, WATDFS_POOL_CONNS.
+#define POOL_CONNS 8
+
+// How long a server that went down is left alone before calls try it again.
+#define SERVER_RETRY_MS 5000
+
+// The connection the RPCs of this thread go over, overriding placement, or
+// nullptr.
+static thread_local struct rpc_conn *current_conn = nullptr;
+
+// The server that holds path. Calls without a path go to the first server.
+static struct Server_endpoint *server_of(void *userdata, const char *path) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (info == nullptr || info->servers.empty()) {
+        return nullptr;
+    }
+    if (info->ring == nullptr || path == nullptr) {
+        return &info->servers[0];
+    }
+    return &info->servers[shard_ring_lookup(info->ring, path)];
+}
+
+// The k-th server after the one path is placed on: the server of its k-th
+// stripe or replica.
+static struct Server_endpoint *nth_server(void *userdata, const char *path,
+                                          uint32_t k) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    int home = shard_ring_lookup(info->ring, path);
+    return &info->servers[(home + k) % info->servers.size()];
+}
+
+// Remember that the server behind conn cannot be reached.
+static void mark_down(void *userdata, struct rpc_conn *conn) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (info == nullptr) {
+        return;
+    }
+    for (struct Server_endpoint &server : info->servers) {
+        if (server.conn == conn && conn != nullptr) {
+            DLOG("server %zu is down", &server - &info->servers[0]);
+            __atomic_store_n(&server.down_at, stats_now_ns(), __ATOMIC_RELAXED);
+            __atomic_store_n(&server.down, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Whether calls should go to server: it is up, or went down long enough ago
+// to be tried again.
+static bool server_usable(struct Server_endpoint *server) {
+    return !__atomic_load_n(&server->down, __ATOMIC_RELAXED) ||
+           stats_now_ns() - __atomic_load_n(&server->down_at, __ATOMIC_RELAXED) >=
+               SERVER_RETRY_MS * 1000000L;
+}
+
+// Count a call of name. Returns its rpc_names entry, or RPC_KINDS.
+static size_t count_rpc(struct Client_information *info, const char *name) {
+    size_t kind = 0;
+    while (kind < RPC_KINDS && strcmp(rpc_names[kind], name) != 0) {
+        kind++;
+    }
+    __atomic_add_fetch(&info->rpc_counts[kind], 1, __ATOMIC_RELAXED);
+    return kind;
+}
+
+static void register_stats(struct Client_information *info) {
+    for (int op = 0; op < OP_KINDS; op++) {
+        info->stats.ops[op] = stats_histogram((std::string("op.") + op_names[op]).c_str());
+    }
+    for (size_t kind = 0; kind <= RPC_KINDS; kind++) {
+        std::string name = kind < RPC_KINDS ? rpc_names[kind] : "other";
+        info->stats.rpcs[kind] = stats_histogram(("rpc." + name).c_str());
+    }
+    info->stats.freshness_checks = stats_counter("freshness_checks");
+    info->stats.cache_hits = stats_counter("cache_hits");
+    info->stats.cache_misses = stats_counter("cache_misses");
+    info->stats.bytes_downloaded = stats_counter("bytes_downloaded");
+    info->stats.bytes_uploaded = stats_counter("bytes_uploaded");
+    info->stats.write_credit_waits = stats_histogram("write_credit_wait");
+}
+
+// Add the size of the cache file full_path to counter.
+static void count_file_bytes(int counter, const char *full_path) {
+    struct stat st;
+    if (stat(full_path, &st) == 0) {
+        stats_add(counter, st.st_size);
+    }
+}
+
+// The RPCs made so far, for benchmarks.
+long rpc_call_count(void *userdata) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    long total = 0;
+    for (size_t kind = 0; kind <= RPC_KINDS; kind++) {
+        total += __atomic_load_n(&info->rpc_counts[kind], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Write the RPC counts to path as a JSON object, for benchmarks.
+static void write_rpc_counts(struct Client_information *info, const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == nullptr) {
+        DLOG("cannot write rpc counts to %s", path);
+        return;
+    }
+    fprintf(out, "{");
+    const char *sep = "";
+    for (size_t kind = 0; kind <= RPC_KINDS; kind++) {
+        long count = __atomic_load_n(&info->rpc_counts[kind], __ATOMIC_RELAXED);
+        if (count > 0) {
+            fprintf(out, "%s\"%s\": %ld", sep,
+                    kind < RPC_KINDS ? rpc_names[kind] : "other", count);
+            sep = ", ";
+        }
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+}
+
+static void take_write_credit(void *userdata, struct Server_endpoint *server, long bytes);
+
+// Send a call to server, over whichever of its pooled connections is idle.
+// Writes wait for the server's credit first.
+static int call_server(void *userdata, struct Server_endpoint *server, const char *name,
+                       int *arg_types, void **args) {
+    if (server != nullptr && server->credit != nullptr &&
+        (strcmp(name, "write") == 0 || strcmp(name, "write_z") == 0)) {
+        take_write_credit(userdata, server, arg_types[1] & 0xffff);
+    }
+    if (server == nullptr || server->pool == nullptr) {
+        return rpcCall((char *)name, arg_types, args);
+    }
+    int rpc_ret = rpc_conn_pool_call(server->pool, name, arg_types, args);
+    if (rpc_ret != TERMINATED && rpc_ret != FAILED_TO_SEND &&
+        __atomic_exchange_n(&server->down, 0, __ATOMIC_RELAXED)) {
+        struct Client_information *info = (struct Client_information *)userdata;
+        DLOG("server %zu is up again", server - &info->servers[0]);
+    }
+    return rpc_ret;
+}
+
+// Send a call to the server that holds path, or over the connection the
+// calling thread picked. When the server holding path cannot be reached, the
+// call goes to the next of its replicas.
+static int route_rpc(void *userdata, const char *path, const char *name,
+                     int *arg_types, void **args) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (current_conn != nullptr) {
+        // A thread that picked a server still shares its pool; one that
+        // picked an extra connection has it to itself.
+        struct Server_endpoint *picked = nullptr;
+        for (struct Server_endpoint &server : info->servers) {
+            if (server.conn == current_conn) {
+                picked = &server;
+            }
+        }
+        int rpc_ret = picked != nullptr ? call_server(userdata, picked, name, arg_types, args)
+                                        : rpc_conn_call(current_conn, name, arg_types, args);
+        if (rpc_ret == TERMINATED || rpc_ret == FAILED_TO_SEND) {
+            mark_down(userdata, current_conn);
+        }
+        return rpc_ret;
+    }
+    if (info == nullptr || info->ring == nullptr || path == nullptr) {
+        return call_server(userdata, server_of(userdata, path), name, arg_types, args);
+    }
+    int rpc_ret = TERMINATED;
+    int replicas = std::max(1, std::min(info->replicas, (int)info->servers.size()));
+    for (int i = 0; i < replicas; i++) {
+        struct Server_endpoint *server = nth_server(userdata, path, i);
+        if (!server_usable(server)) {
+            continue;
+        }
+        rpc_ret = call_server(userdata, server, name, arg_types, args);
+        if (rpc_ret != TERMINATED && rpc_ret != FAILED_TO_SEND) {
+            break;
+        }
+        mark_down(userdata, server->conn);
+    }
+    return rpc_ret;
+}
+
+// Every RPC goes through here, to be counted and timed, then routed.
+static int client_rpc_call(void *userdata, const char *path, const char *name,
+                           int *arg_types, void **args) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (info == nullptr) {
+        return route_rpc(userdata, path, name, arg_types, args);
+    }
+    size_t kind = count_rpc(info, name);
+    long start = stats_now_ns();
+    int rpc_ret = route_rpc(userdata, path, name, arg_types, args);
+    long end = stats_now_ns();
+    stats_record(info->stats.rpcs[kind], end - start);
+    trace_span("rpc", name, start, end);
+    return rpc_ret;
+}
+
+// CLIENT STATE
+
+// The entry of the open file p, or nullptr.
+static struct Filedata *find_filedata(void *userdata, const std::string &p) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    pthread_mutex_lock(&info->maps_lock);
+    auto it = info->filedatas.find(p);
+    struct Filedata *file = it == info->filedatas.end() ? nullptr : &it->second;
+    pthread_mutex_unlock(&info->maps_lock);
+    return file;
+}
+
+// The entry of p, added zeroed if there is none.
+static struct Filedata &filedata(void *userdata, const std::string &p) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    pthread_mutex_lock(&info->maps_lock);
+    struct Filedata &file = info->filedatas[p];
+    pthread_mutex_unlock(&info->maps_lock);
+    return file;
+}
+
+static void erase_filedata(void *userdata, const std::string &p) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    pthread_mutex_lock(&info->maps_lock);
+    info->filedatas.erase(p);
+    pthread_mutex_unlock(&info->maps_lock);
+}
+
+// Holds the lock of path for as long as it lives. The locks are recursive,
+// as one call may make another on the same file.
+struct File_lock {
+    pthread_mutex_t *lock;
+    File_lock(void *userdata, const char *path) {
+        struct Client_information *info = (struct Client_information *)userdata;
+        lock = &info->file_locks[std::hash<std::string>()(path) % FILE_LOCKS];
+        pthread_mutex_lock(lock);
+    }
+    ~File_lock() {
+        pthread_mutex_unlock(lock);
+    }
+};
+
+// Times a watdfs_cli_* op, waiting for its File_lock included, in its
+// histogram.
+struct Op_timer {
+    int op;
+    int histogram;
+    long start;
+    // Whether the op started a request of its own, rather than being part of
+    // another op.
+    bool new_request;
+    Op_timer(void *userdata, int op) : op(op) {
+        histogram = ((struct Client_information *)userdata)->stats.ops[op];
+        new_request = trace_request() == 0;
+        if (new_request) {
+            trace_set_request(trace_new_request());
+        }
+        start = stats_now_ns();
+    }
+    ~Op_timer() {
+        long end = stats_now_ns();
+        stats_record(histogram, end - start);
+        trace_span("op", op_names[op], start, end);
+        if (new_request) {
+            trace_set_request(0);
+        }
+    }
 };
 
+// Striped files, see below.
+static const struct stripe_layout *striped_layout(void *userdata, const char *path);
+static struct Stripe_handles *stripe_handles(void *userdata, const char *path,
+                                             struct fuse_file_info *fi);
+static int stripe_getattr(void *userdata, const char *path,
+                          const struct stripe_layout *layout, struct stat *statbuf);
+static bool stripes_new_files(void *userdata);
+static int stripe_mknod(void *userdata, const char *path, mode_t mode, dev_t dev);
+static int stripe_open(void *userdata, const char *path,
+                       const struct stripe_layout *layout, struct fuse_file_info *fi);
+static int stripe_release(void *userdata, const char *path,
+                          struct Stripe_handles *handles, struct fuse_file_info *fi);
+static int stripe_io(void *userdata, const char *path, struct Stripe_handles *handles,
+                     char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi, bool is_write);
+template <class F>
+static int for_each_stripe(void *userdata, const struct stripe_layout *layout,
+                           uint32_t width, F call);
+// Replicated files, see below.
+static bool replicated(void *userdata, const char *path);
+static int replicate(void *userdata, const char *path, std::function<int()> call,
+                     bool replaces = false);
+static int on_newest_replica(void *userdata, const char *path, std::function<int()> call);
+static bool hedges_reads(void *userdata, const char *path, size_t size);
+static int hedged_read(void *userdata, const char *path, char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi);
+int rpc_call_read_direct(void *userdata, const char *path, char *buf, size_t size,
+                         off_t offset, struct fuse_file_info *fi);
+template <class F>
+static int for_each_open_stripe(void *userdata, const char *path,
+                                struct Stripe_handles *handles,
+                                struct fuse_file_info *fi, F call);
+
 int rpc_call_getattr(void *userdata, const char *path, struct stat *statbuf) {
+    const struct stripe_layout *layout = striped_layout(userdata, path);
+    if (layout != nullptr) {
+        return stripe_getattr(userdata, path, layout, statbuf);
+    }
+
     // SET UP THE RPC CALL
     DLOG("watdfs_cli_getattr called for '%s'", path);
 
@@ -67,7 +512,7 @@ int rpc_call_getattr(void *userdata, const char *path, struct stat *statbuf) {
     arg_types[3] = 0;
 
     // MAKE THE RPC CALL
-    int rpc_ret = rpcCall((char *)"getattr", arg_types, args);
+    int rpc_ret = client_rpc_call(userdata, path, "getattr", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -102,6 +547,15 @@ int rpc_call_getattr(void *userdata, const char *path, struct stat *statbuf) {
 
 // CREATE, OPEN AND CLOSE
 int rpc_call_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+    if (stripes_new_files(userdata)) {
+        return stripe_mknod(userdata, path, mode, dev);
+    }
+    if (replicated(userdata, path)) {
+        std::string p = path;
+        return replicate(userdata, path, [=]() {
+            return rpc_call_mknod(userdata, p.c_str(), mode, dev);
+        });
+    }
 
     // Called to create a file.
     // getattr has 4 arguments.
@@ -141,7 +595,7 @@ int rpc_call_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
     arg_types[4] = 0;
 
 
-    int rpc_ret = rpcCall((char *)"mknod", arg_types, args);
+    int rpc_ret = client_rpc_call(userdata, path, "mknod", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -177,6 +631,10 @@ int rpc_call_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
 }
 int rpc_call_open(void *userdata, const char *path,
                     struct fuse_file_info *fi) {
+    const struct stripe_layout *layout = striped_layout(userdata, path);
+    if (layout != nullptr) {
+        return stripe_open(userdata, path, layout, fi);
+    }
     // Called during open.
     // You should fill in fi->fh.
     // getattr has 3 arguments.
@@ -212,7 +670,7 @@ int rpc_call_open(void *userdata, const char *path,
 
     arg_types[3] = 0;
 
-    int rpc_ret = rpcCall((char *)"open", arg_types, args);
+    int rpc_ret = client_rpc_call(userdata, path, "open", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -249,6 +707,10 @@ int rpc_call_open(void *userdata, const char *path,
 
 int rpc_call_release(void *userdata, const char *path,
                        struct fuse_file_info *fi) {
+    struct Stripe_handles *handles = stripe_handles(userdata, path, fi);
+    if (handles != nullptr) {
+        return stripe_release(userdata, path, handles, fi);
+    }
     // Called during close, but possibly asynchronously.
     int ARG_COUNT = 3;
 
@@ -282,7 +744,7 @@ int rpc_call_release(void *userdata, const char *path,
 
     arg_types[3] = 0;
 
-    int rpc_ret = rpcCall((char *)"release", arg_types, args);
+    int rpc_ret = client_rpc_call(userdata, path, "release", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -316,6 +778,320 @@ int rpc_call_release(void *userdata, const char *path,
     return -ENOSYS;
 }
 
+// The checksum kind for the data RPCs, none when there is no client state.
+static int checksum_kind_of(void *userdata) {
+    if (userdata == nullptr) {
+        return CHECKSUM_NONE;
+    }
+    return ((struct Client_information *)userdata)->checksum_kind;
+}
+
+// Ask the server which optional features it supports. Returns the subset of
+// client_caps that both ends support; an older server without the caps RPC
+// supports none.
+int rpc_call_caps(void *userdata, int client_caps) {
+    int ARG_COUNT = 3;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+
+    //client caps
+    arg_types[0] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[0] = (int *)&client_caps;
+
+    //server caps
+    int server_caps = 0;
+    arg_types[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[1] = (int *)&server_caps;
+
+    //retcode
+    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    int return_code;
+    args[2] = (int *)&return_code;
+
+    arg_types[3] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, nullptr, "caps", arg_types, args);
+    delete []args;
+    if (rpc_ret < 0 || return_code < 0) {
+        DLOG("caps rpc failed with error '%d', no optional features", rpc_ret);
+        return 0;
+    }
+    return client_caps & server_caps;
+}
+
+// Ask the server for the port of its extra connections (see rpc_conn.h).
+// Returns the port, or 0 if it has none.
+int rpc_call_conn_port(void *userdata) {
+    int ARG_COUNT = 2;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+
+    //port
+    int port = 0;
+    arg_types[0] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[0] = (int *)&port;
+
+    //retcode
+    arg_types[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    int return_code;
+    args[1] = (int *)&return_code;
+
+    arg_types[2] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, nullptr, "conn_port", arg_types, args);
+    delete []args;
+    if (rpc_ret < 0 || return_code < 0) {
+        DLOG("conn_port rpc failed with error '%d', no extra connections", rpc_ret);
+        return 0;
+    }
+    return port;
+}
+
+// Fetch the statistics report of the server (see stats.h) into report, of
+// size bytes. Returns 0 or a negative error code.
+int rpc_call_stats(void *userdata, char *report, int size) {
+    int ARG_COUNT = 2;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+
+    //report
+    arg_types[0] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) size;
+    args[0] = (void *)report;
+
+    //retcode
+    arg_types[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    int return_code;
+    args[1] = (int *)&return_code;
+
+    arg_types[2] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, nullptr, "stats", arg_types, args);
+    delete []args;
+    if (rpc_ret < 0) {
+        return rpc_ret;
+    }
+    return return_code;
+}
+
+// The statistics of this client, then those of every server, for the
+// WATDFS_STATS_SOCKET.
+static std::string stats_text(struct Client_information *info) {
+    std::string text = "# client\n" + stats_report();
+    for (size_t i = 0; i < info->servers.size(); i++) {
+        current_conn = info->servers[i].conn;
+        std::vector<char> report(MAX_ARRAY_LEN, 0);
+        int ret = rpc_call_stats((void *)info, report.data(), (int)report.size());
+        text += "# server " + std::to_string(i) + "\n";
+        text += ret < 0 ? std::string("unavailable\n") : std::string(report.data());
+    }
+    current_conn = nullptr;
+    return text;
+}
+
+// Compressed read: each RPC returns a buffer of frames (see compress.h) that
+// can cover several times MAX_ARRAY_LEN raw bytes when the data compresses.
+int rpc_call_read_z(void *userdata, const char *path, char *buf, size_t size,
+                    off_t offset, struct fuse_file_info *fi) {
+    int ARG_COUNT = 10;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+    char *frames = (char *)malloc(MAX_ARRAY_LEN);
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+    //frames, the length is set per call
+    args[1] = (void *)frames;
+    //frame buffer capacity
+    long out_cap;
+    arg_types[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[2] = (long *)&out_cap;
+    //raw bytes wanted
+    long want_raw;
+    arg_types[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[3] = (long *)&want_raw;
+    //offset
+    long chunk_offset;
+    arg_types[4] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[4] = (long *)&chunk_offset;
+    //fi
+    arg_types[5] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
+    args[5] = (void *)fi;
+    //encoded length
+    long encoded_len;
+    arg_types[6] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+    args[6] = (long *)&encoded_len;
+    //checksum kind
+    int kind = checksum_kind_of(userdata);
+    arg_types[7] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[7] = (int *)&kind;
+    //checksum of the raw bytes
+    long checksum;
+    arg_types[8] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+    args[8] = (long *)&checksum;
+    //retcode, the raw bytes covered
+    int return_code;
+    arg_types[9] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[9] = (int *)&return_code;
+    arg_types[10] = 0;
+
+    long total_read = 0;
+    int fxn_ret = 0;
+    int retries = 0;
+    while (total_read < (long)size) {
+        want_raw = size - total_read;
+        chunk_offset = offset + total_read;
+        out_cap = compress_bound(want_raw);
+        if (out_cap > MAX_ARRAY_LEN) out_cap = MAX_ARRAY_LEN;
+        arg_types[1] =
+                (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) out_cap;
+
+        int rpc_ret = client_rpc_call(userdata, path, "read_z", arg_types, args);
+        if (rpc_ret < 0) {
+            DLOG("read_z rpc failed with error '%d'", rpc_ret);
+            fxn_ret = -EINVAL;
+            break;
+        }
+        if (return_code <= 0) {
+            fxn_ret = return_code;
+            break;
+        }
+
+        // Unpack the frames straight into the caller's buffer.
+        long pos = 0;
+        long decoded = 0;
+        while (pos < encoded_len) {
+            size_t raw_len;
+            size_t frame = compress_frame_size(frames + pos, encoded_len - pos, &raw_len);
+            long n = frame == 0 ? -1 :
+                     compress_frame_decode(frames + pos, frame, buf + total_read + decoded,
+                                           size - total_read - decoded);
+            if (n < 0) {
+                DLOG("read_z: corrupt frame at %ld", pos);
+                fxn_ret = -EIO;
+                break;
+            }
+            pos += frame;
+            decoded += n;
+        }
+        if (fxn_ret < 0) break;
+        if (kind != CHECKSUM_NONE &&
+            (uint64_t)checksum != checksum_compute(kind, buf + total_read, decoded)) {
+            DLOG("read_z: checksum mismatch at %ld", chunk_offset);
+            if (++retries > CHECKSUM_RETRIES) {
+                fxn_ret = -EIO;
+                break;
+            }
+            continue;
+        }
+        total_read += decoded;
+    }
+
+    free(frames);
+    delete []args;
+    if (fxn_ret < 0) {
+        return fxn_ret;
+    }
+    return total_read;
+}
+
+// Compressed write: the data is compressed on the compressor pool, then sent
+// as whole frames packed into RPC arrays of up to MAX_ARRAY_LEN bytes.
+int rpc_call_write_z(void *userdata, const char *path, const char *buf,
+                     size_t size, off_t offset, struct fuse_file_info *fi) {
+    if (size == 0) {
+        return 0;
+    }
+    char *encoded = (char *)malloc(compress_bound(size));
+    long encoded_len = compress_encode(buf, size, encoded);
+
+    int ARG_COUNT = 8;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+    //frames, set per call
+    //frames length
+    long msg_len;
+    arg_types[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[2] = (long *)&msg_len;
+    //offset
+    long chunk_offset;
+    arg_types[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[3] = (long *)&chunk_offset;
+    //fi
+    arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
+    args[4] = (void *)fi;
+    //checksum kind
+    int kind = checksum_kind_of(userdata);
+    arg_types[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[5] = (int *)&kind;
+    //checksum of the raw bytes
+    long checksum;
+    arg_types[6] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[6] = (long *)&checksum;
+    //retcode, the raw bytes written
+    int return_code;
+    arg_types[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[7] = (int *)&return_code;
+    arg_types[8] = 0;
+
+    long pos = 0;
+    long total_written = 0;
+    int fxn_ret = 0;
+    int retries = 0;
+    while (pos < encoded_len) {
+        // Pack as many whole frames as fit in one array.
+        msg_len = 0;
+        long msg_raw = 0;
+        while (pos + msg_len < encoded_len) {
+            size_t raw_len;
+            size_t frame = compress_frame_size(encoded + pos + msg_len,
+                                               encoded_len - pos - msg_len, &raw_len);
+            if (frame == 0 || msg_len + (long)frame > MAX_ARRAY_LEN) break;
+            msg_len += frame;
+            msg_raw += raw_len;
+        }
+        chunk_offset = offset + total_written;
+        arg_types[1] =
+                (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) msg_len;
+        args[1] = (void *)(encoded + pos);
+        checksum = checksum_compute(kind, buf + total_written, msg_raw);
+
+        int rpc_ret = client_rpc_call(userdata, path, "write_z", arg_types, args);
+        if (rpc_ret < 0) {
+            DLOG("write_z rpc failed with error '%d'", rpc_ret);
+            fxn_ret = -EINVAL;
+            break;
+        }
+        if (return_code == -EBADMSG && ++retries <= CHECKSUM_RETRIES) {
+            // Corrupted on the way, nothing was written; send it again.
+            DLOG("write_z: checksum mismatch at %ld", chunk_offset);
+            continue;
+        }
+        if (return_code < 0) {
+            fxn_ret = return_code == -EBADMSG ? -EIO : return_code;
+            break;
+        }
+        pos += msg_len;
+        total_written += return_code;
+        if (return_code < msg_raw) break;
+    }
+
+    free(encoded);
+    delete []args;
+    if (fxn_ret < 0) {
+        return fxn_ret;
+    }
+    return total_written;
+}
+
 // READ AND WRITE DATA
 int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
                     off_t offset, struct fuse_file_info *fi) {
@@ -324,8 +1100,31 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
     // Remember that size may be greater then the maximum array size of the RPC
     // library.
 
+    // Striped files are read from all their servers at once.
+    struct Stripe_handles *handles = stripe_handles(userdata, path, fi);
+    if (handles != nullptr) {
+        return stripe_io(userdata, path, handles, buf, size, offset, fi, false);
+    }
+
+    // Reads that can also be sent somewhere else are hedged against a slow
+    // server.
+    if (hedges_reads(userdata, path, size)) {
+        return hedged_read(userdata, path, buf, size, offset, fi);
+    }
+    return rpc_call_read_direct(userdata, path, buf, size, offset, fi);
+}
+
+// Read over the connection placement picks, without hedging.
+int rpc_call_read_direct(void *userdata, const char *path, char *buf, size_t size,
+                         off_t offset, struct fuse_file_info *fi) {
+    // Bulk transfers go compressed when the server supports it.
+    if (userdata != nullptr && size >= COMPRESS_MIN_TRANSFER &&
+        (((struct Client_information *)userdata)->caps & WATDFS_CAP_LZ4)) {
+        return rpc_call_read_z(userdata, path, buf, size, offset, fi);
+    }
 
-    int ARG_COUNT = 6;
+
+    int ARG_COUNT = 8;
 
     // Allocate space for the output arguments.
     void **args = new void*[ARG_COUNT];
@@ -364,18 +1163,28 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
     arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
     args[4] = (void *)fi;
 
+    //checksum kind
+    int kind = checksum_kind_of(userdata);
+    arg_types[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[5] = (int *)&kind;
+
+    //checksum of the data read
+    long checksum;
+    arg_types[6] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+    args[6] = (long *)&checksum;
+
     //retcode
-    arg_types[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
+    arg_types[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
     int return_code;
-    args[5] = (int *)&return_code;
+    args[7] = (int *)&return_code;
 
-    arg_types[6] = 0;
+    arg_types[8] = 0;
 
 
     /*long size_copy = size;
     while(size_copy > MAX_ARRAY_LEN){
         size = MAX_ARRAY_LEN;
-        int rpc_ret = rpcCall((char *)"read", arg_types, args);
+        int rpc_ret = client_rpc_call(userdata, path, "read", arg_types, args);
         if (rpc_ret < 0 ) {
             return -EINVAL;
         }
@@ -391,6 +1200,7 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
     long size_copy = size;
     long total_read = 0;
     long chunk_size;
+    int retries = 0;
     while (total_read < size_copy){
         long remaining_size = size_copy-total_read;
         if(remaining_size>MAX_ARRAY_LEN)
@@ -401,24 +1211,34 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
         memset(buf,0,sizeof(size));
         arg_types[1] =
                 (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | chunk_size;
-        int rpc_ret = rpcCall((char *)"read", arg_types, args);
+        int rpc_ret = client_rpc_call(userdata, path, "read", arg_types, args);
         if (rpc_ret < 0) {
             return -EINVAL;
         }
         if(return_code < 0){
             return return_code;
         }
+        //check the chunk before using it, and read it again if it was
+        //corrupted on the way
+        if(return_code > 0 && kind != CHECKSUM_NONE &&
+           (uint64_t)checksum != checksum_compute(kind, buf, return_code)){
+            DLOG("read: checksum mismatch at %ld", offset);
+            if(++retries > CHECKSUM_RETRIES){
+                return -EIO;
+            }
+            continue;
+        }
         if(return_code == 0){
             //DLOG("something wrong");
             return_code = total_read;
             memcpy(buf,buf_total,total_read);
             buf = buf_total;
             DLOG("offset in client: %ld\n", offset);
-            DLOG("buf_end in client: %s\n", buf);
             DLOG("total_read in client: %ld\n", total_read);
+            free(buf_total);
+            delete []args;
             return total_read;
         }
-        DLOG("read content in client: %s\n", buf);
         DLOG("sys_ret in client: %d\n", return_code);
         memcpy(buf_total+total_read,buf,return_code);
         offset+=return_code;
@@ -431,12 +1251,12 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
     //buf = buf_total;
     memcpy(buf,buf_total,total_read);
     DLOG("offset in client: %ld\n", offset);
-    DLOG("buf_end in client: %s\n", buf);
     DLOG("total_read in client: %ld\n", total_read);
+    free(buf_total);
     delete []args;
     return total_read;
 
-    /*int rpc_ret = rpcCall((char *)"read", arg_types, args);
+    /*int rpc_ret = client_rpc_call(userdata, path, "read", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -452,7 +1272,6 @@ int rpc_call_read(void *userdata, const char *path, char *buf, size_t size,
         // should set our function return value to the retcode from the server.
 
         // TODO: set the function return value to the return code from the server.
-        DLOG("read content in client: %s\n", buf);
         DLOG("sys_ret in client: %d\n", return_code);
         fxn_ret = return_code;
     }
@@ -478,7 +1297,19 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
 
     // Remember that size may be greater then the maximum array size of the RPC
     // library.
-    int ARG_COUNT = 6;
+
+    // Striped files are written to all their servers at once.
+    struct Stripe_handles *handles = stripe_handles(userdata, path, fi);
+    if (handles != nullptr) {
+        return stripe_io(userdata, path, handles, (char *)buf, size, offset, fi, true);
+    }
+
+    // Bulk transfers go compressed when the server supports it.
+    if (userdata != nullptr && size >= COMPRESS_MIN_TRANSFER &&
+        (((struct Client_information *)userdata)->caps & WATDFS_CAP_LZ4)) {
+        return rpc_call_write_z(userdata, path, buf, size, offset, fi);
+    }
+    int ARG_COUNT = 8;
 
     // Allocate space for the output arguments.
     void **args = new void*[ARG_COUNT];
@@ -517,12 +1348,22 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
     arg_types[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
     args[4] = (void *)fi;
 
+    //checksum kind
+    int kind = checksum_kind_of(userdata);
+    arg_types[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[5] = (int *)&kind;
+
+    //checksum of the data to write
+    long checksum;
+    arg_types[6] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[6] = (long *)&checksum;
+
     //retcode
-    arg_types[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
+    arg_types[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
     int return_code;
-    args[5] = (int *)&return_code;
+    args[7] = (int *)&return_code;
 
-    arg_types[6] = 0;
+    arg_types[8] = 0;
 
     //char *buf_total = (char *)malloc(size);
     //memset(buf_total,0,sizeof(buf_total));
@@ -531,6 +1372,7 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
     long size_copy = size;
     long total_read = 0;
     long chunk_size;
+    int retries = 0;
     while (total_read < size_copy){
         long remaining_size = size_copy-total_read;
         if(remaining_size>MAX_ARRAY_LEN)
@@ -540,11 +1382,20 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
         size = chunk_size;
         arg_types[1] =
                 (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | chunk_size;
-        int rpc_ret = rpcCall((char *)"write", arg_types, args);
-        args[1] = (char *)args[1]+chunk_size;
+        checksum = checksum_compute(kind, args[1], chunk_size);
+        int rpc_ret = client_rpc_call(userdata, path, "write", arg_types, args);
         if (rpc_ret < 0) {
             return -EINVAL;
         }
+        //the server rejects a corrupted chunk without writing it
+        if(return_code == -EBADMSG && ++retries <= CHECKSUM_RETRIES){
+            DLOG("write: checksum mismatch at %ld", offset);
+            continue;
+        }
+        if(return_code == -EBADMSG){
+            return -EIO;
+        }
+        args[1] = (char *)args[1]+chunk_size;
         if(return_code < 0){
             return return_code;
         }
@@ -568,7 +1419,6 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
     //offset = offset_copy;
     //buf = buf_total;
     DLOG("offset in client: %ld\n", offset);
-    DLOG("buf_end in client: %s\n", buf);
     DLOG("total_write in client: %ld\n", total_read);
     delete []args;
     return total_read;
@@ -576,7 +1426,7 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
     /*long size_copy = size;
     while(size_copy > MAX_ARRAY_LEN){
         size = MAX_ARRAY_LEN;
-        int rpc_ret = rpcCall((char *)"write", arg_types, args);
+        int rpc_ret = client_rpc_call(userdata, path, "write", arg_types, args);
         if (rpc_ret < 0 ) {
             return -EINVAL;
         }
@@ -595,7 +1445,7 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
         else
             chunk_size = remaining_size;
         size = chunk_size;
-        int rpc_ret = rpcCall((char *)"write", arg_types, args);
+        int rpc_ret = client_rpc_call(userdata, path, "write", arg_types, args);
         if (rpc_ret < 0) {
             return -EINVAL;
         }
@@ -612,7 +1462,7 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
     }
     return total_read;*/
 
-    /*int rpc_ret = rpcCall((char *)"write", arg_types, args);
+    /*int rpc_ret = client_rpc_call(userdata, path, "write", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -650,6 +1500,18 @@ int rpc_call_write(void *userdata, const char *path, const char *buf,
 
 int rpc_call_truncate(void *userdata, const char *path, off_t newsize) {
     // Change the file size to newsize.
+    const struct stripe_layout *layout = striped_layout(userdata, path);
+    if (layout != nullptr) {
+        return for_each_stripe(userdata, layout, layout->width, [&](uint32_t k) {
+            return rpc_call_truncate(userdata, path, newsize);
+        });
+    }
+    if (replicated(userdata, path)) {
+        std::string p = path;
+        return replicate(userdata, path, [=]() {
+            return rpc_call_truncate(userdata, p.c_str(), newsize);
+        });
+    }
 
     int ARG_COUNT = 3;
 
@@ -683,7 +1545,7 @@ int rpc_call_truncate(void *userdata, const char *path, off_t newsize) {
 
     arg_types[3] = 0;
 
-    int rpc_ret = rpcCall((char *)"truncate", arg_types, args);
+    int rpc_ret = client_rpc_call(userdata, path, "truncate", arg_types, args);
 
     // HANDLE THE RETURN
     // The integer value watdfs_cli_getattr will return.
@@ -719,10 +1581,23 @@ int rpc_call_truncate(void *userdata, const char *path, off_t newsize) {
 }
 
 int rpc_call_fsync(void *userdata, const char *path,
-                     struct fuse_file_info *fi) {
-    // Force a flush of file data.
+                     struct fuse_file_info *fi, int datasync,
+                     off_t range_start, off_t range_len) {
+    // The stripes of a striped file keep their blocks at the file offsets, so
+    // the range is the same on all of them.
+    struct Stripe_handles *handles = stripe_handles(userdata, path, fi);
+    if (handles != nullptr) {
+        return for_each_open_stripe(userdata, path, handles, fi,
+                                    [&](uint32_t k, struct fuse_file_info *stripe_fi) {
+            return rpc_call_fsync(userdata, path, stripe_fi, datasync,
+                                  range_start, range_len);
+        });
+    }
+    // Force a flush of file data. If datasync is set only the data needs to
+    // be durable, and [range_start, range_start + range_len) is the part of
+    // the file that was written since the last sync (range_len 0 if unknown).
 
-    int ARG_COUNT = 3;
+    int ARG_COUNT = 6;
 
     // Allocate space for the output arguments.
     void **args = new void*[ARG_COUNT];
@@ -747,17 +1622,29 @@ int rpc_call_fsync(void *userdata, const char *path,
             (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
     args[1] = (void *)fi;
 
-    //retcode
-    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
-    int return_code;
-    args[2] = (int *)&return_code;
+    //datasync
+    arg_types[2] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[2] = (int *)&datasync;
 
-    arg_types[3] = 0;
+    //range start
+    arg_types[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[3] = (long *)&range_start;
 
-    int rpc_ret = rpcCall((char *)"fsync", arg_types, args);
+    //range length
+    arg_types[4] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+    args[4] = (long *)&range_len;
 
-    // HANDLE THE RETURN
-    // The integer value watdfs_cli_getattr will return.
+    //retcode
+    arg_types[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
+    int return_code;
+    args[5] = (int *)&return_code;
+
+    arg_types[6] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "fsync", arg_types, args);
+
+    // HANDLE THE RETURN
+    // The integer value watdfs_cli_getattr will return.
     int fxn_ret = 0;
     if (rpc_ret < 0) {
         DLOG("fsync rpc failed with error '%d'", rpc_ret);
@@ -792,6 +1679,19 @@ int rpc_call_fsync(void *userdata, const char *path,
 int rpc_call_utimensat(void *userdata, const char *path,
                          const struct timespec ts[2]) {
     // Change file access and modification times.
+    const struct stripe_layout *layout = striped_layout(userdata, path);
+    if (layout != nullptr) {
+        return for_each_stripe(userdata, layout, layout->width, [&](uint32_t k) {
+            return rpc_call_utimensat(userdata, path, ts);
+        });
+    }
+    if (replicated(userdata, path)) {
+        std::string p = path;
+        struct timespec times[2] = {ts[0], ts[1]};
+        return replicate(userdata, path, [=]() {
+            return rpc_call_utimensat(userdata, p.c_str(), times);
+        });
+    }
     int ARG_COUNT = 3;
 
     // Allocate space for the output arguments.
@@ -801,66 +1701,1439 @@ int rpc_call_utimensat(void *userdata, const char *path,
     // array element.
     int arg_types[ARG_COUNT + 1];
 
-    // The path has string length (strlen) + 1 (for the null character).
-    int pathlen = strlen(path) + 1;
+    // The path has string length (strlen) + 1 (for the null character).
+    int pathlen = strlen(path) + 1;
+
+    // Fill in the arguments
+    // The first argument is the path, it is an input only argument, and a char
+    // array. The length of the array is the length of the path.
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    // For arrays the argument is the array pointer, not a pointer to a pointer.
+    args[0] = (void *)path;
+
+    //ts
+    arg_types[1] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint)(2*sizeof(struct timespec));
+
+    //struct timespec sub = ts[2];
+    //const struct timespec *ptr = &ts[2];
+    args[1] = (void *) ts;
+
+    //retcode
+    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
+    int return_code;
+    args[2] = (int *)&return_code;
+
+    arg_types[3] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "utimensat", arg_types, args);
+
+    // HANDLE THE RETURN
+    // The integer value watdfs_cli_getattr will return.
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("utimensat rpc failed with error '%d'", rpc_ret);
+        // Something went wrong with the rpcCall, return a sensible return
+        // value. In this case lets return, -EINVAL
+        fxn_ret = -EINVAL;
+    } else {
+        // Our RPC call succeeded. However, it's possible that the return code
+        // from the server is not 0, that is it may be -errno. Therefore, we
+        // should set our function return value to the retcode from the server.
+
+        // TODO: set the function return value to the return code from the server.
+        fxn_ret = return_code;
+    }
+
+    /*if (fxn_ret < 0) {
+        // If the return code of watdfs_cli_getattr is negative (an error), then
+        // we need to make sure that the stat structure is filled with 0s. Otherwise,
+        // FUSE will be confused by the contradicting return values.
+        memset(statbuf, 0, sizeof(struct stat));
+    }*/
+
+    // Clean up the memory we have allocated.
+    delete []args;
+
+    // Finally return the value we got from the server.
+    return fxn_ret;
+    //return -ENOSYS;
+}
+
+// Shared by the staged upload calls, which all pass the path, a
+// fuse_file_info and optionally the timestamps.
+static int rpc_call_stage(void *userdata, const char *name, const char *path,
+                          struct fuse_file_info *fi, bool fi_output,
+                          const struct timespec *ts) {
+    int ARG_COUNT = ts != nullptr ? 4 : 3;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+
+    //fi
+    arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                   sizeof(struct fuse_file_info);
+    if (fi_output) arg_types[1] |= (1u << ARG_OUTPUT);
+    args[1] = (void *)fi;
+
+    int i = 2;
+    //ts
+    if (ts != nullptr) {
+        arg_types[i] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                       (uint)(2*sizeof(struct timespec));
+        args[i] = (void *)ts;
+        i++;
+    }
+
+    //retcode
+    arg_types[i] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    int return_code;
+    args[i] = (int *)&return_code;
+    arg_types[i + 1] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, name, arg_types, args);
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("%s rpc failed with error '%d'", name, rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = return_code;
+    }
+
+    delete []args;
+    return fxn_ret;
+}
+
+// Create a staging file for a whole-file upload. fi->fh is set to its server
+// descriptor, to be used with rpc_call_write.
+int rpc_call_upload_begin(void *userdata, const char *path,
+                          struct fuse_file_info *fi) {
+    return rpc_call_stage(userdata, "upload_begin", path, fi, true, nullptr);
+}
+
+// Make the staging file durable, apply ts to it, and atomically rename it
+// over the server file.
+int rpc_call_upload_commit(void *userdata, const char *path,
+                           struct fuse_file_info *fi,
+                           const struct timespec ts[2]) {
+    return rpc_call_stage(userdata, "upload_commit", path, fi, false, ts);
+}
+
+// Throw the staging file away, leaving the server file untouched.
+int rpc_call_upload_abort(void *userdata, const char *path,
+                          struct fuse_file_info *fi) {
+    return rpc_call_stage(userdata, "upload_abort", path, fi, false, nullptr);
+}
+
+// Ask which of count chunk IDs (packed in ids) the server holding path has.
+// present gets one byte per ID. Returns the number the server has or -errno.
+int rpc_call_chunks_has(void *userdata, const char *path, const unsigned char *ids,
+                        int count, char *present) {
+    int ARG_COUNT = 4;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+
+    //ids
+    arg_types[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                   (uint)(count * SHA256_DIGEST_LEN);
+    args[0] = (void *)ids;
+    //count
+    arg_types[1] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[1] = (int *)&count;
+    //present
+    arg_types[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) count;
+    args[2] = (void *)present;
+    //retcode
+    int return_code;
+    arg_types[3] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[3] = (int *)&return_code;
+    arg_types[4] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "chunks_has", arg_types, args);
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("chunks_has rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = return_code;
+    }
+
+    delete []args;
+    return fxn_ret;
+}
+
+// Have the server copy count chunks it already has into the file open as fi
+// (a staging file). placed gets one byte per chunk. Returns the bytes placed
+// or -errno.
+int rpc_call_write_chunks(void *userdata, const char *path,
+                          const struct chunk_ref *refs, int count,
+                          struct fuse_file_info *fi, char *placed) {
+    int ARG_COUNT = 6;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+    //refs
+    arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                   (uint)(count * sizeof(struct chunk_ref));
+    args[1] = (void *)refs;
+    //count
+    arg_types[2] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+    args[2] = (int *)&count;
+    //fi
+    arg_types[3] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
+    args[3] = (void *)fi;
+    //placed
+    arg_types[4] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) count;
+    args[4] = (void *)placed;
+    //retcode
+    int return_code;
+    arg_types[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[5] = (int *)&return_code;
+    arg_types[6] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "write_chunks", arg_types, args);
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("write_chunks rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = return_code;
+    }
+
+    delete []args;
+    return fxn_ret;
+}
+
+// Fetch the layout record of a file (see stripe.h) from the server holding it.
+int rpc_call_layout_get(void *userdata, const char *path,
+                        struct stripe_layout *layout) {
+    int ARG_COUNT = 3;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+    //layout
+    arg_types[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                   (uint) STRIPE_LAYOUT_LEN;
+    args[1] = (void *)layout;
+    //retcode
+    int return_code;
+    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[2] = (int *)&return_code;
+    arg_types[3] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "layout_get", arg_types, args);
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("layout_get rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = return_code;
+    }
+
+    delete []args;
+    return fxn_ret;
+}
+
+// Store the layout record of a file on the server holding it.
+int rpc_call_layout_set(void *userdata, const char *path,
+                        const struct stripe_layout *layout) {
+    int ARG_COUNT = 3;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
+    int pathlen = strlen(path) + 1;
+
+    //path
+    arg_types[0] =
+            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
+    args[0] = (void *)path;
+    //layout
+    arg_types[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) |
+                   (uint) STRIPE_LAYOUT_LEN;
+    args[1] = (void *)layout;
+    //retcode
+    int return_code;
+    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+    args[2] = (int *)&return_code;
+    arg_types[3] = 0;
+
+    int rpc_ret = client_rpc_call(userdata, path, "layout_set", arg_types, args);
+    int fxn_ret = 0;
+    if (rpc_ret < 0) {
+        DLOG("layout_set rpc failed with error '%d'", rpc_ret);
+        fxn_ret = -EINVAL;
+    } else {
+        fxn_ret = return_code;
+    }
+
+    delete []args;
+    return fxn_ret;
+}
+
+// ASYNCHRONOUS CALLS
+// Each rpc_call_*_async starts the matching rpc_call_* on an rpc_async worker
+// (see rpc_async.h) and returns right away; the future gives what it
+// returned. The call goes wherever the caller's own call would have gone.
+// path, buffers and fi must stay valid until the future is ready.
+
+static std::future<int> client_async(std::function<int()> call) {
+    struct rpc_conn *conn = current_conn;
+    uint64_t request = trace_request();
+    return rpc_async([conn, request, call]() {
+        struct rpc_conn *saved = current_conn;
+        uint64_t saved_request = trace_request();
+        current_conn = conn;
+        trace_set_request(request);
+        int ret_code = call();
+        current_conn = saved;
+        trace_set_request(saved_request);
+        return ret_code;
+    });
+}
+
+std::future<int> rpc_call_getattr_async(void *userdata, const char *path,
+                                        struct stat *statbuf) {
+    return client_async([=]() { return rpc_call_getattr(userdata, path, statbuf); });
+}
+
+std::future<int> rpc_call_open_async(void *userdata, const char *path,
+                                     struct fuse_file_info *fi) {
+    return client_async([=]() { return rpc_call_open(userdata, path, fi); });
+}
+
+std::future<int> rpc_call_read_async(void *userdata, const char *path, char *buf,
+                                     size_t size, off_t offset,
+                                     struct fuse_file_info *fi) {
+    return client_async([=]() {
+        return rpc_call_read(userdata, path, buf, size, offset, fi);
+    });
+}
+
+// STRIPED FILES
+// The rpc_call_* functions hand calls on striped files (see stripe.h) to the
+// functions below, which repeat them on every stripe server with the
+// thread's RPCs sent to that server. While a thread is sending to a chosen
+// server the calls are not striped again.
+
+static const struct stripe_layout *striped_layout(void *userdata, const char *path) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (info == nullptr || info->ring == nullptr || current_conn != nullptr) {
+        return nullptr;
+    }
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&info->maps_lock);
+    auto it = info->layouts.find(path);
+    bool known = it != info->layouts.end();
+    auto miss = info->layout_misses.find(path);
+    bool missed = miss != info->layout_misses.end() &&
+                  now - miss->second < info->cacheInterval;
+    pthread_mutex_unlock(&info->maps_lock);
+    if (missed) {
+        return nullptr;
+    }
+    if (!known) {
+        struct stripe_layout layout;
+        int ret_code = rpc_call_layout_get(userdata, path, &layout);
+        pthread_mutex_lock(&info->maps_lock);
+        if (ret_code < 0) {
+            // Most likely the file does not exist yet. Remember that for a
+            // while, rather than asking on every call until it does.
+            info->layout_misses[path] = now;
+            pthread_mutex_unlock(&info->maps_lock);
+            return nullptr;
+        }
+        info->layout_misses.erase(path);
+        it = info->layouts.insert({std::string(path), layout}).first;
+        pthread_mutex_unlock(&info->maps_lock);
+    }
+    return stripe_is_striped(&it->second) ? &it->second : nullptr;
+}
+
+static struct Stripe_handles *stripe_handles(void *userdata, const char *path,
+                                             struct fuse_file_info *fi) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (info == nullptr || current_conn != nullptr) {
+        return nullptr;
+    }
+    pthread_mutex_lock(&info->maps_lock);
+    auto it = info->stripe_fhs.find({std::string(path), fi->fh});
+    struct Stripe_handles *handles = it == info->stripe_fhs.end() ? nullptr : &it->second;
+    pthread_mutex_unlock(&info->maps_lock);
+    return handles;
+}
+
+// The server of stripe k of a file with layout, or nullptr if this client
+// was not given it.
+static struct Server_endpoint *stripe_server(void *userdata,
+                                             const struct stripe_layout *layout, uint32_t k) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    for (struct Server_endpoint &server : info->servers) {
+        if (server.id == layout->servers[k]) {
+            return &server;
+        }
+    }
+    DLOG("stripe %u is on a server this client does not know", k);
+    return nullptr;
+}
+
+// Run call(k) for the first width stripes k of a file with layout in order,
+// on the stripe's server. Returns the first error.
+template <class F>
+static int for_each_stripe(void *userdata, const struct stripe_layout *layout,
+                           uint32_t width, F call) {
+    int fxn_ret = 0;
+    for (uint32_t k = 0; k < width; k++) {
+        struct Server_endpoint *server = stripe_server(userdata, layout, k);
+        int ret_code = -EHOSTUNREACH;
+        if (server != nullptr) {
+            current_conn = server->conn;
+            ret_code = call(k);
+        }
+        if (ret_code < 0 && fxn_ret == 0) fxn_ret = ret_code;
+    }
+    current_conn = nullptr;
+    return fxn_ret;
+}
+
+// The stripe files only hold their own blocks, so the file is as large, and
+// as recently modified, as the largest and latest of them.
+// All stripe servers are asked at once.
+static int stripe_getattr(void *userdata, const char *path,
+                          const struct stripe_layout *layout, struct stat *statbuf) {
+    std::vector<struct stat> stats(layout->width);
+    std::vector<std::future<int>> pending;
+    int missing = for_each_stripe(userdata, layout, layout->width, [&](uint32_t k) {
+        pending.push_back(rpc_call_getattr_async(userdata, path, &stats[k]));
+        return 0;
+    });
+    if (missing < 0) {
+        for (std::future<int> &stripe : pending) {
+            stripe.wait();
+        }
+        return missing;
+    }
+    int fxn_ret = pending[0].get();
+    *statbuf = stats[0];
+    for (uint32_t k = 1; k < layout->width; k++) {
+        if (pending[k].get() == 0 && fxn_ret == 0) {
+            struct stat &stripe_stat = stats[k];
+            statbuf->st_size = std::max(statbuf->st_size, stripe_stat.st_size);
+            if (stripe_stat.st_mtim.tv_sec > statbuf->st_mtim.tv_sec ||
+                (stripe_stat.st_mtim.tv_sec == statbuf->st_mtim.tv_sec &&
+                 stripe_stat.st_mtim.tv_nsec > statbuf->st_mtim.tv_nsec)) {
+                statbuf->st_mtim = stripe_stat.st_mtim;
+            }
+        }
+    }
+    return fxn_ret;
+}
+
+// Whether files created now are striped.
+static bool stripes_new_files(void *userdata) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    return info != nullptr && info->ring != nullptr && current_conn == nullptr &&
+           info->servers.size() >= 2 && stripe_is_striped(&info->new_layout);
+}
+
+// Create the file on every stripe server, then record its layout.
+static int stripe_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    struct stripe_layout layout = info->new_layout;
+    layout.width = std::min(layout.width, (uint32_t)info->servers.size());
+    for (uint32_t k = 0; k < layout.width; k++) {
+        layout.servers[k] = nth_server(userdata, path, k)->id;
+    }
+    int fxn_ret = for_each_stripe(userdata, &layout, layout.width, [&](uint32_t k) {
+        int ret_code = rpc_call_mknod(userdata, path, mode, dev);
+        // A stripe file may be left over from an earlier file of this name.
+        return k > 0 && ret_code == -EEXIST ? 0 : ret_code;
+    });
+    if (fxn_ret == 0) {
+        fxn_ret = rpc_call_layout_set(userdata, path, &layout);
+    }
+    if (fxn_ret == 0) {
+        pthread_mutex_lock(&info->maps_lock);
+        info->layouts[path] = layout;
+        info->layout_misses.erase(path);
+        pthread_mutex_unlock(&info->maps_lock);
+    }
+    return fxn_ret;
+}
+
+// Open every stripe file. fi gets the descriptor of stripe 0, the others are
+// remembered under it.
+static int stripe_open(void *userdata, const char *path,
+                       const struct stripe_layout *layout, struct fuse_file_info *fi) {
+    struct Stripe_handles handles;
+    handles.layout = *layout;
+    struct fuse_file_info stripe_fi = *fi;
+    std::vector<bool> opened(layout->width, false);
+    handles.fhs.resize(layout->width);
+    int fxn_ret = for_each_stripe(userdata, layout, layout->width, [&](uint32_t k) {
+        stripe_fi = *fi;
+        int ret_code = rpc_call_open(userdata, path, &stripe_fi);
+        if (ret_code == 0) {
+            handles.fhs[k] = stripe_fi.fh;
+            opened[k] = true;
+        }
+        return ret_code;
+    });
+    if (fxn_ret < 0) {
+        // Close whatever did open.
+        for_each_stripe(userdata, layout, layout->width, [&](uint32_t k) {
+            stripe_fi.fh = handles.fhs[k];
+            return opened[k] ? rpc_call_release(userdata, path, &stripe_fi) : 0;
+        });
+        return fxn_ret;
+    }
+    fi->fh = handles.fhs[0];
+    struct Client_information *info = (struct Client_information *)userdata;
+    pthread_mutex_lock(&info->maps_lock);
+    info->stripe_fhs[{std::string(path), fi->fh}] = handles;
+    pthread_mutex_unlock(&info->maps_lock);
+    return 0;
+}
+
+// Run call(k, stripe_fi) on every stripe of the open file fi, with stripe_fi
+// carrying the stripe's descriptor.
+template <class F>
+static int for_each_open_stripe(void *userdata, const char *path,
+                                struct Stripe_handles *handles,
+                                struct fuse_file_info *fi, F call) {
+    struct fuse_file_info stripe_fi = *fi;
+    return for_each_stripe(userdata, &handles->layout, handles->fhs.size(), [&](uint32_t k) {
+        stripe_fi.fh = handles->fhs[k];
+        return call(k, &stripe_fi);
+    });
+}
+
+static int stripe_release(void *userdata, const char *path,
+                          struct Stripe_handles *handles, struct fuse_file_info *fi) {
+    int fxn_ret = for_each_open_stripe(userdata, path, handles, fi,
+                                       [&](uint32_t k, struct fuse_file_info *stripe_fi) {
+        return rpc_call_release(userdata, path, stripe_fi);
+    });
+    struct Client_information *info = (struct Client_information *)userdata;
+    pthread_mutex_lock(&info->maps_lock);
+    info->stripe_fhs.erase({std::string(path), fi->fh});
+    pthread_mutex_unlock(&info->maps_lock);
+    return fxn_ret;
+}
+
+// Read or write the size bytes at offset of an open striped file, with every
+// stripe server involved working on its blocks in parallel. Returns the
+// bytes transferred or -errno; a read stops at the first short block.
+static int stripe_io(void *userdata, const char *path, struct Stripe_handles *handles,
+                     char *buf, size_t size, off_t offset,
+                     struct fuse_file_info *fi, bool is_write) {
+    const struct stripe_layout *layout = &handles->layout;
+    std::vector<struct stripe_extent> extents(size / layout->block_size + 2);
+    extents.resize(stripe_split(layout, offset, size, extents.data(), extents.size()));
+    std::vector<int> results(extents.size(), 0);
+
+    std::vector<std::vector<size_t>> work(layout->width);
+    for (size_t i = 0; i < extents.size(); i++) {
+        work[extents[i].stripe].push_back(i);
+    }
+    std::vector<struct Server_endpoint *> servers(layout->width);
+    for (uint32_t k = 0; k < layout->width; k++) {
+        servers[k] = stripe_server(userdata, layout, k);
+        if (servers[k] == nullptr && !work[k].empty()) {
+            return -EHOSTUNREACH;
+        }
+    }
+    uint64_t request = trace_request();
+    auto worker = [&](uint32_t k) {
+        current_conn = servers[k]->conn;
+        trace_set_request(request);
+        struct fuse_file_info stripe_fi = *fi;
+        stripe_fi.fh = handles->fhs[k];
+        for (size_t i : work[k]) {
+            char *data = buf + (extents[i].offset - offset);
+            if (is_write) {
+                results[i] = rpc_call_write(userdata, path, data, extents[i].len,
+                                            extents[i].offset, &stripe_fi);
+            } else {
+                results[i] = rpc_call_read(userdata, path, data, extents[i].len,
+                                           extents[i].offset, &stripe_fi);
+            }
+            if (results[i] < 0) break;
+        }
+        current_conn = nullptr;
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t k = 0; k < layout->width; k++) {
+        if (!work[k].empty()) {
+            threads.emplace_back(worker, k);
+        }
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < extents.size(); i++) {
+        if (results[i] < 0) {
+            return total > 0 && !is_write ? (int)total : results[i];
+        }
+        total += results[i];
+        if ((uint64_t)results[i] < extents[i].len) {
+            if (is_write) return -EIO;
+            break;
+        }
+    }
+    return total;
+}
+
+// REPLICATION
+// With WATDFS_REPLICAS=r, every file that is not striped is kept on r
+// servers: its home on the ring and the r-1 servers after it. Changes go to
+// all of them and return once WATDFS_WRITE_QUORUM have applied them; every
+// replica has a queue that applies its changes in order, so a replica that
+// lags behind still ends up with the same contents. A change carries the data
+// it writes, copied from the cache file when it is queued, so a replica that
+// applies it late still writes what the others did.
+//
+// A replica that failed a change is stale until a whole-file upload replaces
+// its copy. The client numbers its changes to every file and remembers which
+// replica applied which, so downloads only read from replicas that have the
+// last committed change. Of a file it has no record of, the client asks a
+// read quorum (enough replicas to include one of any write quorum) for the
+// modification time and reads from one with the newest. Among those it picks
+// the replica with the least work in flight, and moves on to the next one
+// when a replica cannot be reached.
+
+// The default number of copies of a file.
+#define REPLICAS 1
+
+// One change sent to all the replicas of a file.
+struct Replicated_write {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cv;
+    int succeeded;
+    int failed;
+    int first_error;
+};
+
+struct Replica_job {
+    std::function<int()> call;
+    std::shared_ptr<struct Replicated_write> write;
+    // The request the change is part of (see trace.h).
+    uint64_t request;
+    // The file, which of its replicas the queue's server is, and the number
+    // of the change. A change that replaces the whole file brings a stale
+    // replica up to date.
+    std::string path;
+    int replica;
+    uint64_t version;
+    bool replaces;
+};
+
+// The changes waiting for one replica, applied in order by its own thread.
+struct Replica_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    std::deque<struct Replica_job> jobs;
+    bool stopping;
+    std::thread worker;
+};
+
+static bool replicated(void *userdata, const char *path) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    return info != nullptr && info->ring != nullptr && info->replicas > 1 &&
+           current_conn == nullptr && striped_layout(userdata, path) == nullptr;
+}
+
+// Record that a replica applied the change of job. Once every replica has
+// every change, the file needs no record.
+static void applied_change(struct Client_information *info, const struct Replica_job &job) {
+    pthread_mutex_lock(&info->maps_lock);
+    auto found = info->replica_versions.find(job.path);
+    if (found != info->replica_versions.end()) {
+        struct Replica_versions &versions = found->second;
+        uint64_t &applied = versions.applied[job.replica];
+        if (job.replaces || applied == job.version - 1) {
+            applied = job.version;
+        }
+        if (std::all_of(versions.applied.begin(), versions.applied.end(),
+                        [&](uint64_t v) { return v == versions.queued; })) {
+            info->replica_versions.erase(found);
+        }
+    }
+    pthread_mutex_unlock(&info->maps_lock);
+}
+
+static void replica_worker(struct Client_information *info, struct Server_endpoint *server) {
+    struct Replica_queue *queue = server->queue;
+    current_conn = server->conn;
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (queue->jobs.empty() && !queue->stopping) {
+            pthread_cond_wait(&queue->work_cv, &queue->lock);
+        }
+        if (queue->jobs.empty()) {
+            break;
+        }
+        struct Replica_job job = queue->jobs.front();
+        queue->jobs.pop_front();
+        pthread_mutex_unlock(&queue->lock);
+
+        // Once a replica is down its changes fail right away, instead of
+        // holding up the ones behind them, until it is tried again.
+        trace_set_request(job.request);
+        int ret_code = server_usable(server) ? job.call() : -EHOSTDOWN;
+        trace_set_request(0);
+        __atomic_sub_fetch(&server->outstanding, 1, __ATOMIC_RELAXED);
+        if (ret_code >= 0) {
+            applied_change(info, job);
+        }
+
+        struct Replicated_write *write = job.write.get();
+        pthread_mutex_lock(&write->lock);
+        if (ret_code < 0) {
+            if (write->failed++ == 0) write->first_error = ret_code;
+        } else {
+            write->succeeded++;
+        }
+        pthread_cond_broadcast(&write->done_cv);
+        pthread_mutex_unlock(&write->lock);
+
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    current_conn = nullptr;
+}
+
+// Queue call on every replica of path, to run with the thread's RPCs going
+// to that replica, and wait for the write quorum. call must not refer to
+// anything of the caller's, as it may run after replicate returns. replaces
+// says call rewrites the whole file. Returns 0, or the error of a replica if
+// the quorum cannot be reached.
+static int replicate(void *userdata, const char *path, std::function<int()> call,
+                     bool replaces) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    int replicas = std::min((size_t)info->replicas, info->servers.size());
+    int quorum = std::min(info->write_quorum, replicas);
+
+    std::shared_ptr<struct Replicated_write> write = std::make_shared<struct Replicated_write>();
+    pthread_mutex_init(&write->lock, nullptr);
+    pthread_cond_init(&write->done_cv, nullptr);
+    write->succeeded = 0;
+    write->failed = 0;
+    write->first_error = 0;
+
+    // The changes are numbered and queued under maps_lock, so every queue
+    // holds the changes to a file in the order of their numbers.
+    pthread_mutex_lock(&info->maps_lock);
+    struct Replica_versions &versions = info->replica_versions[path];
+    if (versions.applied.empty()) {
+        versions.queued = versions.committed = 0;
+        versions.applied.assign(replicas, 0);
+    }
+    uint64_t version = ++versions.queued;
+    for (int i = 0; i < replicas; i++) {
+        struct Server_endpoint *server = nth_server(userdata, path, i);
+        struct Replica_queue *queue = server->queue;
+        __atomic_add_fetch(&server->outstanding, 1, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&queue->lock);
+        queue->jobs.push_back({call, write, trace_request(), path, i, version, replaces});
+        pthread_cond_signal(&queue->work_cv);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    pthread_mutex_unlock(&info->maps_lock);
+
+    pthread_mutex_lock(&write->lock);
+    while (write->succeeded < quorum && write->failed <= replicas - quorum) {
+        pthread_cond_wait(&write->done_cv, &write->lock);
+    }
+    int fxn_ret = write->succeeded >= quorum ? 0 : write->first_error;
+    pthread_mutex_unlock(&write->lock);
+
+    if (fxn_ret == 0) {
+        pthread_mutex_lock(&info->maps_lock);
+        auto found = info->replica_versions.find(path);
+        if (found != info->replica_versions.end()) {
+            found->second.committed = std::max(found->second.committed, version);
+        }
+        pthread_mutex_unlock(&info->maps_lock);
+    }
+    return fxn_ret;
+}
+
+// Whether replica k of path has the last committed change to it, as far as
+// this client knows.
+static bool replica_current(struct Client_information *info, const char *path, int k) {
+    pthread_mutex_lock(&info->maps_lock);
+    auto found = info->replica_versions.find(path);
+    bool current = found == info->replica_versions.end() ||
+                   found->second.applied[k] >= found->second.committed;
+    pthread_mutex_unlock(&info->maps_lock);
+    return current;
+}
+
+// Start the replica queues, when there are replicas.
+static void start_replica_queues(struct Client_information *info) {
+    if (info->ring == nullptr || info->replicas <= 1) {
+        return;
+    }
+    for (struct Server_endpoint &server : info->servers) {
+        server.queue = new struct Replica_queue;
+        pthread_mutex_init(&server.queue->lock, nullptr);
+        pthread_cond_init(&server.queue->work_cv, nullptr);
+        server.queue->stopping = false;
+        server.queue->worker = std::thread(replica_worker, info, &server);
+    }
+}
+
+// Apply every queued change, then stop the queues.
+static void stop_replica_queues(struct Client_information *info) {
+    for (struct Server_endpoint &server : info->servers) {
+        struct Replica_queue *queue = server.queue;
+        if (queue == nullptr) {
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        queue->stopping = true;
+        pthread_cond_signal(&queue->work_cv);
+        pthread_mutex_unlock(&queue->lock);
+        queue->worker.join();
+        delete queue;
+        server.queue = nullptr;
+    }
+}
+
+// Keep the servers in order that hold the newest copy of path: for a file
+// this client changed, those that applied its last committed change;
+// otherwise those of a read quorum that report the newest modification time.
+static void keep_newest(struct Client_information *info, const char *path,
+                        std::vector<std::pair<struct Server_endpoint *, int>> &order) {
+    pthread_mutex_lock(&info->maps_lock);
+    bool known = info->replica_versions.count(path) > 0;
+    pthread_mutex_unlock(&info->maps_lock);
+    if (known) {
+        order.erase(std::remove_if(order.begin(), order.end(), [&](const auto &replica) {
+            return !replica_current(info, path, replica.second);
+        }), order.end());
+        return;
+    }
+    int replicas = std::min((size_t)info->replicas, info->servers.size());
+    size_t read_quorum = replicas - std::min(info->write_quorum, replicas) + 1;
+    if (read_quorum <= 1) {
+        return;
+    }
+    // Ask replicas, the least busy first, until read_quorum of them answered.
+    std::vector<std::pair<struct Server_endpoint *, struct timespec>> answers;
+    for (const auto &replica : order) {
+        if (answers.size() == read_quorum) {
+            break;
+        }
+        struct stat statbuf;
+        current_conn = replica.first->conn;
+        int ret_code = rpc_call_getattr((void *)info, path, &statbuf);
+        current_conn = nullptr;
+        if (ret_code == 0) {
+            answers.push_back({replica.first, statbuf.st_mtim});
+        } else if (server_usable(replica.first)) {
+            // The file is missing there, which counts as the oldest copy.
+            answers.push_back({replica.first, {0, 0}});
+        }
+    }
+    struct timespec newest = {0, 0};
+    for (const auto &answer : answers) {
+        if (answer.second.tv_sec > newest.tv_sec ||
+            (answer.second.tv_sec == newest.tv_sec && answer.second.tv_nsec > newest.tv_nsec)) {
+            newest = answer.second;
+        }
+    }
+    order.erase(std::remove_if(order.begin(), order.end(), [&](const auto &replica) {
+        for (const auto &answer : answers) {
+            if (answer.first == replica.first) {
+                return answer.second.tv_sec != newest.tv_sec ||
+                       answer.second.tv_nsec != newest.tv_nsec;
+            }
+        }
+        return true;
+    }), order.end());
+}
+
+// Run call against the replicas of path that have its newest copy, the least
+// busy first, until one can be reached. Returns what call returned on that
+// replica.
+static int on_newest_replica(void *userdata, const char *path, std::function<int()> call) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    int replicas = std::min((size_t)info->replicas, info->servers.size());
+    std::vector<std::pair<struct Server_endpoint *, int>> order;
+    for (int i = 0; i < replicas; i++) {
+        struct Server_endpoint *server = nth_server(userdata, path, i);
+        if (server_usable(server)) {
+            order.push_back({server, i});
+        }
+    }
+    std::stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) {
+        return __atomic_load_n(&a.first->outstanding, __ATOMIC_RELAXED) <
+               __atomic_load_n(&b.first->outstanding, __ATOMIC_RELAXED);
+    });
+    keep_newest(info, path, order);
+    int fxn_ret = -EHOSTDOWN;
+    for (const auto &replica : order) {
+        struct Server_endpoint *server = replica.first;
+        __atomic_add_fetch(&server->outstanding, 1, __ATOMIC_RELAXED);
+        current_conn = server->conn;
+        fxn_ret = call();
+        current_conn = nullptr;
+        __atomic_sub_fetch(&server->outstanding, 1, __ATOMIC_RELAXED);
+        if (fxn_ret >= 0 || !__atomic_load_n(&server->down, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    return fxn_ret;
+}
+
+// HEDGED READS
+// A read that has not returned within the recent 95th percentile of reads of
+// its size is sent a second time: to another replica of the file when it has
+// one (opening the file there), otherwise over another connection to the
+// same server, which shares the file descriptor. The first attempt runs on
+// the caller's thread, straight into its buffer; the hedge is sent by a timer
+// thread through the rpc_async pool, into a buffer of its own. A blocking
+// call cannot be called back, so the caller keeps the answer of its own
+// attempt when it gets one, and takes the hedge's when that attempt failed:
+// a server that stalls and then drops the connection costs the hedge delay
+// instead of a second full read. A hedge that is no longer needed is not
+// sent; one already in flight has its answer dropped. WATDFS_HEDGE=0 turns
+// this off.
+
+// Latencies are kept per size class: under 64 KiB, then doubling up to 4 MiB
+// and over.
+#define HEDGE_SIZE_CLASSES 8
+// The latencies remembered per class, and how many must be known before
+// reads of that class are hedged.
+#define HEDGE_WINDOW 128
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_PERCENTILE 95
+// Never hedge sooner than this many microseconds.
+#define HEDGE_MIN_DELAY_US 1000
+
+struct Hedged_read;
+// Reads by the now_us() their hedge falls due at.
+typedef std::multimap<long, std::shared_ptr<struct Hedged_read>> Due_reads;
+
+// One read and its hedge.
+struct Hedged_read {
+    pthread_mutex_t lock;
+    pthread_cond_t done_cv;
+    // What the hedge reads, and where.
+    void *userdata;
+    std::string path;
+    size_t size;
+    off_t offset;
+    struct fuse_file_info fi;
+    uint64_t request;
+    struct rpc_conn *conn;
+    bool on_replica;
+    // Its place in Read_hedging::due while queued, under the hedging lock.
+    Due_reads::iterator due_at;
+    bool queued;
+    // Set once the caller's attempt returned; a hedge not sent by then is not.
+    bool finished;
+    bool hedge_sent;
+    bool hedge_done;
+    int hedge_result;
+    // The hedge's answer.
+    std::vector<char> scratch;
+};
+
+struct Read_hedging {
+    pthread_mutex_t lock;
+    // Signalled when the last hedge in flight finished.
+    pthread_cond_t idle_cv;
+    int in_flight;
+    // The reads whose hedge is not due yet, and the timer thread sending them
+    // when it is. due_cv runs on CLOCK_MONOTONIC, like now_us().
+    Due_reads due;
+    pthread_cond_t due_cv;
+    pthread_t timer;
+    bool stopping;
+    // The last HEDGE_WINDOW latencies per class in microseconds, a ring.
+    long latencies[HEDGE_SIZE_CLASSES][HEDGE_WINDOW];
+    int count[HEDGE_SIZE_CLASSES];
+    int next[HEDGE_SIZE_CLASSES];
+    // To spread hedges over the extra connections.
+    unsigned next_stream;
+};
+
+// Set while a thread reads for a hedged read, so its read is not hedged again.
+static thread_local bool in_hedged_read = false;
+
+static int size_class(size_t size) {
+    int c = 0;
+    for (size_t s = size >> 16; s > 0 && c < HEDGE_SIZE_CLASSES - 1; s >>= 1) {
+        c++;
+    }
+    return c;
+}
+
+static long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void record_latency(struct Read_hedging *hedging, size_t size, long us) {
+    int c = size_class(size);
+    pthread_mutex_lock(&hedging->lock);
+    hedging->latencies[c][hedging->next[c]] = us;
+    hedging->next[c] = (hedging->next[c] + 1) % HEDGE_WINDOW;
+    hedging->count[c] = std::min(hedging->count[c] + 1, HEDGE_WINDOW);
+    pthread_mutex_unlock(&hedging->lock);
+}
+
+// How long to wait before hedging a read of size bytes, or -1 if too few
+// reads of that size have been seen to tell.
+static long hedge_delay(struct Read_hedging *hedging, size_t size) {
+    int c = size_class(size);
+    pthread_mutex_lock(&hedging->lock);
+    std::vector<long> recent(hedging->latencies[c], hedging->latencies[c] + hedging->count[c]);
+    pthread_mutex_unlock(&hedging->lock);
+    if (recent.size() < HEDGE_MIN_SAMPLES) {
+        return -1;
+    }
+    size_t k = recent.size() * HEDGE_PERCENTILE / 100;
+    std::nth_element(recent.begin(), recent.begin() + k, recent.end());
+    return std::max(recent[k], (long)HEDGE_MIN_DELAY_US);
+}
+
+// The server the calling thread's reads of path go to.
+static struct Server_endpoint *read_server(void *userdata, const char *path) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    if (current_conn == nullptr) {
+        return server_of(userdata, path);
+    }
+    for (struct Server_endpoint &server : info->servers) {
+        if (server.conn == current_conn ||
+            std::find(server.streams.begin(), server.streams.end(), current_conn) !=
+                server.streams.end()) {
+            return &server;
+        }
+    }
+    return nullptr;
+}
+
+// Where a hedge of the calling thread's read of path goes: the least busy
+// other replica that is up, else another connection to the same server. Sets
+// *on_replica if the file has to be opened there. Returns false if there is
+// nowhere to go. A file in info->layouts as striped has no replicas, and the
+// threads reading its stripes have current_conn set, so it is looked up
+// directly.
+static bool hedge_target(void *userdata, const char *path, struct rpc_conn **conn,
+                         bool *on_replica) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    struct Server_endpoint *owner = read_server(userdata, path);
+    if (owner == nullptr) {
+        return false;
+    }
+    pthread_mutex_lock(&info->maps_lock);
+    auto layout = info->layouts.find(path);
+    bool striped = layout != info->layouts.end() && stripe_is_striped(&layout->second);
+    pthread_mutex_unlock(&info->maps_lock);
+    if (info->ring != nullptr && info->replicas > 1 && !striped) {
+        int replicas = std::min((size_t)info->replicas, info->servers.size());
+        struct Server_endpoint *best = nullptr;
+        bool owner_is_replica = false;
+        for (int i = 0; i < replicas; i++) {
+            struct Server_endpoint *server = nth_server(userdata, path, i);
+            if (server == owner) {
+                owner_is_replica = true;
+            } else if (server_usable(server) && replica_current(info, path, i) &&
+                       (best == nullptr ||
+                        __atomic_load_n(&server->outstanding, __ATOMIC_RELAXED) <
+                            __atomic_load_n(&best->outstanding, __ATOMIC_RELAXED))) {
+                best = server;
+            }
+        }
+        if (owner_is_replica && best != nullptr) {
+            *conn = best->conn;
+            *on_replica = true;
+            return true;
+        }
+    }
+    std::vector<struct rpc_conn *> others;
+    for (struct rpc_conn *stream : owner->streams) {
+        if (stream != current_conn) {
+            others.push_back(stream);
+        }
+    }
+    if (others.empty()) {
+        return false;
+    }
+    unsigned n = __atomic_fetch_add(&info->hedging->next_stream, 1, __ATOMIC_RELAXED);
+    *conn = others[n % others.size()];
+    *on_replica = false;
+    return true;
+}
+
+static bool hedges_reads(void *userdata, const char *path, size_t size) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    struct rpc_conn *conn;
+    bool on_replica;
+    return info != nullptr && info->hedging != nullptr && !in_hedged_read &&
+           size > 0 && hedge_target(userdata, path, &conn, &on_replica);
+}
+
+// Read over conn into buf. On a replica the file is opened there first and
+// released again after, and the read is skipped if read (when given) has
+// finished meanwhile. Returns what rpc_call_read_direct does.
+static int read_attempt(void *userdata, const char *path, char *buf, size_t size,
+                        off_t offset, struct fuse_file_info fi, struct rpc_conn *conn,
+                        bool on_replica, struct Hedged_read *read) {
+    struct Read_hedging *hedging = ((struct Client_information *)userdata)->hedging;
+    struct rpc_conn *caller_conn = current_conn;
+    in_hedged_read = true;
+    current_conn = conn;
+    long start = now_us();
+    int ret_code = 0;
+    if (on_replica) {
+        fi.flags = O_RDONLY;
+        ret_code = rpc_call_open(userdata, path, &fi);
+    }
+    if (ret_code == 0) {
+        if (read != nullptr && __atomic_load_n(&read->finished, __ATOMIC_RELAXED)) {
+            ret_code = -ECANCELED;
+        } else {
+            ret_code = rpc_call_read_direct(userdata, path, buf, size, offset, &fi);
+            if (ret_code >= 0) {
+                record_latency(hedging, size, now_us() - start);
+            }
+        }
+        // Whatever came of the read, the replica's descriptor goes.
+        if (on_replica) {
+            rpc_call_release(userdata, path, &fi);
+        }
+    }
+    current_conn = caller_conn;
+    in_hedged_read = false;
+    return ret_code;
+}
+
+// Run the hedge of read on an rpc_async worker and hand its answer over.
+static int hedge_task(std::shared_ptr<struct Hedged_read> read) {
+    struct Read_hedging *hedging = ((struct Client_information *)read->userdata)->hedging;
+    uint64_t worker_request = trace_request();
+    trace_set_request(read->request);
+    read->scratch.resize(read->size);
+    int ret_code = read_attempt(read->userdata, read->path.c_str(), read->scratch.data(),
+                                read->size, read->offset, read->fi, read->conn,
+                                read->on_replica, read.get());
+    trace_set_request(worker_request);
+
+    pthread_mutex_lock(&read->lock);
+    read->hedge_result = ret_code;
+    read->hedge_done = true;
+    pthread_cond_broadcast(&read->done_cv);
+    pthread_mutex_unlock(&read->lock);
+
+    pthread_mutex_lock(&hedging->lock);
+    if (--hedging->in_flight == 0) {
+        pthread_cond_broadcast(&hedging->idle_cv);
+    }
+    pthread_mutex_unlock(&hedging->lock);
+    return ret_code;
+}
+
+// The timer thread: sends every hedge that falls due to the rpc_async pool,
+// unless its read finished first, until stop_hedging.
+static void *hedge_timer(void *arg) {
+    struct Read_hedging *hedging = (struct Read_hedging *)arg;
+    pthread_mutex_lock(&hedging->lock);
+    while (!hedging->stopping) {
+        if (hedging->due.empty()) {
+            pthread_cond_wait(&hedging->due_cv, &hedging->lock);
+            continue;
+        }
+        long at = hedging->due.begin()->first;
+        if (now_us() < at) {
+            struct timespec ts = {at / 1000000, at % 1000000 * 1000};
+            pthread_cond_timedwait(&hedging->due_cv, &hedging->lock, &ts);
+            continue;
+        }
+        std::shared_ptr<struct Hedged_read> read = hedging->due.begin()->second;
+        hedging->due.erase(hedging->due.begin());
+        read->queued = false;
+        pthread_mutex_lock(&read->lock);
+        bool send = !read->finished;
+        read->hedge_sent = send;
+        pthread_mutex_unlock(&read->lock);
+        if (!send) {
+            continue;
+        }
+        hedging->in_flight++;
+        pthread_mutex_unlock(&hedging->lock);
+        DLOG("hedged_read: %s at %ld not back in time, hedging", read->path.c_str(),
+             (long)read->offset);
+        rpc_async([read] { return hedge_task(read); });
+        pthread_mutex_lock(&hedging->lock);
+    }
+    pthread_mutex_unlock(&hedging->lock);
+    return nullptr;
+}
+
+// Read as rpc_call_read_direct would, on the calling thread, with a hedge
+// sent once the read takes longer than hedge_delay. Returns the caller's
+// answer; if that is an error, the hedge's answer, sending the hedge right
+// away if it was not due yet. Returns the first error if both failed.
+static int hedged_read(void *userdata, const char *path, char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi) {
+    struct Read_hedging *hedging = ((struct Client_information *)userdata)->hedging;
+    long delay = hedge_delay(hedging, size);
+    struct rpc_conn *conn;
+    bool on_replica;
+    if (delay < 0 || !hedge_target(userdata, path, &conn, &on_replica)) {
+        return read_attempt(userdata, path, buf, size, offset, *fi, current_conn, false,
+                            nullptr);
+    }
+
+    std::shared_ptr<struct Hedged_read> read = std::make_shared<struct Hedged_read>();
+    pthread_mutex_init(&read->lock, nullptr);
+    pthread_cond_init(&read->done_cv, nullptr);
+    read->userdata = userdata;
+    read->path = path;
+    read->size = size;
+    read->offset = offset;
+    read->fi = *fi;
+    read->request = trace_request();
+    read->conn = conn;
+    read->on_replica = on_replica;
+    read->finished = false;
+    read->hedge_sent = false;
+    read->hedge_done = false;
+    read->hedge_result = -EIO;
+
+    pthread_mutex_lock(&hedging->lock);
+    read->due_at = hedging->due.emplace(now_us() + delay, read);
+    read->queued = true;
+    pthread_cond_signal(&hedging->due_cv);
+    pthread_mutex_unlock(&hedging->lock);
+
+    int fxn_ret = read_attempt(userdata, path, buf, size, offset, *fi, current_conn, false,
+                               nullptr);
+
+    pthread_mutex_lock(&hedging->lock);
+    if (read->queued) {
+        hedging->due.erase(read->due_at);
+        read->queued = false;
+    }
+    pthread_mutex_unlock(&hedging->lock);
+
+    pthread_mutex_lock(&read->lock);
+    // From here on, a hedge is not sent, and one in flight is dropped unless
+    // the caller's attempt failed.
+    read->finished = true;
+    bool hedged = read->hedge_sent;
+    if (fxn_ret < 0 && hedged) {
+        while (!read->hedge_done) {
+            pthread_cond_wait(&read->done_cv, &read->lock);
+        }
+        if (read->hedge_result >= 0) {
+            memcpy(buf, read->scratch.data(), read->hedge_result);
+            fxn_ret = read->hedge_result;
+        }
+    }
+    pthread_mutex_unlock(&read->lock);
+
+    if (fxn_ret < 0 && !hedged) {
+        DLOG("hedged_read: %s at %ld failed before the hedge was due, hedging", path,
+             (long)offset);
+        int ret_code = read_attempt(userdata, path, buf, size, offset, *fi, conn, on_replica,
+                                    nullptr);
+        if (ret_code >= 0) {
+            fxn_ret = ret_code;
+        }
+    }
+    return fxn_ret;
+}
+
+static void start_hedging(struct Client_information *info) {
+    info->hedging = nullptr;
+    const char *env = getenv("WATDFS_HEDGE");
+    if (env != nullptr && atoi(env) == 0) {
+        return;
+    }
+    struct Read_hedging *hedging = new struct Read_hedging();
+    pthread_mutex_init(&hedging->lock, nullptr);
+    pthread_cond_init(&hedging->idle_cv, nullptr);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hedging->due_cv, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&hedging->timer, nullptr, hedge_timer, hedging) != 0) {
+        DLOG("start_hedging: cannot start the timer thread, reads are not hedged");
+        delete hedging;
+        return;
+    }
+    info->hedging = hedging;
+}
+
+// Stop the timer and wait for the hedges still in flight, whose answers
+// nobody wants anymore.
+static void stop_hedging(struct Client_information *info) {
+    struct Read_hedging *hedging = info->hedging;
+    if (hedging == nullptr) {
+        return;
+    }
+    pthread_mutex_lock(&hedging->lock);
+    hedging->stopping = true;
+    pthread_cond_signal(&hedging->due_cv);
+    pthread_mutex_unlock(&hedging->lock);
+    pthread_join(hedging->timer, nullptr);
+    pthread_mutex_lock(&hedging->lock);
+    while (hedging->in_flight > 0) {
+        pthread_cond_wait(&hedging->idle_cv, &hedging->lock);
+    }
+    pthread_mutex_unlock(&hedging->lock);
+    delete hedging;
+    info->hedging = nullptr;
+}
+
+// WRITE CREDIT
+// When every server grants credit (WATDFS_CAP_CREDIT), the payload bytes of
+// the writes sent to a server may not exceed the window it granted for the
+// current period (see write_credit.h). The threads writing to one server
+// share its window; when it is used up they sleep until the period ends, and
+// the first to wake asks for the next one. A write larger than the whole
+// window goes out alone at the start of a period.
+
+struct Write_credit {
+    pthread_mutex_t lock;
+    // Signalled when the next window arrived.
+    pthread_cond_t granted_cv;
+    // The window of the current period, what is left of it, and when the
+    // period ends (CLOCK_MONOTONIC).
+    long window;
+    long left;
+    long expires_ns;
+    // Whether a thread is asking for the next window.
+    int asking;
+};
 
-    // Fill in the arguments
-    // The first argument is the path, it is an input only argument, and a char
-    // array. The length of the array is the length of the path.
-    arg_types[0] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint) pathlen;
-    // For arrays the argument is the array pointer, not a pointer to a pointer.
-    args[0] = (void *)path;
+// Ask the server of the calling thread for its window of the current period.
+// Returns 0 or -errno.
+static int rpc_call_write_credit(void *userdata, long *window, long *period_left_ns) {
+    int ARG_COUNT = 3;
+    void **args = new void*[ARG_COUNT];
+    int arg_types[ARG_COUNT + 1];
 
-    //ts
-    arg_types[1] =
-            (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | (uint)(2*sizeof(struct timespec));
+    //window
+    arg_types[0] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+    args[0] = (long *)window;
 
-    //struct timespec sub = ts[2];
-    //const struct timespec *ptr = &ts[2];
-    args[1] = (void *) ts;
+    //time left in the period
+    arg_types[1] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+    args[1] = (long *)period_left_ns;
 
     //retcode
-    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);// retcode
+    arg_types[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
     int return_code;
     args[2] = (int *)&return_code;
 
     arg_types[3] = 0;
 
-    int rpc_ret = rpcCall((char *)"utimensat", arg_types, args);
-
-    // HANDLE THE RETURN
-    // The integer value watdfs_cli_getattr will return.
-    int fxn_ret = 0;
+    int rpc_ret = client_rpc_call(userdata, nullptr, "write_credit", arg_types, args);
+    delete []args;
     if (rpc_ret < 0) {
-        DLOG("utimensat rpc failed with error '%d'", rpc_ret);
-        // Something went wrong with the rpcCall, return a sensible return
-        // value. In this case lets return, -EINVAL
-        fxn_ret = -EINVAL;
-    } else {
-        // Our RPC call succeeded. However, it's possible that the return code
-        // from the server is not 0, that is it may be -errno. Therefore, we
-        // should set our function return value to the retcode from the server.
-
-        // TODO: set the function return value to the return code from the server.
-        fxn_ret = return_code;
+        DLOG("write_credit rpc failed with error '%d'", rpc_ret);
+        return -EINVAL;
     }
+    return return_code;
+}
 
-    /*if (fxn_ret < 0) {
-        // If the return code of watdfs_cli_getattr is negative (an error), then
-        // we need to make sure that the stat structure is filled with 0s. Otherwise,
-        // FUSE will be confused by the contradicting return values.
-        memset(statbuf, 0, sizeof(struct stat));
-    }*/
-
-    // Clean up the memory we have allocated.
-    delete []args;
+// Wait until bytes more may be written to server.
+static void take_write_credit(void *userdata, struct Server_endpoint *server, long bytes) {
+    struct Client_information *info = (struct Client_information *)userdata;
+    struct Write_credit *credit = server->credit;
+    long start = stats_now_ns();
+    bool waited = false;
+    pthread_mutex_lock(&credit->lock);
+    while (true) {
+        long now = stats_now_ns();
+        if (now < credit->expires_ns &&
+            (credit->left >= bytes || (credit->left == credit->window && bytes > credit->window))) {
+            credit->left -= std::min(bytes, credit->left);
+            break;
+        }
+        if (credit->asking) {
+            pthread_cond_wait(&credit->granted_cv, &credit->lock);
+            continue;
+        }
+        if (now < credit->expires_ns) {
+            // Used up; wait for the next period.
+            long sleep_ns = credit->expires_ns - now;
+            pthread_mutex_unlock(&credit->lock);
+            struct timespec ts = {sleep_ns / 1000000000, sleep_ns % 1000000000};
+            nanosleep(&ts, nullptr);
+            waited = true;
+            pthread_mutex_lock(&credit->lock);
+            continue;
+        }
+        credit->asking = 1;
+        pthread_mutex_unlock(&credit->lock);
+        struct rpc_conn *saved = current_conn;
+        current_conn = server->conn;
+        long window = 0;
+        long period_left_ns = 0;
+        int ret_code = rpc_call_write_credit(userdata, &window, &period_left_ns);
+        current_conn = saved;
+        now = stats_now_ns();
+        pthread_mutex_lock(&credit->lock);
+        credit->asking = 0;
+        if (ret_code < 0) {
+            // Not paced for a period, rather than not writing at all.
+            window = LONG_MAX / 2;
+            period_left_ns = (long)WRITE_CREDIT_PERIOD_MS * 1000000;
+        }
+        credit->window = credit->left = window;
+        credit->expires_ns = now + period_left_ns;
+        pthread_cond_broadcast(&credit->granted_cv);
+    }
+    pthread_mutex_unlock(&credit->lock);
+    if (waited) {
+        stats_record(info->stats.write_credit_waits, stats_now_ns() - start);
+    }
+}
 
-    // Finally return the value we got from the server.
-    return fxn_ret;
-    //return -ENOSYS;
+static void start_write_credit(struct Client_information *info) {
+    if (!(info->caps & WATDFS_CAP_CREDIT)) {
+        return;
+    }
+    for (struct Server_endpoint &server : info->servers) {
+        server.credit = new struct Write_credit;
+        memset(server.credit, 0, sizeof(struct Write_credit));
+        pthread_mutex_init(&server.credit->lock, nullptr);
+        pthread_cond_init(&server.credit->granted_cv, nullptr);
+    }
 }
 
+static void stop_write_credit(struct Client_information *info) {
+    for (struct Server_endpoint &server : info->servers) {
+        delete server.credit;
+        server.credit = nullptr;
+    }
+}
 
 char *get_full_path(char *path_to_cache, const char* rela_path) {
     int rela_path_len = strlen(rela_path);
@@ -878,6 +3151,8 @@ char *get_full_path(char *path_to_cache, const char* rela_path) {
 
 
 int file_freshness_check(void *userdata,const char *path){
+    struct Client_stats *stats = &((struct Client_information *)userdata)->stats;
+    stats_add(stats->freshness_checks, 1);
 
     int str_len = strlen(((struct Client_information *)userdata)->cachePath) + 1;
 
@@ -891,11 +3166,12 @@ int file_freshness_check(void *userdata,const char *path){
 
     time_t current_time = time(0);
 
-    Filedata file = (((struct Client_information*)userdata)->filedatas)[p];
+    Filedata file = filedata(userdata, p);
 
     //struct File_metadata f = get_file_meta(path);
 
     if((current_time - file.tc) < ((struct Client_information*)userdata)->cacheInterval){
+        stats_add(stats->cache_hits, 1);
         return 0;
     }
 
@@ -909,38 +3185,158 @@ int file_freshness_check(void *userdata,const char *path){
     stat(cachepath,&buf);
 
     if(buf.st_mtim.tv_sec == statbuf.st_mtim.tv_sec){
+        stats_add(stats->cache_hits, 1);
         return 0;
     }
+    stats_add(stats->cache_misses, 1);
     return -1;
 
 }
 
+// Fetch the size bytes of the server file open as fi into the cache file fd,
+// one stripe per RPC, with a task per extra connection claiming stripes
+// until none are left. The tasks run on the rpc_async workers. Returns 0 or
+// -errno.
+int download_parallel(struct Client_information *userdata, const char *path,
+                     size_t size, struct fuse_file_info *fi, int fd){
+    std::atomic<size_t> next_stripe(0);
+    std::atomic<int> fxn_ret(0);
+    size_t stripes = (size + DOWNLOAD_STRIPE_SIZE - 1) / DOWNLOAD_STRIPE_SIZE;
+    uint64_t request = trace_request();
+    auto worker = [&](struct rpc_conn *conn) {
+        struct rpc_conn *saved = current_conn;
+        uint64_t saved_request = trace_request();
+        current_conn = conn;
+        trace_set_request(request);
+        char *stripe = (char *)malloc(DOWNLOAD_STRIPE_SIZE);
+        size_t i;
+        while (fxn_ret == 0 && (i = next_stripe++) < stripes) {
+            off_t offset = (off_t)i * DOWNLOAD_STRIPE_SIZE;
+            size_t len = std::min(size - offset, (size_t)DOWNLOAD_STRIPE_SIZE);
+            int ret_code = rpc_call_read((void *)userdata, path, stripe, len,
+                                         offset, fi);
+            if (ret_code >= 0 && (size_t)ret_code < len) {
+                // The file shrank since getattr.
+                ret_code = -EAGAIN;
+            }
+            if (ret_code >= 0 && pwrite(fd, stripe, len, offset) != (ssize_t)len) {
+                ret_code = -EIO;
+            }
+            if (ret_code < 0) {
+                fxn_ret = ret_code;
+            }
+        }
+        free(stripe);
+        current_conn = saved;
+        trace_set_request(saved_request);
+        return 0;
+    };
+
+    std::vector<struct rpc_conn *> &streams = server_of(userdata, path)->streams;
+    size_t workers = std::min(streams.size(), stripes);
+    std::vector<std::future<int>> tasks;
+    for (size_t i = 0; i < workers; i++) {
+        struct rpc_conn *conn = streams[i];
+        tasks.push_back(rpc_async([&worker, conn]() { return worker(conn); }));
+    }
+    for (std::future<int> &task : tasks) {
+        task.wait();
+    }
+    DLOG("download_parallel: %zu stripes over %zu connections returned %d",
+         stripes, workers, fxn_ret.load());
+    return fxn_ret;
+}
+
+// Read the size bytes of the server file open as fi into buf, in pieces
+// whose RPCs overlap over the server's pooled connections. Striped files
+// are read at once, they are spread over their servers already. Returns 0
+// or -errno.
+static int download_pieces(struct Client_information *userdata, const char *path,
+                           char *buf, size_t size, struct fuse_file_info *fi) {
+    if (striped_layout(userdata, path) != nullptr) {
+        int ret_code = rpc_call_read((void *)userdata, path, buf, size, 0, fi);
+        return ret_code < 0 ? ret_code : 0;
+    }
+    std::vector<std::future<int>> pieces;
+    for (size_t offset = 0; offset < size; offset += DOWNLOAD_PIECE_SIZE) {
+        size_t len = std::min(size - offset, (size_t)DOWNLOAD_PIECE_SIZE);
+        pieces.push_back(rpc_call_read_async((void *)userdata, path, buf + offset, len,
+                                             (off_t)offset, fi));
+    }
+    int fxn_ret = 0;
+    for (std::future<int> &piece : pieces) {
+        int ret_code = piece.get();
+        if (ret_code < 0 && fxn_ret == 0) fxn_ret = ret_code;
+    }
+    return fxn_ret;
+}
+
+int download_replica(struct Client_information *userdata, const char *path,
+                     const char *full_path);
+
+// Fetch the server copy of path into the cache file full_path. Replicated
+// files are read from the least busy replica with the newest copy that can be
+// reached.
 int download(struct Client_information *userdata, const char *path, const char *full_path){
+    int fxn_ret;
+    if (replicated((void *)userdata, path)) {
+        fxn_ret = on_newest_replica((void *)userdata, path, [&]() {
+            return download_replica(userdata, path, full_path);
+        });
+    } else {
+        fxn_ret = download_replica(userdata, path, full_path);
+    }
+    if (fxn_ret >= 0) {
+        count_file_bytes(userdata->stats.bytes_downloaded, full_path);
+    }
+    return fxn_ret;
+}
+
+int download_replica(struct Client_information *userdata, const char *path,
+                     const char *full_path){
 
     int fxn_ret = 0;
     int sys_ret = 0;
     DLOG("download begin");
     //get file attributes from the server
 
+    // The attributes and the server descriptor are fetched at once.
     struct stat *statbuf = new struct stat;
+    struct fuse_file_info *fi = new struct fuse_file_info;
+    fi->flags = O_RDONLY;
+    std::future<int> opened = rpc_call_open_async((void *)userdata, path, fi);
     int rpc_ret = rpc_call_getattr((void *)userdata, path, statbuf);
+    int open_ret = opened.get();
     if(rpc_ret < 0){
+        if (open_ret == 0) rpc_call_release((void *)userdata, path, fi);
         return rpc_ret;
     }
     size_t size = statbuf->st_size;
-    char *buf = (char *) malloc(((off_t) size) * sizeof(char));
-    struct fuse_file_info *fi = new struct fuse_file_info;
+    // Large files are fetched in parallel stripes, written straight into the
+    // cache file once it is open. Striped files are read from all their
+    // servers in parallel anyway.
+    struct Server_endpoint *server = server_of(userdata, path);
+    for (struct Server_endpoint &replica : userdata->servers) {
+        if (current_conn != nullptr && replica.conn == current_conn) {
+            server = &replica;
+        }
+    }
+    bool parallel = server != nullptr && !server->streams.empty() &&
+                    size >= 2 * DOWNLOAD_STRIPE_SIZE &&
+                    striped_layout(userdata, path) == nullptr;
+    char *buf = parallel ? nullptr : (char *) malloc(((off_t) size) * sizeof(char));
 
     //read the file from the server
 
-    fi->flags = O_RDONLY;
-    rpc_ret = rpc_call_open((void *)userdata, path, fi);
+    rpc_ret = open_ret;
     DLOG("rpc_call_open fi->fh %d",fi->fh);
     DLOG("rpc_call_open return value %d",rpc_ret);
     if (rpc_ret < 0) fxn_ret = rpc_ret;
-    rpc_ret = rpc_call_read((void *)userdata, path, buf, size, 0, fi);
-    DLOG("rpc_call_read return value %d",rpc_ret);
-    if (rpc_ret < 0) fxn_ret = rpc_ret;
+    if (!parallel && rpc_ret == 0) {
+        rpc_ret = download_pieces(userdata, path, buf, size, fi);
+        DLOG("download_pieces return value %d",rpc_ret);
+        if (rpc_ret < 0) fxn_ret = rpc_ret;
+    }
 
     //write the file to the client
 
@@ -964,16 +3360,22 @@ int download(struct Client_information *userdata, const char *path, const char *
     //DLOG("Download function: full_path %s",full_path);
 
     //DLOG("Download: file_descriptor before %d",(((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor);
-    if((((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor == 0)
-        (((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor = sys_ret;
+    if(filedata(userdata, full_path).file_descriptor == 0)
+        filedata(userdata, full_path).file_descriptor = sys_ret;
 
-    DLOG("Download: file_descriptor after %d",(((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor);
+    DLOG("Download: file_descriptor after %d",filedata(userdata, full_path).file_descriptor);
 
-    int sys_ret_write = pwrite(sys_ret, buf, size, 0);
-    DLOG("pwrite return value %d",sys_ret_write);
-    if (sys_ret_write < 0) {
-        sys_ret_write = -errno;
-        return sys_ret_write;
+    if (parallel) {
+        rpc_ret = download_parallel(userdata, path, size, fi, sys_ret);
+        if (rpc_ret < 0) fxn_ret = rpc_ret;
+    } else {
+        int sys_ret_write = pwrite(sys_ret, buf, size, 0);
+        DLOG("pwrite return value %d",sys_ret_write);
+        free(buf);
+        if (sys_ret_write < 0) {
+            sys_ret_write = -errno;
+            return sys_ret_write;
+        }
     }
 
 
@@ -984,12 +3386,15 @@ int download(struct Client_information *userdata, const char *path, const char *
     ts[0] = (struct timespec)(statbuf->st_atim);
     ts[1] = (struct timespec)(statbuf->st_mtim);
 
+    int local_fd = sys_ret;
     sys_ret = utimensat(0, full_path, ts, 0);
     rpc_ret = rpc_call_release((void *)userdata, path, fi);
     if (rpc_ret < 0) fxn_ret = rpc_ret;
 
-    // close file locally
-    int ret_code = close(sys_ret);
+    // close file locally, unless it is the descriptor kept for the open file
+    int ret_code = 0;
+    if (filedata(userdata, full_path).file_descriptor != local_fd)
+        ret_code = close(local_fd);
     if(ret_code < 0) fxn_ret = -errno;
 
     sys_ret = open(full_path, O_RDWR);
@@ -1005,20 +3410,147 @@ int download(struct Client_information *userdata, const char *path, const char *
     return fxn_ret;
 }
 
+// Fill the staging file fi with the size bytes of buf, sending only the
+// chunks the server does not have yet (see chunker.h). The rest are copied
+// from the server's own files. Returns 0 or -errno.
+int upload_dedup(struct Client_information *userdata, const char *path,
+                 const char *buf, size_t size, struct fuse_file_info *fi){
+    std::vector<struct chunk_ref> refs(size / CHUNK_MIN_SIZE + 1);
+    refs.resize(chunker_split(buf, size, 0, refs.data(), refs.size()));
+
+    // Which chunks the server can place itself. A failed query only costs
+    // the savings, the chunks are then sent.
+    std::vector<char> have(refs.size(), 0);
+    std::vector<unsigned char> ids(CHUNK_IDS_PER_RPC * SHA256_DIGEST_LEN);
+    for (size_t i = 0; i < refs.size(); i += CHUNK_IDS_PER_RPC) {
+        int count = std::min(refs.size() - i, (size_t)CHUNK_IDS_PER_RPC);
+        for (int j = 0; j < count; j++) {
+            memcpy(&ids[j * SHA256_DIGEST_LEN], refs[i + j].id, SHA256_DIGEST_LEN);
+        }
+        if (rpc_call_chunks_has((void *)userdata, path, ids.data(), count, &have[i]) < 0) {
+            std::fill(have.begin() + i, have.begin() + i + count, 0);
+        }
+    }
+
+    std::vector<struct chunk_ref> known;
+    std::vector<size_t> known_index;
+    for (size_t i = 0; i < refs.size(); i++) {
+        if (have[i]) {
+            known.push_back(refs[i]);
+            known_index.push_back(i);
+        }
+    }
+    std::vector<char> placed(CHUNK_REFS_PER_RPC);
+    size_t placed_bytes = 0;
+    for (size_t i = 0; i < known.size(); i += CHUNK_REFS_PER_RPC) {
+        int count = std::min(known.size() - i, (size_t)CHUNK_REFS_PER_RPC);
+        int ret_code = rpc_call_write_chunks((void *)userdata, path, &known[i],
+                                             count, fi, placed.data());
+        for (int j = 0; j < count; j++) {
+            // The server may have lost a chunk since the query.
+            have[known_index[i + j]] = ret_code >= 0 && placed[j];
+        }
+        if (ret_code > 0) placed_bytes += ret_code;
+    }
+
+    // Send the rest, merging neighbouring chunks into one write.
+    size_t i = 0;
+    while (i < refs.size()) {
+        if (have[i]) {
+            i++;
+            continue;
+        }
+        size_t start = refs[i].offset;
+        size_t end = start;
+        while (i < refs.size() && !have[i]) {
+            end = refs[i].offset + refs[i].len;
+            i++;
+        }
+        int ret_code = rpc_call_write((void *)userdata, path, buf + start,
+                                      end - start, start, fi);
+        if (ret_code < 0) {
+            return ret_code;
+        }
+        if ((size_t)ret_code < end - start) {
+            return -EIO;
+        }
+    }
+    DLOG("upload_dedup: %zu chunks, %zu of %zu bytes placed by the server",
+         refs.size(), placed_bytes, size);
+    return 0;
+}
+
+// The attributes of a cache file and the bytes of it an upload sends, read
+// when the upload starts, so a replica that applies it later sends the same.
+struct Upload_snapshot {
+    struct stat st;
+    std::vector<char> data;
+};
+
+// Read the attributes of the cache file full_path, and size bytes of it from
+// offset (to the end of the file if size is -1). Returns 0 or -errno.
+static int snapshot_file(const char *full_path, off_t offset, ssize_t size,
+                         struct Upload_snapshot *snapshot) {
+    int fd = open(full_path, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    int fxn_ret = 0;
+    if (fstat(fd, &snapshot->st) < 0) {
+        fxn_ret = -errno;
+    } else {
+        if (size < 0) {
+            size = std::max((off_t)0, snapshot->st.st_size - offset);
+        }
+        snapshot->data.resize(size);
+        ssize_t nread = pread(fd, snapshot->data.data(), size, offset);
+        if (nread < 0) {
+            fxn_ret = -errno;
+        } else {
+            snapshot->data.resize(nread);
+        }
+    }
+    close(fd);
+    return fxn_ret;
+}
+
+int upload_replica(struct Client_information *userdata, const char *path,
+                   const struct Upload_snapshot &snapshot);
+
+// Replace the server copy of path with the cache file full_path, on every
+// replica of a replicated file.
 int upload(struct Client_information *userdata, const char *path, const char *full_path){
+    std::shared_ptr<struct Upload_snapshot> snapshot = std::make_shared<struct Upload_snapshot>();
+    int fxn_ret = snapshot_file(full_path, 0, -1, snapshot.get());
+    if (fxn_ret < 0) {
+        return fxn_ret;
+    }
+    if (replicated((void *)userdata, path)) {
+        std::string p = path;
+        fxn_ret = replicate((void *)userdata, path, [=]() {
+            return upload_replica(userdata, p.c_str(), *snapshot);
+        }, true);
+    } else {
+        fxn_ret = upload_replica(userdata, path, *snapshot);
+    }
+    if (fxn_ret >= 0) {
+        stats_add(userdata->stats.bytes_uploaded, snapshot->data.size());
+    }
+    return fxn_ret;
+}
+
+int upload_replica(struct Client_information *userdata, const char *path,
+                   const struct Upload_snapshot &snapshot){
     DLOG("upload begin");
     int fxn_ret = 0;
-    int sys_ret = 0;
     struct fuse_file_info *fi = new struct fuse_file_info;
     fi->flags = O_RDWR;
-    std::string p = std::string(full_path);
-    struct stat *statbuf = new struct stat;
+    const struct stat *statbuf = &snapshot.st;
+    const char *buf = snapshot.data.data();
+    size_t size = snapshot.data.size();
+    DLOG("size %zu",size);
 
-    //get the  local file information
-    int ret_code = stat(full_path, statbuf);
-
-    //open the file in the server side
-    ret_code = rpc_call_open((void *)userdata, path, fi);
+    int ret_code = rpc_call_open((void *)userdata, path, fi);
     //judge whether the file exists
     if (ret_code < 0){
         mode_t mt = statbuf->st_mode;
@@ -1026,66 +3558,263 @@ int upload(struct Client_information *userdata, const char *path, const char *fu
         ret_code = rpc_call_mknod((void *)userdata, path, mt, dt);
         ret_code = rpc_call_open((void *)userdata, path, fi);
     }
-
-    //read the file in the local side
-    size_t size = statbuf->st_size;
-    //char * buf = (char *) malloc(((off_t) size) * sizeof(char));
-    DLOG("size %d",size);
-    char buf[size];
-    sys_ret = open(full_path, O_RDONLY);
-
     if (ret_code < 0){
-        fxn_ret = -errno;
+        fxn_ret = ret_code;
     }
-    //(((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor = sys_ret;
-    //DLOG("Download: file_descriptor after %d",(((struct Client_information *)userdata)->filedatas)[full_path].file_descriptor);
-    DLOG("buf1 %s",buf);
-    ret_code = pread(sys_ret, buf, size, 0);
-    DLOG("buf2 %s",buf);
-    if (ret_code < 0){
-        fxn_ret = -errno;
+
+    //a striped file is spread over several servers, where no single rename
+    //can commit it, so it is written in place
+    bool in_place = striped_layout(userdata, path) != nullptr;
+    if (fxn_ret == 0 && in_place) {
+        struct timespec ts[2];
+        ts[0] = (struct timespec)(statbuf->st_atim);
+        ts[1] = (struct timespec)(statbuf->st_mtim);
+        ret_code = rpc_call_truncate((void *)userdata, path, (off_t) size);
+        if (ret_code == 0)
+            ret_code = rpc_call_write((void*)userdata, path, buf, size, 0, fi);
+        if (ret_code >= 0)
+            ret_code = rpc_call_utimensat((void *)userdata, path, ts);
+        if (ret_code < 0) fxn_ret = ret_code;
     }
-    //truncte the size in server side
-    ret_code = rpc_call_truncate((void *)userdata, path, (off_t) size);
-    if (ret_code < 0){
-        fxn_ret = -errno;
+
+    //stage the new contents next to the server file, the old version stays
+    //in place (and readable) until the commit renames the staging file over it
+    struct fuse_file_info stage_fi;
+    memset(&stage_fi, 0, sizeof(stage_fi));
+    stage_fi.flags = O_RDWR;
+    if (fxn_ret == 0 && !in_place) {
+        ret_code = rpc_call_upload_begin((void *)userdata, path, &stage_fi);
+        if (ret_code < 0) fxn_ret = ret_code;
     }
-    //write the data into the server side
-    DLOG("buf3 %s",buf);
-    ret_code = rpc_call_write((void*)userdata, path, buf, (off_t) size, 0, fi);
-    if(ret_code < 0){
-        fxn_ret = -errno;
+
+    //write the data into the staging file, only the new chunks if the
+    //server deduplicates
+    if (fxn_ret == 0 && !in_place) {
+        if ((userdata->caps & WATDFS_CAP_DEDUP) && size >= DEDUP_MIN_UPLOAD) {
+            ret_code = upload_dedup(userdata, path, buf, size, &stage_fi);
+        } else {
+            ret_code = rpc_call_write((void*)userdata, path, buf, (off_t) size, 0, &stage_fi);
+        }
+        DLOG("return rpc_call_write: %d",ret_code);
+        if(ret_code < 0){
+            fxn_ret = ret_code;
+        }
+
+        //commit along with the metadata, or throw the staging file away
+        struct timespec ts[2];
+        ts[0] = (struct timespec)(statbuf->st_atim);
+        ts[1] = (struct timespec)(statbuf->st_mtim);
+        if (fxn_ret == 0) {
+            ret_code = rpc_call_upload_commit((void *)userdata, path, &stage_fi, ts);
+            DLOG("return rpc_call_upload_commit: %d",ret_code);
+            if (ret_code < 0) fxn_ret = ret_code;
+        } else {
+            rpc_call_upload_abort((void *)userdata, path, &stage_fi);
+        }
     }
-    DLOG("return rpc_call_write: %d",ret_code);
 
-    //Update metadata to the server side
-    struct timespec ts[2];
+    int rpc_ret = rpc_call_release((void *)userdata, path, fi);
+    DLOG("return rpc_call_release: %d",rpc_ret);
+    if (rpc_ret < 0) fxn_ret = rpc_ret;
 
-    ts[0] = (struct timespec)(statbuf->st_atim);
-    ts[1] = (struct timespec)(statbuf->st_mtim);
+    return fxn_ret;
+}
 
-    ret_code = rpc_call_utimensat((void *)userdata, path, ts);
-    DLOG("return rpc_call_utimensat: %d",ret_code);
+// Push only [offset, offset + size) of the cached file to the server. Every
+// write goes through to the server, so the rest of the server copy is already
+// up to date; this keeps appends from re-sending the whole file each time.
+int upload_range_replica(struct Client_information *userdata, const char *path,
+                         const char *full_path, off_t offset,
+                         const struct Upload_snapshot &snapshot);
+
+// Send [offset, offset + size) of the cache file full_path to the server
+// copy of path, on every replica of a replicated file.
+int upload_range(struct Client_information *userdata, const char *path,
+                 const char *full_path, off_t offset, size_t size){
+    std::shared_ptr<struct Upload_snapshot> snapshot = std::make_shared<struct Upload_snapshot>();
+    int fxn_ret = snapshot_file(full_path, offset, size, snapshot.get());
+    if (fxn_ret < 0) {
+        return fxn_ret;
+    }
+    if (replicated((void *)userdata, path)) {
+        // A replica missing the file cannot be rebuilt from a range; it fails
+        // the change and stays stale until a whole-file upload.
+        std::string p = path;
+        fxn_ret = replicate((void *)userdata, path, [=]() {
+            return upload_range_replica(userdata, p.c_str(), nullptr, offset, *snapshot);
+        });
+    } else {
+        fxn_ret = upload_range_replica(userdata, path, full_path, offset, *snapshot);
+    }
+    if (fxn_ret >= 0) {
+        stats_add(userdata->stats.bytes_uploaded, snapshot->data.size());
+    }
+    return fxn_ret;
+}
+
+int upload_range_replica(struct Client_information *userdata, const char *path,
+                         const char *full_path, off_t offset,
+                         const struct Upload_snapshot &snapshot){
+    DLOG("upload_range begin: offset %ld size %zu", offset, snapshot.data.size());
+    int fxn_ret = 0;
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDWR;
+
+    int ret_code = rpc_call_open((void *)userdata, path, &fi);
     if (ret_code < 0) {
-        fxn_ret = -errno;
+        if (full_path == nullptr) {
+            return ret_code;
+        }
+        // The server copy is missing, fall back to a whole-file upload which
+        // creates it.
+        struct Upload_snapshot whole;
+        ret_code = snapshot_file(full_path, 0, -1, &whole);
+        return ret_code < 0 ? ret_code : upload_replica(userdata, path, whole);
     }
 
-    ret_code = close(sys_ret);
-    if(ret_code < 0) fxn_ret = -errno;
+    if (!snapshot.data.empty()) {
+        ret_code = rpc_call_write((void *)userdata, path, snapshot.data.data(),
+                                  snapshot.data.size(), offset, &fi);
+        if (ret_code < 0) fxn_ret = ret_code;
+    }
 
-    int rpc_ret = rpc_call_release((void *)userdata, path, fi);
-    DLOG("return rpc_call_release: %d",rpc_ret);
-    if (rpc_ret < 0) fxn_ret = rpc_ret;
+    // The freshness checks compare modification times, so keep them in step.
+    struct timespec ts[2];
+    ts[0] = (struct timespec)(snapshot.st.st_atim);
+    ts[1] = (struct timespec)(snapshot.st.st_mtim);
+    ret_code = rpc_call_utimensat((void *)userdata, path, ts);
+    if (ret_code < 0 && fxn_ret == 0) fxn_ret = ret_code;
+
+    ret_code = rpc_call_release((void *)userdata, path, &fi);
+    if (ret_code < 0 && fxn_ret == 0) fxn_ret = ret_code;
+
+    return fxn_ret;
+}
+
+// Remember that [start, end) of the file was written to the server copy in
+// place and is not yet durable there. The range only tells the server what
+// to start writing back early; its fsync covers the whole file either way.
+// Whole-file uploads need no entry, upload_commit makes them durable.
+void mark_unsynced(struct Client_information *userdata, const std::string &p,
+                   off_t start, off_t end){
+    struct Filedata *found = find_filedata(userdata, p);
+    if (found == nullptr || start >= end) {
+        return;
+    }
+    struct Filedata &file = *found;
+    if (file.sync_start == file.sync_end) {
+        file.sync_start = start;
+        file.sync_end = end;
+    } else {
+        if (start < file.sync_start) file.sync_start = start;
+        if (end > file.sync_end) file.sync_end = end;
+    }
+}
 
+// Make the server copy durable. A server descriptor is only held while the
+// sync runs; read-only is enough for fsync and does not take the server's
+// write slot away from other clients.
+int server_sync(struct Client_information *userdata, const char *path,
+                int datasync, off_t range_start, off_t range_len){
+    // A replicated file is durable once a write quorum of replicas is.
+    if (replicated((void *)userdata, path)) {
+        std::string p = path;
+        return replicate((void *)userdata, path, [=]() {
+            return server_sync(userdata, p.c_str(), datasync, range_start, range_len);
+        });
+    }
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_RDONLY;
+    int ret_code = rpc_call_open((void *)userdata, path, &fi);
+    if (ret_code < 0) {
+        return ret_code;
+    }
+    int fxn_ret = rpc_call_fsync((void *)userdata, path, &fi, datasync,
+                                 range_start, range_len);
+    ret_code = rpc_call_release((void *)userdata, path, &fi);
+    if (ret_code < 0 && fxn_ret == 0) fxn_ret = ret_code;
     return fxn_ret;
 }
 
 
 // SETUP AND TEARDOWN
+
+// Open count extra connections to the server at address:port for parallel
+// downloads. Stops at the first that fails.
+static void open_streams(struct Server_endpoint *server, const char *address,
+                         int port, int count) {
+    for (int i = 0; port > 0 && i < count; i++) {
+        struct rpc_conn *conn = rpc_conn_open(address, port);
+        if (conn == nullptr) {
+            break;
+        }
+        server->streams.push_back(conn);
+    }
+}
+
+// Connect to every server in list, "host:port,host:port,...", and place the
+// files on them with a ring. The ports are the servers' WATDFS_CONN_PORT.
+// Every server gets a pool of up to pool_conns connections, and streams
+// extra ones.
+// Returns 0 or -errno.
+static int open_servers(struct Client_information *userdata, const char *list,
+                        int pool_conns, int streams) {
+    std::vector<std::string> names;
+    std::string rest = list;
+    while (!rest.empty()) {
+        size_t comma = rest.find(',');
+        std::string name = rest.substr(0, comma);
+        rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+        if (!name.empty()) {
+            names.push_back(name);
+        }
+    }
+    for (const std::string &name : names) {
+        size_t colon = name.rfind(':');
+        if (colon == std::string::npos) {
+            DLOG("bad server '%s' in WATDFS_SERVERS", name.c_str());
+            return -EINVAL;
+        }
+        std::string address = name.substr(0, colon);
+        int port = atoi(name.c_str() + colon + 1);
+        struct Server_endpoint server;
+        server.id = stripe_server_id(name.c_str());
+        server.outstanding = 0;
+        server.down = 0;
+        server.down_at = 0;
+        server.queue = nullptr;
+        server.credit = nullptr;
+        server.pool = rpc_conn_pool_create(address.c_str(), port, pool_conns);
+        if (server.pool == nullptr) {
+            return -EHOSTUNREACH;
+        }
+        server.conn = rpc_conn_pool_first(server.pool);
+        open_streams(&server, address.c_str(), port, streams);
+        userdata->servers.push_back(server);
+    }
+    std::vector<const char *> c_names;
+    for (const std::string &name : names) {
+        c_names.push_back(name.c_str());
+    }
+    userdata->ring = shard_ring_create(c_names.data(), (int)c_names.size());
+    if (userdata->ring == nullptr) {
+        return -EINVAL;
+    }
+    DLOG("%zu servers", userdata->servers.size());
+    return 0;
+}
+
 void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
                       time_t cache_interval, int *ret_code) {
     // TODO: set up the RPC library by calling `rpcClientInit`.
-    int  return_code = rpcClientInit();
+    // WATDFS_SERVERS spreads the files over several servers, all reached
+    // through rpc_conn, so librpc is only needed without it.
+    const char *servers_env = getenv("WATDFS_SERVERS");
+    int  return_code = 0;
+    if (servers_env == nullptr)
+        return_code = rpcClientInit();
     // TODO: check the return code of the `rpcClientInit` call
     // `rpcClientInit` may fail, for example, if an incorrect port was exported.
 
@@ -1107,6 +3836,136 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
     userdata->cachePath = (char *)malloc(str_len);
     strcpy(userdata->cachePath, path_to_cache);
 
+    // Every server gets WATDFS_DOWNLOAD_STREAMS extra connections for
+    // parallel downloads (0 for none).
+    int streams = DOWNLOAD_STREAMS;
+    if (getenv("WATDFS_DOWNLOAD_STREAMS") != nullptr) {
+        streams = atoi(getenv("WATDFS_DOWNLOAD_STREAMS"));
+    }
+    // Calls from many FUSE threads to one server go out at once over a pool
+    // of up to WATDFS_POOL_CONNS connections.
+    int pool_conns = POOL_CONNS;
+    if (getenv("WATDFS_POOL_CONNS") != nullptr) {
+        pool_conns = std::max(1, atoi(getenv("WATDFS_POOL_CONNS")));
+    }
+    pthread_mutex_init(&userdata->maps_lock, nullptr);
+    memset(userdata->rpc_counts, 0, sizeof(userdata->rpc_counts));
+    register_stats(userdata);
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    for (int i = 0; i < FILE_LOCKS; i++) {
+        pthread_mutex_init(&userdata->file_locks[i], &recursive);
+    }
+    pthread_mutexattr_destroy(&recursive);
+    userdata->ring = nullptr;
+    // With several servers, WATDFS_REPLICAS keeps that many copies of every
+    // file, and changes return once WATDFS_WRITE_QUORUM of them (a majority
+    // by default) have them.
+    userdata->replicas = REPLICAS;
+    if (getenv("WATDFS_REPLICAS") != nullptr) {
+        userdata->replicas = std::max(1, atoi(getenv("WATDFS_REPLICAS")));
+    }
+    userdata->write_quorum = userdata->replicas / 2 + 1;
+    if (getenv("WATDFS_WRITE_QUORUM") != nullptr) {
+        userdata->write_quorum = std::max(1, atoi(getenv("WATDFS_WRITE_QUORUM")));
+    }
+    if (servers_env != nullptr) {
+        return_code = open_servers(userdata, servers_env, pool_conns, streams);
+        if (return_code == 0) {
+            start_replica_queues(userdata);
+        }
+    } else if (return_code == 0) {
+        // The librpc server listens for the pooled and extra connections on
+        // the port it reports, at the same address. Once the pool is open,
+        // librpc is no longer used for calls.
+        struct Server_endpoint server;
+        server.id = 0;
+        server.pool = nullptr;
+        server.conn = nullptr;
+        server.outstanding = 0;
+        server.down = 0;
+        server.down_at = 0;
+        server.queue = nullptr;
+        server.credit = nullptr;
+        userdata->servers.push_back(server);
+        int conn_port = getenv("SERVER_ADDRESS") == nullptr ? 0
+                        : rpc_call_conn_port((void *)userdata);
+        if (conn_port > 0) {
+            struct Server_endpoint *only = &userdata->servers[0];
+            only->pool = rpc_conn_pool_create(getenv("SERVER_ADDRESS"), conn_port,
+                                              pool_conns);
+            only->conn = rpc_conn_pool_first(only->pool);
+            open_streams(only, getenv("SERVER_ADDRESS"), conn_port, streams);
+        }
+    }
+
+    // With several servers, WATDFS_STRIPE_WIDTH=n stripes every new file over
+    // n of them in blocks of WATDFS_STRIPE_BLOCK bytes.
+    memset(&userdata->new_layout, 0, sizeof(userdata->new_layout));
+    if (getenv("WATDFS_STRIPE_WIDTH") != nullptr) {
+        userdata->new_layout.magic = STRIPE_LAYOUT_MAGIC;
+        userdata->new_layout.width = std::min(atoi(getenv("WATDFS_STRIPE_WIDTH")),
+                                              STRIPE_MAX_WIDTH);
+        userdata->new_layout.block_size = STRIPE_BLOCK_SIZE;
+        if (getenv("WATDFS_STRIPE_BLOCK") != nullptr) {
+            userdata->new_layout.block_size = atol(getenv("WATDFS_STRIPE_BLOCK"));
+        }
+    }
+
+    // Negotiate compression of bulk transfers and deduplicated uploads,
+    // unless WATDFS_COMPRESS=0 or WATDFS_DEDUP=0 turn them off.
+    userdata->caps = 0;
+    int client_caps = 0;
+    const char *compress_env = getenv("WATDFS_COMPRESS");
+    if (compress_env == nullptr || strcmp(compress_env, "0") != 0) {
+        client_caps |= WATDFS_CAP_LZ4;
+    }
+    const char *dedup_env = getenv("WATDFS_DEDUP");
+    if (dedup_env == nullptr || strcmp(dedup_env, "0") != 0) {
+        client_caps |= WATDFS_CAP_DEDUP;
+    }
+    const char *credit_env = getenv("WATDFS_WRITE_CREDIT");
+    if (credit_env == nullptr || strcmp(credit_env, "0") != 0) {
+        client_caps |= WATDFS_CAP_CREDIT;
+    }
+    if (return_code == 0 && client_caps != 0) {
+        // Only what every server supports.
+        userdata->caps = client_caps;
+        for (struct Server_endpoint &server : userdata->servers) {
+            current_conn = server.conn;
+            userdata->caps &= rpc_call_caps((void *)userdata, client_caps);
+        }
+        current_conn = nullptr;
+    }
+
+    // Read and write payloads carry a CRC32C by default; WATDFS_CHECKSUM
+    // picks xxh3 or none instead.
+    userdata->checksum_kind = CHECKSUM_CRC32C;
+    const char *checksum_env = getenv("WATDFS_CHECKSUM");
+    if (checksum_env != nullptr && strcmp(checksum_env, "xxh3") == 0) {
+        userdata->checksum_kind = CHECKSUM_XXH3;
+    } else if (checksum_env != nullptr && strcmp(checksum_env, "none") == 0) {
+        userdata->checksum_kind = CHECKSUM_NONE;
+    }
+    DLOG("checksum kind %d (%s)", userdata->checksum_kind,
+         checksum_impl_name(userdata->checksum_kind));
+    DLOG("negotiated caps %d", userdata->caps);
+    start_hedging(userdata);
+    start_write_credit(userdata);
+
+    // WATDFS_STATS_SOCKET names a Unix socket serving the latency histograms
+    // and counters of this client and its servers.
+    const char *stats_socket = getenv("WATDFS_STATS_SOCKET");
+    if (return_code == 0 && stats_socket != nullptr) {
+        int stats_ret = stats_socket_start(stats_socket, [userdata]() {
+            return stats_text(userdata);
+        });
+        if (stats_ret < 0) {
+            DLOG("cannot serve stats on %s: %d", stats_socket, stats_ret);
+        }
+    }
+
     // TODO: save `path_to_cache` and `cache_interval` (for A3).
 
     // TODO: set `ret_code` to 0 if everything above succeeded else some appropriate
@@ -1122,7 +3981,30 @@ void *watdfs_cli_init(struct fuse_conn_info *conn, const char *path_to_cache,
 void watdfs_cli_destroy(void *userdata) {
     // TODO: clean up your userdata state.
     // TODO: tear down the RPC library by calling `rpcClientDestroy`.
-        rpcClientDestroy();
+        struct Client_information *info = (struct Client_information *)userdata;
+        bool uses_librpc = info->ring == nullptr;
+        stats_socket_stop();
+        stop_replica_queues(info);
+        stop_hedging(info);
+        stop_write_credit(info);
+        // WATDFS_RPC_COUNTS names a file to leave the RPC counts of this
+        // mount in.
+        if (getenv("WATDFS_RPC_COUNTS") != nullptr) {
+            write_rpc_counts(info, getenv("WATDFS_RPC_COUNTS"));
+        }
+        for (struct Server_endpoint &server : info->servers) {
+            rpc_conn_pool_destroy(server.pool);
+            for (struct rpc_conn *conn : server.streams) {
+                rpc_conn_close(conn);
+            }
+        }
+        info->servers.clear();
+        shard_ring_destroy(info->ring);
+        info->ring = nullptr;
+        if (uses_librpc)
+            rpcClientDestroy();
+        compress_pool_destroy();
+        rpc_async_destroy();
         //free(((struct Client_information *)userdata)->cachePath);
     // delete userdata;
         //userdata = NULL;
@@ -1130,6 +4012,8 @@ void watdfs_cli_destroy(void *userdata) {
 
 // GET FILE ATTRIBUTES
 int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
+    Op_timer op_timer(userdata, OP_GETATTR);
+    File_lock file_lock(userdata, path);
     // SET UP THE RPC CALL
     //(char *)malloc(size+1);
 
@@ -1149,9 +4033,9 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
         return ret_code;
     }
 
-    if((((struct Client_information *)userdata)->filedatas).find(p) != (((struct Client_information *)userdata)->filedatas).end()){
+    if(find_filedata(userdata, p) != nullptr){
         DLOG("IN watdfs_cli_getattr, the client file is open");
-        int local_mode = (((struct Client_information*)userdata)->filedatas)[p].client_mode;
+        int local_mode = filedata(userdata, p).client_mode;
         if((local_mode & O_ACCMODE) == O_RDONLY){
             int fresh_check = file_freshness_check(userdata,path);
             if(fresh_check == 0) {
@@ -1161,7 +4045,7 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
                     free(full_path);
                     return -errno;
                 }
-                (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+                filedata(userdata, p).tc = time(0);
                 return ret_code;
             }
             else{
@@ -1170,7 +4054,7 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
                     free(full_path);
                     return ret_code;
                 }
-                (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+                filedata(userdata, p).tc = time(0);
                 ret_code = stat(full_path, statbuf);
                 if(ret_code < 0) {
                     free(full_path);
@@ -1212,6 +4096,8 @@ int watdfs_cli_getattr(void *userdata, const char *path, struct stat *statbuf) {
 
 // CREATE, OPEN AND CLOSE
 int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
+    Op_timer op_timer(userdata, OP_MKNOD);
+    File_lock file_lock(userdata, path);
 
     int str_len = strlen(((struct Client_information *)userdata)->cachePath) + 1;
 
@@ -1242,7 +4128,7 @@ int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
         return 0;
     }
 
-    if(!((((struct Client_information *)userdata)->filedatas).find(p) != (((struct Client_information *)userdata)->filedatas).end())){
+    if(!(find_filedata(userdata, p) != nullptr)){
         DLOG("IN watdfs_cli_mknod: server file exist but no client file");
         int ret_code1 = mknod(full_path,mode,dev);
         if(ret_code1 < 0){
@@ -1256,6 +4142,8 @@ int watdfs_cli_mknod(void *userdata, const char *path, mode_t mode, dev_t dev) {
 }
 int watdfs_cli_open(void *userdata, const char *path,
                     struct fuse_file_info *fi) {
+    Op_timer op_timer(userdata, OP_OPEN);
+    File_lock file_lock(userdata, path);
     int str_len = strlen(((struct Client_information *)userdata)->cachePath) + 1;
     char *cachepath = (char *)malloc(str_len+1);
 
@@ -1266,7 +4154,7 @@ int watdfs_cli_open(void *userdata, const char *path,
 
     DLOG("open_address_0226: %s", full_path);
 
-    if((((struct Client_information *)userdata)->filedatas).find(p) != (((struct Client_information *)userdata)->filedatas).end()){
+    if(find_filedata(userdata, p) != nullptr){
         free(full_path);
         return -EMFILE;
     }
@@ -1316,7 +4204,7 @@ int watdfs_cli_open(void *userdata, const char *path,
         //DLOG("fi->flag %d",fi->flags);
         //fi->fh = ret_code;
         struct Filedata file = {fi->flags, ret_code, time(0)};
-        (((struct Client_information*)userdata)->filedatas)[p] = file;
+        filedata(userdata, p) = file;
         //DLOG("watdfs_cli_open: file %d",file.file_descriptor);
     }
 
@@ -1327,6 +4215,8 @@ int watdfs_cli_open(void *userdata, const char *path,
 
 int watdfs_cli_release(void *userdata, const char *path,
                        struct fuse_file_info *fi) {
+    Op_timer op_timer(userdata, OP_RELEASE);
+    File_lock file_lock(userdata, path);
 
     int sys_ret = 0;
 
@@ -1340,21 +4230,21 @@ int watdfs_cli_release(void *userdata, const char *path,
 
     std::string p = std::string(full_path);
 
-    int file_flag = (((struct Client_information *)userdata)->filedatas)[p].client_mode;
+    int file_flag = filedata(userdata, p).client_mode;
 
     if (!(O_RDONLY == (file_flag & O_ACCMODE))) {
         // not read only, push the updates to server
         sys_ret = upload((Client_information*)userdata, path, full_path);
         if (sys_ret < 0) return sys_ret;
     }
-    DLOG("watdfs_cli_release: %d",(((struct Client_information *)userdata)->filedatas)[p].file_descriptor);
-    sys_ret = close((((struct Client_information *)userdata)->filedatas)[p].file_descriptor);
+    DLOG("watdfs_cli_release: %d",filedata(userdata, p).file_descriptor);
+    sys_ret = close(filedata(userdata, p).file_descriptor);
     if (sys_ret < 0) return -errno;
 
     //bool whether_empty = (((struct Client_information *)userdata)->filedatas).empty();
     //DLOG("whether the userdata is empty1 %s",whether_empty);
     DLOG("I erase the local file here");
-    (((struct Client_information *)userdata)->filedatas).erase(p);
+    erase_filedata(userdata, p);
     //whether_empty = (((struct Client_information *)userdata)->filedatas).empty();
     //DLOG("whether the userdata is empty2 %s",whether_empty);
     free(full_path);
@@ -1365,6 +4255,8 @@ int watdfs_cli_release(void *userdata, const char *path,
 // READ AND WRITE DATA
 int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
                     off_t offset, struct fuse_file_info *fi) {
+    Op_timer op_timer(userdata, OP_READ);
+    File_lock file_lock(userdata, path);
     int sys_ret = 0;
 
 
@@ -1377,9 +4269,9 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
 
     std::string p = std::string(full_path);
 
-    int file_descriptor = (((struct Client_information *)userdata)->filedatas)[p].file_descriptor;
+    int file_descriptor = filedata(userdata, p).file_descriptor;
 
-    int file_flag = (((struct Client_information *)userdata)->filedatas)[p].client_mode;
+    int file_flag = filedata(userdata, p).client_mode;
     if((file_flag & O_ACCMODE)!= O_RDONLY){
         DLOG("watdfs_cli_read: file_flag is not O_RDONLY");
         int sys_ret = pread(file_descriptor, buf, size, offset);
@@ -1394,11 +4286,11 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
         if (ret_code < 0) {
             return -EPERM;
         }
-        (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+        filedata(userdata, p).tc = time(0);
     }
 
     //int ret_code = download((Client_information*)userdata, path, full_path);
-    file_descriptor = (((struct Client_information *)userdata)->filedatas)[p].file_descriptor;
+    file_descriptor = filedata(userdata, p).file_descriptor;
     //DLOG("watdfs_cli_read: download return code %d",ret_code);
     //if (ret_code < 0) {
     //    return ret_code;
@@ -1426,6 +4318,8 @@ int watdfs_cli_read(void *userdata, const char *path, char *buf, size_t size,
 }
 int watdfs_cli_write(void *userdata, const char *path, const char *buf,
                      size_t size, off_t offset, struct fuse_file_info *fi) {
+    Op_timer op_timer(userdata, OP_WRITE);
+    File_lock file_lock(userdata, path);
 
     int sys_ret = 0;
 
@@ -1439,9 +4333,8 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
 
     std::string p = std::string(full_path);
 
-    int file_descriptor = (((struct Client_information *)userdata)->filedatas)[p].file_descriptor;
+    int file_descriptor = filedata(userdata, p).file_descriptor;
     DLOG("i operate the write system function here");
-    DLOG("buf sentence %s",buf);
     DLOG("offset %d",offset);
     DLOG("file_descriptor %d",file_descriptor);
     DLOG("fi->fh %d",fi->fh);
@@ -1449,14 +4342,17 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
     DLOG("ret_code %d",ret_code);
     if(ret_code < 0)
         return -errno;
-    int fxn_ret = upload((Client_information*)userdata, path, full_path);
+    int fxn_ret = upload_range((Client_information*)userdata, path, full_path, offset, ret_code);
     if(fxn_ret < 0)
         return fxn_ret;
-    (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+    mark_unsynced((Client_information*)userdata, p, offset, offset + ret_code);
+    filedata(userdata, p).tc = time(0);
     return ret_code;
 }
 
 int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
+    Op_timer op_timer(userdata, OP_TRUNCATE);
+    File_lock file_lock(userdata, path);
     int sys_ret = 0;
 
 
@@ -1471,7 +4367,7 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
 
 
     //judge whether the local file is open
-    if(!((((struct Client_information *)userdata)->filedatas).find(p) != (((struct Client_information *)userdata)->filedatas).end())){
+    if(!(find_filedata(userdata, p) != nullptr)){
         int ret_code = download((Client_information*)userdata, path, full_path);
         if (ret_code < 0) {
             return ret_code;
@@ -1492,7 +4388,7 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
         //local file updates if freshness condition has expired. Write calls should perform the
         //freshness checks at the end of writes, as usual.
     else{
-        int file_flag = (((struct Client_information *)userdata)->filedatas)[p].client_mode;
+        int file_flag = filedata(userdata, p).client_mode;
         if ((file_flag & O_ACCMODE) != O_RDONLY) {
             int ret_code = truncate(full_path, newsize);
             if (ret_code < 0) {
@@ -1501,7 +4397,7 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
             int fxn_ret = upload((Client_information*)userdata, path, full_path);
             if(fxn_ret < 0)
                 return fxn_ret;
-            (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+            filedata(userdata, p).tc = time(0);
             return fxn_ret;
         }
         else{
@@ -1516,7 +4412,17 @@ int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize) {
 
 int watdfs_cli_fsync(void *userdata, const char *path,
                      struct fuse_file_info *fi) {
-    int sys_ret = 0;
+    return watdfs_cli_fsync_datasync(userdata, path, 0, fi);
+}
+
+int watdfs_cli_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return watdfs_cli_fsync_datasync(fuse_get_context()->private_data, path, datasync, fi);
+}
+
+int watdfs_cli_fsync_datasync(void *userdata, const char *path, int datasync,
+                              struct fuse_file_info *fi) {
+    Op_timer op_timer(userdata, OP_FSYNC);
+    File_lock file_lock(userdata, path);
 
 
     int str_len = strlen(((struct Client_information *)userdata)->cachePath) + 1;
@@ -1529,15 +4435,27 @@ int watdfs_cli_fsync(void *userdata, const char *path,
     std::string p = std::string(full_path);
 
 
-    int local_mode = (((struct Client_information*)userdata)->filedatas)[p].client_mode;
+    int local_mode = filedata(userdata, p).client_mode;
     if((local_mode & O_ACCMODE) == O_RDONLY){
         return -EMFILE;
     }
 
-    int fxn_ret = upload((Client_information*)userdata, path, full_path);
-    if(fxn_ret < 0)
+    // Every write is already pushed to the server as it happens, so there is
+    // nothing left to upload: just make the server copy durable. With
+    // datasync only the file data is flushed, not the inode metadata, and the
+    // server gets the range written since the last sync.
+    struct Filedata &file = filedata(userdata, p);
+    off_t range_start = file.sync_start;
+    off_t range_len = file.sync_end - file.sync_start;
+    int fxn_ret = server_sync((Client_information*)userdata, path, datasync,
+                              range_start, range_len);
+    if(fxn_ret < 0) {
+        free(full_path);
         return fxn_ret;
-    (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+    }
+    file.sync_start = 0;
+    file.sync_end = 0;
+    file.tc = time(0);
 
     free(full_path);
     return fxn_ret;
@@ -1546,6 +4464,8 @@ int watdfs_cli_fsync(void *userdata, const char *path,
 // CHANGE METADATA
 int watdfs_cli_utimensat(void *userdata, const char *path,
                        const struct timespec ts[2]) {
+    Op_timer op_timer(userdata, OP_UTIMENSAT);
+    File_lock file_lock(userdata, path);
     int sys_ret = 0;
 
 
@@ -1558,7 +4478,7 @@ int watdfs_cli_utimensat(void *userdata, const char *path,
 
     std::string p = std::string(full_path);
 
-    if(!((((struct Client_information *)userdata)->filedatas).find(p) != (((struct Client_information *)userdata)->filedatas).end())){
+    if(!(find_filedata(userdata, p) != nullptr)){
 
         int ret_code = download((Client_information*)userdata, path, full_path);
         if (ret_code < 0) {
@@ -1577,7 +4497,7 @@ int watdfs_cli_utimensat(void *userdata, const char *path,
 
     }
     else{
-        int file_flag = (((struct Client_information *)userdata)->filedatas)[p].client_mode;
+        int file_flag = filedata(userdata, p).client_mode;
         if ((file_flag & O_ACCMODE) != O_RDONLY) {
             int ret_code = utimensat(0, full_path, ts, 0);
             if (ret_code < 0) {
@@ -1586,7 +4506,7 @@ int watdfs_cli_utimensat(void *userdata, const char *path,
             int fxn_ret = upload((Client_information*)userdata, path, full_path);
             if(fxn_ret < 0)
                 return fxn_ret;
-            (((struct Client_information*)userdata)->filedatas)[p].tc = time(0);
+            filedata(userdata, p).tc = time(0);
             return fxn_ret;
         }
         else{
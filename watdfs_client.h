@@ -50,6 +50,16 @@ int watdfs_cli_write(void *userdata, const char *path, const char *buf,
 int watdfs_cli_truncate(void *userdata, const char *path, off_t newsize);
 int watdfs_cli_fsync(void *userdata, const char *path,
                      struct fuse_file_info *fi);
+// Like watdfs_cli_fsync, but carries FUSE's datasync flag: if it is non-zero
+// only the file data is flushed on the server (fdatasync), not the inode
+// metadata. watdfs_cli_fsync is the datasync == 0 case.
+int watdfs_cli_fsync_datasync(void *userdata, const char *path, int datasync,
+                              struct fuse_file_info *fi);
+// The fsync handler of struct fuse_operations, with FUSE's own signature, for
+// a main whose FUSE private data is what watdfs_cli_init returned. It passes
+// datasync on, so fdatasync(2) on a mount flushes only data on the server; a
+// main that calls watdfs_cli_fsync gets a full fsync every time.
+int watdfs_cli_fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi);
 
 // CHANGE METADATA
 int watdfs_cli_utimensat(void *userdata, const char *path,
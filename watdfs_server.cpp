@@ -1,7 +1,23 @@
 
 #include "rpc.h"
 #include "debug.h"
+#include "io_engine.h"
+#include "fsync_batcher.h"
+#include "file_clone.h"
+#include "compress.h"
+#include "chunk_index.h"
+#include "checksum.h"
+#include "rpc_conn.h"
+#include "stripe.h"
+#include "stats.h"
+#include "trace.h"
+#include "rpc_sched.h"
+#include "write_credit.h"
+#include "work_pool.h"
+#include "watdfs_server.h"
+#ifndef WATDFS_SERVER_LIBRARY
 INIT_LOG
+#endif
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -12,18 +28,314 @@ INIT_LOG
 #include <fuse.h>
 #include <fcntl.h>
 #include <iostream>
+#include <algorithm>
 #include <map>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
 
 // Global state server_persist_dir.
 char *server_persist_dir = nullptr;
+// Whether deduplicated uploads are enabled (WATDFS_DEDUP=1).
+int dedup_enabled = 0;
+// Whether clients are offered write credit (see write_credit.h).
+int credit_enabled = 1;
+// The port of the multi-connection transport (see rpc_conn.h).
+int conn_port = 0;
 
 struct server_mode{
     int mode;
+    // The number of descriptors reading the live file in place.
+    int live_readers;
+    // Whether a writer is modifying the live file in place.
+    int inplace_writer;
+    // The private version a writer is building, published on release.
+    std::string version_path;
+    // A version is made on the writer's first change (see make_version);
+    // until then the writer's descriptor version_fd reads the live file.
+    bool version_made = false;
+    int version_fd = -1;
+    int version_flags = 0;
+    // Held shared by every write in place, and exclusively while the file is
+    // snapshotted or a version is made, so neither sees half of a write.
+    pthread_rwlock_t *data_lock = nullptr;
 };
 std::map<std::string, struct server_mode > filedatas;
 
+// Every open descriptor works on one version of its file, so that readers get
+// a stable view without ever waiting for writers:
+// - a reader opens the live file, unless a writer is modifying it in place,
+//   in which case it gets a private snapshot (a reflink clone where the file
+//   system supports it, a copy otherwise);
+// - a writer modifies the live file in place, unless readers have it open, in
+//   which case it writes a new version that replaces the live file on release.
+//   The version is made on the writer's first change, so a writer that
+//   changes nothing copies nothing, and one whose readers are gone by then
+//   writes in place after all.
+#define HANDLE_LIVE_READ 0
+#define HANDLE_SNAPSHOT_READ 1
+#define HANDLE_INPLACE_WRITE 2
+#define HANDLE_VERSION_WRITE 3
+
+struct server_handle {
+    std::string path;
+    int kind;
+    std::string version_path;
+};
+// Server descriptor -> the version it works on.
+std::map<int, struct server_handle> handles;
+// To protect filedatas and handles.
+pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int number = 0;
 
+// Whole-file uploads are staged in a file next to the target, named with this
+// marker, and renamed over the target on commit. Writer versions use the same
+// naming. Anything carrying the marker at startup never got committed.
+#define STAGE_MARKER ".watdfs-stage-"
+
+// The layout record of a striped file (see stripe.h) is kept next to it, in
+// a file named with this suffix.
+#define LAYOUT_SUFFIX ".watdfs-layout"
+
+// Staging descriptor -> staging file path, for uploads in progress.
+std::map<int, std::string> staged_uploads;
+pthread_mutex_t staged_uploads_lock = PTHREAD_MUTEX_INITIALIZER;
+// Makes staging file names unique.
+unsigned long stage_counter = 0;
+
+// Returns a fresh staging file name next to full_path.
+std::string stage_path_for(const char *full_path) {
+    pthread_mutex_lock(&staged_uploads_lock);
+    unsigned long id = stage_counter++;
+    pthread_mutex_unlock(&staged_uploads_lock);
+    return std::string(full_path) + STAGE_MARKER + std::to_string(getpid()) +
+           "-" + std::to_string(id);
+}
+
+// Whether name is that of a staging file: anything followed by the marker,
+// a pid, "-" and a counter, as stage_path_for makes them.
+static bool is_stage_name(const char *name) {
+    std::string file = name;
+    size_t at = file.rfind(STAGE_MARKER);
+    if (at == std::string::npos || at == 0) {
+        return false;
+    }
+    const char *suffix = name + at + strlen(STAGE_MARKER);
+    int dashes = 0;
+    int digits = 0;
+    for (const char *c = suffix; *c != 0; c++) {
+        if (*c == '-' && digits > 0 && dashes == 0) {
+            dashes++;
+            digits = 0;
+        } else if (*c >= '0' && *c <= '9') {
+            digits++;
+        } else {
+            return false;
+        }
+    }
+    return dashes == 1 && digits > 0;
+}
+
+// Make a rename into the directory of full_path durable, by syncing the
+// directory. Returns 0 or -errno.
+static int sync_parent(const char *full_path) {
+    std::string dir = full_path;
+    size_t slash = dir.rfind('/');
+    dir = slash == std::string::npos ? "." : slash == 0 ? "/" : dir.substr(0, slash);
+    int fd = io_engine_open(dir.c_str(), O_RDONLY | O_DIRECTORY, 0);
+    if (fd < 0) {
+        return fd;
+    }
+    int sys_ret = io_engine_fsync(fd, 0);
+    io_engine_close(fd);
+    return sys_ret;
+}
+
+struct clone_call {
+    int src_fd_;
+    int dst_fd_;
+};
+
+static int run_clone(void *arg) {
+    struct clone_call *call = (struct clone_call *)arg;
+    return file_clone(call->src_fd_, call->dst_fd_);
+}
+
+// Create a writer's private version of full_path at version_path, starting
+// from the current contents unless the writer truncates anyway. Returns the
+// descriptor or -errno.
+int open_version(const char *full_path, const char *version_path, int flags) {
+    mode_t mode = 0644;
+    struct stat statbuf;
+    if (io_engine_stat(full_path, &statbuf) == 0) {
+        mode = statbuf.st_mode & 07777;
+    }
+    int fd = io_engine_open(version_path, O_RDWR | O_CREAT | O_EXCL, mode);
+    if (fd < 0 || (flags & O_TRUNC)) {
+        return fd;
+    }
+    int src_fd = io_engine_open(full_path, O_RDONLY, 0);
+    struct clone_call clone = {src_fd, fd};
+    int ret = src_fd < 0 ? src_fd : work_pool_block(run_clone, &clone);
+    if (src_fd >= 0) io_engine_close(src_fd);
+    if (ret < 0) {
+        io_engine_close(fd);
+        io_engine_unlink(version_path);
+        return ret;
+    }
+    return fd;
+}
+
+static int lock_shared(void *arg) {
+    return pthread_rwlock_rdlock((pthread_rwlock_t *)arg);
+}
+
+static int lock_exclusive(void *arg) {
+    return pthread_rwlock_wrlock((pthread_rwlock_t *)arg);
+}
+
+// Take a file's data_lock, waiting through work_pool_block if it is held.
+static void data_lock_shared(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_tryrdlock(lock) != 0) {
+        work_pool_block(lock_shared, lock);
+    }
+}
+
+static void data_lock_exclusive(pthread_rwlock_t *lock) {
+    if (pthread_rwlock_trywrlock(lock) != 0) {
+        work_pool_block(lock_exclusive, lock);
+    }
+}
+
+// Make the version of the writer of key, before its first change: copy the
+// live file to the version and swap it in under the writer's descriptor. If
+// the readers have all gone, the writer writes the live file in place
+// instead. Returns 0 or -errno.
+static int make_version(const std::string &key, const char *full_path) {
+    pthread_mutex_lock(&files_lock);
+    pthread_rwlock_t *lock = filedatas[key].data_lock;
+    pthread_mutex_unlock(&files_lock);
+    data_lock_exclusive(lock);
+
+    pthread_mutex_lock(&files_lock);
+    struct server_mode &file = filedatas[key];
+    if (file.version_path.empty() || file.version_made || file.version_fd < 0) {
+        pthread_mutex_unlock(&files_lock);
+        pthread_rwlock_unlock(lock);
+        return 0;
+    }
+    int fd = file.version_fd;
+    int flags = file.version_flags & ~(O_CREAT | O_EXCL | O_TRUNC);
+    std::string version_path = file.version_path;
+    bool in_place = file.live_readers == 0;
+    if (in_place) {
+        handles[fd].kind = HANDLE_INPLACE_WRITE;
+        handles[fd].version_path.clear();
+        file.inplace_writer = 1;
+        file.version_path.clear();
+    }
+    file.version_made = true;
+    pthread_mutex_unlock(&files_lock);
+
+    int new_fd = in_place ? io_engine_open(full_path, flags, 0)
+                          : open_version(full_path, version_path.c_str(), flags);
+    int ret = new_fd < 0 ? new_fd : 0;
+    if (new_fd >= 0) {
+        if (dup2(new_fd, fd) < 0) ret = -errno;
+        io_engine_close(new_fd);
+    }
+    if (ret < 0) {
+        pthread_mutex_lock(&files_lock);
+        if (in_place) {
+            handles[fd].kind = HANDLE_VERSION_WRITE;
+            handles[fd].version_path = version_path;
+            file.inplace_writer = 0;
+            file.version_path = version_path;
+        } else {
+            io_engine_unlink(version_path.c_str());
+        }
+        file.version_made = false;
+        pthread_mutex_unlock(&files_lock);
+    }
+    pthread_rwlock_unlock(lock);
+    return ret;
+}
+
+// Changes through descriptor fh run between begin_write and end_write. The
+// writer's version is made first if it is still pending, and a write in
+// place holds the file's data_lock shared, which it sets *lock to (nullptr
+// otherwise). Returns 0 or -errno.
+static int begin_write(int fh, const char *full_path, pthread_rwlock_t **lock) {
+    *lock = nullptr;
+    pthread_mutex_lock(&files_lock);
+    auto it = handles.find(fh);
+    if (it == handles.end()) {
+        // A staging file, private to its upload.
+        pthread_mutex_unlock(&files_lock);
+        return 0;
+    }
+    std::string key = it->second.path;
+    struct server_mode &file = filedatas[key];
+    bool pending = it->second.kind == HANDLE_VERSION_WRITE && !file.version_made &&
+                   file.version_path == it->second.version_path;
+    pthread_mutex_unlock(&files_lock);
+    if (pending) {
+        int ret = make_version(key, full_path);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    pthread_mutex_lock(&files_lock);
+    it = handles.find(fh);
+    if (it != handles.end() && it->second.kind == HANDLE_INPLACE_WRITE) {
+        *lock = file.data_lock;
+    }
+    pthread_mutex_unlock(&files_lock);
+    if (*lock != nullptr) {
+        data_lock_shared(*lock);
+    }
+    return 0;
+}
+
+static void end_write(pthread_rwlock_t *lock) {
+    if (lock != nullptr) {
+        pthread_rwlock_unlock(lock);
+    }
+}
+
+// Path-based operations on a file that a writer is versioning must land in
+// the writer's version, or the publish would undo them. A pending version is
+// made first. Sets *lock as begin_write does, for changes to the live file.
+std::string current_version_path(const char *short_path, const char *full_path,
+                                 pthread_rwlock_t **lock) {
+    std::string key = short_path;
+    *lock = nullptr;
+    pthread_mutex_lock(&files_lock);
+    auto it = filedatas.find(key);
+    bool pending = it != filedatas.end() && !it->second.version_path.empty() &&
+                   !it->second.version_made;
+    pthread_mutex_unlock(&files_lock);
+    if (pending) {
+        make_version(key, full_path);
+    }
+    std::string target = full_path;
+    pthread_mutex_lock(&files_lock);
+    it = filedatas.find(key);
+    if (it != filedatas.end() && !it->second.version_path.empty()) {
+        target = it->second.version_path;
+    } else if (it != filedatas.end() && it->second.inplace_writer) {
+        *lock = it->second.data_lock;
+    }
+    pthread_mutex_unlock(&files_lock);
+    if (*lock != nullptr) {
+        data_lock_shared(*lock);
+    }
+    return target;
+}
+
 // Important: the server needs to handle multiple concurrent client requests.
 // You have to be carefuly in handling global variables, esp. for updating them.
 // Hint: use locks before you update any global variable.
@@ -72,12 +384,12 @@ int watdfs_getattr(int *argTypes, void **args) {
     (void)statbuf;
     // Let sys_ret be the return code from the stat system call.
     int sys_ret = 0;
-    sys_ret = stat(full_path,statbuf);
+    sys_ret = io_engine_stat(full_path,statbuf);
 
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
-        // be -errno.
-        *ret = -errno;
+        // be -errno, which the io engine already hands back.
+        *ret = sys_ret;
     }
 
     // Clean up the full path, it was allocated on the heap.
@@ -121,35 +433,97 @@ int watdfs_open(int *argTypes, void **args){
     *ret = 0;
     int sys_ret = 0;
     (void)fi;
+    std::string key = std::string(short_path);
+    bool writing = (fi->flags & O_ACCMODE) != O_RDONLY;
 
-    bool is_file_open = filedatas.find(std::string(short_path)) != filedatas.end();
+    pthread_mutex_lock(&files_lock);
+    bool is_file_open = filedatas.find(key) != filedatas.end();
     DLOG("is_file_open: %d",is_file_open);
     if(!is_file_open){
         DLOG("file has not been opened.");
         struct server_mode newfile;
         newfile.mode = (fi->flags) & O_ACCMODE;
-        filedatas[std::string(short_path)] = newfile;
+        newfile.live_readers = 0;
+        newfile.inplace_writer = 0;
+        filedatas[key] = newfile;
         DLOG("Add new file into server.");
     }
-    else if((filedatas[std::string(short_path)].mode) != O_RDONLY){
-        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    else if((filedatas[key].mode) != O_RDONLY){
+        if (writing) {
+            pthread_mutex_unlock(&files_lock);
+            free(full_path);
             *ret = -EACCES;
             return 0;
         }
     }
-    else if((filedatas[std::string(short_path)].mode)== O_RDONLY){
-        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
-            filedatas[std::string(short_path)].mode = O_RDWR;
+    else if((filedatas[key].mode)== O_RDONLY){
+        if (writing) {
+            filedatas[key].mode = O_RDWR;
         }
     }
 
+    // Pick the version this descriptor works on, see server_handle.
+    struct server_mode &file = filedatas[key];
+    if (file.data_lock == nullptr) {
+        file.data_lock = new pthread_rwlock_t;
+        pthread_rwlock_init(file.data_lock, nullptr);
+    }
+    pthread_rwlock_t *data_lock = file.data_lock;
+    struct server_handle handle;
+    handle.path = key;
+    if (!writing) {
+        handle.kind = file.inplace_writer ? HANDLE_SNAPSHOT_READ : HANDLE_LIVE_READ;
+        if (handle.kind == HANDLE_LIVE_READ) file.live_readers++;
+    } else if (file.live_readers > 0) {
+        handle.kind = HANDLE_VERSION_WRITE;
+        handle.version_path = stage_path_for(full_path);
+        file.version_path = handle.version_path;
+        file.version_made = false;
+        file.version_fd = -1;
+        file.version_flags = fi->flags;
+    } else {
+        handle.kind = HANDLE_INPLACE_WRITE;
+        file.inplace_writer = 1;
+    }
+    pthread_mutex_unlock(&files_lock);
+
+    // Cloning may copy the whole file, so it happens outside files_lock. A
+    // snapshot holds the file's data_lock, so the writer's writes in place
+    // wait for it. A writer's version starts out as a read-only descriptor of
+    // the live file, and is made on its first change, unless it truncates
+    // the file and there is nothing to copy.
+    if (handle.kind == HANDLE_SNAPSHOT_READ) {
+        data_lock_exclusive(data_lock);
+        sys_ret = work_pool_block([](void *path) {
+            return file_open_snapshot((const char *)path);
+        }, full_path);
+        pthread_rwlock_unlock(data_lock);
+    } else if (handle.kind == HANDLE_VERSION_WRITE && (fi->flags & O_TRUNC)) {
+        sys_ret = open_version(full_path, handle.version_path.c_str(), fi->flags);
+    } else if (handle.kind == HANDLE_VERSION_WRITE) {
+        sys_ret = io_engine_open(full_path, O_RDONLY, 0);
+    } else {
+        sys_ret = io_engine_open(full_path,fi->flags,0);
+    }
 
-    sys_ret = open(full_path,fi->flags);
+    pthread_mutex_lock(&files_lock);
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
-        // be -errno.
-        *ret = -errno;
+        // be -errno. Undo the bookkeeping, or the failed writer would lock
+        // every later writer out.
+        *ret = sys_ret;
+        if (handle.kind == HANDLE_LIVE_READ) file.live_readers--;
+        if (handle.kind == HANDLE_INPLACE_WRITE) file.inplace_writer = 0;
+        if (handle.kind == HANDLE_VERSION_WRITE) file.version_path.clear();
+        if (writing) file.mode = O_RDONLY;
+    } else {
+        handles[sys_ret] = handle;
+        if (handle.kind == HANDLE_VERSION_WRITE && file.version_path == handle.version_path) {
+            file.version_made = (fi->flags & O_TRUNC) != 0;
+            file.version_fd = sys_ret;
+        }
     }
+    pthread_mutex_unlock(&files_lock);
     fi->fh = sys_ret;
     // Clean up the full path, it was allocated on the heap.
     free(full_path);
@@ -167,16 +541,68 @@ int watdfs_release(int *argTypes, void **args){
     *ret = 0;
     int sys_ret = 0;
     (void)fi;
-    sys_ret = close(fi->fh);
+
+    // Drop the descriptor from the version bookkeeping. A writer's private
+    // version becomes the live file once it is released, unless a staged
+    // upload replaced the file in the meantime.
+    std::string publish_path;
+    bool modified = false;
+    pthread_mutex_lock(&files_lock);
+    auto it = handles.find(fi->fh);
+    if (it != handles.end()) {
+        struct server_mode &file = filedatas[it->second.path];
+        switch (it->second.kind) {
+        case HANDLE_LIVE_READ:
+            file.live_readers--;
+            break;
+        case HANDLE_INPLACE_WRITE:
+            file.inplace_writer = 0;
+            modified = true;
+            break;
+        case HANDLE_VERSION_WRITE:
+            // A version that was never made has nothing to publish.
+            if (file.version_path == it->second.version_path) {
+                if (file.version_made) publish_path = it->second.version_path;
+                file.version_path.clear();
+                file.version_fd = -1;
+            }
+            break;
+        }
+        handles.erase(it);
+    }
+    pthread_mutex_unlock(&files_lock);
+
+    if (!publish_path.empty()) {
+        sys_ret = fsync_batcher_sync(fi->fh, 0);
+        if (sys_ret == 0) {
+            sys_ret = io_engine_rename(publish_path.c_str(), full_path);
+            if (sys_ret == 0) {
+                sys_ret = sync_parent(full_path);
+            }
+        }
+        if (sys_ret < 0) {
+            io_engine_unlink(publish_path.c_str());
+            *ret = sys_ret;
+        } else {
+            modified = true;
+        }
+    }
+    if (modified && dedup_enabled) {
+        chunk_index_add_file(short_path);
+    }
+
+    sys_ret = io_engine_close(fi->fh);
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
         // be -errno.
-        *ret = -errno;
+        *ret = sys_ret;
     }
     else{
         if ((fi->flags & O_ACCMODE) != O_RDONLY) {
             DLOG("remove the file from the server");
+            pthread_mutex_lock(&files_lock);
             filedatas[std::string(short_path)].mode = O_RDONLY;
+            pthread_mutex_unlock(&files_lock);
         }
     }
 
@@ -185,7 +611,7 @@ int watdfs_release(int *argTypes, void **args){
 
     //DLOG("Returning code: %d", *ret);
     // The RPC call succeeded, so return 0.
-    DLOG("After release, the rest number %d",filedatas.size());
+    DLOG("After release, the rest number %zu",filedatas.size());
     return 0;
 }
 
@@ -195,17 +621,20 @@ int watdfs_read(int *argTypes, void **args){
     long *size = (long *)args[2];
     long *offset = (long *)args[3];
     struct fuse_file_info *fi = (struct fuse_file_info *)args[4];
-    int *ret = (int *)args[5];
+    int *kind = (int *)args[5];
+    long *checksum = (long *)args[6];
+    int *ret = (int *)args[7];
     char *full_path = get_full_path(short_path);
     *ret = 0;
+    *checksum = 0;
     int sys_ret = 0;
     (void)fi;
     (void)buf;
     DLOG("offset before: %d\n", *offset);
-    sys_ret = pread(fi->fh,buf,*size,*offset);
-    DLOG("buf after: %s\n", buf);
-    if (sys_ret == -1)
-        sys_ret = -errno;
+    sys_ret = io_engine_pread(fi->fh,buf,*size,*offset);
+    if (sys_ret > 0) {
+        *checksum = checksum_compute(*kind, buf, sys_ret);
+    }
     *ret = sys_ret;
     return sys_ret;
 }
@@ -216,19 +645,284 @@ int watdfs_write(int *argTypes, void **args){
     long *size = (long *)args[2];
     long *offset = (long *)args[3];
     struct fuse_file_info *fi = (struct fuse_file_info *)args[4];
-    int *ret = (int *)args[5];
-    char *full_path = get_full_path(short_path);
+    int *kind = (int *)args[5];
+    long *checksum = (long *)args[6];
+    int *ret = (int *)args[7];
     *ret = 0;
     int sys_ret = 0;
-    (void)fi;
-    DLOG("buf: %s\n",buf);
-    sys_ret = pwrite(fi->fh,buf,*size,*offset);
-    if (sys_ret < 0)
-        sys_ret = -errno;
+    if (*size < 0 || *size > (argTypes[1] & 0xffff)) {
+        *ret = -EINVAL;
+        return 0;
+    }
+    // Refuse a chunk that was corrupted on the way; the client sends it again.
+    if (*kind != CHECKSUM_NONE &&
+        checksum_compute(*kind, buf, *size) != (uint64_t)*checksum) {
+        DLOG("write: checksum mismatch at %ld", *offset);
+        *ret = -EBADMSG;
+        return 0;
+    }
+    char *full_path = get_full_path(short_path);
+    pthread_rwlock_t *lock;
+    sys_ret = begin_write(fi->fh, full_path, &lock);
+    free(full_path);
+    if (sys_ret < 0) {
+        *ret = sys_ret;
+        return 0;
+    }
+    long start = stats_now_ns();
+    sys_ret = io_engine_pwrite(fi->fh,buf,*size,*offset);
+    write_credit_record(*size, stats_now_ns() - start);
+    end_write(lock);
     *ret = sys_ret;
     return sys_ret;
 }
 
+// Report the optional features this server supports.
+int watdfs_caps(int *argTypes, void **args){
+    int *client_caps = (int *)args[0];
+    int *server_caps = (int *)args[1];
+    int *ret = (int *)args[2];
+    (void)client_caps;
+    *server_caps = WATDFS_CAP_LZ4;
+    if (dedup_enabled) {
+        *server_caps |= WATDFS_CAP_DEDUP;
+    }
+    if (credit_enabled) {
+        *server_caps |= WATDFS_CAP_CREDIT;
+    }
+    *ret = 0;
+    return 0;
+}
+
+// Grant the calling client its window of write bytes for the current period
+// (see write_credit.h).
+int watdfs_write_credit(int *argTypes, void **args){
+    long *window = (long *)args[0];
+    long *period_left_ns = (long *)args[1];
+    int *ret = (int *)args[2];
+    const char *client = rpc_conn_peer();
+    *window = write_credit_grant(client != nullptr ? client : "librpc", period_left_ns);
+    *ret = 0;
+    return 0;
+}
+
+// The latency histograms of the RPCs served so far (see stats.h), as text,
+// cut to the length of the array.
+int watdfs_stats(int *argTypes, void **args){
+    char *report = (char *)args[0];
+    int *ret = (int *)args[1];
+    size_t len = argTypes[0] & 0xffff;
+    std::string text = stats_report();
+    if (len > 0) {
+        memset(report, 0, len);
+        memcpy(report, text.data(), std::min(text.size(), len - 1));
+    }
+    *ret = 0;
+    return 0;
+}
+
+// Report the port of the multi-connection transport, so the client can open
+// extra connections to this server.
+int watdfs_conn_port(int *argTypes, void **args){
+    int *port = (int *)args[0];
+    int *ret = (int *)args[1];
+    *port = conn_port;
+    *ret = 0;
+    return 0;
+}
+
+// Return the layout record of a file. A file without one gets an all-zero
+// record, which means it is not striped.
+int watdfs_layout_get(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    char *record = (char *)args[1];
+    int *ret = (int *)args[2];
+    *ret = 0;
+    if ((argTypes[1] & 0xffff) < STRIPE_LAYOUT_LEN) {
+        *ret = -EINVAL;
+        return 0;
+    }
+    char *full_path = get_full_path(short_path);
+    memset(record, 0, STRIPE_LAYOUT_LEN);
+
+    struct stat statbuf;
+    int sys_ret = io_engine_stat(full_path, &statbuf);
+    if (sys_ret < 0) {
+        *ret = sys_ret;
+    } else {
+        std::string layout_path = std::string(full_path) + LAYOUT_SUFFIX;
+        int fd = io_engine_open(layout_path.c_str(), O_RDONLY, 0);
+        if (fd >= 0) {
+            sys_ret = io_engine_pread(fd, record, STRIPE_LAYOUT_LEN, 0);
+            if (sys_ret != (int)STRIPE_LAYOUT_LEN) {
+                memset(record, 0, STRIPE_LAYOUT_LEN);
+            }
+            io_engine_close(fd);
+        }
+    }
+    free(full_path);
+    return 0;
+}
+
+// Store the layout record of a file, which must exist.
+int watdfs_layout_set(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    char *record = (char *)args[1];
+    int *ret = (int *)args[2];
+    *ret = 0;
+    if ((argTypes[1] & 0xffff) < STRIPE_LAYOUT_LEN) {
+        *ret = -EINVAL;
+        return 0;
+    }
+    char *full_path = get_full_path(short_path);
+
+    struct stat statbuf;
+    int sys_ret = io_engine_stat(full_path, &statbuf);
+    if (sys_ret < 0) {
+        *ret = sys_ret;
+    } else {
+        std::string layout_path = std::string(full_path) + LAYOUT_SUFFIX;
+        int fd = io_engine_open(layout_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            *ret = fd;
+        } else {
+            sys_ret = io_engine_pwrite(fd, record, STRIPE_LAYOUT_LEN, 0);
+            if (sys_ret < 0) {
+                *ret = sys_ret;
+            } else {
+                *ret = io_engine_fsync(fd, 0);
+            }
+            io_engine_close(fd);
+        }
+    }
+    free(full_path);
+    return 0;
+}
+
+// Compressed read: fill the output buffer with frames (see compress.h) of
+// consecutive file data, starting at offset, until it is full, want_raw bytes
+// are covered, or the file ends. The return code is the raw byte count, and
+// the checksum covers those raw bytes.
+int watdfs_read_z(int *argTypes, void **args){
+    char *frames = (char *)args[1];
+    long *out_cap = (long *)args[2];
+    long *want_raw = (long *)args[3];
+    long *offset = (long *)args[4];
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[5];
+    long *encoded_len = (long *)args[6];
+    int *kind = (int *)args[7];
+    long *checksum = (long *)args[8];
+    int *ret = (int *)args[9];
+    *ret = 0;
+    *encoded_len = 0;
+    *checksum = 0;
+
+    // The raw bytes are kept until the end, since XXH3 is not incremental.
+    std::vector<char> raw;
+    long used = 0;
+    long total_raw = 0;
+    while (total_raw < *want_raw) {
+        long want = *want_raw - total_raw;
+        if (want > COMPRESS_BLOCK_SIZE) want = COMPRESS_BLOCK_SIZE;
+        // Stop while a stored (worst case) frame is still sure to fit.
+        if (*out_cap - used < COMPRESS_FRAME_HEADER + want) break;
+        raw.resize(total_raw + want);
+        ssize_t n = io_engine_pread(fi->fh, raw.data() + total_raw, want, *offset + total_raw);
+        if (n < 0) {
+            if (total_raw == 0) *ret = n;
+            break;
+        }
+        if (n == 0) break;
+        used += compress_frame_encode(raw.data() + total_raw, n, frames + used,
+                                      *out_cap - used);
+        total_raw += n;
+        if (n < want) break;
+    }
+    *checksum = checksum_compute(*kind, raw.data(), total_raw);
+
+    *encoded_len = used;
+    if (*ret == 0) *ret = total_raw;
+    return 0;
+}
+
+// Compressed write: decode the frames, check the raw bytes against the
+// checksum, and write them at offset. The return code is the raw byte count
+// written, or -EBADMSG if the data was corrupted on the way.
+int watdfs_write_z(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    char *frames = (char *)args[1];
+    long *frames_len = (long *)args[2];
+    long *offset = (long *)args[3];
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[4];
+    int *kind = (int *)args[5];
+    long *checksum = (long *)args[6];
+    int *ret = (int *)args[7];
+    *ret = 0;
+
+    // Size the raw buffer from the frame headers, so the whole message is
+    // checked before any of it is written.
+    if (*frames_len < 0 || *frames_len > MAX_ARRAY_LEN) {
+        *ret = -EBADMSG;
+        return 0;
+    }
+    long pos = 0;
+    long raw_total = 0;
+    while (pos < *frames_len) {
+        size_t raw_len;
+        size_t frame = compress_frame_size(frames + pos, *frames_len - pos, &raw_len);
+        if (frame == 0) {
+            *ret = -EBADMSG;
+            return 0;
+        }
+        pos += frame;
+        raw_total += raw_len;
+    }
+
+    if (raw_total > (long)MAX_ARRAY_LEN * COMPRESS_MAX_RATIO) {
+        *ret = -EBADMSG;
+        return 0;
+    }
+    char *raw = (char *)malloc(raw_total > 0 ? raw_total : 1);
+    if (raw == nullptr) {
+        *ret = -ENOMEM;
+        return 0;
+    }
+    pos = 0;
+    long decoded = 0;
+    while (pos < *frames_len) {
+        size_t raw_len;
+        size_t frame = compress_frame_size(frames + pos, *frames_len - pos, &raw_len);
+        long n = compress_frame_decode(frames + pos, frame, raw + decoded,
+                                       raw_total - decoded);
+        if (n < 0) {
+            *ret = -EBADMSG;
+            break;
+        }
+        pos += frame;
+        decoded += n;
+    }
+    if (*ret == 0 && *kind != CHECKSUM_NONE &&
+        checksum_compute(*kind, raw, decoded) != (uint64_t)*checksum) {
+        DLOG("write_z: checksum mismatch at %ld", *offset);
+        *ret = -EBADMSG;
+    }
+    pthread_rwlock_t *lock = nullptr;
+    if (*ret == 0) {
+        char *full_path = get_full_path(short_path);
+        *ret = begin_write(fi->fh, full_path, &lock);
+        free(full_path);
+    }
+    if (*ret == 0) {
+        long start = stats_now_ns();
+        ssize_t written = io_engine_pwrite(fi->fh, raw, decoded, *offset);
+        write_credit_record(*frames_len, stats_now_ns() - start);
+        *ret = written;
+    }
+    end_write(lock);
+    free(raw);
+    return 0;
+}
+
 int watdfs_truncate(int *argTypes, void **args){
     char *short_path = (char *)args[0];
     long *new_size = (long *) args[1];
@@ -236,32 +930,270 @@ int watdfs_truncate(int *argTypes, void **args){
     *ret = 0;
     char *full_path = get_full_path(short_path);
     int sys_ret = 0;
-    sys_ret = truncate(full_path,*new_size);
+    pthread_rwlock_t *lock;
+    std::string target = current_version_path(short_path, full_path, &lock);
+    sys_ret = io_engine_truncate(target.c_str(),*new_size);
+    end_write(lock);
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
         // be -errno.
-        *ret = -errno;
+        *ret = sys_ret;
     }
 
+    free(full_path);
     return 0;
 }
 
 //fsync
 int watdfs_fsync(int *argTypes, void **args){
     struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
-    int *ret = (int *)args[2];
+    int *datasync = (int *)args[2];
+    long *range_start = (long *)args[3];
+    long *range_len = (long *)args[4];
+    int *ret = (int *)args[5];
     *ret = 0;
     int sys_ret = 0;
     (void)fi;
-    sys_ret = fsync(fi->fh);
+    if (*datasync && *range_len > 0) {
+        // Start writeback of just the dirty range now, so it overlaps with
+        // the group commit window. This is not durable on its own; the
+        // fdatasync below is what makes it so.
+        sync_file_range(fi->fh, *range_start, *range_len, SYNC_FILE_RANGE_WRITE);
+    }
+    // Concurrent fsyncs are merged into one group commit. With datasync the
+    // flush is an fdatasync, which skips inode metadata that is not needed
+    // to read the data back.
+    sys_ret = fsync_batcher_sync(fi->fh,*datasync);
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
         // be -errno.
-        *ret = -errno;
+        *ret = sys_ret;
+    }
+    return 0;
+}
+
+// Start a staged whole-file upload: create an empty staging file with the
+// permissions of the target and hand its descriptor back in fi->fh.
+int watdfs_upload_begin(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
+    int *ret = (int *)args[2];
+    char *full_path = get_full_path(short_path);
+    *ret = 0;
+
+    mode_t mode = 0644;
+    struct stat statbuf;
+    if (io_engine_stat(full_path, &statbuf) == 0) {
+        mode = statbuf.st_mode & 07777;
+    }
+
+    std::string stage_path = stage_path_for(full_path);
+
+    int sys_ret = io_engine_open(stage_path.c_str(), O_RDWR | O_CREAT | O_EXCL, mode);
+    if (sys_ret < 0) {
+        *ret = sys_ret;
+    } else {
+        fi->fh = sys_ret;
+        pthread_mutex_lock(&staged_uploads_lock);
+        staged_uploads[sys_ret] = stage_path;
+        pthread_mutex_unlock(&staged_uploads_lock);
+        DLOG("upload_begin: staging %s as %s", full_path, stage_path.c_str());
+    }
+
+    free(full_path);
+    return 0;
+}
+
+// Commit a staged upload: set the timestamps, make the staging file durable,
+// then rename it over the target and sync the directory, so the rename is
+// durable too. rename is atomic, so readers see either the old or the new
+// contents, and readers with the old file open keep it.
+int watdfs_upload_commit(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
+    const struct timespec *ts = (const struct timespec *)args[2];
+    int *ret = (int *)args[3];
+    *ret = 0;
+
+    pthread_mutex_lock(&staged_uploads_lock);
+    auto it = staged_uploads.find(fi->fh);
+    if (it == staged_uploads.end()) {
+        pthread_mutex_unlock(&staged_uploads_lock);
+        *ret = -EBADF;
+        return 0;
+    }
+    std::string stage_path = it->second;
+    staged_uploads.erase(it);
+    pthread_mutex_unlock(&staged_uploads_lock);
+
+    char *full_path = get_full_path(short_path);
+    int fd = fi->fh;
+    int sys_ret = io_engine_futimens(fd, ts);
+    if (sys_ret == 0) {
+        sys_ret = fsync_batcher_sync(fd, 0);
+    }
+    if (sys_ret == 0) {
+        sys_ret = io_engine_rename(stage_path.c_str(), full_path);
+        if (sys_ret == 0) {
+            sys_ret = sync_parent(full_path);
+        }
+    }
+    if (sys_ret < 0) {
+        io_engine_unlink(stage_path.c_str());
+        *ret = sys_ret;
+    } else {
+        // The upload supersedes any version the uploader's own open started.
+        std::string superseded;
+        pthread_mutex_lock(&files_lock);
+        auto file = filedatas.find(std::string(short_path));
+        if (file != filedatas.end()) {
+            superseded.swap(file->second.version_path);
+        }
+        pthread_mutex_unlock(&files_lock);
+        if (!superseded.empty()) {
+            io_engine_unlink(superseded.c_str());
+        }
+        if (dedup_enabled) {
+            chunk_index_add_file(short_path);
+        }
+    }
+    io_engine_close(fd);
+
+    free(full_path);
+    return 0;
+}
+
+// Deduplicated upload, step one: report which of count chunk IDs (packed in
+// ids) the chunk index knows, one byte per ID in present. The answer covers
+// the files of all clients.
+int watdfs_chunks_has(int *argTypes, void **args){
+    const unsigned char *ids = (const unsigned char *)args[0];
+    int *count = (int *)args[1];
+    char *present = (char *)args[2];
+    int *ret = (int *)args[3];
+    *ret = 0;
+    if (!dedup_enabled) {
+        *ret = -ENOSYS;
+        return 0;
+    }
+    // count comes from the client; the arrays are only as long as argTypes
+    // says.
+    long ids_len = argTypes[0] & 0xffff;
+    long present_len = argTypes[2] & 0xffff;
+    if (*count < 0 || (long)*count * SHA256_DIGEST_LEN > ids_len || *count > present_len) {
+        *ret = -EINVAL;
+        return 0;
+    }
+
+    int known = 0;
+    for (int i = 0; i < *count; i++) {
+        present[i] = chunk_index_has(ids + i * SHA256_DIGEST_LEN);
+        known += present[i];
+    }
+    DLOG("chunks_has: %d of %d chunks known", known, *count);
+    *ret = known;
+    return 0;
+}
+
+// Deduplicated upload, step two: copy count chunks (packed chunk_refs) from
+// where the server already has them into the staging file. placed gets one
+// byte per chunk; the client sends the ones that could not be placed. The
+// return code is the number of bytes placed.
+int watdfs_write_chunks(int *argTypes, void **args){
+    char *short_path = (char *)args[0];
+    const struct chunk_ref *refs = (const struct chunk_ref *)args[1];
+    int *count = (int *)args[2];
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[3];
+    char *placed = (char *)args[4];
+    int *ret = (int *)args[5];
+    *ret = 0;
+    if (!dedup_enabled) {
+        *ret = -ENOSYS;
+        return 0;
+    }
+    long refs_len = argTypes[1] & 0xffff;
+    long placed_len = argTypes[4] & 0xffff;
+    if (*count < 0 || (long)(*count * sizeof(struct chunk_ref)) > refs_len ||
+        *count > placed_len) {
+        *ret = -EINVAL;
+        return 0;
+    }
+
+    char *full_path = get_full_path(short_path);
+    pthread_rwlock_t *lock;
+    int sys_ret = begin_write(fi->fh, full_path, &lock);
+    free(full_path);
+    if (sys_ret < 0) {
+        *ret = sys_ret;
+        return 0;
+    }
+    long total = 0;
+    for (int i = 0; i < *count; i++) {
+        long n = chunk_index_place(&refs[i], fi->fh);
+        placed[i] = n > 0;
+        if (n > 0) total += n;
+    }
+    end_write(lock);
+    *ret = total;
+    return 0;
+}
+
+// Abandon a staged upload, leaving the target untouched.
+int watdfs_upload_abort(int *argTypes, void **args){
+    struct fuse_file_info *fi = (struct fuse_file_info *)args[1];
+    int *ret = (int *)args[2];
+    *ret = 0;
+
+    pthread_mutex_lock(&staged_uploads_lock);
+    auto it = staged_uploads.find(fi->fh);
+    if (it == staged_uploads.end()) {
+        pthread_mutex_unlock(&staged_uploads_lock);
+        *ret = -EBADF;
+        return 0;
     }
+    std::string stage_path = it->second;
+    staged_uploads.erase(it);
+    pthread_mutex_unlock(&staged_uploads_lock);
+
+    io_engine_close(fi->fh);
+    io_engine_unlink(stage_path.c_str());
     return 0;
 }
 
+// Remove staging files left behind by uploads that never committed, e.g.
+// because the client or the server died midway.
+void remove_stale_stages() {
+    DIR *dir = opendir(server_persist_dir);
+    if (dir == nullptr) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (is_stage_name(entry->d_name)) {
+            std::string stale = std::string(server_persist_dir) + "/" + entry->d_name;
+            DLOG("removing stale staging file %s", stale.c_str());
+            unlink(stale.c_str());
+        }
+    }
+    closedir(dir);
+}
+
+// Queue every file already under server_persist_dir for the chunk index.
+void index_existing_files() {
+    DIR *dir = opendir(server_persist_dir);
+    if (dir == nullptr) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG && !is_stage_name(entry->d_name) &&
+            strstr(entry->d_name, LAYOUT_SUFFIX) == nullptr) {
+            chunk_index_add_file((std::string("/") + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+}
+
 //utimensat
 int watdfs_utimensat(int *argTypes, void **args){
     char *short_path = (char *)args[0];
@@ -273,47 +1205,200 @@ int watdfs_utimensat(int *argTypes, void **args){
     (void)ts;
     DLOG("full path: %s\n",full_path);
     //DLOG("ts2: %ld %ld\n",ts->tv_sec,ts->tv_nsec);
-    sys_ret = utimensat(0,full_path, ts,AT_SYMLINK_NOFOLLOW);
+    pthread_rwlock_t *lock;
+    std::string target = current_version_path(short_path, full_path, &lock);
+    sys_ret = utimensat(0,target.c_str(), ts,AT_SYMLINK_NOFOLLOW);
     if (sys_ret < 0) {
         // If there is an error on the system call, then the return code should
         // be -errno.
         DLOG("you bao cuo");
         *ret = -errno;
     }
+    end_write(lock);
     return 0;
 }
 
 
 
-// The main function of the server.
-int main(int argc, char *argv[]) {
-    // argv[1] should contain the directory where you should store data on the
-    // server. If it is not present it is an error, that we cannot recover from.
-    if (argc != 2) {
-        // In general you shouldn't print to stderr or stdout, but it may be
-        // helpful here for debugging. Important: Make sure you turn off logging
-        // prior to submission!
-        // See watdfs_client.c for more details
-        // # ifdef PRINT_ERR
-        // std::cerr << "Usaage:" << argv[0] << " server_persist_dir";
-        // #endif
-        return -1;
+// Whether skeletons are registered with librpc as well as rpc_conn.
+static int with_librpc = 1;
+
+// The RPCs that move file data, scheduled as bulk (see rpc_sched.h); the others
+// are metadata.
+static int rpc_class(const char *name) {
+    static const char *const bulk[] = {"read", "write", "read_z", "write_z",
+                                       "write_chunks", "upload_commit", "fsync"};
+    for (const char *b : bulk) {
+        if (strcmp(name, b) == 0) {
+            return SCHED_BULK;
+        }
     }
-    // Store the directory in a global variable.
-    server_persist_dir = argv[1];
+    return SCHED_METADATA;
+}
 
-    // TODO: Initialize the rpc library by calling `rpcServerInit`.
-    // Important: `rpcServerInit` prints the 'export SERVER_ADDRESS' and
-    // 'export SERVER_PORT' lines. Make sure you *do not* print anything
-    // to *stdout* before calling `rpcServerInit`.
-    //DLOG("Initializing server...");
-    int return_code = rpcServerInit();
+// The bytes a call moves: the sizes of its array arguments.
+static long call_cost(int *argTypes) {
+    long cost = 0;
+    for (int i = 0; argTypes[i] != 0; i++) {
+        if (argTypes[i] & (1u << ARG_ARRAY)) {
+            cost += argTypes[i] & 0xffff;
+        }
+    }
+    return cost;
+}
+
+// Skeleton F, run on the work pool when the scheduler gives it a turn, and
+// recording how long every call takes in its histogram. write_credit needs
+// rpc_conn_peer, so it stays on the thread that got the call.
+template <skeleton F>
+struct Timed_skeleton {
+    static const char *name;
+    static int histogram;
+    static int sched_class;
+    static int on_pool;
+    struct Call {
+        int *argTypes;
+        void **args;
+        uint64_t request;
+    };
+    static int run(void *arg) {
+        struct Call *c = (struct Call *)arg;
+        uint64_t saved = trace_request();
+        trace_set_request(c->request);
+        int ret = F(c->argTypes, c->args);
+        trace_set_request(saved);
+        return ret;
+    }
+    static int call(int *argTypes, void **args) {
+        const char *client = rpc_conn_peer();
+        long queued = stats_now_ns();
+        int waited = sched_enter(client != nullptr ? client : "librpc", sched_class,
+                                 call_cost(argTypes));
+        long start = stats_now_ns();
+        struct Call c = {argTypes, args, trace_request()};
+        int ret = on_pool ? work_pool_run(run, &c) : F(argTypes, args);
+        long end = stats_now_ns();
+        sched_exit(sched_class);
+        stats_record(histogram, end - start);
+        if (waited) {
+            trace_span("sched", name, queued, start);
+        }
+        trace_span("server", name, start, end);
+        return ret;
+    }
+};
+template <skeleton F>
+const char *Timed_skeleton<F>::name = "";
+template <skeleton F>
+int Timed_skeleton<F>::histogram = -1;
+template <skeleton F>
+int Timed_skeleton<F>::sched_class = SCHED_METADATA;
+template <skeleton F>
+int Timed_skeleton<F>::on_pool = 1;
+
+// Register skeleton F with librpc and with the multi-connection transport, so
+// every call can arrive over either, scheduled and timed as server.<name>.
+template <skeleton F>
+static int register_rpc(const char *name, int *argTypes) {
+    Timed_skeleton<F>::name = name;
+    Timed_skeleton<F>::sched_class = rpc_class(name);
+    Timed_skeleton<F>::on_pool = strcmp(name, "write_credit") != 0;
+    Timed_skeleton<F>::histogram = stats_histogram((std::string("server.") + name).c_str());
+    skeleton f = Timed_skeleton<F>::call;
+    if (with_librpc) {
+        int ret = rpcRegister((char *)name, argTypes, f);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return rpc_conn_register(name, argTypes, f);
+}
 
+int watdfs_server_setup(char *persist_dir, int librpc) {
+    with_librpc = librpc;
+    // Store the directory in a global variable.
+    server_persist_dir = persist_dir;
+    remove_stale_stages();
     int ret = 0;
-    // TODO: If there is an error with `rpcServerInit`, it maybe useful to have
-    // debug-printing here, and then you should return.
-    if(return_code<0){
-        return return_code;
+
+    // Set up the disk I/O engine. It falls back to blocking syscalls on its own
+    // if io_uring is not available, so there is no error to handle here.
+    io_engine_init(IO_ENGINE_QUEUE_DEPTH);
+
+    // Run the skeletons on a work-stealing pool when WATDFS_POOL_WORKERS is
+    // set, to a number of workers or "cores" for one per core, with
+    // WATDFS_POOL_SPARES threads to stand in for workers blocked on the disk.
+    // WATDFS_POOL_NUMA=1 pins the workers. Without it every skeleton runs on
+    // the thread that received the call.
+    const char *pool_env = getenv("WATDFS_POOL_WORKERS");
+    if (pool_env != nullptr && (strcmp(pool_env, "cores") == 0 || atoi(pool_env) > 0)) {
+        int spares = WORK_POOL_SPARES;
+        if (getenv("WATDFS_POOL_SPARES") != nullptr) {
+            spares = atoi(getenv("WATDFS_POOL_SPARES"));
+        }
+        const char *numa_env = getenv("WATDFS_POOL_NUMA");
+        ret = work_pool_init(atoi(pool_env), spares,
+                             numa_env != nullptr && strcmp(numa_env, "1") == 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    // Set up fsync group commit. WATDFS_FSYNC_WINDOW_US overrides how long a
+    // batch leader waits for more fsyncs to join.
+    long fsync_window = FSYNC_BATCH_WINDOW_US;
+    if (getenv("WATDFS_FSYNC_WINDOW_US") != nullptr) {
+        fsync_window = atol(getenv("WATDFS_FSYNC_WINDOW_US"));
+    }
+    fsync_batcher_init(fsync_window);
+
+    // Schedule the calls of different clients fairly. WATDFS_SCHED_SLOTS=0
+    // turns it off, and WATDFS_SCHED_WEIGHTS gives clients weights, as
+    // client=weight,client=weight.
+    int sched_slots = SCHED_SLOTS;
+    int metadata_weight = SCHED_METADATA_WEIGHT;
+    if (getenv("WATDFS_SCHED_SLOTS") != nullptr) {
+        sched_slots = atoi(getenv("WATDFS_SCHED_SLOTS"));
+    }
+    if (getenv("WATDFS_SCHED_METADATA_WEIGHT") != nullptr) {
+        metadata_weight = atoi(getenv("WATDFS_SCHED_METADATA_WEIGHT"));
+    }
+    sched_init(sched_slots, metadata_weight);
+    if (getenv("WATDFS_SCHED_WEIGHTS") != nullptr) {
+        std::string weights = getenv("WATDFS_SCHED_WEIGHTS");
+        size_t pos = 0;
+        while (pos < weights.size()) {
+            size_t end = weights.find(',', pos);
+            if (end == std::string::npos) end = weights.size();
+            std::string entry = weights.substr(pos, end - pos);
+            size_t eq = entry.rfind('=');
+            if (eq != std::string::npos && eq > 0) {
+                sched_set_weight(entry.substr(0, eq).c_str(), atoi(entry.c_str() + eq + 1));
+            } else {
+                DLOG("bad entry '%s' in WATDFS_SCHED_WEIGHTS", entry.c_str());
+            }
+            pos = end + 1;
+        }
+    }
+
+    // Clients are paced by write credit unless WATDFS_WRITE_CREDIT=0;
+    // WATDFS_WRITE_CREDIT_TARGET_MS sets the write latency it aims for.
+    const char *credit_env = getenv("WATDFS_WRITE_CREDIT");
+    credit_enabled = credit_env == nullptr || strcmp(credit_env, "0") != 0;
+    long credit_target = WRITE_CREDIT_TARGET_MS;
+    if (getenv("WATDFS_WRITE_CREDIT_TARGET_MS") != nullptr) {
+        credit_target = atol(getenv("WATDFS_WRITE_CREDIT_TARGET_MS"));
+    }
+    write_credit_init(credit_target);
+
+    // Deduplicated uploads are optional: WATDFS_DEDUP=1 builds the chunk index
+    // and advertises the capability. The index answers every client about
+    // every file (see chunk_index.h), so it stays off by default.
+    const char *dedup_env = getenv("WATDFS_DEDUP");
+    if (dedup_env != nullptr && strcmp(dedup_env, "1") == 0) {
+        dedup_enabled = 1;
+        chunk_index_init(server_persist_dir);
+        index_existing_files();
     }
 
     // TODO: Register your functions with the RPC library.
@@ -338,7 +1423,7 @@ int main(int argc, char *argv[]) {
         argTypes[3] = 0;
 
         // We need to register the function with the types and the name.
-        ret = rpcRegister((char *)"getattr", argTypes, watdfs_getattr);
+        ret = register_rpc<watdfs_getattr>("getattr", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -363,7 +1448,7 @@ int main(int argc, char *argv[]) {
         argTypes[4] = 0;
 
         // We need to register the function with the types and the name.
-        ret = rpcRegister((char *)"mknod", argTypes, watdfs_mknod);
+        ret = register_rpc<watdfs_mknod>("mknod", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -383,7 +1468,7 @@ int main(int argc, char *argv[]) {
         argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
         // Finally we fill in the null terminator.
         argTypes[3] = 0;
-        ret = rpcRegister((char *)"open", argTypes, watdfs_open);
+        ret = register_rpc<watdfs_open>("open", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -403,7 +1488,7 @@ int main(int argc, char *argv[]) {
         argTypes[2] = (1u << ARG_OUTPUT) | (ARG_INT << 16u);
         // Finally we fill in the null terminator.
         argTypes[3] = 0;
-        ret = rpcRegister((char *)"release", argTypes, watdfs_release);
+        ret = register_rpc<watdfs_release>("release", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -412,7 +1497,7 @@ int main(int argc, char *argv[]) {
 
     //read
     {
-        int argTypes[7];
+        int argTypes[9];
         argTypes[0] =
                 (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
         argTypes[1] =
@@ -420,9 +1505,11 @@ int main(int argc, char *argv[]) {
         argTypes[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
         argTypes[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
         argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-        argTypes[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
-        argTypes[6] = 0;
-        ret = rpcRegister((char *)"read", argTypes, watdfs_read);
+        argTypes[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[6] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+        argTypes[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[8] = 0;
+        ret = register_rpc<watdfs_read>("read", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -432,7 +1519,7 @@ int main(int argc, char *argv[]) {
 
     //write
     {
-        int argTypes[7];
+        int argTypes[9];
         argTypes[0] =
                 (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
         argTypes[1] =
@@ -440,9 +1527,11 @@ int main(int argc, char *argv[]) {
         argTypes[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
         argTypes[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
         argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
-        argTypes[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
-        argTypes[6] = 0;
-        ret = rpcRegister((char *)"write", argTypes, watdfs_write);
+        argTypes[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[6] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[8] = 0;
+        ret = register_rpc<watdfs_write>("write", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -459,7 +1548,7 @@ int main(int argc, char *argv[]) {
                 (1u << ARG_INPUT)  | (ARG_LONG << 16u) ;
         argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
         argTypes[3] = 0;
-        ret = rpcRegister((char *)"truncate", argTypes, watdfs_truncate);
+        ret = register_rpc<watdfs_truncate>("truncate", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -468,12 +1557,15 @@ int main(int argc, char *argv[]) {
 
     //fsync
     {
-        int argTypes[4];
+        int argTypes[7];
         argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
         argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct fuse_file_info);
-        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
-        argTypes[3] = 0;
-        ret = rpcRegister((char *)"fsync", argTypes, watdfs_fsync);
+        argTypes[2] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[4] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[6] = 0;
+        ret = register_rpc<watdfs_fsync>("fsync", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
@@ -487,15 +1579,264 @@ int main(int argc, char *argv[]) {
         argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | sizeof(struct timespec);
         argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
         argTypes[3] = 0;
-        ret = rpcRegister((char *)"utimensat", argTypes, watdfs_utimensat);
+        ret = register_rpc<watdfs_utimensat>("utimensat", argTypes);
         if (ret < 0) {
             // It may be useful to have debug-printing here.
             return ret;
         }
     }
 
+    //caps
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_caps>("caps", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //read_z
+    {
+        int argTypes[11];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[4] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[5] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[6] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+        argTypes[7] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[8] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+        argTypes[9] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[10] = 0;
+        ret = register_rpc<watdfs_read_z>("read_z", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //write_z
+    {
+        int argTypes[9];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[3] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[4] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[5] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[6] = (1u << ARG_INPUT)  | (ARG_LONG << 16u);
+        argTypes[7] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[8] = 0;
+        ret = register_rpc<watdfs_write_z>("write_z", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //upload_begin
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_upload_begin>("upload_begin", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //upload_commit
+    {
+        int argTypes[5];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[3] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[4] = 0;
+        ret = register_rpc<watdfs_upload_commit>("upload_commit", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //upload_abort
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_upload_abort>("upload_abort", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //chunks_has
+    {
+        int argTypes[5];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[2] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[3] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[4] = 0;
+        ret = register_rpc<watdfs_chunks_has>("chunks_has", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //write_chunks
+    {
+        int argTypes[7];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_INPUT)  | (ARG_INT << 16u);
+        argTypes[3] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[4] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[5] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[6] = 0;
+        ret = register_rpc<watdfs_write_chunks>("write_chunks", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //conn_port
+    {
+        int argTypes[3];
+        argTypes[0] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[2] = 0;
+        ret = register_rpc<watdfs_conn_port>("conn_port", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //layout_get
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_layout_get>("layout_get", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //stats
+    {
+        int argTypes[3];
+        argTypes[0] = (1u << ARG_OUTPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[2] = 0;
+        ret = register_rpc<watdfs_stats>("stats", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //layout_set
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[1] = (1u << ARG_INPUT) | (1u << ARG_ARRAY) | (ARG_CHAR << 16u) | 1u;
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_layout_set>("layout_set", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    //write_credit
+    {
+        int argTypes[4];
+        argTypes[0] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+        argTypes[1] = (1u << ARG_OUTPUT)  | (ARG_LONG << 16u);
+        argTypes[2] = (1u << ARG_OUTPUT)  | (ARG_INT << 16u);
+        argTypes[3] = 0;
+        ret = register_rpc<watdfs_write_credit>("write_credit", argTypes);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+void watdfs_server_teardown() {
+    if (dedup_enabled) {
+        chunk_index_destroy();
+    }
+    write_credit_destroy();
+    sched_destroy();
+    fsync_batcher_destroy();
+    work_pool_destroy();
+    io_engine_destroy();
+}
+
+#ifndef WATDFS_SERVER_LIBRARY
+// The main function of the server.
+int main(int argc, char *argv[]) {
+    // argv[1] should contain the directory where you should store data on the
+    // server. If it is not present it is an error, that we cannot recover from.
+    if (argc != 2) {
+        // In general you shouldn't print to stderr or stdout, but it may be
+        // helpful here for debugging. Important: Make sure you turn off logging
+        // prior to submission!
+        // See watdfs_client.c for more details
+        // # ifdef PRINT_ERR
+        // std::cerr << "Usaage:" << argv[0] << " server_persist_dir";
+        // #endif
+        return -1;
+    }
+    // TODO: Initialize the rpc library by calling `rpcServerInit`.
+    // Important: `rpcServerInit` prints the 'export SERVER_ADDRESS' and
+    // 'export SERVER_PORT' lines. Make sure you *do not* print anything
+    // to *stdout* before calling `rpcServerInit`.
+    //DLOG("Initializing server...");
+    int return_code = rpcServerInit();
+
+    // TODO: If there is an error with `rpcServerInit`, it maybe useful to have
+    // debug-printing here, and then you should return.
+    if(return_code<0){
+        return return_code;
+    }
+
+    // Clients open extra connections to this server through rpc_conn, on
+    // WATDFS_CONN_PORT or any free port. The server works without it.
+    int conn_port_wanted = 0;
+    if (getenv("WATDFS_CONN_PORT") != nullptr) {
+        conn_port_wanted = atoi(getenv("WATDFS_CONN_PORT"));
+    }
+    conn_port = rpc_conn_server_init(conn_port_wanted);
+    if (conn_port < 0) {
+        DLOG("cannot listen for extra connections: %d", conn_port);
+        conn_port = 0;
+    }
+
+    int ret = watdfs_server_setup(argv[1], 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (conn_port > 0) {
+        rpc_conn_server_start();
+    }
+
     // TODO: Hand over control to the RPC library by calling `rpcExecute`.
     int return_code2 = rpcExecute();
+    rpc_conn_server_stop();
+    watdfs_server_teardown();
     if(return_code2<0){
         return return_code2;
     }
@@ -504,3 +1845,4 @@ int main(int argc, char *argv[]) {
     // then you should return.
     return ret;
 }
+#endif
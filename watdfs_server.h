@@ -0,0 +1,32 @@
+
+
+#ifndef WATDFS_SERVER_H
+#define WATDFS_SERVER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// watdfs_server.h
+// The server without its main function, for running it inside another
+// process. Compiled with -DWATDFS_SERVER_LIBRARY, watdfs_server.cpp leaves
+// out main and INIT_LOG (the host program has its own); the calls then reach
+// the skeletons over the loopback address of rpc_conn (RPC_CONN_LOOPBACK),
+// with no sockets involved. The server keeps its state in globals, so a
+// process holds one server at most.
+
+// FUNCTIONS
+// Set up the server on persist_dir: the I/O engine, fsync batching, the
+// chunk index with WATDFS_DEDUP=1, and every skeleton, registered with
+// rpc_conn and, if librpc is set, with librpc too (after rpcServerInit).
+// Returns 0 or a negative error code.
+int watdfs_server_setup(char *persist_dir, int librpc);
+
+// Undo watdfs_server_setup. No call may be in flight.
+void watdfs_server_teardown();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
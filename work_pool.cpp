@@ -0,0 +1,315 @@
+
+#include "work_pool.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+struct pool_task {
+    int (*fn_)(void *);
+    void *arg_;
+    int ret_;
+    // Posted once fn_ returned.
+    sem_t done_sem_;
+};
+
+struct pool_worker {
+    pthread_mutex_t lock_;
+    // The owner takes from the back, thieves from the front.
+    std::deque<struct pool_task *> tasks_;
+    pthread_t thread_;
+    // The core it is pinned to, or -1, and that core's NUMA node.
+    int cpu_;
+    int node_;
+    int index_;
+};
+
+static std::vector<struct pool_worker *> workers;
+static int running = 0;
+// Tasks in the deques, and workers asleep waiting for one.
+static long pending = 0;
+static int sleepers = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cv = PTHREAD_COND_INITIALIZER;
+static unsigned next_worker = 0;
+static int pinned = 0;
+static int steal_counter = -1;
+
+// The spare threads, with deques that stay empty. A spare runs tasks while
+// fewer spares do than threads are blocked in work_pool_block; they wait on
+// spare_cv under idle_lock.
+static std::vector<struct pool_worker *> spares;
+static int blocked = 0;
+static int standing_in = 0;
+static pthread_cond_t spare_cv = PTHREAD_COND_INITIALIZER;
+
+// The worker or spare this thread is.
+static thread_local struct pool_worker *self = nullptr;
+
+// The NUMA node of cpu, from sysfs; 0 when it cannot tell.
+static int node_of(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == nullptr) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' &&
+            entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+// Take a task from the back of worker's own deque, or steal one from the
+// front of another's, those on its node first. Returns nullptr if there is
+// none.
+static struct pool_task *find_task(struct pool_worker *worker) {
+    struct pool_task *task = nullptr;
+    pthread_mutex_lock(&worker->lock_);
+    if (!worker->tasks_.empty()) {
+        task = worker->tasks_.back();
+        worker->tasks_.pop_back();
+    }
+    pthread_mutex_unlock(&worker->lock_);
+    for (int pass = 0; task == nullptr && pass < 2; pass++) {
+        for (size_t i = 0; task == nullptr && i < workers.size(); i++) {
+            struct pool_worker *victim = workers[(worker->index_ + i) % workers.size()];
+            if (victim == worker || (victim->node_ == worker->node_) != (pass == 0) ||
+                __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0) {
+                continue;
+            }
+            pthread_mutex_lock(&victim->lock_);
+            if (!victim->tasks_.empty()) {
+                task = victim->tasks_.front();
+                victim->tasks_.pop_front();
+            }
+            pthread_mutex_unlock(&victim->lock_);
+            if (task != nullptr) {
+                stats_add(steal_counter, 1);
+            }
+        }
+    }
+    if (task != nullptr) {
+        __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return task;
+}
+
+static void run_task(struct pool_task *task) {
+    task->ret_ = task->fn_(task->arg_);
+    sem_post(&task->done_sem_);
+}
+
+// Sleep until there is a task to take, or the pool stops. Called with
+// idle_lock held.
+static void wait_for_work() {
+    __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0 && running) {
+        pthread_cond_wait(&idle_cv, &idle_lock);
+    }
+    __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void *worker_main(void *arg) {
+    self = (struct pool_worker *)arg;
+    if (self->cpu_ >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu_, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    while (true) {
+        struct pool_task *task = find_task(self);
+        if (task != nullptr) {
+            run_task(task);
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        wait_for_work();
+        bool stop = !running && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&idle_lock);
+        if (stop) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+// A spare runs one task at a time while a thread is blocked that no other
+// spare stands in for.
+static void *spare_main(void *arg) {
+    self = (struct pool_worker *)arg;
+    pthread_mutex_lock(&idle_lock);
+    while (true) {
+        while (running && (standing_in >= __atomic_load_n(&blocked, __ATOMIC_SEQ_CST) ||
+                           __atomic_load_n(&pending, __ATOMIC_SEQ_CST) == 0)) {
+            pthread_cond_wait(&spare_cv, &idle_lock);
+        }
+        if (!running) {
+            break;
+        }
+        standing_in++;
+        pthread_mutex_unlock(&idle_lock);
+        struct pool_task *task = find_task(self);
+        if (task != nullptr) {
+            run_task(task);
+        }
+        pthread_mutex_lock(&idle_lock);
+        standing_in--;
+    }
+    pthread_mutex_unlock(&idle_lock);
+    return nullptr;
+}
+
+static struct pool_worker *new_worker(int index, int cpu, int node) {
+    struct pool_worker *worker = new struct pool_worker;
+    pthread_mutex_init(&worker->lock_, nullptr);
+    worker->index_ = index;
+    worker->cpu_ = cpu;
+    worker->node_ = node;
+    return worker;
+}
+
+int work_pool_init(int cpu_workers, int spare_count, int numa) {
+    cpu_set_t allowed;
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+    }
+    if (cpus.empty()) {
+        cpus.push_back(0);
+    }
+    if (cpu_workers <= 0) {
+        cpu_workers = cpus.size();
+    }
+    steal_counter = stats_counter("server.pool_steals");
+    pinned = numa;
+    running = 1;
+    for (int i = 0; i < cpu_workers; i++) {
+        int cpu = numa ? cpus[i % cpus.size()] : -1;
+        workers.push_back(new_worker(i, cpu, numa ? node_of(cpu) : 0));
+    }
+    for (int i = 0; i < spare_count; i++) {
+        spares.push_back(new_worker(i % cpu_workers, -1, 0));
+    }
+    for (struct pool_worker *worker : workers) {
+        int ret = pthread_create(&worker->thread_, nullptr, worker_main, worker);
+        if (ret != 0) {
+            DLOG("work pool: cannot start a worker: %d", ret);
+            return -ret;
+        }
+    }
+    for (struct pool_worker *spare : spares) {
+        int ret = pthread_create(&spare->thread_, nullptr, spare_main, spare);
+        if (ret != 0) {
+            DLOG("work pool: cannot start a spare: %d", ret);
+            return -ret;
+        }
+    }
+    DLOG("work pool: %d workers%s, %d spares", cpu_workers, numa ? " pinned" : "",
+         spare_count);
+    return 0;
+}
+
+void work_pool_destroy() {
+    pthread_mutex_lock(&idle_lock);
+    running = 0;
+    pthread_cond_broadcast(&idle_cv);
+    pthread_cond_broadcast(&spare_cv);
+    pthread_mutex_unlock(&idle_lock);
+    for (struct pool_worker *worker : workers) {
+        pthread_join(worker->thread_, nullptr);
+    }
+    for (struct pool_worker *spare : spares) {
+        pthread_join(spare->thread_, nullptr);
+    }
+    for (std::vector<struct pool_worker *> *threads : {&workers, &spares}) {
+        for (struct pool_worker *worker : *threads) {
+            pthread_mutex_destroy(&worker->lock_);
+            delete worker;
+        }
+        threads->clear();
+    }
+}
+
+// Queue task on the worker of the calling thread's core when the workers are
+// pinned, on the next one in turn otherwise, and wake a sleeping worker, or a
+// spare if a worker is blocked.
+static void submit(struct pool_task *task) {
+    struct pool_worker *target = nullptr;
+    if (pinned) {
+        int cpu = sched_getcpu();
+        for (struct pool_worker *worker : workers) {
+            if (worker->cpu_ == cpu) {
+                target = worker;
+                break;
+            }
+        }
+    }
+    if (target == nullptr) {
+        target = workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % workers.size()];
+    }
+    pthread_mutex_lock(&target->lock_);
+    target->tasks_.push_back(task);
+    pthread_mutex_unlock(&target->lock_);
+    __atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0 ||
+        __atomic_load_n(&blocked, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cv);
+        if (standing_in < blocked) {
+            pthread_cond_signal(&spare_cv);
+        }
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+int work_pool_run(int (*fn)(void *), void *arg) {
+    if (self != nullptr || workers.empty()) {
+        return fn(arg);
+    }
+    struct pool_task task;
+    task.fn_ = fn;
+    task.arg_ = arg;
+    task.ret_ = 0;
+    sem_init(&task.done_sem_, 0, 0);
+    submit(&task);
+    while (sem_wait(&task.done_sem_) != 0 && errno == EINTR) {
+    }
+    sem_destroy(&task.done_sem_);
+    return task.ret_;
+}
+
+int work_pool_block(int (*fn)(void *), void *arg) {
+    if (self == nullptr || spares.empty()) {
+        return fn(arg);
+    }
+    pthread_mutex_lock(&idle_lock);
+    __atomic_add_fetch(&blocked, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pending, __ATOMIC_SEQ_CST) > 0) {
+        pthread_cond_signal(&spare_cv);
+    }
+    pthread_mutex_unlock(&idle_lock);
+    int ret = fn(arg);
+    __atomic_sub_fetch(&blocked, 1, __ATOMIC_SEQ_CST);
+    return ret;
+}
@@ -0,0 +1,54 @@
+
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// work_pool.h
+// The threads that run the server's skeletons. The threads reading calls off
+// connections (and librpc's) no longer run skeletons themselves: they hand
+// them to a fixed set of CPU workers, one per core by default, and wait. So
+// however many clients are connected, only that many skeletons compete for
+// the cores.
+//
+// Every worker has a deque of its own. A task handed in from outside goes to
+// a worker's deque, and a worker that runs out of tasks steals the oldest
+// task of another. With WATDFS_POOL_NUMA=1 every worker is pinned to a core,
+// tasks go to the worker of the core the caller runs on, and workers steal
+// within their NUMA node before looking further.
+//
+// A task that blocks on the disk parks its worker: it calls the blocking
+// function through work_pool_block, which wakes a spare thread to take the
+// worker's place until the call returns. So however many tasks wait on the
+// disk, that many workers keep running tasks, and a task never runs on top
+// of another on one stack. Waits for other tasks (fsync_batcher_sync) go
+// through work_pool_block too.
+
+// The default number of spare threads, WATDFS_POOL_SPARES.
+#define WORK_POOL_SPARES 16
+
+// FUNCTIONS
+// Start cpu_workers workers (0 for one per core the process may run on),
+// pinned to cores if numa is set, and spares threads to stand in for blocked
+// ones. Returns 0 or -errno.
+int work_pool_init(int cpu_workers, int spares, int numa);
+// Stop the threads once the tasks handed in so far are done.
+void work_pool_destroy();
+
+// Run fn(arg) on a CPU worker and wait for it. Returns what fn returns. Runs
+// it right away on the calling thread when that is a worker, or there are no
+// workers.
+int work_pool_run(int (*fn)(void *), void *arg);
+
+// Run fn(arg), which blocks. Called on a worker, a spare takes its place
+// until fn returns. Returns what fn returns.
+int work_pool_block(int (*fn)(void *), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,89 @@
+
+#include "write_credit.h"
+#include "debug.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <algorithm>
+#include <map>
+#include <string>
+
+#define PERIOD_NS ((long)WRITE_CREDIT_PERIOD_MS * 1000000)
+
+static pthread_mutex_t credit_lock = PTHREAD_MUTEX_INITIALIZER;
+static long target_ns = (long)WRITE_CREDIT_TARGET_MS * 1000000;
+static long budget = WRITE_CREDIT_INITIAL_BUDGET;
+// The current period, counted from the epoch of CLOCK_MONOTONIC, and what was
+// written in it.
+static long period = 0;
+static long period_bytes = 0;
+static long period_writes = 0;
+static long period_latency_ns = 0;
+// The clients by the last period they asked in.
+static std::map<std::string, long> last_asked;
+static int granted_counter = -1;
+
+int write_credit_init(long target_ms) {
+    pthread_mutex_lock(&credit_lock);
+    target_ns = std::max(target_ms, 1L) * 1000000;
+    budget = WRITE_CREDIT_INITIAL_BUDGET;
+    period = stats_now_ns() / PERIOD_NS;
+    period_bytes = period_writes = period_latency_ns = 0;
+    pthread_mutex_unlock(&credit_lock);
+    granted_counter = stats_counter("server.write_credit_granted");
+    DLOG("write credit: target latency %ld ms", target_ms);
+    return 0;
+}
+
+void write_credit_destroy() {
+    pthread_mutex_lock(&credit_lock);
+    last_asked.clear();
+    pthread_mutex_unlock(&credit_lock);
+}
+
+// Close the periods before now's, adjusting the budget to what was written.
+// Called with credit_lock held.
+static void roll(long now) {
+    long current = now / PERIOD_NS;
+    if (current == period) {
+        return;
+    }
+    if (period_writes > 0) {
+        long latency = period_latency_ns / period_writes;
+        if (latency > target_ns) {
+            budget = std::max(period_bytes / 2, (long)WRITE_CREDIT_MIN_BUDGET);
+        } else {
+            budget = std::min(std::max(budget, period_bytes * 2), (long)WRITE_CREDIT_MAX_BUDGET);
+        }
+        DLOG("write credit: %ld bytes in %ld writes of %ld us, budget %ld", period_bytes,
+             period_writes, latency / 1000, budget);
+    }
+    period = current;
+    period_bytes = period_writes = period_latency_ns = 0;
+    for (auto it = last_asked.begin(); it != last_asked.end();) {
+        it = it->second < period - 1 ? last_asked.erase(it) : std::next(it);
+    }
+}
+
+long write_credit_grant(const char *client, long *period_left_ns) {
+    long now = stats_now_ns();
+    pthread_mutex_lock(&credit_lock);
+    roll(now);
+    last_asked[client] = period;
+    // Shared by the clients that asked in this period or the one before.
+    long window = std::max(budget / (long)last_asked.size(), (long)WRITE_CREDIT_MIN_GRANT);
+    *period_left_ns = (period + 1) * PERIOD_NS - now;
+    pthread_mutex_unlock(&credit_lock);
+    stats_add(granted_counter, window);
+    return window;
+}
+
+void write_credit_record(long bytes, long latency_ns) {
+    long now = stats_now_ns();
+    pthread_mutex_lock(&credit_lock);
+    roll(now);
+    period_bytes += bytes;
+    period_writes++;
+    period_latency_ns += latency_ns;
+    pthread_mutex_unlock(&credit_lock);
+}
@@ -0,0 +1,60 @@
+
+
+#ifndef WRITE_CREDIT_H
+#define WRITE_CREDIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// write_credit.h
+// Flow control of bulk writes, so a server under heavy write traffic can slow
+// its clients down before dirty pages pile up in its page cache and writes
+// start stalling on writeback. Time is cut into periods of
+// WRITE_CREDIT_PERIOD_MS. A client asks the server for credit with the
+// "write_credit" RPC and gets a window: the payload bytes of "write" and
+// "write_z" calls it may send until the period ends. Once the window is used
+// up it waits for the next period and asks again.
+//
+// The server shares a budget per period between the clients that asked
+// recently, equally. The budget follows what the disk takes: at the end of
+// every period with writes, it grows to twice the bytes written in the
+// period if the writes kept within the target latency on average
+// (WATDFS_WRITE_CREDIT_TARGET_MS), and drops to half of them if not, so when
+// the page cache starts throttling the clients back off to what the disk
+// drains.
+//
+// Clients are told apart as by the scheduler (see rpc_sched.h). Credit is a
+// capability negotiated at init; a client that does not ask is not held to
+// it.
+
+// Capability bit exchanged by the "caps" RPC (see compress.h).
+#define WATDFS_CAP_CREDIT (1 << 2)
+
+#define WRITE_CREDIT_PERIOD_MS 100
+// The default target latency of a write, WATDFS_WRITE_CREDIT_TARGET_MS.
+#define WRITE_CREDIT_TARGET_MS 5
+// The least a client is granted, so one call of the largest size always fits.
+#define WRITE_CREDIT_MIN_GRANT (64 << 10)
+// The bounds of the budget, and where it starts.
+#define WRITE_CREDIT_MIN_BUDGET (1 << 20)
+#define WRITE_CREDIT_MAX_BUDGET (256 << 20)
+#define WRITE_CREDIT_INITIAL_BUDGET (16 << 20)
+
+// FUNCTIONS
+// Start granting credit, for a target write latency of target_ms.
+int write_credit_init(long target_ms);
+void write_credit_destroy();
+
+// The window of client for the current period, and the nanoseconds left
+// until the period ends.
+long write_credit_grant(const char *client, long *period_left_ns);
+
+// Account a write of bytes (as the client counts them) that took latency_ns.
+void write_credit_record(long bytes, long latency_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif